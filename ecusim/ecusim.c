@@ -0,0 +1,760 @@
+/*
+ *	ecusim - pty-based ECU simulator for nisprog
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * Creates a pseudo-terminal and answers iso14230 requests on it like an ECU would,
+ * with simulated bitrate and turnaround latency. nisprog (or anything else) can then
+ * use the pty slave as if it were a K-line interface ("dumb" L0).
+ *
+ * Only the timing of the K-line is simulated; the pty itself transfers data instantly.
+ * Every received byte is considered to arrive one byte-time after the previous one,
+ * and every transmitted byte is written at the time it would start on the bus.
+ */
+
+#define _GNU_SOURCE	//clock_nanosleep etc
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stypes.h"
+
+#include "ecusim.h"
+#include "isoframe.h"
+#include "npk_util.h"
+#include "simpty.h"
+#include "nissutils/cli_utils/nislib.h"
+
+
+#define SIM_DEFBAUD 10400
+#define SIM_DEFLATENCY 2	//ms
+#define SIM_RXTIMEOUT 50	//ms; partial frames are dropped after this much silence
+#define SIM_DEFECUID "SIM00"
+#define SIM_DEFACLEN 12	//what nisprog uses
+#define SIM_DEFSSMID "\x3D\x12\x59\x40\x05"
+
+static const struct sim_personality *personalities[] = {
+	&sim_npk,
+	&sim_nis,
+	&sim_ssm,
+	NULL
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig) {
+	(void) sig;
+	quit = 1;
+}
+
+
+/*** timing */
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t) {
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+		if (quit) {
+			return;
+		}
+	}
+}
+
+/** time to transfer 1 byte (10 bits) at current speed, in ns */
+static uint64_t bytetime(const struct ecusim *sim) {
+	unsigned baud = sim->baud_forced ? sim->baud_forced : sim->baud;
+	return 10 * 1000000000ULL / baud;
+}
+
+static uint64_t max_u64(uint64_t a, uint64_t b) {
+	return (a > b) ? a : b;
+}
+
+
+static void dumpbytes(const char *prefix, const uint8_t *buf, unsigned len) {
+	printf("%s", prefix);
+	for (; len; len--) {
+		printf(" %02X", (unsigned) *buf++);
+	}
+	printf("\n");
+}
+
+
+/** write all of buf, blocking */
+static void write_all(int fd, const uint8_t *buf, unsigned len) {
+	while (len) {
+		ssize_t rv = write(fd, buf, len);
+		if (rv < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			perror("pty write");
+			quit = 1;
+			return;
+		}
+		buf += rv;
+		len -= (unsigned) rv;
+	}
+}
+
+/** transmit with byte pacing. Starts after the turnaround delay
+ * if this is the first reply to the current request
+ */
+static void sim_tx(struct ecusim *sim, const uint8_t *buf, unsigned len) {
+	uint64_t bt = bytetime(sim);
+	uint64_t start = max_u64(sim->tx_next, sim->rx_last + (sim->latency_ms * 1000000ULL));
+	unsigned sent = 0;
+
+	if (sim->verbose) {
+		dumpbytes("\ttx:", buf, len);
+	}
+
+	while (sent < len) {
+		uint64_t t = now_ns();
+		unsigned due;
+
+		if (t < start + (sent * bt)) {
+			sleep_until(start + (sent * bt));
+			t = start + (sent * bt);
+		}
+		/* send every byte that should have started by now */
+		due = (unsigned) ((t - start) / bt) + 1;
+		if (due > len) {
+			due = len;
+		}
+		write_all(sim->fd, &buf[sent], due - sent);
+		sent = due;
+	}
+	sim->tx_next = start + (len * bt);
+	sim->txbytes += len;
+	if (sim->curreq) {
+		sim->sidstats[sim->curreq->data[0]].txbytes += len;
+	}
+}
+
+
+/*** helpers for personalities */
+
+void sim_reply(struct ecusim *sim, const uint8_t *data, unsigned len) {
+	uint8_t frame[ISOFRAME_MAXLEN];
+	unsigned flen;
+	const struct isoframe *req = sim->curreq;
+
+	/* mirror request header format, swapping addresses */
+	if (req && req->addressed) {
+		flen = isoframe_build(frame, data, len, 1, sim->hdr_lenbyte, req->src, req->tgt);
+	} else {
+		flen = isoframe_build(frame, data, len, 0, sim->hdr_lenbyte, 0, 0);
+	}
+	if (!flen) {
+		printf("bad reply length %u !\n", len);
+		return;
+	}
+	if (sim->corrupt_pm && ((unsigned) (rand() % 1000) < sim->corrupt_pm)) {
+		frame[flen - 1] ^= 0xFF;
+		sim->ncorrupted += 1;
+		if (sim->verbose) {
+			printf("\tcorrupting checksum\n");
+		}
+	}
+	sim_tx(sim, frame, flen);
+}
+
+void sim_nrc(struct ecusim *sim, uint8_t sid, uint8_t nrc) {
+	uint8_t resp[3] = {0x7F, sid, nrc};
+	sim->sidstats[sid].nrc += 1;
+	if (sim->verbose) {
+		printf("\tNRC %02X for SID %02X\n", (unsigned) nrc, (unsigned) sid);
+	}
+	sim_reply(sim, resp, 3);
+}
+
+void sim_setbaud(struct ecusim *sim, unsigned baud) {
+	if (!baud) {
+		return;
+	}
+	/* let the last reply finish at the old speed */
+	sleep_until(sim->tx_next);
+	sim->baud = baud;
+	if (sim->verbose || !sim->baud_forced) {
+		printf("bitrate now %u%s\n", baud, sim->baud_forced ? " (ignored, forced rate)" : "");
+	}
+}
+
+void sim_busy(struct ecusim *sim, unsigned ms) {
+	uint64_t t = max_u64(now_ns(), sim->rx_last) + (ms * 1000000ULL);
+	sim->tx_next = max_u64(sim->tx_next, t);
+}
+
+
+static void sim_saverom(struct ecusim *sim) {
+	FILE *romf;
+
+	if (!sim->rom_writeback || !sim->rom_dirty) {
+		return;
+	}
+	romf = fopen(sim->romfile, "wb");
+	if (!romf) {
+		printf("can't open %s for writing !\n", sim->romfile);
+		return;
+	}
+	if (fwrite(sim->rom, 1, sim->fdt->romsize, romf) != sim->fdt->romsize) {
+		printf("fwrite error on %s\n", sim->romfile);
+	} else {
+		printf("ROM saved to %s\n", sim->romfile);
+		sim->rom_dirty = 0;
+	}
+	fclose(romf);
+}
+
+void sim_enter(struct ecusim *sim, const struct sim_personality *pers) {
+	sim->pers = pers;
+	sim->hdr_lenbyte = 0;
+	pers->reset(sim);
+	printf("personality : %s\n", pers->name);
+}
+
+void sim_ecureset(struct ecusim *sim) {
+	sleep_until(sim->tx_next);
+	sim_saverom(sim);
+	printf("ECU reset\n");
+	sim->baud = sim->baud_init;
+	sim_enter(sim, sim->pers_boot);
+}
+
+
+int sim_memread(const struct ecusim *sim, uint32_t addr, uint8_t *dest, unsigned len) {
+	if ((addr < sim->fdt->romsize) && ((sim->fdt->romsize - addr) >= len)) {
+		memcpy(dest, &sim->rom[addr], len);
+		return 0;
+	}
+	if ((addr >= SIM_RAMBASE) && ((addr - SIM_RAMBASE) + len <= SIM_RAMSIZE)) {
+		memcpy(dest, &sim->ram[addr - SIM_RAMBASE], len);
+		return 0;
+	}
+	return -1;
+}
+
+int sim_memwrite(struct ecusim *sim, uint32_t addr, const uint8_t *src, unsigned len) {
+	if ((addr >= SIM_RAMBASE) && ((addr - SIM_RAMBASE) + len <= SIM_RAMSIZE)) {
+		memcpy(&sim->ram[addr - SIM_RAMBASE], src, len);
+		return 0;
+	}
+	return -1;
+}
+
+
+/*** setup */
+
+/** load ROM file, or create a blank image if it doesn't exist and fdt is known.
+ * ret 0 if ok
+ */
+static int load_romfile(struct ecusim *sim, const char *fname) {
+	FILE *romf;
+	long fsize;
+	unsigned idx;
+
+	sim->romfile = fname;
+	romf = fopen(fname, "rb");
+	if (!romf) {
+		if (!sim->fdt) {
+			printf("Cannot open %s ! Specify a device with -d to start with a blank ROM.\n", fname);
+			return -1;
+		}
+		printf("%s not found, using blank ROM\n", fname);
+		sim->rom = malloc(sim->fdt->romsize);
+		if (!sim->rom) {
+			return -1;
+		}
+		memset(sim->rom, 0xFF, sim->fdt->romsize);
+		return 0;
+	}
+
+	fseek(romf, 0, SEEK_END);
+	fsize = ftell(romf);
+	rewind(romf);
+
+	if (!sim->fdt) {
+		for (idx = 0; flashdevices[idx].name; idx++) {
+			if ((long) flashdevices[idx].romsize == fsize) {
+				sim->fdt = &flashdevices[idx];
+				break;
+			}
+		}
+		if (!sim->fdt) {
+			printf("can't guess device from ROM size %ld, use -d\n", fsize);
+			goto badexit;
+		}
+	}
+	if (fsize != (long) sim->fdt->romsize) {
+		printf("wrong ROM size %ld, expected %lu for %s\n", fsize,
+		       (unsigned long) sim->fdt->romsize, sim->fdt->name);
+		goto badexit;
+	}
+
+	sim->rom = malloc(sim->fdt->romsize);
+	if (!sim->rom) {
+		goto badexit;
+	}
+	if (fread(sim->rom, 1, sim->fdt->romsize, romf) != sim->fdt->romsize) {
+		printf("fread prob !?\n");
+		free(sim->rom);
+		sim->rom = NULL;
+		goto badexit;
+	}
+	fclose(romf);
+	return 0;
+
+badexit:
+	fclose(romf);
+	return -1;
+}
+
+static int load_eepfile(struct ecusim *sim, const char *fname) {
+	FILE *eepf = fopen(fname, "rb");
+	if (!eepf) {
+		printf("Cannot open %s !\n", fname);
+		return -1;
+	}
+	memset(sim->eep, 0xFF, SIM_EEPSIZE);
+	(void) fread(sim->eep, 1, SIM_EEPSIZE, eepf);
+	fclose(eepf);
+	return 0;
+}
+
+
+/** load reference kernel for the "nis" personality */
+static int load_kernelfile(struct ecusim *sim, const char *fname) {
+	FILE *kf = fopen(fname, "rb");
+	uint8_t *kbuf;
+	uint32_t klen;
+
+	if (!kf) {
+		printf("Cannot open %s !\n", fname);
+		return -1;
+	}
+	klen = flen(kf);
+	if (!klen || (klen > SIM_NIS_PLMAX)) {
+		printf("bad kernel size %lu\n", (unsigned long) klen);
+		goto badexit;
+	}
+	kbuf = malloc(klen);
+	if (!kbuf) {
+		goto badexit;
+	}
+	if (fread(kbuf, 1, klen, kf) != klen) {
+		printf("fread prob !?\n");
+		free(kbuf);
+		goto badexit;
+	}
+	fclose(kf);
+	sim->nisconf.kernel = kbuf;
+	sim->nisconf.kernel_len = klen;
+	return 0;
+
+badexit:
+	fclose(kf);
+	return -1;
+}
+
+/** set "nis" keyset from s27k; s36k1 comes from the known keysets
+ * ret 0 if ok
+ */
+static int set_nis_keyset(struct ecusim *sim, uint32_t s27k) {
+	unsigned idx;
+	for (idx = 0; known_keys[idx].s27k; idx++) {
+		if (known_keys[idx].s27k == s27k) {
+			sim->nisconf.s27k = s27k;
+			sim->nisconf.s36k1 = known_keys[idx].s36k1;
+			return 0;
+		}
+	}
+	printf("keyset %08lX not in the known list\n", (unsigned long) s27k);
+	return -1;
+}
+
+/** parse 10 hex digits into the SSM ECUID. ret 0 if ok */
+static int parse_ssmid(struct ecusim *sim, const char *str) {
+	unsigned idx;
+
+	if (strlen(str) != 10) {
+		return -1;
+	}
+	for (idx = 0; idx < 5; idx++) {
+		char hexbyte[3] = {str[2 * idx], str[(2 * idx) + 1], 0};
+		char *endp;
+
+		sim->ssmconf.ecuid[idx] = (uint8_t) strtoul(hexbyte, &endp, 16);
+		if (*endp) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+
+/*** main loop */
+
+static void handle_frame(struct ecusim *sim, const uint8_t *raw, unsigned rawlen, const struct isoframe *req) {
+	if (sim->verbose) {
+		dumpbytes("rx:", raw, rawlen);
+	}
+
+	/* K-line echo of the whole request, once it has "arrived" */
+	if (sim->echo) {
+		sleep_until(sim->rx_last);
+		write_all(sim->fd, raw, rawlen);
+	}
+
+	if (!req->cks_ok) {
+		sim->nbadframes += 1;
+		if (sim->verbose) {
+			printf("\tbad checksum, ignored\n");
+		}
+		return;
+	}
+
+	sim->nreq += 1;
+	sim->sidstats[req->data[0]].n += 1;
+	sim->sidstats[req->data[0]].rxbytes += rawlen;
+	sim->curreq = req;
+	sim->pers->handle(sim, req);
+	sim->curreq = NULL;
+}
+
+static void run(struct ecusim *sim) {
+	uint8_t rxbuf[ISOFRAME_MAXLEN * 4];
+	unsigned rxlen = 0;
+	uint64_t rx_wall = 0;	//real time of last read
+
+	while (!quit) {
+		struct pollfd pfd = {.fd = sim->fd, .events = POLLIN};
+		int rv = poll(&pfd, 1, rxlen ? 10 : 200);
+
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+
+		if (rv == 0) {
+			if (rxlen && ((now_ns() - rx_wall) > (SIM_RXTIMEOUT * 1000000ULL))) {
+				if (sim->verbose) {
+					dumpbytes("rx timeout, dropping partial frame :", rxbuf, rxlen);
+				}
+				sim->nbadframes += 1;
+				rxlen = 0;
+			}
+			continue;
+		}
+
+		ssize_t rdlen = read(sim->fd, &rxbuf[rxlen], sizeof(rxbuf) - rxlen);
+		if (rdlen <= 0) {
+			if ((rdlen < 0) && (errno == EINTR || errno == EAGAIN)) {
+				continue;
+			}
+			perror("pty read");
+			break;
+		}
+
+		/* simulate arrival of each byte at current bitrate */
+		rx_wall = now_ns();
+		if (!sim->t_first) {
+			sim->t_first = max_u64(sim->rx_last, rx_wall);
+		}
+		sim->rx_last = max_u64(sim->rx_last, rx_wall) + ((uint64_t) rdlen * bytetime(sim));
+		sim->rxbytes += (unsigned long) rdlen;
+		rxlen += (unsigned) rdlen;
+
+		while (rxlen) {
+			struct isoframe req;
+			unsigned flen = isoframe_parse(rxbuf, rxlen, &req);
+			if (!flen) {
+				break;
+			}
+			handle_frame(sim, rxbuf, flen, &req);
+			rxlen -= flen;
+			memmove(rxbuf, &rxbuf[flen], rxlen);
+		}
+		if (rxlen == sizeof(rxbuf)) {
+			/* can't happen with valid frames */
+			rxlen = 0;
+		}
+	}
+}
+
+
+/** write counters as JSON, one top-level key per line so scripts can grep it.
+ * span_ms is the simulated time from the first received byte to the end of the last transmission.
+ */
+static void write_stats(const struct ecusim *sim, const char *fname) {
+	FILE *sf;
+	uint64_t t_end;
+	unsigned sid;
+	bool first = 1;
+
+	sf = fopen(fname, "w");
+	if (!sf) {
+		printf("can't open %s for writing !\n", fname);
+		return;
+	}
+	t_end = max_u64(sim->tx_next, sim->rx_last);
+	fprintf(sf, "{\n"
+	        "\"baud\": %u,\n"
+	        "\"latency_ms\": %u,\n"
+	        "\"corrupt_pm\": %u,\n"
+	        "\"requests\": %lu,\n"
+	        "\"badframes\": %lu,\n"
+	        "\"corrupted\": %lu,\n"
+	        "\"rxbytes\": %lu,\n"
+	        "\"txbytes\": %lu,\n"
+	        "\"span_ms\": %lu,\n"
+	        "\"sids\": {",
+	        sim->baud_forced ? sim->baud_forced : sim->baud, sim->latency_ms, sim->corrupt_pm,
+	        sim->nreq, sim->nbadframes, sim->ncorrupted, sim->rxbytes, sim->txbytes,
+	        sim->t_first ? (unsigned long) ((t_end - sim->t_first) / 1000000ULL) : 0UL);
+	for (sid = 0; sid < 256; sid++) {
+		const struct sim_sidstats *ss = &sim->sidstats[sid];
+		if (!ss->n) {
+			continue;
+		}
+		fprintf(sf, "%s\n\t\"%02X\": {\"n\": %lu, \"nrc\": %lu, \"rxbytes\": %lu, \"txbytes\": %lu}",
+		        first ? "" : ",", sid, ss->n, ss->nrc, ss->rxbytes, ss->txbytes);
+		first = 0;
+	}
+	fprintf(sf, "\n}\n}\n");
+	fclose(sf);
+}
+
+
+static void usage(void) {
+	unsigned idx;
+
+	printf("ecusim : pty-based ECU simulator\n"
+	       "usage : ecusim [options] <romfile>\n"
+	       "\t-p <name>\tpersonality at startup / after reset (default: %s)\n"
+	       "\t-d <device>\tflash device (7051, 7055, 7058); default : from ROM file size\n"
+	       "\t-E <eepfile>\tEEPROM image (%u bytes)\n"
+	       "\t-b <baud>\tinitial bitrate (default: %u; ssm : 4800)\n"
+	       "\t-B <baud>\tforce a fixed bitrate for pacing; kernel speed changes are ignored\n"
+	       "\t-l <ms>\t\tturnaround latency, end of request to start of response (default: %u)\n"
+	       "\t-e\t\techo received bytes, like a K-line (needed for dumb L0 with BLOCKDUPLEX)\n"
+	       "\t-w\t\twrite ROM modifications back to <romfile> on reset / exit\n"
+	       "\t-s <path>\tcreate a symlink to the pty slave\n"
+	       "\t-v\t\tverbose : dump all frames\n"
+	       "\t-x <permille>\tsend this fraction of responses with a bad checksum\n"
+	       "\t-R <seed>\tseed for SID27 seeds and -x (default: time)\n"
+	       "\t-j <file>\twrite request / byte counters (JSON) to <file> on exit\n"
+	       "\"nis\" personality :\n"
+	       "\t-i <ecuid>\tECUID (default: %s)\n"
+	       "\t-k <s27k>\tSID27 key (hex), must be a known keyset (default: first known keyset)\n"
+	       "\t-a <n>\t\tmax addresses per SID AC request (default: %u, max %u)\n"
+	       "\t-K <file>\treference kernel; the uploaded payload is compared to it\n"
+	       "\"ssm\" personality :\n"
+	       "\t-S <ecuid>\tECUID, 10 hex digits (default: 3D12594005)\n"
+	       "\t-K <file>\tsame as above, compared after decryption\n"
+	       "personalities :\n",
+	       personalities[0]->name, SIM_EEPSIZE, SIM_DEFBAUD, SIM_DEFLATENCY,
+	       SIM_DEFECUID, SIM_DEFACLEN, SIM_NIS_ACMAX);
+	for (idx = 0; personalities[idx]; idx++) {
+		printf("\t%s\t%s\n", personalities[idx]->name, personalities[idx]->descr);
+	}
+}
+
+int main(int argc, char **argv) {
+	static struct ecusim sim;	//static since it's rather large
+	const char *linkname = NULL;
+	const char *eepfile = NULL;
+	const char *kernelfile = NULL;
+	const char *statsfile = NULL;
+	unsigned seed = (unsigned) time(NULL);
+	int slavefd = -1;
+	int opt;
+	unsigned idx;
+
+	sim.pers_boot = personalities[0];
+	sim.baud_init = SIM_DEFBAUD;
+	sim.latency_ms = SIM_DEFLATENCY;
+	strcpy(sim.nisconf.ecuid, SIM_DEFECUID);
+	sim.nisconf.s27k = known_keys[0].s27k;
+	sim.nisconf.s36k1 = known_keys[0].s36k1;
+	sim.nisconf.aclen = SIM_DEFACLEN;
+	memcpy(sim.ssmconf.ecuid, SIM_DEFSSMID, 5);
+
+	while ((opt = getopt(argc, argv, "p:d:E:b:B:l:ews:vx:R:j:i:k:a:K:S:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			for (idx = 0; personalities[idx]; idx++) {
+				if (strcmp(personalities[idx]->name, optarg) == 0) {
+					break;
+				}
+			}
+			if (!personalities[idx]) {
+				printf("unknown personality %s\n", optarg);
+				usage();
+				return 1;
+			}
+			sim.pers_boot = personalities[idx];
+			break;
+		case 'd':
+			for (idx = 0; flashdevices[idx].name; idx++) {
+				if (strcmp(flashdevices[idx].name, optarg) == 0) {
+					sim.fdt = &flashdevices[idx];
+					break;
+				}
+			}
+			if (!sim.fdt) {
+				printf("unknown device %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'E':
+			eepfile = optarg;
+			break;
+		case 'b':
+			sim.baud_init = (unsigned) strtoul(optarg, NULL, 0);
+			sim.baud_given = 1;
+			break;
+		case 'B':
+			sim.baud_forced = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			sim.latency_ms = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			sim.echo = 1;
+			break;
+		case 'w':
+			sim.rom_writeback = 1;
+			break;
+		case 's':
+			linkname = optarg;
+			break;
+		case 'v':
+			sim.verbose = 1;
+			break;
+		case 'x':
+			sim.corrupt_pm = (unsigned) strtoul(optarg, NULL, 0);
+			if (sim.corrupt_pm > 1000) {
+				printf("bad -x value\n");
+				return 1;
+			}
+			break;
+		case 'R':
+			seed = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			statsfile = optarg;
+			break;
+		case 'i':
+			if (strlen(optarg) != 5) {
+				printf("ECUID must be 5 characters\n");
+				return 1;
+			}
+			strcpy(sim.nisconf.ecuid, optarg);
+			break;
+		case 'k':
+			if (set_nis_keyset(&sim, (uint32_t) strtoul(optarg, NULL, 16))) {
+				return 1;
+			}
+			break;
+		case 'a':
+			sim.nisconf.aclen = (unsigned) strtoul(optarg, NULL, 0);
+			if (!sim.nisconf.aclen || (sim.nisconf.aclen > SIM_NIS_ACMAX)) {
+				printf("bad AC list length\n");
+				return 1;
+			}
+			break;
+		case 'K':
+			kernelfile = optarg;
+			break;
+		case 'S':
+			if (parse_ssmid(&sim, optarg)) {
+				printf("SSM ECUID must be 10 hex digits\n");
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if ((optind != argc - 1) || !sim.baud_init) {
+		usage();
+		return 1;
+	}
+
+	if (load_romfile(&sim, argv[optind])) {
+		return 1;
+	}
+
+	for (idx = 0; idx < SIM_EEPSIZE; idx++) {
+		sim.eep[idx] = (uint8_t) idx;
+	}
+	if (eepfile && load_eepfile(&sim, eepfile)) {
+		goto badexit;
+	}
+	if (kernelfile && load_kernelfile(&sim, kernelfile)) {
+		goto badexit;
+	}
+	srand(seed);
+
+	sim.fd = simpty_open(&slavefd, linkname);
+	if (sim.fd < 0) {
+		goto badexit;
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	printf("device %s, %u bps%s, latency %u ms%s\n", sim.fdt->name,
+	       sim.baud_forced ? sim.baud_forced : sim.baud_init,
+	       sim.baud_forced ? " (forced)" : "", sim.latency_ms, sim.echo ? ", echo" : "");
+	sim.baud = sim.baud_init;
+	sim_enter(&sim, sim.pers_boot);
+
+	run(&sim);
+
+	sim_saverom(&sim);
+	printf("\n%lu requests, %lu bad frames, %lu bytes received, %lu sent\n",
+	       sim.nreq, sim.nbadframes, sim.rxbytes, sim.txbytes);
+	if (statsfile) {
+		write_stats(&sim, statsfile);
+	}
+
+	if (linkname) {
+		(void) unlink(linkname);
+	}
+	close(slavefd);
+	close(sim.fd);
+	free(sim.rom);
+	free((void *) sim.nisconf.kernel);
+	return 0;
+
+badexit:
+	free(sim.rom);
+	free((void *) sim.nisconf.kernel);
+	return 1;
+}
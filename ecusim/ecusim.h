@@ -0,0 +1,182 @@
+#ifndef ECUSIM_H
+#define ECUSIM_H
+
+/* ecusim : pty-based ECU simulator, to exercise / benchmark nisprog without hardware.
+ *
+ * ecusim.c owns the pty, byte timing and framing; each "personality" (sim_*.c)
+ * implements the request handlers of one firmware (npkern, stock ECU, ...).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "isoframe.h"
+#include "npk_util.h"
+
+/* simulated RAM window, reachable through RMBA / WMBA */
+#define SIM_RAMBASE 0xFFFF0000UL
+#define SIM_RAMSIZE 0x10000UL
+
+#define SIM_EEPSIZE 512	//93C66
+
+#define SIM_NPK_BOOTSPEED 62500	//npkern speed after RAMjump, same as nisprog's default kspeed
+
+struct ecusim;
+
+struct sim_personality {
+	const char *name;
+	const char *descr;
+	/** (re)initialize personality state; called when the personality is entered */
+	void (*reset)(struct ecusim *sim);
+	/** handle one complete request (checksum verified). Replies through sim_reply() etc. */
+	void (*handle)(struct ecusim *sim, const struct isoframe *req);
+};
+
+/* npkern personality state */
+struct sim_npk_state {
+	bool commstarted;	//StartComm received at current speed
+	bool flreq;		//RequestDownload done
+	bool unprotected;	//else, "practice mode" : erase / write don't modify ROM
+	uint32_t eepr_addr;	//eeprom_read() addr; 0 if not set
+};
+
+/* stock Nissan ECU personality : settings */
+#define SIM_NIS_ACMAX 32	//max AC list length supported by the sim
+#define SIM_NIS_PLMAX (16 * 1024)	//max SID36 payload
+struct sim_nis_conf {
+	char ecuid[6];		//ASCIIz
+	uint32_t s27k;
+	uint32_t s36k1;
+	unsigned aclen;		//max # of addresses per AC 81 request
+	const uint8_t *kernel;	//optional plaintext kernel, to verify the uploaded payload
+	uint32_t kernel_len;
+};
+
+/* stock Nissan ECU personality : state */
+struct sim_nis_state {
+	uint32_t seed;
+	bool seedsent;
+	bool unlocked;		//SID27 done
+	bool dl_active;		//SID34 done
+	bool xfer_done;		//SID37 ok
+	bool jumpcheck;		//BF 00 done
+	uint16_t nextblock;	//expected SID36 block #
+	uint32_t pl_len;
+	uint8_t payload[SIM_NIS_PLMAX];	//received (encrypted) SID36 payload
+	uint32_t acaddr[SIM_NIS_ACMAX];
+	unsigned aclen;		//0 if no AC list defined
+};
+
+/* Subaru SSM personality : settings */
+struct sim_ssm_conf {
+	uint8_t ecuid[5];	//returned by A8 reads of addresses 1-5
+};
+
+/* Subaru SSM personality : state */
+struct sim_ssm_state {
+	uint32_t seed;
+	bool seedsent;
+	bool unlocked;		//SID27 done
+	bool progsession;	//10 85 done
+	bool dl_active;		//SID34 done
+	uint32_t pl_addr;	//first SID34 area, i.e. where the kernel is loaded
+	uint32_t dl_addr;	//current SID34 area
+	uint32_t dl_len;
+	uint32_t xfer_bytes;	//total SID36 payload
+	unsigned xfer_blocks;
+	uint64_t t_first36;	//simulated arrival of first and last SID36 (ns)
+	uint64_t t_last36;
+};
+
+/* per-SID counters, for benchmarks */
+struct sim_sidstats {
+	unsigned long n;	//requests
+	unsigned long nrc;	//negative responses
+	unsigned long rxbytes;	//request frames
+	unsigned long txbytes;	//response frames
+};
+
+struct ecusim {
+	/* memory images */
+	uint8_t *rom;
+	const struct flashdev_t *fdt;
+	const char *romfile;
+	bool rom_writeback;	//save ROM modifications to romfile
+	bool rom_dirty;
+	uint8_t ram[SIM_RAMSIZE];
+	uint8_t eep[SIM_EEPSIZE];
+
+	/* link */
+	int fd;			//pty master
+	unsigned baud;		//current simulated bitrate
+	unsigned baud_init;	//bitrate after ECU reset
+	bool baud_given;	//baud_init set with -b, else personalities may use their own
+	unsigned baud_forced;	//if nonzero : ignore speed changes, always pace at this rate
+	unsigned latency_ms;	//end of request -> start of response
+	bool echo;		//K-line echo of received bytes
+	bool hdr_lenbyte;	//replies always have a length byte (set by personality)
+	bool verbose;
+	unsigned corrupt_pm;	//per mille of response frames sent with a bad checksum
+
+	/* timing, in ns (CLOCK_MONOTONIC) */
+	uint64_t rx_last;	//simulated arrival time of last received byte
+	uint64_t tx_next;	//earliest start of next transmitted byte
+
+	const struct sim_personality *pers;
+	const struct sim_personality *pers_boot;	//personality after ECU reset
+	const struct isoframe *curreq;	//request being handled; replies mirror its header
+
+	struct sim_npk_state npk;
+	struct sim_nis_conf nisconf;
+	struct sim_nis_state nis;
+	struct sim_ssm_conf ssmconf;
+	struct sim_ssm_state ssm;
+
+	/* stats */
+	unsigned long nreq;
+	unsigned long nbadframes;
+	unsigned long rxbytes;
+	unsigned long txbytes;
+	unsigned long ncorrupted;	//responses sent with a bad checksum
+	uint64_t t_first;	//simulated arrival of the first byte; 0 if none yet
+	struct sim_sidstats sidstats[256];
+};
+
+
+/** personalities */
+extern const struct sim_personality sim_npk;
+extern const struct sim_personality sim_nis;
+extern const struct sim_personality sim_ssm;
+
+
+/*** helpers for personalities */
+
+/** send a positive / generic response to the current request */
+void sim_reply(struct ecusim *sim, const uint8_t *data, unsigned len);
+
+/** send "7F <sid> <nrc>" */
+void sim_nrc(struct ecusim *sim, uint8_t sid, uint8_t nrc);
+
+/** change simulated bitrate; takes effect for the next byte sent or received */
+void sim_setbaud(struct ecusim *sim, unsigned baud);
+
+/** simulate processing time (flash erase etc.) before the next reply */
+void sim_busy(struct ecusim *sim, unsigned ms);
+
+/** ECU reset : back to boot personality and initial bitrate. Saves ROM if required */
+void sim_ecureset(struct ecusim *sim);
+
+/** switch to another personality (e.g. kernel started), after calling its reset() */
+void sim_enter(struct ecusim *sim, const struct sim_personality *pers);
+
+/** copy <len> bytes of simulated ROM / RAM at <addr>.
+ * @return 0 if ok, -1 if any part is outside ROM and RAM
+ */
+int sim_memread(const struct ecusim *sim, uint32_t addr, uint8_t *dest, unsigned len);
+
+/** write to simulated RAM only.
+ * @return 0 if ok
+ */
+int sim_memwrite(struct ecusim *sim, uint32_t addr, const uint8_t *src, unsigned len);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ *	seeded fault schedule for byte streams
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE	//strtok_r, strdup
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fault.h"
+
+
+static const char *fault_names[FAULT_NKINDS] = {
+	[FAULT_NONE] = "none",
+	[FAULT_DROP] = "drop",
+	[FAULT_CORRUPT] = "corrupt",
+	[FAULT_DUP] = "dup",
+	[FAULT_DELAY] = "delay",
+	[FAULT_BURST] = "burst",
+};
+
+const char *fault_name(enum fault_kind fk) {
+	return (fk < FAULT_NKINDS) ? fault_names[fk] : "?";
+}
+
+
+/* splitmix64 : small, and good enough to decorrelate the schedule from the seed */
+static uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t rng_next(uint64_t *state) {
+	*state += 0x9E3779B97F4A7C15ULL;
+	return mix64(*state);
+}
+
+
+/** parse "<a>:<b>" or "<a>". ret 0 if ok */
+static int parse_pair(const char *str, unsigned long *a, unsigned long *b) {
+	char *endp;
+
+	*a = strtoul(str, &endp, 0);
+	if (endp == str) {
+		return -1;
+	}
+	if (*endp == ':') {
+		str = endp + 1;
+		*b = strtoul(str, &endp, 0);
+		if (endp == str) {
+			return -1;
+		}
+	}
+	return *endp ? -1 : 0;
+}
+
+int fault_parse(struct fault_conf *fc, const char *spec) {
+	char *tmp = strdup(spec);
+	char *tok, *saveptr;
+	int rv = -1;
+
+	if (!tmp) {
+		return -1;
+	}
+	if (!fc->dirmask) {
+		fc->dirmask = (1U << FAULT_TOECU) | (1U << FAULT_TOHOST);
+	}
+	for (tok = strtok_r(tmp, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		char *val = strchr(tok, '=');
+		unsigned long a, b = 0;
+
+		if (!val) {
+			goto exit;
+		}
+		*val++ = 0;
+		if (strcmp(tok, "dir") == 0) {
+			switch (val[0]) {
+			case 'h':
+				fc->dirmask = 1U << FAULT_TOECU;
+				break;
+			case 'e':
+				fc->dirmask = 1U << FAULT_TOHOST;
+				break;
+			case 'b':
+				fc->dirmask = (1U << FAULT_TOECU) | (1U << FAULT_TOHOST);
+				break;
+			default:
+				goto exit;
+			}
+			continue;
+		}
+		if (parse_pair(val, &a, &b)) {
+			goto exit;
+		}
+		if (strcmp(tok, "seed") == 0) {
+			fc->seed = (uint32_t) a;
+		} else if (strcmp(tok, "drop") == 0) {
+			fc->drop_ppm = (uint32_t) a;
+		} else if (strcmp(tok, "corrupt") == 0) {
+			fc->corrupt_ppm = (uint32_t) a;
+		} else if (strcmp(tok, "dup") == 0) {
+			fc->dup_ppm = (uint32_t) a;
+		} else if (strcmp(tok, "delay") == 0) {
+			fc->delay_ppm = (uint32_t) a;
+			fc->delay_ms = (unsigned) b;
+		} else if (strcmp(tok, "burst") == 0) {
+			fc->burst_period_ms = (unsigned) a;
+			fc->burst_len_ms = (unsigned) b;
+		} else {
+			goto exit;
+		}
+	}
+	if (((uint64_t) fc->drop_ppm + fc->corrupt_ppm + fc->dup_ppm + fc->delay_ppm) > 1000000) {
+		goto exit;
+	}
+	if (fc->burst_period_ms && (fc->burst_len_ms >= fc->burst_period_ms)) {
+		goto exit;
+	}
+	rv = 0;
+exit:
+	free(tmp);
+	return rv;
+}
+
+
+void fault_init(struct fault_state *fs, const struct fault_conf *fc) {
+	unsigned dir;
+
+	memset(fs, 0, sizeof(*fs));
+	fs->conf = *fc;
+	for (dir = 0; dir < FAULT_NDIRS; dir++) {
+		fs->rng[dir] = mix64(((uint64_t) fc->seed << 1) | dir);
+	}
+}
+
+/* burst #k starts at a pseudo-random offset within period #k, so it never spills into the next one */
+bool fault_inburst(const struct fault_conf *fc, uint64_t t_ms) {
+	uint64_t k, start;
+
+	if (!fc->burst_period_ms || !fc->burst_len_ms) {
+		return 0;
+	}
+	k = t_ms / fc->burst_period_ms;
+	start = (k * fc->burst_period_ms) +
+	        (mix64(((uint64_t) fc->seed << 32) ^ k) % (fc->burst_period_ms - fc->burst_len_ms));
+	return (t_ms >= start) && (t_ms < (start + fc->burst_len_ms));
+}
+
+enum fault_kind fault_apply(struct fault_state *fs, enum fault_dir dir, uint64_t t_ms, uint8_t *byte) {
+	const struct fault_conf *fc = &fs->conf;
+	enum fault_kind fk = FAULT_NONE;
+	uint64_t r, aux;
+	uint32_t ppm;
+
+	/* always draw the same amount per byte, to keep the schedule tied to byte positions */
+	r = rng_next(&fs->rng[dir]);
+	aux = rng_next(&fs->rng[dir]);
+
+	if (!(fc->dirmask & (1U << dir))) {
+		return FAULT_NONE;
+	}
+
+	if (fault_inburst(fc, t_ms)) {
+		*byte ^= (uint8_t) ((aux % 255) + 1);
+		fk = FAULT_BURST;
+		goto exit;
+	}
+
+	ppm = (uint32_t) (r % 1000000);
+	if (ppm < fc->drop_ppm) {
+		fk = FAULT_DROP;
+		goto exit;
+	}
+	ppm -= fc->drop_ppm;
+	if (ppm < fc->corrupt_ppm) {
+		*byte ^= (uint8_t) (1U << (aux % 8));
+		fk = FAULT_CORRUPT;
+		goto exit;
+	}
+	ppm -= fc->corrupt_ppm;
+	if (ppm < fc->dup_ppm) {
+		fk = FAULT_DUP;
+		goto exit;
+	}
+	ppm -= fc->dup_ppm;
+	if (ppm < fc->delay_ppm) {
+		fk = FAULT_DELAY;
+	}
+exit:
+	fs->count[dir][fk] += 1;
+	return fk;
+}
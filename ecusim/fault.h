@@ -0,0 +1,69 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+/* seeded fault schedule for byte streams : drop, corrupt, duplicate or delay single bytes,
+ * plus periodic noise bursts (ignition-like) that corrupt everything on the wire for a while.
+ *
+ * Each direction has its own generator, so the fate of a byte only depends on the seed
+ * and the byte's position in its stream, not on how both directions interleave; bursts
+ * only depend on the seed and the time since start.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum fault_dir {
+	FAULT_TOECU = 0,
+	FAULT_TOHOST = 1,
+	FAULT_NDIRS
+};
+
+enum fault_kind {
+	FAULT_NONE = 0,
+	FAULT_DROP,
+	FAULT_CORRUPT,	//one bit flipped
+	FAULT_DUP,	//byte sent twice
+	FAULT_DELAY,	//byte (and the rest of the stream) held for delay_ms
+	FAULT_BURST,	//byte garbled by a noise burst
+	FAULT_NKINDS
+};
+
+struct fault_conf {
+	uint32_t seed;
+	uint32_t drop_ppm;	//probabilities per byte, in parts per million
+	uint32_t corrupt_ppm;
+	uint32_t dup_ppm;
+	uint32_t delay_ppm;
+	unsigned delay_ms;
+	unsigned burst_period_ms;	//0 : no bursts
+	unsigned burst_len_ms;
+	unsigned dirmask;	//(1 << enum fault_dir) : directions affected
+};
+
+struct fault_state {
+	struct fault_conf conf;
+	uint64_t rng[FAULT_NDIRS];
+	unsigned long count[FAULT_NDIRS][FAULT_NKINDS];
+};
+
+/** parse a schedule like "drop=100,corrupt=500,dup=50,delay=20:30,burst=1000:8,dir=e,seed=3".
+ * Probabilities are in ppm; delay=<ppm>:<ms>; burst=<period_ms>:<len_ms>;
+ * dir = h (host->ECU), e (ECU->host) or b (both, default).
+ * Fields not given are left untouched.
+ * ret 0 if ok
+ */
+int fault_parse(struct fault_conf *fc, const char *spec);
+
+void fault_init(struct fault_state *fs, const struct fault_conf *fc);
+
+/** decide what happens to one byte travelling in direction <dir>, <t_ms> after start.
+ * *byte is modified for FAULT_CORRUPT / FAULT_BURST.
+ */
+enum fault_kind fault_apply(struct fault_state *fs, enum fault_dir dir, uint64_t t_ms, uint8_t *byte);
+
+/** ret 1 if a noise burst is active at <t_ms> */
+bool fault_inburst(const struct fault_conf *fc, uint64_t t_ms);
+
+const char *fault_name(enum fault_kind fk);
+
+#endif
@@ -0,0 +1,442 @@
+/*
+ *	klreplay - play back the ECU side of a K-line capture
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * Reads a kcap file (nisprog "kcap" command, or klshim -c) and acts as the ECU on a pty :
+ * each recorded request is waited for (and compared), then the recorded responses are sent
+ * with their original delay relative to the request. Field captures can then be re-run
+ * against nisprog as regression / performance tests.
+ *
+ * Also prints captures (-d), and finds the gaps between messages (-a) :
+ *	host gap : end of a response -> next request (nisprog overhead, P3)
+ *	ECU gap : request -> its first response byte(s)
+ */
+
+#define _GNU_SOURCE	//clock_nanosleep
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isoframe.h"
+#include "kcap.h"
+#include "simpty.h"
+
+
+#define REPLAY_DEFTIMEOUT 10000	//ms to wait for each request
+#define REPLAY_TOPGAPS 10
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig) {
+	(void) sig;
+	quit = 1;
+}
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000ULL) + (uint64_t) (ts.tv_nsec / 1000);
+}
+
+static void sleep_until_us(uint64_t t) {
+	struct timespec ts;
+	ts.tv_sec = t / 1000000ULL;
+	ts.tv_nsec = (t % 1000000ULL) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+		if (quit) {
+			return;
+		}
+	}
+}
+
+static const char *type_name(enum kcap_type type) {
+	switch (type) {
+	case KCAP_TXRAW: return "TXRAW";
+	case KCAP_RXRAW: return "RXRAW";
+	case KCAP_TXMSG: return "TXMSG";
+	case KCAP_RXMSG: return "RXMSG";
+	case KCAP_NOTE: return "NOTE ";
+	default: return "?";
+	}
+}
+
+
+/*** -d : dump */
+
+static int dump_capture(struct kcap *kc) {
+	struct kcap_rec rec;
+	int rv;
+
+	while ((rv = kcap_read(kc, &rec)) == 1) {
+		unsigned idx;
+
+		printf("%10.6f %s", rec.t_us / 1e6, type_name(rec.type));
+		if (rec.type == KCAP_NOTE) {
+			printf(" %.*s\n", (int) rec.len, (const char *) rec.data);
+			continue;
+		}
+		for (idx = 0; idx < rec.len; idx++) {
+			printf(" %02X", (unsigned) rec.data[idx]);
+		}
+		printf("\n");
+	}
+	return rv;
+}
+
+
+/*** -a : gap analysis */
+
+struct gap {
+	uint64_t len_us;
+	unsigned long recno;
+	char note[48];	//last note before the gap
+};
+
+static void gap_insert(struct gap *top, const struct gap *g) {
+	unsigned idx = REPLAY_TOPGAPS;
+
+	while (idx && (top[idx - 1].len_us < g->len_us)) {
+		if (idx < REPLAY_TOPGAPS) {
+			top[idx] = top[idx - 1];
+		}
+		idx--;
+	}
+	if (idx < REPLAY_TOPGAPS) {
+		top[idx] = *g;
+	}
+}
+
+static int analyze_capture(struct kcap *kc) {
+	struct kcap_rec rec;
+	struct gap top[REPLAY_TOPGAPS] = {{0}};
+	char note[48] = "";
+	unsigned long txbytes = 0, rxbytes = 0, nreq = 0, nhost = 0, necu = 0;
+	uint64_t hostgap = 0, ecugap = 0;
+	uint64_t t_lastrx = 0, t_lasttx = 0, t_end = 0;
+	bool have_rx = 0, waiting_resp = 0;
+	int rv;
+
+	while ((rv = kcap_read(kc, &rec)) == 1) {
+		t_end = rec.t_us;
+		if (rec.type == KCAP_NOTE) {
+			snprintf(note, sizeof(note), "%.*s", (int) rec.len, (const char *) rec.data);
+			continue;
+		}
+		if (kcap_is_tx(rec.type)) {
+			txbytes += rec.len;
+			if (waiting_resp) {
+				/* previous chunk of the same request (TXRAW), or no response at all */
+				t_lasttx = rec.t_us;
+				continue;
+			}
+			nreq += 1;
+			if (have_rx) {
+				struct gap g = {.len_us = rec.t_us - t_lastrx, .recno = kc->nrecs};
+				memcpy(g.note, note, sizeof(g.note));
+				hostgap += g.len_us;
+				nhost += 1;
+				gap_insert(top, &g);
+			}
+			t_lasttx = rec.t_us;
+			waiting_resp = 1;
+			continue;
+		}
+		rxbytes += rec.len;
+		if (waiting_resp) {
+			ecugap += rec.t_us - t_lasttx;
+			necu += 1;
+			waiting_resp = 0;
+		}
+		t_lastrx = rec.t_us;
+		have_rx = 1;
+	}
+
+	printf("%lu records, %.3f s, %lu requests; %lu bytes to ECU, %lu from ECU (%lu B/s)\n",
+	       kc->nrecs, t_end / 1e6, nreq, txbytes, rxbytes,
+	       t_end ? (unsigned long) ((rxbytes * 1000000ULL) / t_end) : 0UL);
+	if (nhost) {
+		printf("host gaps : total %.3f s (%.1f%%), avg %lu us\n", hostgap / 1e6,
+		       t_end ? (100.0 * hostgap / t_end) : 0, (unsigned long) (hostgap / nhost));
+	}
+	if (necu) {
+		printf("ECU gaps : total %.3f s (%.1f%%), avg %lu us\n", ecugap / 1e6,
+		       t_end ? (100.0 * ecugap / t_end) : 0, (unsigned long) (ecugap / necu));
+	}
+	printf("largest host gaps :\n");
+	for (unsigned idx = 0; (idx < REPLAY_TOPGAPS) && top[idx].len_us; idx++) {
+		printf("\t%8lu us before record %lu%s%s\n", (unsigned long) top[idx].len_us, top[idx].recno,
+		       top[idx].note[0] ? ", after " : "", top[idx].note);
+	}
+	return rv;
+}
+
+
+/*** replay */
+
+struct replay {
+	int fd;
+	bool echo;
+	bool notiming;
+	bool verbose;
+	unsigned timeout_ms;
+
+	uint8_t rxbuf[ISOFRAME_MAXLEN * 4];
+	unsigned rxlen;
+
+	/* last request : header to mirror for RXMSG, and time anchors */
+	struct isoframe req;
+	bool have_req;
+	uint64_t t_req_host;	//us, CLOCK_MONOTONIC
+	uint64_t t_req_cap;	//us, capture time
+
+	unsigned long nreq;
+	unsigned long mismatches;
+};
+
+static void write_all(int fd, const uint8_t *buf, unsigned len) {
+	while (len && !quit) {
+		ssize_t rv = write(fd, buf, len);
+		if (rv < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			perror("pty write");
+			quit = 1;
+			return;
+		}
+		buf += rv;
+		len -= (unsigned) rv;
+	}
+}
+
+/** read more bytes from the host. ret 0 if ok, -1 if timeout / error */
+static int replay_fill(struct replay *rp, uint64_t deadline) {
+	struct pollfd pfd = {.fd = rp->fd, .events = POLLIN};
+	ssize_t rdlen;
+	int rv;
+
+	while (!quit) {
+		uint64_t t = now_us();
+		if (t >= deadline) {
+			return -1;
+		}
+		rv = poll(&pfd, 1, (int) ((deadline - t) / 1000) + 1);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (rv == 0) {
+			continue;
+		}
+		rdlen = read(rp->fd, &rp->rxbuf[rp->rxlen], sizeof(rp->rxbuf) - rp->rxlen);
+		if (rdlen <= 0) {
+			if ((rdlen < 0) && (errno == EINTR || errno == EAGAIN)) {
+				continue;
+			}
+			return -1;
+		}
+		if (rp->echo) {
+			write_all(rp->fd, &rp->rxbuf[rp->rxlen], (unsigned) rdlen);
+		}
+		rp->rxlen += (unsigned) rdlen;
+		return 0;
+	}
+	return -1;
+}
+
+static void replay_consume(struct replay *rp, unsigned len) {
+	rp->rxlen -= len;
+	memmove(rp->rxbuf, &rp->rxbuf[len], rp->rxlen);
+}
+
+/** wait for the host to send what <rec> recorded. ret 0 if ok */
+static int replay_expect(struct replay *rp, const struct kcap_rec *rec) {
+	uint64_t deadline = now_us() + (rp->timeout_ms * 1000ULL);
+	bool match;
+
+	if (rec->type == KCAP_TXMSG) {
+		unsigned flen;
+		while (!(flen = isoframe_parse(rp->rxbuf, rp->rxlen, &rp->req))) {
+			if (replay_fill(rp, deadline)) {
+				return -1;
+			}
+		}
+		replay_consume(rp, flen);
+		match = (rp->req.len == rec->len) && !memcmp(rp->req.data, rec->data, rec->len);
+		rp->have_req = 1;
+	} else {
+		/* raw chunk, not necessarily a whole frame */
+		while (rp->rxlen < rec->len) {
+			if (replay_fill(rp, deadline)) {
+				return -1;
+			}
+		}
+		match = !memcmp(rp->rxbuf, rec->data, rec->len);
+		if (isoframe_parse(rp->rxbuf, rec->len, &rp->req)) {
+			rp->have_req = 1;
+		}
+		replay_consume(rp, rec->len);
+	}
+	if (!match) {
+		rp->mismatches += 1;
+		if (rp->verbose) {
+			printf("request %lu differs from capture\n", rp->nreq);
+		}
+	}
+	rp->nreq += 1;
+	rp->t_req_host = now_us();
+	rp->t_req_cap = rec->t_us;
+	return 0;
+}
+
+/** send what the ECU sent in <rec>, at the recorded delay after the last request */
+static void replay_respond(struct replay *rp, const struct kcap_rec *rec) {
+	uint8_t frame[ISOFRAME_MAXLEN];
+
+	if (!rp->notiming && (rec->t_us > rp->t_req_cap)) {
+		sleep_until_us(rp->t_req_host + (rec->t_us - rp->t_req_cap));
+	}
+	if (rec->type == KCAP_RXRAW) {
+		write_all(rp->fd, rec->data, rec->len);
+		return;
+	}
+	/* RXMSG : rebuild the frame, mirroring the request header */
+	unsigned flen;
+	if (rp->have_req && rp->req.addressed) {
+		flen = isoframe_build(frame, rec->data, rec->len, 1, 0, rp->req.src, rp->req.tgt);
+	} else {
+		flen = isoframe_build(frame, rec->data, rec->len, 0, 0, 0, 0);
+	}
+	if (flen) {
+		write_all(rp->fd, frame, flen);
+	}
+}
+
+static int replay_capture(struct kcap *kc, struct replay *rp) {
+	struct kcap_rec rec;
+	int rv;
+
+	while (!quit && ((rv = kcap_read(kc, &rec)) == 1)) {
+		if (rec.type == KCAP_NOTE) {
+			printf("note : %.*s\n", (int) rec.len, (const char *) rec.data);
+			continue;
+		}
+		if (kcap_is_tx(rec.type)) {
+			if (replay_expect(rp, &rec)) {
+				printf("no request from host (record %lu), stopping\n", kc->nrecs);
+				return -1;
+			}
+			continue;
+		}
+		replay_respond(rp, &rec);
+	}
+	return quit ? -1 : rv;
+}
+
+
+static void usage(void) {
+	printf("klreplay : play back the ECU side of a K-line capture\n"
+	       "usage : klreplay [options] <capture.kcap>\n"
+	       "\t-s <path>\tcreate a symlink to the pty slave, for nisprog's \"set port\"\n"
+	       "\t-e\t\techo requests, like a K-line (for nisprog captures with dumbopts 0x48)\n"
+	       "\t-T\t\tignore recorded timing, respond immediately\n"
+	       "\t-t <ms>\t\ttimeout for each request (default: %u)\n"
+	       "\t-d\t\tprint capture and exit\n"
+	       "\t-a\t\tanalyze gaps between messages and exit\n"
+	       "\t-v\t\tverbose\n",
+	       REPLAY_DEFTIMEOUT);
+}
+
+int main(int argc, char **argv) {
+	static struct replay rp;
+	struct kcap kc;
+	const char *linkname = NULL;
+	bool dump = 0, analyze = 0;
+	int slavefd = -1;
+	int opt, rv;
+
+	rp.timeout_ms = REPLAY_DEFTIMEOUT;
+
+	while ((opt = getopt(argc, argv, "s:eTt:davh")) != -1) {
+		switch (opt) {
+		case 's':
+			linkname = optarg;
+			break;
+		case 'e':
+			rp.echo = 1;
+			break;
+		case 'T':
+			rp.notiming = 1;
+			break;
+		case 't':
+			rp.timeout_ms = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			dump = 1;
+			break;
+		case 'a':
+			analyze = 1;
+			break;
+		case 'v':
+			rp.verbose = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+	if (kcap_open(&kc, argv[optind])) {
+		printf("can't open %s, or not a capture file\n", argv[optind]);
+		return 1;
+	}
+
+	if (dump || analyze) {
+		rv = dump ? dump_capture(&kc) : analyze_capture(&kc);
+		kcap_close(&kc);
+		if (rv < 0) {
+			printf("capture file is truncated / corrupt\n");
+			return 1;
+		}
+		return 0;
+	}
+
+	rp.fd = simpty_open(&slavefd, linkname);
+	if (rp.fd < 0) {
+		kcap_close(&kc);
+		return 1;
+	}
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	rv = replay_capture(&kc, &rp);
+	printf("%s : %lu requests, %lu differed from the capture\n",
+	       (rv == 0) ? "capture done" : "replay stopped", rp.nreq, rp.mismatches);
+
+	/* give the host time to read the last response before the pty goes away */
+	sleep_until_us(now_us() + 200000);
+	kcap_close(&kc);
+	if (linkname) {
+		(void) unlink(linkname);
+	}
+	close(slavefd);
+	close(rp.fd);
+	return (rv == 0) ? 0 : 1;
+}
@@ -0,0 +1,522 @@
+/*
+ *	klshim - fault-injecting relay between nisprog and a K-line interface
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * nisprog opens the pty created here; every byte is relayed to / from <device>
+ * (a real interface, or an ecusim pty) through a seeded fault schedule (see fault.h),
+ * so the recovery paths (dump retries, flash block aborts, bad CRC handling) can be
+ * exercised and timed under repeatable conditions.
+ *
+ * Both delivered streams are re-framed (iso14230) to measure what actually got through :
+ *	goodput : data bytes of valid frames delivered to the host, per second of activity
+ *	time to recover : from a fault until the next valid, non-echo frame reaches the host
+ *
+ * Only standard bitrates set on the pty by nisprog can be mirrored on <device>; that
+ * doesn't matter when relaying to ecusim, which only looks at bytes.
+ */
+
+#define _GNU_SOURCE	//cfmakeraw
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fault.h"
+#include "isoframe.h"
+#include "kcap.h"
+#include "simpty.h"
+
+
+#define SHIM_QSIZE 4096	//bytes in flight per direction
+#define SHIM_FRAMEGAP 20	//ms; ISO14230 P1max. Partial frames older than this are garbage
+
+struct relayq {
+	uint8_t data[SHIM_QSIZE];
+	uint64_t release[SHIM_QSIZE];	//ms
+	unsigned head;
+	unsigned count;
+	uint64_t hold_until;	//ms; set by FAULT_DELAY
+	unsigned long overflows;
+};
+
+/* iso14230 framing of a delivered stream */
+struct ftrack {
+	uint8_t buf[ISOFRAME_MAXLEN];
+	unsigned len;
+	uint64_t t_start;	//first byte of current partial frame
+	uint64_t t_last;
+	uint64_t t_first;	//first byte ever delivered
+	unsigned long bytes;
+	unsigned long frames_ok;
+	unsigned long frames_bad;
+	unsigned long echoes;
+	unsigned long garbage;	//bytes not part of any frame
+	unsigned long data_bytes;	//payload of valid frames
+};
+
+struct shim {
+	int ptyfd;
+	int devfd;
+	bool devtty;
+	speed_t devspeed;
+	bool verbose;
+	uint64_t t0;
+
+	struct kcap cap;	//capture of the delivered streams, if cap.f != NULL
+
+	struct fault_state fs;
+	struct relayq q[FAULT_NDIRS];
+	struct ftrack ft[FAULT_NDIRS];
+
+	/* last request frame delivered to the ECU, to recognize its echo */
+	uint8_t lastreq[ISOFRAME_MAXLEN];
+	unsigned lastreq_len;
+
+	/* recovery */
+	bool recovering;
+	uint64_t t_fault_first;	//first fault since the last valid response
+	uint64_t t_fault_last;
+	unsigned long nrecov;
+	uint64_t recov_total;
+	uint64_t recov_max;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig) {
+	(void) sig;
+	quit = 1;
+}
+
+static uint64_t now_ms(const struct shim *sh) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000ULL) + (uint64_t) (ts.tv_nsec / 1000000) - sh->t0;
+}
+
+static const char *dir_name(enum fault_dir dir) {
+	return (dir == FAULT_TOECU) ? "host->ECU" : "ECU->host";
+}
+
+
+/** a complete frame was delivered in direction <dir> */
+static void shim_frame(struct shim *sh, enum fault_dir dir, const uint8_t *raw, unsigned rawlen,
+                       const struct isoframe *f, uint64_t t) {
+	struct ftrack *ft = &sh->ft[dir];
+
+	if (dir == FAULT_TOECU) {
+		memcpy(sh->lastreq, raw, rawlen);
+		sh->lastreq_len = rawlen;
+	} else if ((rawlen == sh->lastreq_len) && !memcmp(raw, sh->lastreq, rawlen)) {
+		/* K-line echo of the request */
+		ft->echoes += 1;
+		return;
+	}
+
+	if (!f->cks_ok) {
+		ft->frames_bad += 1;
+		return;
+	}
+	ft->frames_ok += 1;
+	ft->data_bytes += f->len;
+
+	if ((dir == FAULT_TOHOST) && sh->recovering && (ft->t_start > sh->t_fault_last)) {
+		uint64_t dt = t - sh->t_fault_first;
+		sh->recovering = 0;
+		sh->nrecov += 1;
+		sh->recov_total += dt;
+		if (dt > sh->recov_max) {
+			sh->recov_max = dt;
+		}
+		if (sh->verbose) {
+			printf("recovered after %lu ms\n", (unsigned long) dt);
+		}
+	}
+}
+
+/** feed one delivered byte to the framing of direction <dir> */
+static void shim_track(struct shim *sh, enum fault_dir dir, uint8_t byte, uint64_t t) {
+	struct ftrack *ft = &sh->ft[dir];
+	struct isoframe f;
+	unsigned flen;
+
+	if (!ft->bytes) {
+		ft->t_first = t;
+	}
+	ft->bytes += 1;
+	if (ft->len && ((t - ft->t_last) > SHIM_FRAMEGAP)) {
+		ft->garbage += ft->len;
+		ft->len = 0;
+	}
+	if (!ft->len) {
+		ft->t_start = t;
+	}
+	ft->buf[ft->len++] = byte;
+	ft->t_last = t;
+
+	flen = isoframe_parse(ft->buf, ft->len, &f);
+	if (flen) {
+		shim_frame(sh, dir, ft->buf, flen, &f, t);
+		/* flen is always == len since bytes are fed one at a time */
+		ft->len = 0;
+	} else if (ft->len == sizeof(ft->buf)) {
+		ft->garbage += ft->len;
+		ft->len = 0;
+	}
+}
+
+
+static void note_fault(struct shim *sh, enum fault_dir dir, enum fault_kind fk, uint64_t t) {
+	if (!sh->recovering) {
+		sh->recovering = 1;
+		sh->t_fault_first = t;
+	}
+	sh->t_fault_last = t;
+	if (sh->verbose) {
+		printf("%lu ms : %s %s\n", (unsigned long) t, dir_name(dir), fault_name(fk));
+	}
+}
+
+static void q_push(struct relayq *q, uint8_t byte, uint64_t release) {
+	unsigned idx;
+
+	if (q->count == SHIM_QSIZE) {
+		q->overflows += 1;
+		return;
+	}
+	idx = (q->head + q->count) % SHIM_QSIZE;
+	q->data[idx] = byte;
+	q->release[idx] = release;
+	q->count += 1;
+}
+
+/** run bytes just read from the <dir> source through the fault schedule, into the queue */
+static void shim_inject(struct shim *sh, enum fault_dir dir, const uint8_t *buf, unsigned len, uint64_t t) {
+	struct relayq *q = &sh->q[dir];
+	unsigned idx;
+
+	for (idx = 0; idx < len; idx++) {
+		uint8_t byte = buf[idx];
+		enum fault_kind fk = fault_apply(&sh->fs, dir, t, &byte);
+		uint64_t release;
+
+		if (fk != FAULT_NONE) {
+			note_fault(sh, dir, fk, t);
+		}
+		if (fk == FAULT_DROP) {
+			continue;
+		}
+		if (fk == FAULT_DELAY) {
+			uint64_t from = (q->hold_until > t) ? q->hold_until : t;
+			q->hold_until = from + sh->fs.conf.delay_ms;
+		}
+		release = (q->hold_until > t) ? q->hold_until : t;
+		q_push(q, byte, release);
+		if (fk == FAULT_DUP) {
+			q_push(q, byte, release);
+		}
+	}
+}
+
+/** write out every queued byte that's due. ret ms until the next one, -1 if queue empty */
+static int shim_flush(struct shim *sh, enum fault_dir dir, uint64_t t) {
+	struct relayq *q = &sh->q[dir];
+	int fd = (dir == FAULT_TOECU) ? sh->devfd : sh->ptyfd;
+	uint8_t out[SHIM_QSIZE];
+	unsigned n = 0;
+
+	while (q->count && (q->release[q->head] <= t)) {
+		out[n++] = q->data[q->head];
+		q->head = (q->head + 1) % SHIM_QSIZE;
+		q->count -= 1;
+	}
+	if (n) {
+		unsigned idx, done = 0;
+		while (done < n) {
+			ssize_t rv = write(fd, &out[done], n - done);
+			if (rv < 0) {
+				if (errno == EINTR || errno == EAGAIN) {
+					continue;
+				}
+				perror("write");
+				quit = 1;
+				break;
+			}
+			done += (unsigned) rv;
+		}
+		for (idx = 0; idx < n; idx++) {
+			shim_track(sh, dir, out[idx], t);
+		}
+		if (sh->cap.f) {
+			(void) kcap_write(&sh->cap, (dir == FAULT_TOECU) ? KCAP_TXRAW : KCAP_RXRAW,
+			                  kcap_now() - sh->cap.t_start, out, n);
+		}
+	}
+	if (!q->count) {
+		return -1;
+	}
+	return (int) (q->release[q->head] - t);
+}
+
+
+/** apply the pty's bitrate to the device, if it changed and is a standard rate */
+static void shim_mirror_speed(struct shim *sh) {
+	struct termios tio;
+	speed_t sp;
+
+	if (!sh->devtty || tcgetattr(sh->ptyfd, &tio)) {
+		return;
+	}
+	sp = cfgetospeed(&tio);
+	if (sp == sh->devspeed) {
+		return;
+	}
+	sh->devspeed = sp;
+	if (tcgetattr(sh->devfd, &tio)) {
+		return;
+	}
+	if (cfsetispeed(&tio, sp) || cfsetospeed(&tio, sp) || tcsetattr(sh->devfd, TCSANOW, &tio)) {
+		printf("can't mirror bitrate on device\n");
+		return;
+	}
+	if (sh->verbose) {
+		printf("device speed updated\n");
+	}
+}
+
+
+static int open_device(struct shim *sh, const char *fname) {
+	struct termios tio;
+
+	sh->devfd = open(fname, O_RDWR | O_NOCTTY);
+	if (sh->devfd < 0) {
+		perror("open device");
+		return -1;
+	}
+	if (tcgetattr(sh->devfd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+		(void) tcsetattr(sh->devfd, TCSANOW, &tio);
+		sh->devtty = 1;
+		sh->devspeed = cfgetospeed(&tio);
+	}
+	return 0;
+}
+
+
+static void run(struct shim *sh) {
+	uint8_t buf[512];
+
+	while (!quit) {
+		struct pollfd pfd[2] = {
+			{.fd = sh->ptyfd, .events = POLLIN},
+			{.fd = sh->devfd, .events = POLLIN},
+		};
+		uint64_t t = now_ms(sh);
+		int timeout = 50;
+		int next, rv;
+		unsigned idx;
+
+		for (idx = 0; idx < FAULT_NDIRS; idx++) {
+			next = shim_flush(sh, (enum fault_dir) idx, t);
+			if ((next >= 0) && (next < timeout)) {
+				timeout = next;
+			}
+		}
+		shim_mirror_speed(sh);
+
+		rv = poll(pfd, 2, timeout);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+		t = now_ms(sh);
+		for (idx = 0; idx < 2; idx++) {
+			/* pty (host) feeds the to-ECU stream, device feeds the to-host stream */
+			enum fault_dir dir = idx ? FAULT_TOHOST : FAULT_TOECU;
+			ssize_t rdlen;
+
+			if (!(pfd[idx].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			rdlen = read(pfd[idx].fd, buf, sizeof(buf));
+			if (rdlen <= 0) {
+				if ((rdlen < 0) && (errno == EINTR || errno == EAGAIN)) {
+					continue;
+				}
+				printf("%s : read error / EOF\n", idx ? "device" : "pty");
+				quit = 1;
+				break;
+			}
+			shim_inject(sh, dir, buf, (unsigned) rdlen, t);
+		}
+	}
+}
+
+
+static void print_stats(const struct shim *sh, FILE *outf, bool json) {
+	unsigned dir, fk;
+
+	if (json) {
+		fprintf(outf, "{\n");
+	}
+	for (dir = 0; dir < FAULT_NDIRS; dir++) {
+		const struct ftrack *ft = &sh->ft[dir];
+		uint64_t span = ft->t_last - ft->t_first;
+		unsigned long goodput = span ? (unsigned long) ((ft->data_bytes * 1000ULL) / span) : 0;
+
+		if (json) {
+			fprintf(outf, "\"%s\": {\"bytes\": %lu, \"frames_ok\": %lu, \"frames_bad\": %lu, "
+			        "\"echoes\": %lu, \"garbage\": %lu, \"data_bytes\": %lu, \"goodput_Bps\": %lu, "
+			        "\"overflows\": %lu",
+			        (dir == FAULT_TOECU) ? "to_ecu" : "to_host", ft->bytes, ft->frames_ok,
+			        ft->frames_bad, ft->echoes, ft->garbage, ft->data_bytes, goodput,
+			        sh->q[dir].overflows);
+			for (fk = FAULT_DROP; fk < FAULT_NKINDS; fk++) {
+				fprintf(outf, ", \"%s\": %lu", fault_name(fk), sh->fs.count[dir][fk]);
+			}
+			fprintf(outf, "},\n");
+			continue;
+		}
+		fprintf(outf, "%s : %lu bytes, %lu good / %lu bad frames, %lu garbage bytes, goodput %lu B/s\n\tfaults :",
+		        dir_name(dir), ft->bytes, ft->frames_ok, ft->frames_bad, ft->garbage, goodput);
+		for (fk = FAULT_DROP; fk < FAULT_NKINDS; fk++) {
+			fprintf(outf, " %s %lu", fault_name(fk), sh->fs.count[dir][fk]);
+		}
+		fprintf(outf, "\n");
+	}
+	if (json) {
+		fprintf(outf, "\"recoveries\": %lu,\n\"recover_avg_ms\": %lu,\n\"recover_max_ms\": %lu,\n"
+		        "\"unrecovered\": %s\n}\n",
+		        sh->nrecov, sh->nrecov ? (unsigned long) (sh->recov_total / sh->nrecov) : 0UL,
+		        (unsigned long) sh->recov_max, sh->recovering ? "true" : "false");
+		return;
+	}
+	fprintf(outf, "%lu recoveries, avg %lu ms, max %lu ms%s\n",
+	        sh->nrecov, sh->nrecov ? (unsigned long) (sh->recov_total / sh->nrecov) : 0UL,
+	        (unsigned long) sh->recov_max, sh->recovering ? "; last fault not recovered" : "");
+}
+
+
+static void usage(void) {
+	printf("klshim : fault-injecting relay between nisprog and a K-line interface\n"
+	       "usage : klshim [options] <device>\n"
+	       "\t<device> is the real interface, or an ecusim pty\n"
+	       "\t-f <schedule>\tfaults, e.g. \"drop=100,corrupt=500,dup=50,delay=20:30,burst=1000:8,dir=e\"\n"
+	       "\t\t\tprobabilities in ppm per byte; delay=<ppm>:<ms>; burst=<period_ms>:<len_ms>;\n"
+	       "\t\t\tdir = h (host->ECU), e (ECU->host), b (both, default)\n"
+	       "\t-R <seed>\tschedule seed (default: 1)\n"
+	       "\t-s <path>\tcreate a symlink to the pty slave, for nisprog's \"set port\"\n"
+	       "\t-j <file>\twrite counters (JSON) to <file> on exit\n"
+	       "\t-c <file>\tcapture delivered bytes (kcap format, see klreplay)\n"
+	       "\t-v\t\tverbose : print every fault and recovery\n");
+}
+
+int main(int argc, char **argv) {
+	static struct shim sh;
+	struct fault_conf fc = {.seed = 1};
+	const char *linkname = NULL;
+	const char *statsfile = NULL;
+	const char *capfile = NULL;
+	int slavefd = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:R:s:j:c:vh")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (fault_parse(&fc, optarg)) {
+				printf("bad fault schedule \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		case 'R':
+			fc.seed = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			linkname = optarg;
+			break;
+		case 'j':
+			statsfile = optarg;
+			break;
+		case 'c':
+			capfile = optarg;
+			break;
+		case 'v':
+			sh.verbose = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+	if (!fc.dirmask) {
+		fc.dirmask = (1U << FAULT_TOECU) | (1U << FAULT_TOHOST);
+	}
+	fault_init(&sh.fs, &fc);
+
+	if (open_device(&sh, argv[optind])) {
+		return 1;
+	}
+	if (capfile && kcap_create(&sh.cap, capfile)) {
+		printf("can't create %s\n", capfile);
+		close(sh.devfd);
+		return 1;
+	}
+	sh.ptyfd = simpty_open(&slavefd, linkname);
+	if (sh.ptyfd < 0) {
+		kcap_close(&sh.cap);
+		close(sh.devfd);
+		return 1;
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	sh.t0 = 0;
+	sh.t0 = now_ms(&sh);
+	run(&sh);
+
+	printf("\n");
+	print_stats(&sh, stdout, 0);
+	if (statsfile) {
+		FILE *sf = fopen(statsfile, "w");
+		if (sf) {
+			print_stats(&sh, sf, 1);
+			fclose(sf);
+		} else {
+			printf("can't open %s for writing !\n", statsfile);
+		}
+	}
+
+	if (sh.cap.f) {
+		printf("%lu records captured to %s\n", sh.cap.nrecs, capfile);
+		kcap_close(&sh.cap);
+	}
+	if (linkname) {
+		(void) unlink(linkname);
+	}
+	close(slavefd);
+	close(sh.ptyfd);
+	close(sh.devfd);
+	return 0;
+}
@@ -0,0 +1,836 @@
+/*
+ *	nisprog_bench - reproducible throughput benchmark, nisprog against ecusim
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * For every combination of bitrate, turnaround latency and error rate, each operation
+ * (ROM / RAM / EEPROM dump, CRC verify, block reflash, kernel upload) runs in a fresh
+ * ecusim + nisprog pair driven by a generated script. ecusim reports what went over the
+ * simulated K-line (-j); a "setup only" run (connect + initk, or connect + setkeys) is
+ * subtracted so only the operation itself is counted.
+ *
+ * Results go to stdout, as CSV (default) or JSON :
+ *	effective payload B/s, round trips, wire bytes and wire efficiency (payload / wire bytes).
+ * The simulated link time is used, so results don't depend on host load, as long as
+ * nisprog keeps up with the simulated bitrate.
+ */
+
+#define _GNU_SOURCE	//strdup
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stypes.h"
+
+#include "npk_util.h"
+#include "nissutils/cli_utils/nislib.h"
+
+
+#define BENCH_DEFBAUDS "10400,31250,62500,125000"
+#define BENCH_DEFLATS "2"
+#define BENCH_DEFERRS "0"
+#define BENCH_DEFOPS "rom,ram,eep,crc,block,kernel"
+#define BENCH_DEFBLOCK 1
+#define BENCH_DEFTIMEOUT 1800	//s, per nisprog run
+#define BENCH_MAXLIST 16
+
+#define BENCH_RAMADDR 0xFFFF8000UL	//inside ecusim's RAM window
+#define BENCH_RAMLEN 0x2000
+#define BENCH_EEPSIZE 512	//must match ecusim
+
+#define BENCH_PTYWAIT 3000	//ms to wait for ecusim to create its pty
+
+
+enum bench_op {
+	OP_SETUP_NPK,	//baseline for kernel operations
+	OP_SETUP_NIS,	//baseline for kernel upload
+	OP_ROM,
+	OP_RAM,
+	OP_EEP,
+	OP_CRC,
+	OP_BLOCK,
+	OP_KERNEL,
+	OP_INVALID
+};
+
+static const char *op_names[] = {
+	[OP_SETUP_NPK] = "setup_npk",
+	[OP_SETUP_NIS] = "setup_nis",
+	[OP_ROM] = "rom",
+	[OP_RAM] = "ram",
+	[OP_EEP] = "eep",
+	[OP_CRC] = "crc",
+	[OP_BLOCK] = "block",
+	[OP_KERNEL] = "kernel",
+};
+
+struct bench_conf {
+	const char *nisprog;	//executables
+	const char *ecusim;
+	const char *workdir;
+	const char *romfile;
+	const char *kernelfile;
+	char eepfile[256];
+	const struct flashdev_t *fdt;
+	uint32_t kernel_len;
+	unsigned blockno;
+	unsigned seed;
+	unsigned timeout;
+	bool json;
+};
+
+struct bench_cell {
+	unsigned baud;
+	unsigned latency_ms;
+	unsigned err_pm;
+};
+
+/* ecusim counters, from its -j file */
+struct simstats {
+	unsigned long baud;	//bitrate ecusim actually paced the line at
+	unsigned long requests;
+	unsigned long badframes;
+	unsigned long corrupted;
+	unsigned long rxbytes;
+	unsigned long txbytes;
+	unsigned long span_ms;
+};
+
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000ULL) + (uint64_t) (ts.tv_nsec / 1000000);
+}
+
+static void sleep_ms(unsigned ms) {
+	struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+}
+
+
+/** parse comma-separated list of unsigned ints. ret # of entries, 0 if error */
+static unsigned parse_list(const char *str, unsigned *dest) {
+	unsigned n = 0;
+
+	while (*str && (n < BENCH_MAXLIST)) {
+		char *endp;
+		dest[n++] = (unsigned) strtoul(str, &endp, 0);
+		if (endp == str) {
+			return 0;
+		}
+		if (*endp == ',') {
+			endp++;
+		} else if (*endp) {
+			return 0;
+		}
+		str = endp;
+	}
+	return *str ? 0 : n;
+}
+
+/** parse comma-separated op names into a bitmask. ret 0 if error */
+static unsigned parse_ops(const char *str) {
+	char *tmp = strdup(str);
+	char *tok, *saveptr;
+	unsigned mask = 0;
+
+	if (!tmp) {
+		return 0;
+	}
+	for (tok = strtok_r(tmp, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		unsigned op;
+		for (op = OP_ROM; op < OP_INVALID; op++) {
+			if (strcmp(tok, op_names[op]) == 0) {
+				break;
+			}
+		}
+		if (op == OP_INVALID) {
+			printf("unknown operation %s\n", tok);
+			free(tmp);
+			return 0;
+		}
+		mask |= 1U << op;
+	}
+	free(tmp);
+	return mask;
+}
+
+
+/** make <workdir>/<name> into dest (PATH_MAX-ish buffer) */
+static void wpath(const struct bench_conf *bc, const char *name, char *dest, size_t len) {
+	snprintf(dest, len, "%s/%s", bc->workdir, name);
+}
+
+/** payload bytes transferred by an operation */
+static uint32_t op_payload(const struct bench_conf *bc, enum bench_op op) {
+	switch (op) {
+	case OP_ROM:
+	case OP_CRC:
+		return bc->fdt->romsize;
+	case OP_RAM:
+		return BENCH_RAMLEN;
+	case OP_EEP:
+		return BENCH_EEPSIZE;
+	case OP_BLOCK:
+		return bc->fdt->fblocks[bc->blockno].len;
+	case OP_KERNEL:
+		return bc->kernel_len;
+	default:
+		return 0;
+	}
+}
+
+static bool op_is_nis(enum bench_op op) {
+	return (op == OP_SETUP_NIS) || (op == OP_KERNEL);
+}
+
+
+/** write nisprog script for one operation. ret 0 if ok */
+static int write_script(const struct bench_conf *bc, enum bench_op op, const char *fname,
+                        const char *ptyname, const char *outfile) {
+	FILE *sf;
+
+	sf = fopen(fname, "w");
+	if (!sf) {
+		fprintf(stderr, "can't create %s\n", fname);
+		return -1;
+	}
+	fprintf(sf, "set\n"
+	        "interface dumb\n"
+	        "port %s\n"
+	        "dumbopts 0x48\n"
+	        "l2protocol iso14230\n"
+	        "initmode fast\n"
+	        "testerid 0xfc\n"
+	        "destaddr 0x10\n"
+	        "addrtype phys\n"
+	        "speed %u\n"
+	        "up\n"
+	        "setdev %s\n"
+	        "nc\n",
+	        ptyname, op_is_nis(op) ? 10400 : 62500, bc->fdt->name);
+
+	if (op_is_nis(op)) {
+		fprintf(sf, "setkeys 0x%08lX\n", (unsigned long) known_keys[0].s27k);
+	} else {
+		fprintf(sf, "initk\n");
+	}
+
+	switch (op) {
+	case OP_ROM:
+		fprintf(sf, "dm %s 0 0\n", outfile);
+		break;
+	case OP_RAM:
+		fprintf(sf, "dm %s 0x%08lX %u\n", outfile, (unsigned long) BENCH_RAMADDR, BENCH_RAMLEN);
+		break;
+	case OP_EEP:
+		fprintf(sf, "dm %s 0 %u eep\n", outfile, BENCH_EEPSIZE);
+		break;
+	case OP_CRC:
+		fprintf(sf, "flverif %s\n", bc->romfile);
+		break;
+	case OP_BLOCK:
+		/* practice mode : same traffic, no confirmation prompt */
+		fprintf(sf, "flblock %s %u\n", bc->romfile, bc->blockno);
+		break;
+	case OP_KERNEL:
+		fprintf(sf, "runkernel %s\n", bc->kernelfile);
+		break;
+	default:
+		break;
+	}
+	fprintf(sf, "quit\n");
+	fclose(sf);
+	return 0;
+}
+
+
+/** fork + exec, with stdout/stderr to <logfile> and stdin from /dev/null.
+ * ret pid, -1 if error
+ */
+static pid_t spawn(char *const argv[], const char *logfile) {
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		int nullfd = open("/dev/null", O_RDONLY);
+		int logfd = open(logfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if ((nullfd < 0) || (logfd < 0)) {
+			_exit(127);
+		}
+		dup2(nullfd, STDIN_FILENO);
+		dup2(logfd, STDOUT_FILENO);
+		dup2(logfd, STDERR_FILENO);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+/** wait for a child, killing it after <timeout> s. ret exit status, -1 if killed / error */
+static int wait_child(pid_t pid, unsigned timeout) {
+	uint64_t deadline = now_ms() + (timeout * 1000ULL);
+	int status;
+
+	while (1) {
+		pid_t rv = waitpid(pid, &status, WNOHANG);
+		if (rv == pid) {
+			return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+		}
+		if (rv < 0) {
+			return -1;
+		}
+		if (now_ms() > deadline) {
+			fprintf(stderr, "timeout, killing pid %ld\n", (long) pid);
+			kill(pid, SIGKILL);
+			(void) waitpid(pid, &status, 0);
+			return -1;
+		}
+		sleep_ms(20);
+	}
+}
+
+
+/** parse ecusim's -j file; only top-level counters. ret 0 if ok */
+static int read_simstats(const char *fname, struct simstats *st) {
+	char line[256];
+	FILE *sf;
+	unsigned found = 0;
+
+	sf = fopen(fname, "r");
+	if (!sf) {
+		return -1;
+	}
+	memset(st, 0, sizeof(*st));
+	while (fgets(line, sizeof(line), sf)) {
+		char key[32];
+		unsigned long val;
+
+		if (sscanf(line, " \"%31[^\"]\": %lu", key, &val) != 2) {
+			continue;
+		}
+		found++;
+		if (strcmp(key, "baud") == 0) {
+			st->baud = val;
+		} else if (strcmp(key, "requests") == 0) {
+			st->requests = val;
+		} else if (strcmp(key, "badframes") == 0) {
+			st->badframes = val;
+		} else if (strcmp(key, "corrupted") == 0) {
+			st->corrupted = val;
+		} else if (strcmp(key, "rxbytes") == 0) {
+			st->rxbytes = val;
+		} else if (strcmp(key, "txbytes") == 0) {
+			st->txbytes = val;
+		} else if (strcmp(key, "span_ms") == 0) {
+			st->span_ms = val;
+		} else {
+			found--;
+		}
+	}
+	fclose(sf);
+	return (found == 7) ? 0 : -1;
+}
+
+
+/** compare file with <len> bytes of <ref> (or of file <reffile>). ret 1 if identical */
+static bool file_matches(const char *fname, const char *reffile, uint32_t len) {
+	FILE *fa, *fb;
+	bool same = 0;
+	uint32_t idx;
+
+	fa = fopen(fname, "rb");
+	fb = fopen(reffile, "rb");
+	if (!fa || !fb) {
+		goto exit;
+	}
+	for (idx = 0; idx < len; idx++) {
+		int a = fgetc(fa);
+		if ((a == EOF) || (a != fgetc(fb))) {
+			goto exit;
+		}
+	}
+	same = (fgetc(fa) == EOF);
+exit:
+	if (fa) {
+		fclose(fa);
+	}
+	if (fb) {
+		fclose(fb);
+	}
+	return same;
+}
+
+static bool file_contains(const char *fname, const char *needle) {
+	char line[512];
+	FILE *lf;
+	bool found = 0;
+
+	lf = fopen(fname, "r");
+	if (!lf) {
+		return 0;
+	}
+	while (!found && fgets(line, sizeof(line), lf)) {
+		found = (strstr(line, needle) != NULL);
+	}
+	fclose(lf);
+	return found;
+}
+
+static bool file_sizeis(const char *fname, uint32_t len) {
+	struct stat sb;
+	return (stat(fname, &sb) == 0) && ((uint32_t) sb.st_size == len);
+}
+
+/** check the outcome of an operation */
+static bool op_succeeded(const struct bench_conf *bc, enum bench_op op, const char *outfile, const char *logfile) {
+	switch (op) {
+	case OP_ROM:
+		return file_matches(outfile, bc->romfile, bc->fdt->romsize);
+	case OP_RAM:
+		return file_sizeis(outfile, BENCH_RAMLEN);
+	case OP_EEP:
+		return file_matches(outfile, bc->eepfile, BENCH_EEPSIZE);
+	case OP_CRC:
+		return file_contains(logfile, "(total: 0)");
+	case OP_BLOCK:
+		return file_contains(logfile, "Reflash complete.");
+	case OP_KERNEL:
+		return file_contains(logfile, "You may now use kernel-specific commands.");
+	case OP_SETUP_NPK:
+		return file_contains(logfile, "Connected to kernel");
+	case OP_SETUP_NIS:
+		return file_contains(logfile, "ECUID: ");
+	default:
+		return 1;
+	}
+}
+
+
+/** run one operation in a fresh ecusim + nisprog pair.
+ * ret 0 if the run completed (check *ok for the outcome), -1 if the harness failed
+ */
+static int run_op(const struct bench_conf *bc, const struct bench_cell *cell, enum bench_op op,
+                  struct simstats *st, bool *ok) {
+	char ptyname[256], statsfile[256], scriptfile[256], outfile[256], simlog[256], nplog[256];
+	char baudstr[16], latstr[16], errstr[16], seedstr[16];
+	char *simargv[24];
+	char *npargv[4];
+	unsigned argc = 0;
+	pid_t simpid, nppid;
+	unsigned waited;
+
+	wpath(bc, "sim.pty", ptyname, sizeof(ptyname));
+	wpath(bc, "sim.json", statsfile, sizeof(statsfile));
+	wpath(bc, "bench.nsp", scriptfile, sizeof(scriptfile));
+	wpath(bc, "out.bin", outfile, sizeof(outfile));
+	wpath(bc, "ecusim.log", simlog, sizeof(simlog));
+	wpath(bc, "nisprog.log", nplog, sizeof(nplog));
+	(void) unlink(ptyname);
+	(void) unlink(statsfile);
+	(void) unlink(outfile);
+
+	if (write_script(bc, op, scriptfile, ptyname, outfile)) {
+		return -1;
+	}
+
+	snprintf(baudstr, sizeof(baudstr), "%u", cell->baud);
+	snprintf(latstr, sizeof(latstr), "%u", cell->latency_ms);
+	snprintf(errstr, sizeof(errstr), "%u", cell->err_pm);
+	snprintf(seedstr, sizeof(seedstr), "%u", bc->seed);
+
+	simargv[argc++] = (char *) bc->ecusim;
+	simargv[argc++] = "-p";
+	simargv[argc++] = op_is_nis(op) ? "nis" : "npk";
+	simargv[argc++] = "-d";
+	simargv[argc++] = (char *) bc->fdt->name;
+	simargv[argc++] = "-B";
+	simargv[argc++] = baudstr;
+	simargv[argc++] = "-l";
+	simargv[argc++] = latstr;
+	simargv[argc++] = "-x";
+	simargv[argc++] = errstr;
+	simargv[argc++] = "-R";
+	simargv[argc++] = seedstr;
+	simargv[argc++] = "-e";
+	simargv[argc++] = "-E";
+	simargv[argc++] = (char *) bc->eepfile;
+	simargv[argc++] = "-s";
+	simargv[argc++] = ptyname;
+	simargv[argc++] = "-j";
+	simargv[argc++] = statsfile;
+	if (bc->kernelfile) {
+		simargv[argc++] = "-K";
+		simargv[argc++] = (char *) bc->kernelfile;
+	}
+	simargv[argc++] = (char *) bc->romfile;
+	simargv[argc] = NULL;
+
+	simpid = spawn(simargv, simlog);
+	if (simpid < 0) {
+		return -1;
+	}
+	for (waited = 0; access(ptyname, F_OK) != 0; waited += 20) {
+		if (waited > BENCH_PTYWAIT) {
+			fprintf(stderr, "ecusim didn't start, see %s\n", simlog);
+			goto killsim;
+		}
+		sleep_ms(20);
+	}
+
+	npargv[0] = (char *) bc->nisprog;
+	npargv[1] = "-f";
+	npargv[2] = scriptfile;
+	npargv[3] = NULL;
+	nppid = spawn(npargv, nplog);
+	if (nppid < 0) {
+		goto killsim;
+	}
+	*ok = (wait_child(nppid, bc->timeout) == 0);
+
+	/* ecusim writes its counters on SIGTERM */
+	kill(simpid, SIGTERM);
+	(void) wait_child(simpid, 5);
+	if (read_simstats(statsfile, st)) {
+		fprintf(stderr, "no counters from ecusim, see %s\n", simlog);
+		return -1;
+	}
+	*ok = *ok && op_succeeded(bc, op, outfile, nplog);
+	return 0;
+
+killsim:
+	kill(simpid, SIGKILL);
+	(void) waitpid(simpid, NULL, 0);
+	return -1;
+}
+
+
+static void print_header(const struct bench_conf *bc) {
+	if (bc->json) {
+		printf("[");
+		return;
+	}
+	printf("op,baud,sim_baud,latency_ms,err_pm,ok,payload_bytes,time_ms,payload_Bps,"
+	       "round_trips,wire_bytes,wire_eff_pct,bad_frames,corrupted\n");
+}
+
+/** <baud> : bitrate reported by ecusim for this run */
+static void print_result(const struct bench_conf *bc, bool first, enum bench_op op,
+                         const struct bench_cell *cell, unsigned long baud, bool ok, const struct simstats *d) {
+	uint32_t payload = op_payload(bc, op);
+	unsigned long wire = d->rxbytes + d->txbytes;
+	unsigned long bps = d->span_ms ? (unsigned long) ((payload * 1000ULL) / d->span_ms) : 0;
+	double eff = wire ? (100.0 * payload / wire) : 0;
+
+	if (bc->json) {
+		printf("%s\n\t{\"op\": \"%s\", \"baud\": %u, \"sim_baud\": %lu, \"latency_ms\": %u, \"err_pm\": %u, \"ok\": %s, "
+		       "\"payload_bytes\": %lu, \"time_ms\": %lu, \"payload_Bps\": %lu, \"round_trips\": %lu, "
+		       "\"wire_bytes\": %lu, \"wire_eff_pct\": %.1f, \"bad_frames\": %lu, \"corrupted\": %lu}",
+		       first ? "" : ",", op_names[op], cell->baud, baud, cell->latency_ms, cell->err_pm,
+		       ok ? "true" : "false", (unsigned long) payload, d->span_ms, bps, d->requests,
+		       wire, eff, d->badframes, d->corrupted);
+		return;
+	}
+	printf("%s,%u,%lu,%u,%u,%u,%lu,%lu,%lu,%lu,%lu,%.1f,%lu,%lu\n",
+	       op_names[op], cell->baud, baud, cell->latency_ms, cell->err_pm, (unsigned) ok,
+	       (unsigned long) payload, d->span_ms, bps, d->requests, wire, eff,
+	       d->badframes, d->corrupted);
+	fflush(stdout);
+}
+
+/** d = a - b, clamped at 0 */
+static void stats_sub(struct simstats *d, const struct simstats *a, const struct simstats *b) {
+#define SUB0(x) d->x = (a->x > b->x) ? (a->x - b->x) : 0
+	d->baud = a->baud;
+	SUB0(requests);
+	SUB0(badframes);
+	SUB0(corrupted);
+	SUB0(rxbytes);
+	SUB0(txbytes);
+	SUB0(span_ms);
+#undef SUB0
+}
+
+
+/** fill workdir/eep.bin with pseudo-random data from <seed>. ret 0 if ok */
+static int make_eepfile(struct bench_conf *bc) {
+	FILE *ef;
+	unsigned idx;
+
+	wpath(bc, "eep.bin", bc->eepfile, sizeof(bc->eepfile));
+	ef = fopen(bc->eepfile, "wb");
+	if (!ef) {
+		fprintf(stderr, "can't create %s\n", bc->eepfile);
+		return -1;
+	}
+	srand(bc->seed);
+	for (idx = 0; idx < BENCH_EEPSIZE; idx++) {
+		fputc(rand() & 0xFF, ef);
+	}
+	fclose(ef);
+	return 0;
+}
+
+/** get ROM size and pick the matching device, if not forced. ret 0 if ok */
+static int check_romfile(struct bench_conf *bc) {
+	struct stat sb;
+	unsigned idx;
+
+	if (stat(bc->romfile, &sb) != 0) {
+		printf("can't open %s\n", bc->romfile);
+		return -1;
+	}
+	if (!bc->fdt) {
+		for (idx = 0; flashdevices[idx].name; idx++) {
+			if (flashdevices[idx].romsize == (uint32_t) sb.st_size) {
+				bc->fdt = &flashdevices[idx];
+				break;
+			}
+		}
+	}
+	if (!bc->fdt || (bc->fdt->romsize != (uint32_t) sb.st_size)) {
+		printf("ROM size (%ld) doesn't match a known device\n", (long) sb.st_size);
+		return -1;
+	}
+	if (bc->blockno >= bc->fdt->numblocks) {
+		printf("block # out of range\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/** nisprog and ecusim are normally built next to nisprog_bench */
+static const char *default_exe(const char *argv0, const char *name) {
+	const char *slash = strrchr(argv0, '/');
+	char *path;
+
+	if (!slash) {
+		return name;	//let execvp search PATH
+	}
+	path = malloc((size_t) (slash - argv0) + strlen(name) + 2);
+	if (!path) {
+		return name;
+	}
+	sprintf(path, "%.*s/%s", (int) (slash - argv0), argv0, name);
+	return path;
+}
+
+static void usage(void) {
+	printf("nisprog_bench : throughput benchmark, nisprog against ecusim\n"
+	       "usage : nisprog_bench [options] <romfile>\n"
+	       "\t-b <list>\tbitrates (default: %s)\n"
+	       "\t-l <list>\tturnaround latencies, ms (default: %s)\n"
+	       "\t-x <list>\tresponse error rates, per mille (default: %s)\n"
+	       "\t-o <list>\toperations (default: %s; \"kernel\" needs -K)\n"
+	       "\t-K <file>\tkernel for the \"kernel\" operation\n"
+	       "\t-f <blockno>\tblock for the \"block\" operation (default: %u)\n"
+	       "\t-d <device>\tflash device (default: from ROM file size)\n"
+	       "\t-w <dir>\tworking directory for scripts, logs and dumps (default: .)\n"
+	       "\t-n <path>\tnisprog executable\n"
+	       "\t-s <path>\tecusim executable\n"
+	       "\t-R <seed>\tseed for ecusim and the EEPROM image (default: 1)\n"
+	       "\t-t <s>\t\ttimeout per run (default: %u)\n"
+	       "\t-j\t\tJSON output instead of CSV\n",
+	       BENCH_DEFBAUDS, BENCH_DEFLATS, BENCH_DEFERRS, BENCH_DEFOPS, BENCH_DEFBLOCK, BENCH_DEFTIMEOUT);
+}
+
+int main(int argc, char **argv) {
+	struct bench_conf bc = {0};
+	unsigned bauds[BENCH_MAXLIST], lats[BENCH_MAXLIST], errs[BENCH_MAXLIST];
+	unsigned nbauds, nlats, nerrs;
+	unsigned opmask;
+	const char *baudlist = BENCH_DEFBAUDS;
+	const char *latlist = BENCH_DEFLATS;
+	const char *errlist = BENCH_DEFERRS;
+	const char *oplist = BENCH_DEFOPS;
+	bool ops_given = 0;
+	unsigned ib, il, ie, idx;
+	bool first = 1;
+	int opt;
+
+	bc.workdir = ".";
+	bc.blockno = BENCH_DEFBLOCK;
+	bc.seed = 1;
+	bc.timeout = BENCH_DEFTIMEOUT;
+
+	while ((opt = getopt(argc, argv, "b:l:x:o:K:f:d:w:n:s:R:t:jh")) != -1) {
+		switch (opt) {
+		case 'b':
+			baudlist = optarg;
+			break;
+		case 'l':
+			latlist = optarg;
+			break;
+		case 'x':
+			errlist = optarg;
+			break;
+		case 'o':
+			oplist = optarg;
+			ops_given = 1;
+			break;
+		case 'K':
+			bc.kernelfile = optarg;
+			break;
+		case 'f':
+			bc.blockno = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			for (idx = 0; flashdevices[idx].name; idx++) {
+				if (strcmp(flashdevices[idx].name, optarg) == 0) {
+					bc.fdt = &flashdevices[idx];
+					break;
+				}
+			}
+			if (!bc.fdt) {
+				printf("unknown device %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'w':
+			bc.workdir = optarg;
+			break;
+		case 'n':
+			bc.nisprog = optarg;
+			break;
+		case 's':
+			bc.ecusim = optarg;
+			break;
+		case 'R':
+			bc.seed = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			bc.timeout = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			bc.json = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+	bc.romfile = argv[optind];
+
+	nbauds = parse_list(baudlist, bauds);
+	nlats = parse_list(latlist, lats);
+	nerrs = parse_list(errlist, errs);
+	opmask = parse_ops(oplist);
+	if (!nbauds || !nlats || !nerrs || !opmask) {
+		printf("bad list argument\n");
+		usage();
+		return 1;
+	}
+	for (idx = 0; idx < nbauds; idx++) {
+		if (!bauds[idx]) {
+			printf("bad bitrate\n");
+			return 1;
+		}
+	}
+	if (opmask & (1U << OP_KERNEL)) {
+		FILE *kf;
+		if (!bc.kernelfile) {
+			/* only skip it silently if it wasn't asked for explicitly */
+			if (ops_given) {
+				printf("\"kernel\" operation needs -K\n");
+				return 1;
+			}
+			opmask &= ~(1U << OP_KERNEL);
+		} else if ((kf = fopen(bc.kernelfile, "rb")) == NULL) {
+			printf("can't open %s\n", bc.kernelfile);
+			return 1;
+		} else {
+			bc.kernel_len = flen(kf);
+			fclose(kf);
+		}
+	}
+
+	if (!bc.nisprog) {
+		bc.nisprog = default_exe(argv[0], "nisprog");
+	}
+	if (!bc.ecusim) {
+		bc.ecusim = default_exe(argv[0], "ecusim");
+	}
+	if (check_romfile(&bc) || make_eepfile(&bc)) {
+		return 1;
+	}
+
+	print_header(&bc);
+	for (ib = 0; ib < nbauds; ib++) {
+	for (il = 0; il < nlats; il++) {
+	for (ie = 0; ie < nerrs; ie++) {
+		struct bench_cell cell = {bauds[ib], lats[il], errs[ie]};
+		struct simstats base_npk, base_nis;
+		bool have_npk = 0, have_nis = 0;
+		bool npk_ok = 0, nis_ok = 0;
+		enum bench_op op;
+
+		for (op = OP_ROM; op < OP_INVALID; op++) {
+			struct simstats st, *base, delta;
+			bool ok = 0;
+
+			if (!(opmask & (1U << op))) {
+				continue;
+			}
+			/* baselines are only measured when needed, once per cell */
+			if (op_is_nis(op) && !have_nis) {
+				if (run_op(&bc, &cell, OP_SETUP_NIS, &base_nis, &nis_ok)) {
+					return 1;
+				}
+				if (!nis_ok) {
+					fprintf(stderr, "%u bps (ecusim : %lu bps) : can't connect to the simulated ECU, "
+					        "skipping kernel upload\n", cell.baud, base_nis.baud);
+				}
+				have_nis = 1;
+			} else if (!op_is_nis(op) && !have_npk) {
+				if (run_op(&bc, &cell, OP_SETUP_NPK, &base_npk, &npk_ok)) {
+					return 1;
+				}
+				if (!npk_ok) {
+					fprintf(stderr, "%u bps (ecusim : %lu bps) : can't connect to the simulated kernel, "
+					        "skipping kernel operations\n", cell.baud, base_npk.baud);
+				}
+				have_npk = 1;
+			}
+			/* without a baseline, the numbers would be meaningless */
+			if (!(op_is_nis(op) ? nis_ok : npk_ok)) {
+				continue;
+			}
+			base = op_is_nis(op) ? &base_nis : &base_npk;
+
+			if (run_op(&bc, &cell, op, &st, &ok)) {
+				return 1;
+			}
+			stats_sub(&delta, &st, base);
+			print_result(&bc, first, op, &cell, st.baud, ok, &delta);
+			first = 0;
+		}
+	}
+	}
+	}
+	if (bc.json) {
+		printf("\n]\n");
+	}
+	return 0;
+}
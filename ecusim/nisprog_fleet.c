@@ -0,0 +1,642 @@
+/*
+ *	nisprog_fleet - reflash several ECUs in parallel, one nisprog per K-line interface
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * The nisprog CLI drives a single ECU session (npsess) through freediag's global interface
+ * settings, so one process handles one ECU. This runs one nisprog per job instead, each with a
+ * generated script (connect, runkernel, flrom, flverif, stopkernel), and follows their logs
+ * to show per-port progress. Ports don't share anything, so total throughput scales with the
+ * number of interfaces as long as the host keeps up.
+ *
+ * Job list : one job per line, '#' starts a comment :
+ *	<port>,<type>,<device>,<romfile>[,<keys>[,<kernel>]]
+ *	type : "nis" (Nissan, nc + runkernel) or "ssm" (Subaru, spconn + sprunkernel)
+ *	keys : SID27 key (hex), or empty to use the keyset selected by "nc" (ignored for ssm)
+ *	kernel : defaults to the -K option
+ */
+
+#define _GNU_SOURCE	//strdup, strtok_r
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "npk_util.h"
+
+
+#define FLEET_MAXJOBS 64
+#define FLEET_DEFTIMEOUT 3600	//s, per job
+#define FLEET_POLL 200	//ms between log scans
+#define FLEET_LINELEN 512
+
+
+/* job stages, in order. A job that exits before FS_DONE failed at its current stage */
+enum fleet_stage {
+	FS_WAIT,	//not started yet
+	FS_CONNECT,
+	FS_KERNEL,
+	FS_FLASH,
+	FS_VERIFY,
+	FS_DONE,
+};
+
+static const char *stage_names[] = {
+	[FS_WAIT] = "waiting",
+	[FS_CONNECT] = "connect",
+	[FS_KERNEL] = "kernel",
+	[FS_FLASH] = "flash",
+	[FS_VERIFY] = "verify",
+	[FS_DONE] = "done",
+};
+
+struct fleet_job {
+	/* from the job list */
+	char *port;
+	bool ssm;
+	const struct flashdev_t *fdt;
+	char *romfile;
+	char *keys;	//NULL : autoselect
+	char *kernel;
+
+	char script[256];
+	char logfile[256];
+	char evfile[256];	//JSON-lines progress events, see "progress" in nisprog
+
+	pid_t pid;
+	FILE *logf;
+	char line[FLEET_LINELEN];	//partial line from the log
+	unsigned linelen;
+
+	enum fleet_stage stage;
+	bool running;
+	bool failed;
+	bool timedout;
+	char ecuid[16];
+	unsigned blocks;	//reflashed
+	unsigned long flashbytes;
+	uint64_t t_start;
+	uint64_t t_flash;	//start of the "flash" stage
+	uint64_t t_end;
+};
+
+struct fleet_conf {
+	const char *nisprog;
+	const char *workdir;
+	const char *kernel;
+	const char *prefile;	//extra commands, after "up"
+	unsigned dumbopts;
+	unsigned maxpar;	//max running jobs, 0 = all
+	unsigned timeout;
+	bool practice;
+	bool quiet;
+};
+
+
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig) {
+	(void) sig;
+	quit = 1;
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000ULL) + (uint64_t) (ts.tv_nsec / 1000000);
+}
+
+static void sleep_ms(unsigned ms) {
+	struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+		if (quit) {
+			return;
+		}
+	}
+}
+
+static const struct flashdev_t *find_dev(const char *name) {
+	unsigned idx;
+
+	for (idx = 0; flashdevices[idx].name; idx++) {
+		if (strcmp(flashdevices[idx].name, name) == 0) {
+			return &flashdevices[idx];
+		}
+	}
+	return NULL;
+}
+
+static char *trim(char *str) {
+	char *end;
+
+	while ((*str == ' ') || (*str == '\t')) {
+		str++;
+	}
+	end = str + strlen(str);
+	while ((end > str) && strchr(" \t\r\n", end[-1])) {
+		*--end = 0;
+	}
+	return str;
+}
+
+
+/** parse the job list. ret # of jobs, 0 if error */
+static unsigned load_jobs(const char *fname, struct fleet_job *jobs, const struct fleet_conf *fc) {
+	char line[FLEET_LINELEN];
+	unsigned lineno = 0, njobs = 0;
+	FILE *jf;
+
+	jf = fopen(fname, "r");
+	if (!jf) {
+		printf("can't open %s\n", fname);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), jf)) {
+		char *fields[6] = {0};
+		char *hash, *tok, *saveptr, *rest;
+		unsigned nf = 0;
+		struct fleet_job *job;
+
+		lineno++;
+		hash = strchr(line, '#');
+		if (hash) {
+			*hash = 0;
+		}
+		rest = trim(line);
+		if (!*rest) {
+			continue;
+		}
+		/* strtok would merge empty fields, so split manually */
+		for (tok = rest; tok && (nf < 6); tok = saveptr) {
+			saveptr = strchr(tok, ',');
+			if (saveptr) {
+				*saveptr++ = 0;
+			}
+			fields[nf++] = trim(tok);
+		}
+		if ((nf < 4) || !*fields[0] || !*fields[3]) {
+			printf("%s:%u : expected <port>,<type>,<device>,<romfile>[,<keys>[,<kernel>]]\n", fname, lineno);
+			goto badexit;
+		}
+		if (njobs == FLEET_MAXJOBS) {
+			printf("too many jobs (max %u)\n", FLEET_MAXJOBS);
+			goto badexit;
+		}
+		job = &jobs[njobs];
+		memset(job, 0, sizeof(*job));
+
+		if (strcmp(fields[1], "nis") == 0) {
+			job->ssm = 0;
+		} else if (strcmp(fields[1], "ssm") == 0) {
+			job->ssm = 1;
+		} else {
+			printf("%s:%u : unknown ECU type \"%s\" (nis, ssm)\n", fname, lineno, fields[1]);
+			goto badexit;
+		}
+		job->fdt = find_dev(fields[2]);
+		if (!job->fdt) {
+			printf("%s:%u : unknown device \"%s\"\n", fname, lineno, fields[2]);
+			goto badexit;
+		}
+		if ((nf >= 6) && *fields[5]) {
+			job->kernel = strdup(fields[5]);
+		} else if (fc->kernel) {
+			job->kernel = strdup(fc->kernel);
+		} else {
+			printf("%s:%u : no kernel, and no default kernel (-K)\n", fname, lineno);
+			goto badexit;
+		}
+		job->port = strdup(fields[0]);
+		job->romfile = strdup(fields[3]);
+		if ((nf >= 5) && *fields[4]) {
+			job->keys = strdup(fields[4]);
+		}
+		njobs++;
+	}
+	fclose(jf);
+	if (!njobs) {
+		printf("no jobs in %s\n", fname);
+	}
+	return njobs;
+
+badexit:
+	fclose(jf);
+	return 0;
+}
+
+
+/** copy the -c file into the script. ret 0 if ok */
+static int copy_prefile(FILE *sf, const char *prefile) {
+	char line[FLEET_LINELEN];
+	FILE *pf;
+
+	pf = fopen(prefile, "r");
+	if (!pf) {
+		printf("can't open %s\n", prefile);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), pf)) {
+		fputs(line, sf);
+	}
+	fclose(pf);
+	return 0;
+}
+
+/** write nisprog script for one job. ret 0 if ok */
+static int write_script(const struct fleet_conf *fc, const struct fleet_job *job) {
+	FILE *sf;
+
+	sf = fopen(job->script, "w");
+	if (!sf) {
+		printf("can't create %s\n", job->script);
+		return -1;
+	}
+	fprintf(sf, "set\n"
+	        "interface dumb\n"
+	        "port %s\n"
+	        "dumbopts 0x%X\n"
+	        "l2protocol %s\n"
+	        "initmode fast\n"
+	        "testerid %s\n"
+	        "destaddr 0x10\n"
+	        "addrtype phys\n"
+	        "speed %u\n"
+	        "up\n",
+	        job->port, fc->dumbopts, job->ssm ? "raw" : "iso14230",
+	        job->ssm ? "0xf0" : "0xfc", job->ssm ? 4800 : 10400);
+	fprintf(sf, "progress %s\n", job->evfile);
+	if (fc->prefile && copy_prefile(sf, fc->prefile)) {
+		fclose(sf);
+		return -1;
+	}
+	fprintf(sf, "setdev %s\n", job->fdt->name);
+	if (job->ssm) {
+		fprintf(sf, "spconn\n"
+		        "sprunkernel %s\n", job->kernel);
+	} else {
+		fprintf(sf, "nc\n");
+		if (job->keys) {
+			fprintf(sf, "setkeys %s\n", job->keys);
+		}
+		fprintf(sf, "runkernel %s\n", job->kernel);
+	}
+	/* nisprog runs in batch mode (-b) : flrom only proceeds with --mode.
+	 * In practice mode the flash isn't modified, so verifying would only fail. */
+	fprintf(sf, "flrom %s --mode=%s\n", job->romfile, fc->practice ? "practice" : "changed");
+	if (!fc->practice) {
+		fprintf(sf, "flverif %s\n", job->romfile);
+	}
+	fprintf(sf, "stopkernel\n"
+	        "quit\n");
+	fclose(sf);
+	return 0;
+}
+
+
+/** fork + exec, with stdout/stderr to <logfile> and stdin from <infile>.
+ * ret pid, -1 if error
+ */
+static pid_t spawn(char *const argv[], const char *infile, const char *logfile) {
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		int infd = open(infile, O_RDONLY);
+		int logfd = open(logfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if ((infd < 0) || (logfd < 0)) {
+			_exit(127);
+		}
+		dup2(infd, STDIN_FILENO);
+		dup2(logfd, STDOUT_FILENO);
+		dup2(logfd, STDERR_FILENO);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+static void job_setstage(const struct fleet_conf *fc, struct fleet_job *job, enum fleet_stage stage) {
+	if (stage <= job->stage) {
+		return;
+	}
+	job->stage = stage;
+	if (stage == FS_FLASH) {
+		job->t_flash = now_ms();
+	}
+	if (!fc->quiet) {
+		printf("[%s] %s (%.1f s)\n", job->port, stage_names[stage],
+		       (now_ms() - job->t_start) / 1000.0);
+		fflush(stdout);
+	}
+}
+
+/** follow nisprog's output. The messages are the ones printed by the CLI commands */
+static void job_parseline(const struct fleet_conf *fc, struct fleet_job *job, const char *line) {
+	unsigned blockno;
+
+	if (strncmp(line, "ECUID: ", 7) == 0) {
+		/* spconn prints the SSM ECUID as hex bytes "3d 12 59 40 05" : join them,
+		 * uppercase like the ECU cache key */
+		const char *src;
+		unsigned len = 0;
+
+		for (src = &line[7]; *src && (len < (sizeof(job->ecuid) - 1)); src++) {
+			if (!isspace((unsigned char) *src)) {
+				job->ecuid[len++] = (char) toupper((unsigned char) *src);
+			}
+		}
+		job->ecuid[len] = 0;
+		return;
+	}
+	if (strstr(line, "Connected to ECU")) {
+		job_setstage(fc, job, FS_KERNEL);
+		return;
+	}
+	if (strstr(line, "You may now use kernel-specific commands.")) {
+		job_setstage(fc, job, FS_FLASH);
+		return;
+	}
+	if ((job->stage == FS_FLASH) && (sscanf(line, "\tBlock %u", &blockno) == 1) &&
+	    (blockno < job->fdt->numblocks)) {
+		job->blocks += 1;
+		job->flashbytes += job->fdt->fblocks[blockno].len;
+		if (!fc->quiet) {
+			printf("[%s] block %u\n", job->port, blockno);
+			fflush(stdout);
+		}
+		return;
+	}
+	if (strstr(line, "Reflash complete.")) {
+		job_setstage(fc, job, fc->practice ? FS_DONE : FS_VERIFY);
+		return;
+	}
+	if ((job->stage == FS_VERIFY) && strstr(line, "(total: 0)")) {
+		job_setstage(fc, job, FS_DONE);
+		return;
+	}
+}
+
+/** read new complete lines from the job's log */
+static void job_poll(const struct fleet_conf *fc, struct fleet_job *job) {
+	int c;
+
+	if (!job->logf) {
+		job->logf = fopen(job->logfile, "r");
+		if (!job->logf) {
+			return;
+		}
+	}
+	clearerr(job->logf);
+	while ((c = fgetc(job->logf)) != EOF) {
+		if (c == '\n') {
+			job->line[job->linelen] = 0;
+			job_parseline(fc, job, job->line);
+			job->linelen = 0;
+		} else if (job->linelen < (FLEET_LINELEN - 1)) {
+			job->line[job->linelen++] = (char) c;
+		}
+	}
+}
+
+static int job_start(const struct fleet_conf *fc, struct fleet_job *job) {
+	char *npargv[5];
+
+	(void) unlink(job->logfile);
+	(void) unlink(job->evfile);
+	npargv[0] = (char *) fc->nisprog;
+	npargv[1] = "-b";
+	npargv[2] = "-f";
+	npargv[3] = job->script;
+	npargv[4] = NULL;
+	job->pid = spawn(npargv, "/dev/null", job->logfile);
+	if (job->pid < 0) {
+		job->failed = 1;
+		return -1;
+	}
+	job->running = 1;
+	job->t_start = now_ms();
+	job_setstage(fc, job, FS_CONNECT);
+	return 0;
+}
+
+static void job_finish(const struct fleet_conf *fc, struct fleet_job *job, int status) {
+	job_poll(fc, job);
+	if (job->logf) {
+		fclose(job->logf);
+		job->logf = NULL;
+	}
+	job->running = 0;
+	job->t_end = now_ms();
+	job->failed = (job->stage != FS_DONE) || !WIFEXITED(status) || WEXITSTATUS(status);
+	if (!fc->quiet) {
+		printf("[%s] %s%s%s, see %s\n", job->port, job->failed ? "FAILED at " : "",
+		       job->failed ? stage_names[job->stage] : "ok", job->timedout ? " (timeout)" : "",
+		       job->logfile);
+		fflush(stdout);
+	}
+}
+
+
+static void print_summary(const struct fleet_job *jobs, unsigned njobs, uint64_t t_wall) {
+	unsigned long totbytes = 0;
+	uint64_t busy = 0;
+	unsigned idx, nok = 0;
+
+	printf("\nport,ecuid,result,stage,blocks,flash_bytes,total_s,flash_s,flash_Bps\n");
+	for (idx = 0; idx < njobs; idx++) {
+		const struct fleet_job *job = &jobs[idx];
+		uint64_t total = job->t_end - job->t_start;
+		uint64_t flash = (job->t_flash && (job->stage > FS_FLASH)) ? (job->t_end - job->t_flash) : 0;
+
+		printf("%s,%s,%s,%s,%u,%lu,%.1f,%.1f,%lu\n", job->port, job->ecuid[0] ? job->ecuid : "?",
+		       job->failed ? "FAIL" : "ok", stage_names[job->stage], job->blocks, job->flashbytes,
+		       total / 1000.0, flash / 1000.0,
+		       flash ? (unsigned long) ((job->flashbytes * 1000ULL) / flash) : 0UL);
+		if (!job->failed) {
+			nok++;
+		}
+		totbytes += job->flashbytes;
+		busy += total;
+	}
+	printf("\n%u / %u ECUs ok; %lu bytes reflashed in %.1f s (%lu B/s aggregate)\n",
+	       nok, njobs, totbytes, t_wall / 1000.0,
+	       t_wall ? (unsigned long) ((totbytes * 1000ULL) / t_wall) : 0UL);
+	if (t_wall) {
+		/* 1.0 = perfectly parallel : the wall time equals the longest job */
+		printf("parallelism : %.2f jobs running on average\n", (double) busy / t_wall);
+	}
+}
+
+
+/** nisprog is normally built next to nisprog_fleet */
+static const char *default_exe(const char *argv0, const char *name) {
+	const char *slash = strrchr(argv0, '/');
+	char *path;
+
+	if (!slash) {
+		return name;	//let execvp search PATH
+	}
+	path = malloc((size_t) (slash - argv0) + strlen(name) + 2);
+	if (!path) {
+		return name;
+	}
+	sprintf(path, "%.*s/%s", (int) (slash - argv0), argv0, name);
+	return path;
+}
+
+static void usage(void) {
+	printf("nisprog_fleet : reflash ECUs in parallel, one nisprog per interface\n"
+	       "usage : nisprog_fleet [options] <joblist>\n"
+	       "\tjob list lines : <port>,<type>,<device>,<romfile>[,<keys>[,<kernel>]]\n"
+	       "\t\ttype = nis or ssm; empty <keys> : use the keyset selected by \"nc\"\n"
+	       "\t-K <file>\tdefault kernel\n"
+	       "\t-c <file>\textra nisprog commands for every job, after \"up\" (e.g. npconf, kspeed)\n"
+	       "\t-o <opts>\tdumbopts (default: 0x48)\n"
+	       "\t-P <n>\t\tmax simultaneous jobs (default: all)\n"
+	       "\t-p\t\tpractice mode : flrom dry run, flash ROM is not modified (and not verified)\n"
+	       "\t-w <dir>\tworking directory for scripts and logs (default: .)\n"
+	       "\t-n <path>\tnisprog executable\n"
+	       "\t-t <s>\t\ttimeout per job (default: %u)\n"
+	       "\t-q\t\tonly print the summary\n",
+	       FLEET_DEFTIMEOUT);
+}
+
+int main(int argc, char **argv) {
+	static struct fleet_job jobs[FLEET_MAXJOBS];
+	struct fleet_conf fc = {0};
+	unsigned njobs, idx, nrunning, nstarted;
+	uint64_t t_start;
+	int opt;
+
+	fc.workdir = ".";
+	fc.dumbopts = 0x48;
+	fc.timeout = FLEET_DEFTIMEOUT;
+
+	while ((opt = getopt(argc, argv, "K:c:o:P:pw:n:t:qh")) != -1) {
+		switch (opt) {
+		case 'K':
+			fc.kernel = optarg;
+			break;
+		case 'c':
+			fc.prefile = optarg;
+			break;
+		case 'o':
+			fc.dumbopts = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			fc.maxpar = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			fc.practice = 1;
+			break;
+		case 'w':
+			fc.workdir = optarg;
+			break;
+		case 'n':
+			fc.nisprog = optarg;
+			break;
+		case 't':
+			fc.timeout = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			fc.quiet = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+	if (!fc.nisprog) {
+		fc.nisprog = default_exe(argv[0], "nisprog");
+	}
+
+	njobs = load_jobs(argv[optind], jobs, &fc);
+	if (!njobs) {
+		return 1;
+	}
+	if (!fc.maxpar || (fc.maxpar > njobs)) {
+		fc.maxpar = njobs;
+	}
+
+	for (idx = 0; idx < njobs; idx++) {
+		snprintf(jobs[idx].script, sizeof(jobs[idx].script), "%s/job%02u.nsp", fc.workdir, idx);
+		snprintf(jobs[idx].logfile, sizeof(jobs[idx].logfile), "%s/job%02u.log", fc.workdir, idx);
+		snprintf(jobs[idx].evfile, sizeof(jobs[idx].evfile), "%s/job%02u.jsonl", fc.workdir, idx);
+		if (write_script(&fc, &jobs[idx])) {
+			return 1;
+		}
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	printf("%u jobs, %u at a time%s\n", njobs, fc.maxpar, fc.practice ? ", practice mode" : "");
+
+	t_start = now_ms();
+	nrunning = 0;
+	nstarted = 0;
+	while (nstarted < njobs || nrunning) {
+		while (!quit && (nstarted < njobs) && (nrunning < fc.maxpar)) {
+			if (job_start(&fc, &jobs[nstarted]) == 0) {
+				nrunning++;
+			}
+			nstarted++;
+		}
+		if (quit && (nstarted < njobs)) {
+			/* don't start anything new; mark the rest as failed */
+			for (; nstarted < njobs; nstarted++) {
+				jobs[nstarted].failed = 1;
+				jobs[nstarted].t_start = jobs[nstarted].t_end = now_ms();
+			}
+		}
+
+		sleep_ms(FLEET_POLL);
+
+		for (idx = 0; idx < nstarted; idx++) {
+			struct fleet_job *job = &jobs[idx];
+			int status;
+
+			if (!job->running) {
+				continue;
+			}
+			if (waitpid(job->pid, &status, WNOHANG) == job->pid) {
+				job_finish(&fc, job, status);
+				nrunning--;
+				continue;
+			}
+			job_poll(&fc, job);
+			if ((now_ms() - job->t_start) > (fc.timeout * 1000ULL)) {
+				/* may be in the middle of a block : the kernel stays running, "initk" + flrom can resume */
+				job->timedout = 1;
+				kill(job->pid, SIGKILL);
+			}
+		}
+	}
+
+	print_summary(jobs, njobs, now_ms() - t_start);
+
+	for (idx = 0; idx < njobs; idx++) {
+		if (jobs[idx].failed) {
+			return 1;
+		}
+	}
+	return 0;
+}
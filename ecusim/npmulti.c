@@ -0,0 +1,1229 @@
+/*
+ *	npmulti - dump, verify or reflash several ECUs running npkern, from a single thread
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * nisprog (through freediag) does blocking reads and writes on one interface, so
+ * nisprog_fleet needs one process per ECU. Here, every ECU is a session : a small state
+ * machine that is advanced by received frames, or by its timer when a response is late.
+ * One epoll loop waits on all the serial fds (non-blocking) and timerfds, so a dozen
+ * sessions use a fraction of one core; each K-line still runs at its own pace.
+ *
+ * npkern must already be running on every ECU (nisprog "runkernel", or nisprog_fleet with
+ * a script that stops before flrom); sessions start with StartComm at the kernel speed.
+ * Operations, same requests as nisprog's dumpmem / flverif / flrom :
+ *	dump : ROM (SID_DUMP) or RAM (SID_RMBA, for start >= 0xFF800000) to <file>
+ *	eep : EEPROM (SID_DUMP) to <file>, needs the eeprom_read() address
+ *	verify : SID_CONF_CKS1 against <file>, lists the modified blocks
+ *	flash : verify, then erase + write each modified block, then verify those again
+ *
+ * Linux only (epoll, timerfd, termios2 for non-standard bitrates like 62500).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <asm/termbits.h>	//termios2 / BOTHER. Can't be mixed with <termios.h>
+
+#include "isoframe.h"
+#include "npk_util.h"
+#include "npkern/iso_cmds.h"
+#include "npkern/npk_errcodes.h"
+
+
+#define NPM_MAXSESS 64
+#define NPM_RXBUFSIZE 2048
+#define NPM_DUMPBLK 32	//SID_DUMP block size
+#define NPM_MAXBLKS 8	//blocks per SID_DUMP request, like nisprog
+#define NPM_RMBA_MAX 251
+#define NPM_CRC_ITER (ROMCRC_NUMCHUNKS * ROMCRC_CHUNKSIZE)	//bytes covered by one CKS1 request
+#define NPM_ERASE_MS 2000
+#define NPM_WRITE_MS 800
+#define NPM_MAXFBLOCKS 32
+#define NPM_STATUS_MS 1000
+#define NPM_RAMSTART 0xFF800000
+
+/* epoll_event.data.u32 : session index << 2 | kind */
+#define EV_SERIAL 0
+#define EV_TIMER 1
+#define EV_STATUS 3
+
+
+enum npm_op {
+	OP_DUMP,
+	OP_EEP,
+	OP_VERIFY,
+	OP_FLASH,
+};
+
+static const char *op_names[] = {
+	[OP_DUMP] = "dump",
+	[OP_EEP] = "eep",
+	[OP_VERIFY] = "verify",
+	[OP_FLASH] = "flash",
+};
+
+/* what the current request is waiting for */
+enum npm_state {
+	ST_STARTCOMM,
+	ST_SETEEPR,
+	ST_DUMP,
+	ST_RMBA,
+	ST_CRC,
+	ST_FLREQ,
+	ST_UNPROTECT,
+	ST_ERASE,
+	ST_WRITE,
+	ST_DONE,
+	ST_FAILED,
+};
+
+static const char *state_names[] = {
+	[ST_STARTCOMM] = "startcomm",
+	[ST_SETEEPR] = "seteepr",
+	[ST_DUMP] = "dump",
+	[ST_RMBA] = "rmba",
+	[ST_CRC] = "crc",
+	[ST_FLREQ] = "flreq",
+	[ST_UNPROTECT] = "unprotect",
+	[ST_ERASE] = "erase",
+	[ST_WRITE] = "write",
+	[ST_DONE] = "done",
+	[ST_FAILED] = "failed",
+};
+
+/* flash : phases */
+enum npm_phase {
+	PH_VERIFY,
+	PH_WRITE,
+	PH_REVERIFY,
+};
+
+struct npm_conf {
+	enum npm_op op;
+	const struct flashdev_t *fdt;
+	uint32_t start;
+	uint32_t len;
+	uint32_t eepr;	//eeprom_read() address
+	unsigned kspeed;
+	unsigned rxe;	//ms, added to every response timeout
+	unsigned retries;
+	bool echo;
+	bool practice;
+	bool quiet;
+};
+
+struct npm_sess {
+	const struct npm_conf *conf;
+	const char *port;
+	const char *file;
+	unsigned idx;
+	int fd;
+	int tfd;
+	bool pollout;	//EPOLLOUT is registered : tx[] couldn't be written in one go
+
+	/* current request, kept for retries */
+	uint8_t tx[ISOFRAME_MAXLEN];
+	unsigned txlen;
+	unsigned txdone;
+	unsigned echo_left;	//echo bytes still to drop
+	unsigned nresp;	//responses to the current request
+	unsigned expect;	//responses still expected
+	unsigned timeout;	//ms
+	unsigned tries;
+	const char *bad;	//problem with a response; the request is repeated once all responses are in
+
+	uint8_t rx[NPM_RXBUFSIZE];
+	unsigned rxlen;
+
+	enum npm_state st;
+	char err[64];
+
+	/* dump : data[] receives the aligned area ; verify / flash : data[] is the ROM image */
+	uint8_t *data;
+	uint32_t datalen;
+	uint32_t base;	//address of data[0]
+	uint32_t skip;	//dump : unaligned bytes before <start>
+	uint32_t pos;	//dump : offset of current request; crc / write : current address
+	uint32_t reqpos;	//dump : bytes received for the current request
+	uint32_t reqlen;	//dump : bytes asked by the current request
+	bool ram;
+
+	enum npm_phase phase;
+	unsigned blk;	//current flash block
+	bool modified[NPM_MAXFBLOCKS];
+	unsigned nmod;
+	unsigned stillbad;	//re-verify failures
+
+	/* progress within the current phase */
+	unsigned long work_done;
+	unsigned long work_total;
+
+	uint64_t t_start;
+	uint64_t t_end;
+	unsigned long payload;	//bytes dumped, checked or written
+	unsigned long requests;
+	unsigned long retries;
+	unsigned long txbytes;
+	unsigned long rxbytes;
+};
+
+
+static volatile sig_atomic_t quit = 0;
+static int epfd = -1;
+
+static void sighandler(int sig) {
+	(void) sig;
+	quit = 1;
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000ULL) + (uint64_t) (ts.tv_nsec / 1000000);
+}
+
+static const struct flashdev_t *find_dev(const char *name) {
+	unsigned idx;
+
+	for (idx = 0; flashdevices[idx].name; idx++) {
+		if (strcmp(flashdevices[idx].name, name) == 0) {
+			return &flashdevices[idx];
+		}
+	}
+	return NULL;
+}
+
+
+/** raw, non-blocking, any bitrate. Not being a tty isn't fatal (e.g. a fifo for testing) */
+static int open_port(const char *port, unsigned speed) {
+	struct termios2 t2;
+	int fd;
+
+	fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		printf("%s : can't open (%s)\n", port, strerror(errno));
+		return -1;
+	}
+	if (ioctl(fd, TCGETS2, &t2) != 0) {
+		printf("%s : not a tty, bitrate not set\n", port);
+		return fd;
+	}
+	t2.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+	t2.c_oflag &= ~OPOST;
+	t2.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	t2.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS | CBAUD);
+	t2.c_cflag |= CS8 | CREAD | CLOCAL | BOTHER;
+	t2.c_ispeed = speed;
+	t2.c_ospeed = speed;
+	t2.c_cc[VMIN] = 0;
+	t2.c_cc[VTIME] = 0;
+	if (ioctl(fd, TCSETS2, &t2) != 0) {
+		printf("%s : can't set %u bps (%s)\n", port, speed, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	(void) ioctl(fd, TCFLSH, TCIOFLUSH);
+	return fd;
+}
+
+/** ms on the wire for <bytes> bytes, 10 bits each */
+static unsigned wire_ms(const struct npm_conf *nc, unsigned bytes) {
+	return ((bytes * 10 * 1000) / nc->kspeed) + 1;
+}
+
+static void arm_timer(struct npm_sess *s, unsigned ms) {
+	struct itimerspec its = {0};
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	(void) timerfd_settime(s->tfd, 0, &its, NULL);
+}
+
+static void set_pollout(struct npm_sess *s, bool on) {
+	struct epoll_event ev = {0};
+
+	if (s->pollout == on) {
+		return;
+	}
+	ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	ev.data.u32 = (s->idx << 2) | EV_SERIAL;
+	(void) epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+	s->pollout = on;
+}
+
+
+/** done or failed : stop watching this port */
+static void sess_stop(struct npm_sess *s) {
+	s->t_end = now_ms();
+	arm_timer(s, 0);
+	(void) epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	(void) epoll_ctl(epfd, EPOLL_CTL_DEL, s->tfd, NULL);
+}
+
+static void sess_fail(struct npm_sess *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void sess_fail(struct npm_sess *s, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(s->err, sizeof(s->err), fmt, args);
+	va_end(args);
+	s->st = ST_FAILED;
+	sess_stop(s);
+}
+
+
+/** write as much of tx[] as the port takes; the rest goes out on EPOLLOUT */
+static void sess_flushtx(struct npm_sess *s) {
+	while (s->txdone < s->txlen) {
+		ssize_t rv = write(s->fd, &s->tx[s->txdone], s->txlen - s->txdone);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				set_pollout(s, 1);
+				return;
+			}
+			sess_fail(s, "write error (%s)", strerror(errno));
+			return;
+		}
+		s->txdone += (unsigned) rv;
+		s->txbytes += (unsigned long) rv;
+	}
+	set_pollout(s, 0);
+}
+
+/** (re)send the current request in tx[] */
+static void sess_xmit(struct npm_sess *s) {
+	s->txdone = 0;
+	s->rxlen = 0;
+	s->bad = NULL;
+	s->echo_left = s->conf->echo ? s->txlen : 0;
+	s->requests++;
+	arm_timer(s, s->timeout + wire_ms(s->conf, s->txlen));
+	sess_flushtx(s);
+}
+
+/** start a new request : <nresp> responses of about <resplen> bytes each are expected */
+static void sess_request(struct npm_sess *s, enum npm_state st, const uint8_t *data, unsigned len,
+			unsigned nresp, unsigned resplen, unsigned extra_ms) {
+	s->st = st;
+	s->txlen = isoframe_build(s->tx, data, len, 0, 0, 0, 0);
+	s->nresp = nresp;
+	s->expect = nresp;
+	s->tries = 0;
+	s->timeout = wire_ms(s->conf, nresp * resplen) + s->conf->rxe + extra_ms;
+	sess_xmit(s);
+}
+
+
+/** drop whatever arrived late, and send the same request again */
+static void sess_retry(struct npm_sess *s, const char *why) {
+	uint8_t junk[256];
+
+	if (s->tries >= s->conf->retries) {
+		sess_fail(s, "%s @ %s, 0x%06X", why, state_names[s->st], (unsigned) s->pos);
+		return;
+	}
+	s->tries++;
+	s->retries++;
+	while (read(s->fd, junk, sizeof(junk)) > 0) {
+		;
+	}
+	/* a partial dump is requested again as a whole */
+	s->expect = s->nresp;
+	s->reqpos = 0;
+	sess_xmit(s);
+}
+
+/** let the rest of the responses go by (they would be mistaken for the next ones), then retry */
+static void sess_badresp(struct npm_sess *s, const char *why) {
+	if (!s->bad) {
+		s->bad = why;
+	}
+	if (!s->expect) {
+		sess_retry(s, s->bad);
+	}
+}
+
+static void sess_done(struct npm_sess *s) {
+	s->st = ST_DONE;
+	sess_stop(s);
+}
+
+
+/*** dump ***/
+
+static void dump_save(struct npm_sess *s) {
+	FILE *f;
+
+	f = fopen(s->file, "wb");
+	if (!f) {
+		sess_fail(s, "can't create %s", s->file);
+		return;
+	}
+	if (fwrite(&s->data[s->skip], 1, s->conf->len, f) != s->conf->len) {
+		fclose(f);
+		sess_fail(s, "can't write %s", s->file);
+		return;
+	}
+	fclose(f);
+	sess_done(s);
+}
+
+static void dump_next(struct npm_sess *s) {
+	uint8_t txdata[6];
+	uint32_t remain = s->datalen - s->pos;
+	uint32_t addr = s->base + s->pos;
+
+	s->work_done = s->pos;
+	if (!remain) {
+		s->payload = s->conf->len;
+		dump_save(s);
+		return;
+	}
+	s->reqpos = 0;
+	if (s->ram) {
+		/* <SID_RMBA> <AH> <AM> <AL> <SIZ> */
+		s->reqlen = (remain > NPM_RMBA_MAX) ? NPM_RMBA_MAX : remain;
+		txdata[0] = SID_RMBA;
+		txdata[1] = addr >> 16;
+		txdata[2] = addr >> 8;
+		txdata[3] = addr >> 0;
+		txdata[4] = s->reqlen;
+		sess_request(s, ST_RMBA, txdata, 5, 1, s->reqlen + 6, 0);
+		return;
+	}
+	/* 0xBD <AS> <BH BL> <AH AL> ; one response per block */
+	uint32_t numblocks = remain / NPM_DUMPBLK;
+	if (numblocks > NPM_MAXBLKS) {
+		numblocks = NPM_MAXBLKS;
+	}
+	uint32_t curblock = addr / NPM_DUMPBLK;
+	s->reqlen = numblocks * NPM_DUMPBLK;
+	txdata[0] = SID_DUMP;
+	txdata[1] = (s->conf->op == OP_EEP) ? SID_DUMP_EEPROM : SID_DUMP_ROM;
+	txdata[2] = numblocks >> 8;
+	txdata[3] = numblocks >> 0;
+	txdata[4] = curblock >> 8;
+	txdata[5] = curblock >> 0;
+	sess_request(s, ST_DUMP, txdata, 6, numblocks, NPM_DUMPBLK + 3, 0);
+}
+
+static void dump_rx(struct npm_sess *s, const struct isoframe *f) {
+	if (s->st == ST_RMBA) {
+		/* 63 <data> <AH> <AM> <AL> */
+		if ((f->len != s->reqlen + 4) || (f->data[0] != SID_RMBA + 0x40)) {
+			sess_badresp(s, "bad RMBA response");
+			return;
+		}
+		memcpy(&s->data[s->pos], &f->data[1], s->reqlen);
+		s->pos += s->reqlen;
+		dump_next(s);
+		return;
+	}
+	if ((f->len != NPM_DUMPBLK + 1) || (f->data[0] != SID_DUMP + 0x40)) {
+		sess_badresp(s, "bad dump response");
+		return;
+	}
+	memcpy(&s->data[s->pos + s->reqpos], &f->data[1], NPM_DUMPBLK);
+	s->reqpos += NPM_DUMPBLK;
+	if (s->expect) {
+		return;
+	}
+	s->pos += s->reqlen;
+	dump_next(s);
+}
+
+
+/*** verify / flash ***/
+
+static void flash_block(struct npm_sess *s);
+
+/** next block to check : all of them for the first pass, only the reflashed ones after */
+static bool crc_nextblock(struct npm_sess *s) {
+	const struct flashdev_t *fdt = s->conf->fdt;
+
+	for (; s->blk < fdt->numblocks; s->blk++) {
+		if ((s->phase == PH_VERIFY) || s->modified[s->blk]) {
+			s->pos = fdt->fblocks[s->blk].start;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void crc_finish(struct npm_sess *s) {
+	if (s->conf->op == OP_VERIFY) {
+		sess_done(s);
+		return;
+	}
+	if (s->phase == PH_VERIFY) {
+		if (!s->nmod) {
+			sess_done(s);
+			return;
+		}
+		s->phase = PH_WRITE;
+		s->work_done = 0;
+		s->work_total = 0;
+		for (s->blk = 0; s->blk < s->conf->fdt->numblocks; s->blk++) {
+			if (s->modified[s->blk]) {
+				s->work_total += s->conf->fdt->fblocks[s->blk].len;
+			}
+		}
+		s->blk = 0;
+		flash_block(s);
+		return;
+	}
+	if (s->stillbad) {
+		sess_fail(s, "%u block(s) still differ after reflash", s->stillbad);
+		return;
+	}
+	sess_done(s);
+}
+
+static void crc_next(struct npm_sess *s) {
+	const struct flashdev_t *fdt = s->conf->fdt;
+	uint8_t txdata[4 + (2 * ROMCRC_NUMCHUNKS)];
+	unsigned idx, txi;
+
+	if (s->pos >= fdt->fblocks[s->blk].start + fdt->fblocks[s->blk].len) {
+		s->blk++;
+		if (!crc_nextblock(s)) {
+			crc_finish(s);
+			return;
+		}
+	}
+	uint16_t chunko = s->pos / ROMCRC_CHUNKSIZE;
+	txi = 0;
+	txdata[txi++] = SID_CONF;
+	txdata[txi++] = SID_CONF_CKS1;
+	txdata[txi++] = chunko >> 8;
+	txdata[txi++] = chunko & 0xFF;
+	for (idx = 0; idx < ROMCRC_NUMCHUNKS; idx++) {
+		uint16_t crc = npk_crc16(&s->data[s->pos + (idx * ROMCRC_CHUNKSIZE)], ROMCRC_CHUNKSIZE);
+		txdata[txi++] = crc >> 8;
+		txdata[txi++] = crc & 0xFF;
+	}
+	sess_request(s, ST_CRC, txdata, txi, 1, 6, 0);
+}
+
+static void crc_start(struct npm_sess *s) {
+	const struct flashdev_t *fdt = s->conf->fdt;
+	unsigned idx;
+
+	s->work_done = 0;
+	s->work_total = 0;
+	for (idx = 0; idx < fdt->numblocks; idx++) {
+		if ((s->phase == PH_VERIFY) || s->modified[idx]) {
+			s->work_total += fdt->fblocks[idx].len;
+		}
+	}
+	s->blk = 0;
+	if (!crc_nextblock(s)) {
+		crc_finish(s);
+		return;
+	}
+	crc_next(s);
+}
+
+/** skip the rest of the current block */
+static void crc_blockdiffers(struct npm_sess *s) {
+	const struct flashblock *fb = &s->conf->fdt->fblocks[s->blk];
+
+	s->work_done += (fb->start + fb->len) - s->pos;
+	s->pos = fb->start + fb->len;
+	if (s->phase == PH_VERIFY) {
+		s->modified[s->blk] = 1;
+		s->nmod++;
+	} else {
+		s->stillbad++;
+	}
+}
+
+static void crc_rx(struct npm_sess *s, const struct isoframe *f) {
+	if ((f->len == 1) && (f->data[0] == SID_CONF + 0x40)) {
+		s->pos += NPM_CRC_ITER;
+		s->work_done += NPM_CRC_ITER;
+		if (s->conf->op == OP_VERIFY) {
+			s->payload += NPM_CRC_ITER;
+		}
+	} else if ((f->len == 3) && (f->data[0] == 0x7F) && (f->data[1] == SID_CONF) &&
+		   (f->data[2] == SID_CONF_CKS1_BADCKS)) {
+		crc_blockdiffers(s);
+	} else {
+		sess_badresp(s, "bad CKS1 response");
+		return;
+	}
+	crc_next(s);
+}
+
+
+static void write_next(struct npm_sess *s) {
+	const struct flashdev_t *fdt = s->conf->fdt;
+	uint8_t txdata[6 + SIDFL_WB_DLEN];
+
+	if (s->pos >= fdt->fblocks[s->blk].start + fdt->fblocks[s->blk].len) {
+		s->blk++;
+		flash_block(s);
+		return;
+	}
+	/* <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <128 data> <cks> */
+	txdata[0] = SID_FLASH;
+	txdata[1] = SIDFL_WB;
+	txdata[2] = s->pos >> 16;
+	txdata[3] = s->pos >> 8;
+	txdata[4] = s->pos >> 0;
+	memcpy(&txdata[5], &s->data[s->pos], SIDFL_WB_DLEN);
+	txdata[5 + SIDFL_WB_DLEN] = npk_cks_add8(&txdata[2], 3 + SIDFL_WB_DLEN);
+	sess_request(s, ST_WRITE, txdata, sizeof(txdata), 1, 6, NPM_WRITE_MS);
+}
+
+/** RequestDownload + unprotect + erase + write, for the next modified block */
+static void flash_block(struct npm_sess *s) {
+	const struct flashdev_t *fdt = s->conf->fdt;
+	static const uint8_t flreq[] = {SID_FLREQ};
+
+	for (; s->blk < fdt->numblocks; s->blk++) {
+		if (s->modified[s->blk]) {
+			s->pos = fdt->fblocks[s->blk].start;
+			sess_request(s, ST_FLREQ, flreq, sizeof(flreq), 1, 6, 0);
+			return;
+		}
+	}
+	if (s->conf->practice) {
+		/* nothing was written, re-verifying would only fail */
+		sess_done(s);
+		return;
+	}
+	s->phase = PH_REVERIFY;
+	crc_start(s);
+}
+
+static void flash_rx(struct npm_sess *s, const struct isoframe *f) {
+	static const uint8_t unprotect[] = {SID_FLASH, SIDFL_UNPROTECT, (uint8_t) ~SIDFL_UNPROTECT};
+	uint8_t erase[] = {SID_FLASH, SIDFL_EB, (uint8_t) s->blk};
+	uint8_t want = (s->st == ST_FLREQ) ? (SID_FLREQ + 0x40) : (SID_FLASH + 0x40);
+
+	if ((f->len >= 3) && (f->data[0] == 0x7F)) {
+		/* the kernel gave up on this request; repeating it won't help */
+		sess_fail(s, "NRC 0x%02X @ %s, 0x%06X", (unsigned) f->data[2], state_names[s->st], (unsigned) s->pos);
+		return;
+	}
+	if ((f->len != 1) || (f->data[0] != want)) {
+		sess_badresp(s, "bad response");
+		return;
+	}
+
+	switch (s->st) {
+	case ST_FLREQ:
+		if (!s->conf->practice) {
+			sess_request(s, ST_UNPROTECT, unprotect, sizeof(unprotect), 1, 6, 0);
+			break;
+		}
+		/* practice mode : erase without unprotecting, which does nothing */
+		/* Fallthrough */
+	case ST_UNPROTECT:
+		sess_request(s, ST_ERASE, erase, sizeof(erase), 1, 6, NPM_ERASE_MS);
+		break;
+	case ST_ERASE:
+		write_next(s);
+		break;
+	case ST_WRITE:
+		s->pos += SIDFL_WB_DLEN;
+		s->work_done += SIDFL_WB_DLEN;
+		s->payload += SIDFL_WB_DLEN;
+		write_next(s);
+		break;
+	default:
+		break;
+	}
+}
+
+
+/*** session events ***/
+
+static void sess_start(struct npm_sess *s) {
+	static const uint8_t startcomm[] = {SID_STARTCOMM};
+
+	s->t_start = now_ms();
+	sess_request(s, ST_STARTCOMM, startcomm, sizeof(startcomm), 1, 6, 0);
+}
+
+/** StartComm is done : start the actual operation */
+static void sess_begin(struct npm_sess *s) {
+	const struct npm_conf *nc = s->conf;
+	uint8_t txdata[5];
+
+	switch (nc->op) {
+	case OP_EEP:
+		if (s->st == ST_STARTCOMM) {
+			/* <SID_CONF> <SID_CONF_SETEEPR> <AH> <AM> <AL> */
+			txdata[0] = SID_CONF;
+			txdata[1] = SID_CONF_SETEEPR;
+			txdata[2] = nc->eepr >> 16;
+			txdata[3] = nc->eepr >> 8;
+			txdata[4] = nc->eepr >> 0;
+			sess_request(s, ST_SETEEPR, txdata, 5, 1, 6, 0);
+			return;
+		}
+		/* Fallthrough */
+	case OP_DUMP:
+		s->work_total = s->datalen;
+		dump_next(s);
+		break;
+	case OP_VERIFY:
+	case OP_FLASH:
+		s->phase = PH_VERIFY;
+		crc_start(s);
+		break;
+	}
+}
+
+static void sess_frame(struct npm_sess *s, const struct isoframe *f) {
+	if (!s->expect) {
+		return;	//stray
+	}
+	s->expect--;
+	if (!s->expect) {
+		arm_timer(s, 0);
+	}
+	if (!f->cks_ok) {
+		sess_badresp(s, "bad checksum");
+		return;
+	}
+	if (s->bad) {
+		sess_badresp(s, s->bad);
+		return;
+	}
+
+	switch (s->st) {
+	case ST_STARTCOMM:
+		if (f->data[0] != SID_STARTCOMM + 0x40) {
+			sess_badresp(s, "bad StartComm response");
+			return;
+		}
+		sess_begin(s);
+		break;
+	case ST_SETEEPR:
+		if (f->data[0] != SID_CONF + 0x40) {
+			sess_fail(s, "SETEEPR failed");
+			return;
+		}
+		sess_begin(s);
+		break;
+	case ST_DUMP:
+	case ST_RMBA:
+		if (f->data[0] == 0x7F) {
+			sess_fail(s, "NRC 0x%02X @ 0x%06X", (f->len >= 3) ? (unsigned) f->data[2] : 0U,
+				  (unsigned) (s->base + s->pos));
+			return;
+		}
+		dump_rx(s, f);
+		break;
+	case ST_CRC:
+		crc_rx(s, f);
+		break;
+	case ST_FLREQ:
+	case ST_UNPROTECT:
+	case ST_ERASE:
+	case ST_WRITE:
+		flash_rx(s, f);
+		break;
+	default:
+		break;
+	}
+}
+
+static void sess_readable(struct npm_sess *s) {
+	for (;;) {
+		ssize_t rv;
+		unsigned used;
+
+		if (s->rxlen == sizeof(s->rx)) {
+			s->rxlen = 0;	//only garbage gets this long
+		}
+		rv = read(s->fd, &s->rx[s->rxlen], sizeof(s->rx) - s->rxlen);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				sess_fail(s, "read error (%s)", strerror(errno));
+			}
+			return;
+		}
+		if (rv == 0) {
+			return;
+		}
+		s->rxbytes += (unsigned long) rv;
+		s->rxlen += (unsigned) rv;
+
+		/* K-line echo of our request */
+		used = (s->echo_left < s->rxlen) ? s->echo_left : s->rxlen;
+		s->echo_left -= used;
+
+		for (;;) {
+			struct isoframe f;
+			unsigned flen;
+			enum npm_state prev_st;
+			unsigned long prev_req;
+
+			if (used >= s->rxlen) {
+				break;
+			}
+			flen = isoframe_parse(&s->rx[used], s->rxlen - used, &f);
+			if (!flen) {
+				break;
+			}
+			used += flen;
+			prev_st = s->st;
+			prev_req = s->requests;
+			sess_frame(s, &f);
+			if ((s->st >= ST_DONE) || (s->st != prev_st) || (s->requests != prev_req)) {
+				/* new request (or retry) : rx[] was reset, the rest is stale */
+				used = s->rxlen;
+				break;
+			}
+		}
+		memmove(s->rx, &s->rx[used], s->rxlen - used);
+		s->rxlen -= used;
+		if (s->st >= ST_DONE) {
+			return;
+		}
+	}
+}
+
+static void sess_timeout(struct npm_sess *s) {
+	uint64_t exp;
+
+	(void) read(s->tfd, &exp, sizeof(exp));
+	if ((s->st >= ST_DONE) || !s->expect) {
+		return;
+	}
+	if (s->bad) {
+		sess_retry(s, s->bad);
+		return;
+	}
+	sess_retry(s, (s->rxlen || ((s->st == ST_DUMP) && s->reqpos)) ? "incomplete response" : "no response");
+}
+
+
+/*** setup / reporting ***/
+
+/** load the ROM image (verify / flash) or allocate the dump area */
+static int sess_setup(struct npm_sess *s, const struct npm_conf *nc) {
+	FILE *f;
+	long fsize;
+
+	if ((nc->op == OP_DUMP) || (nc->op == OP_EEP)) {
+		s->ram = (nc->op == OP_DUMP) && (nc->start >= NPM_RAMSTART);
+		s->skip = s->ram ? 0 : (nc->start & (NPM_DUMPBLK - 1));
+		s->base = nc->start - s->skip;
+		s->datalen = s->ram ? nc->len : ((s->skip + nc->len + NPM_DUMPBLK - 1) & ~(NPM_DUMPBLK - 1));
+		s->data = malloc(s->datalen);
+		if (!s->data) {
+			printf("malloc failed\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	f = fopen(s->file, "rb");
+	if (!f) {
+		printf("can't open %s\n", s->file);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	fsize = ftell(f);
+	rewind(f);
+	if ((fsize < 0) || ((uint32_t) fsize != nc->fdt->romsize)) {
+		printf("%s : %ld bytes, expected %u for a %s\n", s->file, fsize,
+		       (unsigned) nc->fdt->romsize, nc->fdt->name);
+		fclose(f);
+		return -1;
+	}
+	s->datalen = nc->fdt->romsize;
+	s->data = malloc(s->datalen);
+	if (!s->data || (fread(s->data, 1, s->datalen, f) != s->datalen)) {
+		printf("can't read %s\n", s->file);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void print_status(const struct npm_sess *sessions, unsigned nsess) {
+	unsigned idx;
+
+	printf("\r");
+	for (idx = 0; idx < nsess; idx++) {
+		const struct npm_sess *s = &sessions[idx];
+		unsigned pct = s->work_total ? (unsigned) ((s->work_done * 100) / s->work_total) : 0;
+
+		if (s->st >= ST_DONE) {
+			printf("[%u:%s] ", idx, state_names[s->st]);
+		} else {
+			printf("[%u:%s %3u%%] ", idx, state_names[s->st], pct);
+		}
+	}
+	fflush(stdout);
+}
+
+static void print_modified(const struct npm_sess *s) {
+	unsigned idx;
+
+	if (((s->conf->op != OP_VERIFY) && (s->conf->op != OP_FLASH)) || !s->nmod) {
+		return;
+	}
+	printf("%s : %s", s->port, (s->conf->op == OP_VERIFY) ? "modified blocks" : "reflashed blocks");
+	for (idx = 0; idx < s->conf->fdt->numblocks; idx++) {
+		if (s->modified[idx]) {
+			printf(" %u", idx);
+		}
+	}
+	printf("%s\n", s->conf->practice ? " (practice)" : "");
+}
+
+static void print_summary(const struct npm_sess *sessions, unsigned nsess, uint64_t t_wall) {
+	unsigned long totbytes = 0;
+	unsigned idx, nok = 0;
+	struct rusage ru;
+
+	printf("\nport,op,result,blocks,bytes,time_s,Bps,requests,retries,tx_bytes,rx_bytes,error\n");
+	for (idx = 0; idx < nsess; idx++) {
+		const struct npm_sess *s = &sessions[idx];
+		uint64_t t = s->t_end - s->t_start;
+
+		printf("%s,%s,%s,%u,%lu,%.1f,%lu,%lu,%lu,%lu,%lu,%s\n", s->port, op_names[s->conf->op],
+		       (s->st == ST_DONE) ? "ok" : "FAIL", s->nmod, s->payload, t / 1000.0,
+		       t ? (unsigned long) ((s->payload * 1000ULL) / t) : 0UL,
+		       s->requests, s->retries, s->txbytes, s->rxbytes, s->err);
+		if (s->st == ST_DONE) {
+			nok++;
+		}
+		totbytes += s->payload;
+	}
+	for (idx = 0; idx < nsess; idx++) {
+		print_modified(&sessions[idx]);
+	}
+	printf("\n%u / %u ECUs ok; %lu bytes in %.1f s (%lu B/s aggregate)\n", nok, nsess, totbytes,
+	       t_wall / 1000.0, t_wall ? (unsigned long) ((totbytes * 1000ULL) / t_wall) : 0UL);
+	if (t_wall && (getrusage(RUSAGE_SELF, &ru) == 0)) {
+		uint64_t cpu = ((uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000ULL) +
+			       (uint64_t) ((ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000);
+		printf("CPU : %.2f s, %.1f %% of one core\n", cpu / 1000.0, (cpu * 100.0) / t_wall);
+	}
+}
+
+
+static void usage(void) {
+	printf("npmulti : dump / verify / reflash ECUs already running npkern, all from one thread\n"
+	       "usage : npmulti -o <op> -d <device> [options] <port>=<file> [<port>=<file> ...]\n"
+	       "\t-o <op>\t\tdump, eep, verify or flash\n"
+	       "\t-d <device>\tflash device (7051, 7055, 7058); verify / flash, and \"dump\" without -s / -l\n"
+	       "\t-s <addr>\tdump start (hex), RAM if >= 0xFF800000 (default: 0)\n"
+	       "\t-l <len>\tdump length (hex); default : ROM size, or 0x200 for eep\n"
+	       "\t-a <addr>\teeprom_read() address (hex), for eep\n"
+	       "\t-k <bps>\tkernel comms speed (default: 62500)\n"
+	       "\t-e\t\tdrop the K-line echo of every request (dumbopts 0x48 interfaces)\n"
+	       "\t-p\t\tpractice mode : flash doesn't unprotect, the ROM is not modified\n"
+	       "\t-r <n>\t\tretries per request (default: 3)\n"
+	       "\t-t <ms>\t\textra response timeout, like npconf rxe (default: 50)\n"
+	       "\t-q\t\tonly print the summary\n");
+}
+
+int main(int argc, char **argv) {
+	static struct npm_sess sessions[NPM_MAXSESS];
+	struct npm_conf nc = {0};
+	struct epoll_event ev;
+	const char *devname = NULL;
+	unsigned nsess, idx, nactive;
+	bool have_len = 0;
+	int opt, statusfd = -1;
+	uint64_t t_start;
+
+	nc.op = OP_VERIFY;
+	nc.kspeed = 62500;
+	nc.rxe = 50;
+	nc.retries = 3;
+
+	while ((opt = getopt(argc, argv, "o:d:s:l:a:k:epr:t:qh")) != -1) {
+		switch (opt) {
+		case 'o':
+			for (idx = 0; idx < (sizeof(op_names) / sizeof(op_names[0])); idx++) {
+				if (strcmp(optarg, op_names[idx]) == 0) {
+					break;
+				}
+			}
+			if (idx == (sizeof(op_names) / sizeof(op_names[0]))) {
+				printf("unknown op \"%s\"\n", optarg);
+				return 1;
+			}
+			nc.op = (enum npm_op) idx;
+			break;
+		case 'd':
+			devname = optarg;
+			break;
+		case 's':
+			nc.start = (uint32_t) strtoul(optarg, NULL, 16);
+			break;
+		case 'l':
+			nc.len = (uint32_t) strtoul(optarg, NULL, 16);
+			have_len = 1;
+			break;
+		case 'a':
+			nc.eepr = (uint32_t) strtoul(optarg, NULL, 16);
+			break;
+		case 'k':
+			nc.kspeed = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			nc.echo = 1;
+			break;
+		case 'p':
+			nc.practice = 1;
+			break;
+		case 'r':
+			nc.retries = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nc.rxe = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			nc.quiet = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if ((optind >= argc) || !nc.kspeed) {
+		usage();
+		return 1;
+	}
+	if (devname) {
+		nc.fdt = find_dev(devname);
+		if (!nc.fdt) {
+			printf("unknown device \"%s\"\n", devname);
+			return 1;
+		}
+	}
+
+	switch (nc.op) {
+	case OP_VERIFY:
+	case OP_FLASH:
+		if (!nc.fdt) {
+			printf("%s needs a device type (-d)\n", op_names[nc.op]);
+			return 1;
+		}
+		if (nc.fdt->numblocks > NPM_MAXFBLOCKS) {
+			printf("too many flash blocks\n");
+			return 1;
+		}
+		break;
+	case OP_DUMP:
+		if (!have_len) {
+			if (!nc.fdt) {
+				printf("dump needs -l, or a device type (-d) for the whole ROM\n");
+				return 1;
+			}
+			nc.start = 0;
+			nc.len = nc.fdt->romsize;
+		}
+		break;
+	case OP_EEP:
+		if (!nc.eepr) {
+			printf("eep needs the eeprom_read() address (-a)\n");
+			return 1;
+		}
+		if (!have_len) {
+			nc.len = 0x200;
+		}
+		break;
+	}
+	if (((nc.op == OP_DUMP) || (nc.op == OP_EEP)) && !nc.len) {
+		printf("nothing to dump\n");
+		return 1;
+	}
+	if ((nc.op == OP_EEP) || ((nc.op == OP_DUMP) && (nc.start < NPM_RAMSTART))) {
+		/* SID_DUMP block # is 16 bits */
+		if (((uint64_t) nc.start + nc.len) > (0x10000ULL * NPM_DUMPBLK)) {
+			printf("dump area out of range for SID_DUMP\n");
+			return 1;
+		}
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		printf("epoll_create1 failed\n");
+		return 1;
+	}
+
+	nsess = 0;
+	for (idx = (unsigned) optind; idx < (unsigned) argc; idx++) {
+		struct npm_sess *s = &sessions[nsess];
+		char *eq = strchr(argv[idx], '=');
+
+		if (!eq || (eq == argv[idx]) || !eq[1]) {
+			printf("expected <port>=<file>, got \"%s\"\n", argv[idx]);
+			return 1;
+		}
+		if (nsess == NPM_MAXSESS) {
+			printf("too many ports (max %u)\n", NPM_MAXSESS);
+			return 1;
+		}
+		*eq = 0;
+		s->conf = &nc;
+		s->idx = nsess;
+		s->port = argv[idx];
+		s->file = eq + 1;
+		if (sess_setup(s, &nc)) {
+			return 1;
+		}
+		s->fd = open_port(s->port, nc.kspeed);
+		if (s->fd < 0) {
+			return 1;
+		}
+		s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->tfd < 0) {
+			printf("timerfd_create failed\n");
+			return 1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u32 = (nsess << 2) | EV_SERIAL;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) != 0) {
+			printf("%s : epoll_ctl failed (%s)\n", s->port, strerror(errno));
+			return 1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u32 = (nsess << 2) | EV_TIMER;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->tfd, &ev) != 0) {
+			printf("epoll_ctl failed\n");
+			return 1;
+		}
+		nsess++;
+	}
+
+	if (!nc.quiet) {
+		struct itimerspec its = {0};
+
+		statusfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (statusfd >= 0) {
+			its.it_value.tv_sec = NPM_STATUS_MS / 1000;
+			its.it_interval.tv_sec = NPM_STATUS_MS / 1000;
+			(void) timerfd_settime(statusfd, 0, &its, NULL);
+			ev.events = EPOLLIN;
+			ev.data.u32 = EV_STATUS;
+			(void) epoll_ctl(epfd, EPOLL_CTL_ADD, statusfd, &ev);
+		}
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	printf("%s on %u port(s) at %u bps%s\n", op_names[nc.op], nsess, nc.kspeed,
+	       nc.practice ? ", practice mode" : "");
+
+	t_start = now_ms();
+	nactive = 0;
+	for (idx = 0; idx < nsess; idx++) {
+		struct npm_sess *s = &sessions[idx];
+
+		sess_start(s);
+		/* may already have failed, e.g. write error on an unplugged adapter; its fds are
+		 * out of epoll, so it would never be counted below */
+		if (s->st < ST_DONE) {
+			nactive++;
+		} else if (!nc.quiet) {
+			printf("%s : %s%s%s\n", s->port, state_names[s->st], s->err[0] ? ", " : "", s->err);
+		}
+	}
+
+	while (nactive && !quit) {
+		struct epoll_event evs[NPM_MAXSESS * 2 + 1];
+		int nev, evi;
+
+		nev = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), -1);
+		if (nev < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("epoll_wait failed\n");
+			break;
+		}
+		for (evi = 0; evi < nev; evi++) {
+			uint32_t kind = evs[evi].data.u32 & 3;
+			struct npm_sess *s = &sessions[evs[evi].data.u32 >> 2];
+
+			if (kind == EV_STATUS) {
+				uint64_t exp;
+				(void) read(statusfd, &exp, sizeof(exp));
+				print_status(sessions, nsess);
+				continue;
+			}
+			if (s->st >= ST_DONE) {
+				continue;
+			}
+			if (kind == EV_TIMER) {
+				sess_timeout(s);
+			} else {
+				if (evs[evi].events & EPOLLOUT) {
+					sess_flushtx(s);
+				}
+				if (evs[evi].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+					sess_readable(s);
+				}
+				if ((evs[evi].events & EPOLLHUP) && (s->st < ST_DONE)) {
+					sess_fail(s, "port closed");
+				}
+			}
+			if (s->st >= ST_DONE) {
+				nactive--;
+				if (!nc.quiet) {
+					print_status(sessions, nsess);
+					printf("\n%s : %s%s%s\n", s->port, state_names[s->st],
+					       s->err[0] ? ", " : "", s->err);
+				}
+			}
+		}
+	}
+
+	for (idx = 0; idx < nsess; idx++) {
+		struct npm_sess *s = &sessions[idx];
+
+		if (s->st < ST_DONE) {
+			/* interrupted : the kernel is still running, nisprog can pick up from here */
+			sess_fail(s, "interrupted @ %s", state_names[s->st]);
+		}
+		close(s->fd);
+		close(s->tfd);
+		free(s->data);
+	}
+	print_summary(sessions, nsess, now_ms() - t_start);
+
+	for (idx = 0; idx < nsess; idx++) {
+		if (sessions[idx].st != ST_DONE) {
+			return 1;
+		}
+	}
+	return 0;
+}
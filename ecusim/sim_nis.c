@@ -0,0 +1,332 @@
+/*
+ *	ecusim - pty-based ECU simulator for nisprog
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * stock Nissan ECU personality : what nisprog uses before the kernel is running,
+ * i.e. "nc", dumpmem through SID AC + 21, guesskey, and "runkernel" (27 / 34 / 36 / 37 / BF).
+ * BF 01 starts the npkern personality.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+
+#include "ecusim.h"
+#include "npkern/npk_errcodes.h"
+#include "nissutils/cli_utils/nislib.h"
+
+
+#define ISO_NRC_ROOR	0x31	//requestOutOfRange
+#define C2_NRC_BAD_SID36_SEQ 0x90
+#define C2_NRC_BAD_SID37_CKS 0x91
+
+#define NIS_S27K_ADDR 0xFFFF8416UL	//where many ROMs keep the sid27 key, see cmd_guesskey
+
+
+static void nis_reset(struct ecusim *sim) {
+	uint8_t s27k[4];
+
+	memset(&sim->nis, 0, sizeof(sim->nis));
+	write_32b(sim->nisconf.s27k, s27k);
+	(void) sim_memwrite(sim, NIS_S27K_ADDR, s27k, 4);
+}
+
+
+/* 27 01 : 67 01 <seed> ; 27 02 <key> : 67 02 */
+static void nis_sid27(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[6] = {0x67};
+
+	if ((req->len == 2) && (req->data[1] == 0x01)) {
+		sim->nis.seed = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+		sim->nis.seedsent = 1;
+		resp[1] = 0x01;
+		write_32b(sim->nis.seed, &resp[2]);
+		sim_reply(sim, resp, 6);
+		return;
+	}
+	if ((req->len == 6) && (req->data[1] == 0x02)) {
+		if (!sim->nis.seedsent) {
+			sim_nrc(sim, 0x27, ISO_NRC_CNCORSE);
+			return;
+		}
+		sim->nis.seedsent = 0;
+		if (reconst_32(&req->data[2]) != enc1(sim->nis.seed, sim->nisconf.s27k)) {
+			printf("SID27 : bad key\n");
+			sim_nrc(sim, 0x27, ISO_NRC_IK);
+			return;
+		}
+		printf("SID27 : unlocked\n");
+		sim->nis.unlocked = 1;
+		resp[1] = 0x02;
+		sim_reply(sim, resp, 2);
+		return;
+	}
+	sim_nrc(sim, 0x27, ISO_NRC_SFNS_IF);
+}
+
+/* 36 <BH> <BL> <len> <32 bytes> ; 76 */
+static void nis_sid36(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp = 0x76;
+	uint16_t blockno;
+
+	if (!sim->nis.dl_active) {
+		sim_nrc(sim, 0x36, ISO_NRC_CNCORSE);
+		return;
+	}
+	blockno = (req->data[1] << 8) | req->data[2];
+	if ((req->len != (4 + 32)) || (blockno != sim->nis.nextblock)) {
+		sim_nrc(sim, 0x36, C2_NRC_BAD_SID36_SEQ);
+		return;
+	}
+	if ((sim->nis.pl_len + 32) > SIM_NIS_PLMAX) {
+		sim_nrc(sim, 0x36, ISO_NRC_CNDTSA);
+		return;
+	}
+	memcpy(&sim->nis.payload[sim->nis.pl_len], &req->data[4], 32);
+	sim->nis.pl_len += 32;
+	sim->nis.nextblock += 1;
+	sim_reply(sim, &resp, 1);
+}
+
+/* 37 <CKH> <CKL> ; 77.
+ * The checksum is on the plaintext and there's no inverse of enc1 here, so it can't be checked;
+ * if a reference kernel was given, the encrypted payload is compared instead.
+ */
+static void nis_sid37(struct ecusim *sim, const struct isoframe *req) {
+	const struct sim_nis_conf *nc = &sim->nisconf;
+	uint8_t resp = 0x77;
+	uint32_t idx;
+
+	if (!sim->nis.dl_active || !sim->nis.pl_len || (req->len != 3)) {
+		sim_nrc(sim, 0x37, ISO_NRC_CNCORSE);
+		return;
+	}
+	printf("SID36 payload : %lu bytes\n", (unsigned long) sim->nis.pl_len);
+
+	if (nc->kernel) {
+		if (nc->kernel_len > sim->nis.pl_len) {
+			printf("payload shorter than reference kernel !\n");
+			sim_nrc(sim, 0x37, C2_NRC_BAD_SID37_CKS);
+			return;
+		}
+		/* trailing padding is random, only compare complete words of the kernel */
+		for (idx = 0; (idx + 4) <= nc->kernel_len; idx += 4) {
+			uint8_t enc[4];
+			write_32b(enc1(reconst_32(&nc->kernel[idx]), nc->s36k1), enc);
+			if (memcmp(enc, &sim->nis.payload[idx], 4) != 0) {
+				printf("payload mismatch @ 0x%lX\n", (unsigned long) idx);
+				sim_nrc(sim, 0x37, C2_NRC_BAD_SID37_CKS);
+				return;
+			}
+		}
+		printf("payload matches reference kernel\n");
+	}
+	sim->nis.dl_active = 0;
+	sim->nis.xfer_done = 1;
+	sim_reply(sim, &resp, 1);
+}
+
+/* BF 00 : RAMjumpCheck, BF 01 : RAMjump */
+static void nis_sidBF(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp = 0xFF;
+
+	if (!sim->nis.xfer_done || (req->len != 2)) {
+		sim_nrc(sim, 0xBF, ISO_NRC_CNCORSE);
+		return;
+	}
+	switch (req->data[1]) {
+	case 0:
+		sim->nis.jumpcheck = 1;
+		sim_reply(sim, &resp, 1);
+		return;
+	case 1:
+		if (!sim->nis.jumpcheck) {
+			break;
+		}
+		sim_reply(sim, &resp, 1);
+		printf("RAMjump !\n");
+		sim_setbaud(sim, SIM_NPK_BOOTSPEED);
+		sim_enter(sim, &sim_npk);
+		return;
+	default:
+		break;
+	}
+	sim_nrc(sim, 0xBF, ISO_NRC_CNCORSE);
+}
+
+/* AC 81 {83 <A3> <A2> <A1> <A0>}... : define address list for local id 0x81 ; EC 81 */
+static void nis_sidAC(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[2] = {0xEC, 0x81};
+	unsigned n, idx;
+
+	n = (req->len - 2) / 5;
+	if ((req->len < 7) || (req->data[1] != 0x81) ||
+	    ((req->len - 2) % 5) || (n > sim->nisconf.aclen)) {
+		sim_nrc(sim, 0xAC, ISO_NRC_SFNS_IF);
+		return;
+	}
+	for (idx = 0; idx < n; idx++) {
+		const uint8_t *field = &req->data[2 + (5 * idx)];
+		uint8_t dummy;
+
+		if (field[0] != 0x83) {
+			sim_nrc(sim, 0xAC, ISO_NRC_SFNS_IF);
+			return;
+		}
+		sim->nis.acaddr[idx] = reconst_32(&field[1]);
+		if (sim_memread(sim, sim->nis.acaddr[idx], &dummy, 1)) {
+			sim->nis.aclen = 0;
+			sim_nrc(sim, 0xAC, ISO_NRC_ROOR);
+			return;
+		}
+	}
+	sim->nis.aclen = n;
+	sim_reply(sim, resp, 2);
+}
+
+/* 21 81 ... : 61 81 <1 byte per AC address> */
+static void nis_sid21(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[2 + SIM_NIS_ACMAX] = {0x61, 0x81};
+	unsigned idx;
+
+	if ((req->len < 2) || (req->data[1] != 0x81)) {
+		sim_nrc(sim, 0x21, ISO_NRC_SFNS_IF);
+		return;
+	}
+	if (!sim->nis.aclen) {
+		sim_nrc(sim, 0x21, ISO_NRC_CNCORSE);
+		return;
+	}
+	for (idx = 0; idx < sim->nis.aclen; idx++) {
+		(void) sim_memread(sim, sim->nis.acaddr[idx], &resp[2 + idx], 1);
+	}
+	sim_reply(sim, resp, 2 + sim->nis.aclen);
+}
+
+/* A4 <A3> <A2> <A1> <A0> <TXM> <numresps> : E4 <A3..A0> <data> */
+static void nis_sidA4(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[6] = {0xE4};
+
+	if (req->len != 7) {
+		sim_nrc(sim, 0xA4, ISO_NRC_SFNS_IF);
+		return;
+	}
+	memcpy(&resp[1], &req->data[1], 4);
+	if (sim_memread(sim, reconst_32(&req->data[1]), &resp[5], 1)) {
+		sim_nrc(sim, 0xA4, ISO_NRC_ROOR);
+		return;
+	}
+	sim_reply(sim, resp, 6);
+}
+
+
+static void nis_handle(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[8];
+	uint8_t sid = req->data[0];
+
+	switch (sid) {
+	case 0x81:
+		/* StartCommunication */
+		resp[0] = 0xC1;
+		resp[1] = 0xEF;
+		resp[2] = 0x8F;
+		sim_reply(sim, resp, 3);
+		break;
+	case 0x1A:
+		/* 1A 81 : 5A 81 <ECUID> */
+		if ((req->len != 2) || (req->data[1] != 0x81)) {
+			sim_nrc(sim, sid, ISO_NRC_SFNS_IF);
+			break;
+		}
+		resp[0] = 0x5A;
+		resp[1] = 0x81;
+		memcpy(&resp[2], sim->nisconf.ecuid, 5);
+		sim_reply(sim, resp, 7);
+		break;
+	case 0x10:
+		/* StartDiagnosticSession */
+		if (req->len < 2) {
+			sim_nrc(sim, sid, ISO_NRC_SFNS_IF);
+			break;
+		}
+		resp[0] = 0x50;
+		resp[1] = req->data[1];
+		sim_reply(sim, resp, 2);
+		break;
+	case 0x27:
+		nis_sid27(sim, req);
+		break;
+	case 0x34:
+		/* 34 80 : RequestDownload */
+		if ((req->len != 2) || (req->data[1] != 0x80)) {
+			sim_nrc(sim, sid, ISO_NRC_SFNS_IF);
+			break;
+		}
+		if (!sim->nis.unlocked) {
+			sim_nrc(sim, sid, ISO_NRC_CNCORSE);
+			break;
+		}
+		sim->nis.dl_active = 1;
+		sim->nis.xfer_done = 0;
+		sim->nis.nextblock = 0;
+		sim->nis.pl_len = 0;
+		resp[0] = 0x74;
+		sim_reply(sim, resp, 1);
+		break;
+	case 0x36:
+		nis_sid36(sim, req);
+		break;
+	case 0x37:
+		nis_sid37(sim, req);
+		break;
+	case 0xBF:
+		nis_sidBF(sim, req);
+		break;
+	case 0xAC:
+		nis_sidAC(sim, req);
+		break;
+	case 0x21:
+		nis_sid21(sim, req);
+		break;
+	case 0xA4:
+		nis_sidA4(sim, req);
+		break;
+	case 0x3B:
+		/* WriteDataByLocalId (VIN) : accept and ignore */
+		if (req->len != 4) {
+			sim_nrc(sim, sid, ISO_NRC_SFNS_IF);
+			break;
+		}
+		resp[0] = 0x7B;
+		resp[1] = req->data[1];
+		sim_reply(sim, resp, 2);
+		break;
+	case 0x3E:
+		resp[0] = 0x7E;
+		sim_reply(sim, resp, 1);
+		break;
+	case 0x82:
+		/* StopCommunication */
+		resp[0] = 0xC2;
+		sim_reply(sim, resp, 1);
+		nis_reset(sim);
+		break;
+	default:
+		sim_nrc(sim, sid, ISO_NRC_SNS);
+		break;
+	}
+}
+
+const struct sim_personality sim_nis = {
+	.name = "nis",
+	.descr = "stock Nissan ECU firmware; BF 01 starts the npk personality",
+	.reset = nis_reset,
+	.handle = nis_handle,
+};
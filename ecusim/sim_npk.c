@@ -0,0 +1,343 @@
+/*
+ *	ecusim - pty-based ECU simulator for nisprog
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * npkern personality : see npkern/iso_cmds.h for the protocol.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ecusim.h"
+#include "npk_util.h"
+#include "npkern/iso_cmds.h"
+#include "npkern/npk_errcodes.h"
+
+
+#define NPK_SIM_ID "ecusim npkern"
+#define NPK_ERASE_MS_PER_KB 8	//roughly like a 7058 : ~1s for a 128k block
+#define NPK_DUMP_BLOCKSIZE 32
+
+/** sign-extend 24-bit address to the SH top 8MB area */
+static uint32_t npk_addr24(const uint8_t *abytes) {
+	uint32_t addr = ((uint32_t) abytes[0] << 16) | (abytes[1] << 8) | abytes[2];
+	if (addr & 0x800000) {
+		addr |= 0xFF000000;
+	}
+	return addr;
+}
+
+static void npk_reset(struct ecusim *sim) {
+	memset(&sim->npk, 0, sizeof(sim->npk));
+}
+
+
+/* <SID_RMBA> <AH> <AM> <AL> <SIZ> ; response : <SID + 0x40> <D0>....<Dn> <AH> <AM> <AL> */
+static void npk_rmba(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[ISOFRAME_MAXDATA];
+	unsigned siz;
+
+	if (req->len != 5) {
+		sim_nrc(sim, SID_RMBA, ISO_NRC_SFNS_IF);
+		return;
+	}
+	siz = req->data[4];
+	if ((siz == 0) || (siz > 251) ||
+	    sim_memread(sim, npk_addr24(&req->data[1]), &resp[1], siz)) {
+		sim_nrc(sim, SID_RMBA, ISO_NRC_SFNS_IF);
+		return;
+	}
+	resp[0] = SID_RMBA + 0x40;
+	memcpy(&resp[1 + siz], &req->data[1], 3);
+	sim_reply(sim, resp, siz + 4);
+}
+
+/* <SID_WMBA> <AH> <AM> <AL> <SIZ> <DATA> ; response : <SID + 0x40> <AH> <AM> <AL> */
+static void npk_wmba(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[4];
+	unsigned siz;
+
+	if (req->len < 6) {
+		sim_nrc(sim, SID_WMBA, ISO_NRC_SFNS_IF);
+		return;
+	}
+	siz = req->data[4];
+	if ((siz != (req->len - 5)) ||
+	    sim_memwrite(sim, npk_addr24(&req->data[1]), &req->data[5], siz)) {
+		sim_nrc(sim, SID_WMBA, ISO_NRC_SFNS_IF);
+		return;
+	}
+	resp[0] = SID_WMBA + 0x40;
+	memcpy(&resp[1], &req->data[1], 3);
+	sim_reply(sim, resp, 4);
+}
+
+/* 0xBD <AS> <BH BL> <AH AL> : send <BH BL> blocks of 32 bytes, starting at block <AH AL>.
+ * each block is sent as a separate <SID + 0x40> <32 bytes> response.
+ */
+static void npk_dump(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[1 + NPK_DUMP_BLOCKSIZE];
+	const uint8_t *src;
+	uint32_t srclen, start, numblocks;
+
+	if (req->len != 6) {
+		sim_nrc(sim, SID_DUMP, ISO_NRC_SFNS_IF);
+		return;
+	}
+	numblocks = (req->data[2] << 8) | req->data[3];
+	start = ((req->data[4] << 8) | req->data[5]) * NPK_DUMP_BLOCKSIZE;
+
+	switch (req->data[1]) {
+	case SID_DUMP_ROM:
+		src = sim->rom;
+		srclen = sim->fdt->romsize;
+		break;
+	case SID_DUMP_EEPROM:
+		if (!sim->npk.eepr_addr) {
+			sim_nrc(sim, SID_DUMP, ISO_NRC_CNCORSE);
+			return;
+		}
+		src = sim->eep;
+		srclen = SIM_EEPSIZE;
+		break;
+	default:
+		sim_nrc(sim, SID_DUMP, ISO_NRC_SFNS_IF);
+		return;
+	}
+
+	if ((start + (numblocks * NPK_DUMP_BLOCKSIZE)) > srclen) {
+		sim_nrc(sim, SID_DUMP, ISO_NRC_SFNS_IF);
+		return;
+	}
+
+	resp[0] = SID_DUMP + 0x40;
+	for (; numblocks; numblocks--, start += NPK_DUMP_BLOCKSIZE) {
+		memcpy(&resp[1], &src[start], NPK_DUMP_BLOCKSIZE);
+		sim_reply(sim, resp, sizeof(resp));
+	}
+}
+
+
+static void npk_conf(struct ecusim *sim, const struct isoframe *req) {
+	const uint8_t *d = req->data;
+	uint8_t resp[3] = {SID_CONF + 0x40};
+	unsigned idx;
+
+	if (req->len < 2) {
+		sim_nrc(sim, SID_CONF, ISO_NRC_SFNS_IF);
+		return;
+	}
+
+	switch (d[1]) {
+	case SID_CONF_SETSPEED:
+		/* <SID_CONF> <SID_CONF_SETSPEED> <new divisor> : reply at old speed, then wait for StartComm */
+		if ((req->len != 3) || (d[2] == 0)) {
+			break;
+		}
+		sim_reply(sim, resp, 1);
+		sim_setbaud(sim, KSPEED_FROM_BRR(d[2]));
+		sim->npk.commstarted = 0;
+		return;
+	case SID_CONF_SETEEPR:
+		if (req->len != 5) {
+			break;
+		}
+		sim->npk.eepr_addr = npk_addr24(&d[2]);
+		sim_reply(sim, resp, 1);
+		return;
+	case SID_CONF_CKS1:
+		/* <SID_CONF> <SID_CONF_CKS1> <CNH> <CNL> <CRC0H> <CRC0L> ...<CRC3H> <CRC3L> ; chunk # in units of 256B */
+		if (req->len != (4 + (2 * ROMCRC_NUMCHUNKS))) {
+			break;
+		}
+		for (idx = 0; idx < ROMCRC_NUMCHUNKS; idx++) {
+			uint32_t chunk_addr = (((d[2] << 8) | d[3]) + idx) * ROMCRC_CHUNKSIZE;
+			uint16_t crc = (d[4 + (2 * idx)] << 8) | d[5 + (2 * idx)];
+
+			if ((chunk_addr + ROMCRC_CHUNKSIZE) > sim->fdt->romsize) {
+				sim_nrc(sim, SID_CONF, ISO_NRC_SFNS_IF);
+				return;
+			}
+			if (npk_crc16(&sim->rom[chunk_addr], ROMCRC_CHUNKSIZE) != crc) {
+				sim_nrc(sim, SID_CONF, SID_CONF_CKS1_BADCKS);
+				return;
+			}
+		}
+		sim_reply(sim, resp, 1);
+		return;
+	case SID_CONF_R16:
+		/* <SID_CONF> <SID_CONF_R16> <A2> <A1> <A0> ; 16-bit read in RAM */
+		if ((req->len != 5) ||
+		    (d[4] & 1) ||
+		    sim_memread(sim, 0xFF000000 | npk_addr24(&d[2]), &resp[1], 2)) {
+			break;
+		}
+		sim_reply(sim, resp, 3);
+		return;
+	default:
+		break;
+	}
+	sim_nrc(sim, SID_CONF, ISO_NRC_SFNS_IF);
+}
+
+
+/* <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D127> <CRC> */
+static void npk_writeblock(struct ecusim *sim, const struct isoframe *req) {
+	const uint8_t *d = req->data;
+	uint8_t *dest;
+	uint32_t addr;
+	unsigned idx;
+
+	if (req->len != (5 + SIDFL_WB_DLEN + 1)) {
+		sim_nrc(sim, SID_FLASH, PFWB_LEN);
+		return;
+	}
+	if (npk_cks_add8(&d[2], 3 + SIDFL_WB_DLEN) != d[5 + SIDFL_WB_DLEN]) {
+		sim_nrc(sim, SID_FLASH, ISO_NRC_SFNS_IF);
+		return;
+	}
+	addr = ((uint32_t) d[2] << 16) | (d[3] << 8) | d[4];
+	if (addr & (SIDFL_WB_DLEN - 1)) {
+		sim_nrc(sim, SID_FLASH, PFWB_MISALIGNED);
+		return;
+	}
+	if ((addr + SIDFL_WB_DLEN) > sim->fdt->romsize) {
+		sim_nrc(sim, SID_FLASH, PFWB_OOB);
+		return;
+	}
+
+	if (sim->npk.unprotected) {
+		/* flash can only clear bits; anything else fails verification */
+		dest = &sim->rom[addr];
+		for (idx = 0; idx < SIDFL_WB_DLEN; idx++) {
+			dest[idx] &= d[5 + idx];
+		}
+		sim->rom_dirty = 1;
+		if (memcmp(dest, &d[5], SIDFL_WB_DLEN) != 0) {
+			sim_nrc(sim, SID_FLASH, PFWB_VERIFAIL);
+			return;
+		}
+	}
+	uint8_t resp = SID_FLASH + 0x40;
+	sim_reply(sim, &resp, 1);
+}
+
+static void npk_flash(struct ecusim *sim, const struct isoframe *req) {
+	const uint8_t *d = req->data;
+	uint8_t resp = SID_FLASH + 0x40;
+	const struct flashblock *fb;
+
+	if (!sim->npk.flreq) {
+		sim_nrc(sim, SID_FLASH, ISO_NRC_CNCORSE);
+		return;
+	}
+	if (req->len < 2) {
+		sim_nrc(sim, SID_FLASH, ISO_NRC_SFNS_IF);
+		return;
+	}
+
+	switch (d[1]) {
+	case SIDFL_UNPROTECT:
+		if ((req->len != 3) || (d[2] != (uint8_t) ~SIDFL_UNPROTECT)) {
+			break;
+		}
+		sim->npk.unprotected = 1;
+		printf("flash unprotected\n");
+		sim_reply(sim, &resp, 1);
+		return;
+	case SIDFL_EB:
+		if (req->len != 3) {
+			break;
+		}
+		if (d[2] >= sim->fdt->numblocks) {
+			sim_nrc(sim, SID_FLASH, PFEB_BADBLOCK);
+			return;
+		}
+		fb = &sim->fdt->fblocks[d[2]];
+		printf("erase block %u%s\n", (unsigned) d[2], sim->npk.unprotected ? "" : " (practice)");
+		if (sim->npk.unprotected) {
+			memset(&sim->rom[fb->start], 0xFF, fb->len);
+			sim->rom_dirty = 1;
+		}
+		sim_busy(sim, NPK_ERASE_MS_PER_KB * (fb->len / 1024));
+		sim_reply(sim, &resp, 1);
+		return;
+	case SIDFL_WB:
+		npk_writeblock(sim, req);
+		return;
+	default:
+		break;
+	}
+	sim_nrc(sim, SID_FLASH, ISO_NRC_SFNS_IF);
+}
+
+
+static void npk_handle(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[3];
+	uint8_t sid = req->data[0];
+
+	/* after a speed change, the kernel only listens for StartComm */
+	if (!sim->npk.commstarted && (sid != SID_STARTCOMM)) {
+		if (sim->verbose) {
+			printf("\tignored, waiting for StartComm\n");
+		}
+		return;
+	}
+
+	switch (sid) {
+	case SID_STARTCOMM:
+		resp[0] = SID_STARTCOMM + 0x40;
+		resp[1] = 0xEF;	//keybytes : all header formats supported
+		resp[2] = 0x8F;
+		sim->npk.commstarted = 1;
+		sim_reply(sim, resp, 3);
+		break;
+	case SID_RECUID:
+		sim_reply(sim, (const uint8_t *) SID_RECUID_PRC NPK_SIM_ID, sizeof(SID_RECUID_PRC NPK_SIM_ID) - 1);
+		break;
+	case SID_TP:
+		resp[0] = SID_TP + 0x40;
+		sim_reply(sim, resp, 1);
+		break;
+	case SID_RMBA:
+		npk_rmba(sim, req);
+		break;
+	case SID_WMBA:
+		npk_wmba(sim, req);
+		break;
+	case SID_DUMP:
+		npk_dump(sim, req);
+		break;
+	case SID_CONF:
+		npk_conf(sim, req);
+		break;
+	case SID_FLREQ:
+		sim->npk.flreq = 1;
+		resp[0] = SID_FLREQ + 0x40;
+		sim_reply(sim, resp, 1);
+		break;
+	case SID_FLASH:
+		npk_flash(sim, req);
+		break;
+	case SID_RESET:
+		resp[0] = SID_RESET + 0x40;
+		sim_reply(sim, resp, 1);
+		sim_ecureset(sim);
+		break;
+	default:
+		sim_nrc(sim, sid, ISO_NRC_SNS);
+		break;
+	}
+}
+
+const struct sim_personality sim_npk = {
+	.name = "npk",
+	.descr = "npkern already running",
+	.reset = npk_reset,
+	.handle = npk_handle,
+};
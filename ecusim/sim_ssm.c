@@ -0,0 +1,285 @@
+/*
+ *	ecusim - pty-based ECU simulator for nisprog
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * stock Subaru ECU personality : what "spconn" and "sprunkernel" use, i.e.
+ * 81 / A8 / 27 / 10 85 02 / 34 / 36 / 31. Headers always have a length byte.
+ * After 10 85 the ECU switches to 15625 bps; 31 01 01 starts the npkern personality.
+ * SID36 payloads are decrypted (inverse of sub_encrypt) into RAM.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+
+#include "ecusim.h"
+#include "keyalg.h"
+#include "npkern/npk_errcodes.h"
+#include "nissutils/cli_utils/nislib.h"
+
+
+#define ISO_NRC_ROOR	0x31	//requestOutOfRange
+
+#define SSM_BOOTSPEED	4800
+#define SSM_PROGSPEED	15625	//after 10 85 02; BRR N = 29
+#define SSM_ADDRHI	0xFF000000UL	//3-byte addresses are in the upper 16MB
+#define SSM_36MAX	128	//max SID36 data per block
+
+
+static void ssm_reset(struct ecusim *sim) {
+	memset(&sim->ssm, 0, sizeof(sim->ssm));
+	sim->hdr_lenbyte = 1;
+	sim_setbaud(sim, sim->baud_given ? sim->baud_init : SSM_BOOTSPEED);
+}
+
+static uint32_t reconst_24(const uint8_t *buf) {
+	return ((uint32_t) buf[0] << 16) | ((uint32_t) buf[1] << 8) | buf[2];
+}
+
+
+/* A8 00 {<A2> <A1> <A0>}... : E8 <1 byte per address>.
+ * nisprog reads the ECUID at addresses 1-5; other addresses read RAM, 0 if unmapped.
+ */
+static void ssm_sidA8(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[1 + (ISOFRAME_MAXDATA / 3)] = {0xE8};
+	unsigned n, idx;
+
+	n = (req->len - 2) / 3;
+	if ((req->len < 5) || ((req->len - 2) % 3) || (req->data[1] != 0)) {
+		sim_nrc(sim, 0xA8, ISO_NRC_SFNS_IF);
+		return;
+	}
+	for (idx = 0; idx < n; idx++) {
+		uint32_t addr = reconst_24(&req->data[2 + (3 * idx)]);
+
+		if ((addr >= 1) && (addr <= 5)) {
+			resp[1 + idx] = sim->ssmconf.ecuid[addr - 1];
+		} else if (sim_memread(sim, SSM_ADDRHI | addr, &resp[1 + idx], 1)) {
+			resp[1 + idx] = 0;
+		}
+	}
+	sim_reply(sim, resp, 1 + n);
+}
+
+/* 27 01 : 67 01 <seed> ; 27 02 <key> : 67 02 */
+static void ssm_sid27(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[6] = {0x67};
+	uint8_t key[4];
+
+	if ((req->len == 2) && (req->data[1] == 0x01)) {
+		sim->ssm.seed = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+		sim->ssm.seedsent = 1;
+		resp[1] = 0x01;
+		write_32b(sim->ssm.seed, &resp[2]);
+		sim_reply(sim, resp, 6);
+		return;
+	}
+	if ((req->len == 6) && (req->data[1] == 0x02)) {
+		if (!sim->ssm.seedsent) {
+			sim_nrc(sim, 0x27, ISO_NRC_CNCORSE);
+			return;
+		}
+		sim->ssm.seedsent = 0;
+		write_32b(sim->ssm.seed, resp);
+		sub_genkey(resp, key);
+		if (memcmp(key, &req->data[2], 4) != 0) {
+			printf("SID27 : bad key\n");
+			sim_nrc(sim, 0x27, ISO_NRC_IK);
+			return;
+		}
+		printf("SID27 : unlocked\n");
+		sim->ssm.unlocked = 1;
+		resp[0] = 0x67;
+		resp[1] = 0x02;
+		sim_reply(sim, resp, 2);
+		return;
+	}
+	sim_nrc(sim, 0x27, ISO_NRC_SFNS_IF);
+}
+
+/* 34 <A2> <A1> <A0> 04 <L2> <L1> <L0> : 74 <maxblock> */
+static void ssm_sid34(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[2] = {0x74, SSM_36MAX};
+	uint32_t addr, len;
+	uint8_t dummy;
+
+	if ((req->len != 8) || (req->data[4] != 0x04)) {
+		sim_nrc(sim, 0x34, ISO_NRC_SFNS_IF);
+		return;
+	}
+	if (!sim->ssm.unlocked || !sim->ssm.progsession) {
+		sim_nrc(sim, 0x34, ISO_NRC_CNCORSE);
+		return;
+	}
+	addr = SSM_ADDRHI | reconst_24(&req->data[1]);
+	len = reconst_24(&req->data[5]);
+	if (!len || (len & 3) || (addr < SIM_RAMBASE) ||
+	    sim_memread(sim, addr + len - 1, &dummy, 1)) {
+		sim_nrc(sim, 0x34, ISO_NRC_ROOR);
+		return;
+	}
+	if (!sim->ssm.xfer_blocks) {
+		sim->ssm.pl_addr = addr;
+	}
+	sim->ssm.dl_active = 1;
+	sim->ssm.dl_addr = addr;
+	sim->ssm.dl_len = len;
+	sim_reply(sim, resp, 2);
+}
+
+/* 36 <A2> <A1> <A0> <encrypted data> : 76 */
+static void ssm_sid36(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp = 0x76;
+	uint8_t plain[SSM_36MAX];
+	uint32_t addr, len, idx;
+
+	if (!sim->ssm.dl_active) {
+		sim_nrc(sim, 0x36, ISO_NRC_CNCORSE);
+		return;
+	}
+	addr = SSM_ADDRHI | reconst_24(&req->data[1]);
+	len = req->len - 4;
+	if ((req->len < 8) || (len > SSM_36MAX) || (len & 3) ||
+	    (addr < sim->ssm.dl_addr) ||
+	    ((addr - sim->ssm.dl_addr) + len > sim->ssm.dl_len)) {
+		sim_nrc(sim, 0x36, ISO_NRC_ROOR);
+		return;
+	}
+	for (idx = 0; idx < len; idx += 4) {
+		sub_decrypt(&req->data[4 + idx], &plain[idx]);
+	}
+	(void) sim_memwrite(sim, addr, plain, len);
+
+	if (!sim->ssm.xfer_blocks) {
+		sim->ssm.t_first36 = sim->rx_last;
+	}
+	sim->ssm.t_last36 = sim->rx_last;
+	sim->ssm.xfer_blocks += 1;
+	sim->ssm.xfer_bytes += len;
+	sim_reply(sim, &resp, 1);
+}
+
+/** print transfer stats, check checksum bypass and reference kernel */
+static void ssm_xfer_report(struct ecusim *sim) {
+	const struct sim_nis_conf *nc = &sim->nisconf;
+	const struct sim_ssm_state *ss = &sim->ssm;
+	static const uint8_t cks_bypass[4] = {0x00, 0x00, 0x5A, 0xA5};
+	uint8_t tail[4];
+	uint64_t span_ms;
+
+	span_ms = (ss->t_last36 - ss->t_first36) / 1000000ULL;
+	printf("SID36 : %lu bytes in %u blocks @ 0x%08lX, %lu ms",
+	       (unsigned long) ss->xfer_bytes, ss->xfer_blocks,
+	       (unsigned long) ss->pl_addr, (unsigned long) span_ms);
+	if (span_ms) {
+		printf(" (%lu B/s)", (unsigned long) ((ss->xfer_bytes * 1000ULL) / span_ms));
+	}
+	printf("\n");
+
+	/* sprunkernel sends the checksum bypass as a separate 4-byte area */
+	if ((ss->dl_len == 4) && !sim_memread(sim, ss->dl_addr, tail, 4) &&
+	    !memcmp(tail, cks_bypass, 4)) {
+		printf("checksum bypass present @ 0x%08lX\n", (unsigned long) ss->dl_addr);
+	} else {
+		printf("no checksum bypass after payload; a real ECU may refuse to jump\n");
+	}
+
+	if (nc->kernel) {
+		uint8_t *buf = malloc(nc->kernel_len);
+
+		if (buf && !sim_memread(sim, ss->pl_addr, buf, nc->kernel_len) &&
+		    !memcmp(buf, nc->kernel, nc->kernel_len)) {
+			printf("payload matches reference kernel\n");
+		} else {
+			printf("payload does not match reference kernel !\n");
+		}
+		free(buf);
+	}
+}
+
+/* 31 01 01 : 71 01, RAMjump */
+static void ssm_sid31(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[2] = {0x71, 0x01};
+
+	if ((req->len != 3) || (req->data[1] != 0x01) || (req->data[2] != 0x01)) {
+		sim_nrc(sim, 0x31, ISO_NRC_SFNS_IF);
+		return;
+	}
+	if (!sim->ssm.xfer_blocks) {
+		sim_nrc(sim, 0x31, ISO_NRC_CNCORSE);
+		return;
+	}
+	ssm_xfer_report(sim);
+	sim_reply(sim, resp, 2);
+	printf("RAMjump !\n");
+	sim_setbaud(sim, SIM_NPK_BOOTSPEED);
+	sim_enter(sim, &sim_npk);
+}
+
+
+static void ssm_handle(struct ecusim *sim, const struct isoframe *req) {
+	uint8_t resp[4];
+	uint8_t sid = req->data[0];
+
+	switch (sid) {
+	case 0x81:
+		/* StartCommunication */
+		resp[0] = 0xC1;
+		resp[1] = 0xEF;
+		resp[2] = 0x8F;
+		sim_reply(sim, resp, 3);
+		break;
+	case 0xA8:
+		ssm_sidA8(sim, req);
+		break;
+	case 0x27:
+		ssm_sid27(sim, req);
+		break;
+	case 0x10:
+		/* 10 85 02 : programming session, then switch speed */
+		if ((req->len != 3) || (req->data[1] != 0x85)) {
+			sim_nrc(sim, sid, ISO_NRC_SFNS_IF);
+			break;
+		}
+		if (!sim->ssm.unlocked) {
+			sim_nrc(sim, sid, ISO_NRC_CNCORSE);
+			break;
+		}
+		resp[0] = 0x50;
+		resp[1] = 0x85;
+		sim_reply(sim, resp, 2);
+		sim->ssm.progsession = 1;
+		sim_setbaud(sim, SSM_PROGSPEED);
+		break;
+	case 0x34:
+		ssm_sid34(sim, req);
+		break;
+	case 0x36:
+		ssm_sid36(sim, req);
+		break;
+	case 0x31:
+		ssm_sid31(sim, req);
+		break;
+	case 0x3E:
+		resp[0] = 0x7E;
+		sim_reply(sim, resp, 1);
+		break;
+	default:
+		sim_nrc(sim, sid, ISO_NRC_SNS);
+		break;
+	}
+}
+
+const struct sim_personality sim_ssm = {
+	.name = "ssm",
+	.descr = "stock Subaru ECU firmware (4800 bps); 31 01 01 starts the npk personality",
+	.reset = ssm_reset,
+	.handle = ssm_handle,
+};
@@ -0,0 +1,61 @@
+/*
+ *	pseudo-terminal helpers for the standalone tools
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE	//posix_openpt, cfmakeraw etc
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "simpty.h"
+
+
+int simpty_open(int *slavefd, const char *linkname) {
+	struct termios tio;
+	const char *sname;
+	int mfd;
+
+	mfd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (mfd < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	if (grantpt(mfd) || unlockpt(mfd)) {
+		perror("grantpt / unlockpt");
+		goto badexit;
+	}
+	sname = ptsname(mfd);
+	if (!sname) {
+		goto badexit;
+	}
+
+	*slavefd = open(sname, O_RDWR | O_NOCTTY);
+	if (*slavefd < 0) {
+		perror("open pty slave");
+		goto badexit;
+	}
+	if (tcgetattr(*slavefd, &tio) == 0) {
+		cfmakeraw(&tio);
+		(void) tcsetattr(*slavefd, TCSANOW, &tio);
+	}
+
+	if (linkname) {
+		(void) unlink(linkname);
+		if (symlink(sname, linkname)) {
+			perror("symlink");
+		}
+	}
+	printf("pty : %s%s%s\n", sname, linkname ? " , linked as " : "", linkname ? linkname : "");
+	return mfd;
+
+badexit:
+	close(mfd);
+	return -1;
+}
@@ -0,0 +1,14 @@
+#ifndef SIMPTY_H
+#define SIMPTY_H
+
+/* pseudo-terminal setup shared by the standalone tools (ecusim, klshim etc.) */
+
+/** open pty master, set raw mode.
+ * also returns a slave fd that the caller should keep open, so the master doesn't get EIO
+ * every time the client closes its side.
+ * If linkname is not NULL, a symlink to the slave is created there.
+ * ret master fd, -1 if error
+ */
+int simpty_open(int *slavefd, const char *linkname);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * iso14230 framing on raw byte streams
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "isoframe.h"
+
+
+uint8_t isoframe_cks(const uint8_t *buf, unsigned len) {
+	uint8_t cks = 0;
+	for (; len; len--) {
+		cks += *buf++;
+	}
+	return cks;
+}
+
+
+unsigned isoframe_parse(const uint8_t *buf, unsigned avail, struct isoframe *f) {
+	unsigned hlen, dlen;
+
+	if (!avail) {
+		return 0;
+	}
+
+	f->addressed = (buf[0] & 0x80) ? 1 : 0;
+	hlen = f->addressed ? 3 : 1;
+	dlen = buf[0] & 0x3F;
+	if (!dlen) {
+		/* separate length byte */
+		hlen += 1;
+		if (avail < hlen) {
+			return 0;
+		}
+		dlen = buf[hlen - 1];
+	}
+
+	if (avail < (hlen + dlen + 1)) {
+		return 0;
+	}
+
+	if (f->addressed) {
+		f->tgt = buf[1];
+		f->src = buf[2];
+	} else {
+		f->tgt = 0;
+		f->src = 0;
+	}
+	f->len = dlen;
+	memcpy(f->data, &buf[hlen], dlen);
+	f->cks_ok = (dlen != 0) && (isoframe_cks(buf, hlen + dlen) == buf[hlen + dlen]);
+
+	return hlen + dlen + 1;
+}
+
+
+unsigned isoframe_build(uint8_t *dest, const uint8_t *data, unsigned len,
+			bool addressed, bool lenbyte, uint8_t tgt, uint8_t src) {
+	unsigned hlen = 0;
+
+	if ((len == 0) || (len > ISOFRAME_MAXDATA)) {
+		return 0;
+	}
+	if (len > 0x3F) {
+		lenbyte = 1;
+	}
+
+	if (!lenbyte) {
+		dest[hlen++] = (addressed ? 0x80 : 0) | len;
+	} else {
+		dest[hlen++] = addressed ? 0x80 : 0;
+	}
+	if (addressed) {
+		dest[hlen++] = tgt;
+		dest[hlen++] = src;
+	}
+	if (lenbyte) {
+		dest[hlen++] = len;
+	}
+
+	memcpy(&dest[hlen], data, len);
+	dest[hlen + len] = isoframe_cks(dest, hlen + len);
+	return hlen + len + 1;
+}
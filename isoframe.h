@@ -0,0 +1,51 @@
+#ifndef ISOFRAME_H
+#define ISOFRAME_H
+
+/* iso14230 frame parsing / building on raw byte streams. No freediag dependencies;
+ * used by the standalone tools that talk to a serial port (or pty) directly.
+ *
+ * Header forms :
+ *	<FMT> ...				FMT = len (1-63), no address bytes
+ *	<0x00> <LEN> ...			no address bytes, separate length byte
+ *	<0x80 | len> <TGT> <SRC> ...		with address bytes
+ *	<0x80> <TGT> <SRC> <LEN> ...
+ * followed by <data> <cks>, cks being the 8-bit sum of all preceding bytes.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ISOFRAME_MAXDATA 255
+#define ISOFRAME_MAXHDR 4
+#define ISOFRAME_MAXLEN (ISOFRAME_MAXHDR + ISOFRAME_MAXDATA + 1)
+
+struct isoframe {
+	uint8_t data[ISOFRAME_MAXDATA];
+	unsigned len;		//# of data bytes
+	bool addressed;		//header had TGT + SRC bytes
+	uint8_t tgt;
+	uint8_t src;
+	bool cks_ok;
+};
+
+/** 8-bit sum of <len> bytes */
+uint8_t isoframe_cks(const uint8_t *buf, unsigned len);
+
+/** Try to parse one frame at the start of buf[], which holds <avail> bytes.
+ *
+ * @return 0 if the frame is incomplete (need more bytes); otherwise the total
+ * length of the frame (header + data + cks), which the caller should drop from its buffer.
+ * Frames with a bad checksum are returned with f->cks_ok = 0.
+ */
+unsigned isoframe_parse(const uint8_t *buf, unsigned avail, struct isoframe *f);
+
+/** Build a frame into dest[] (must hold ISOFRAME_MAXLEN bytes).
+ * Uses the shortest header allowed for the given addressing mode,
+ * unless lenbyte is set : then the length is always a separate byte (e.g. 4-byte Subaru headers).
+ *
+ * @return total frame length, or 0 if len is invalid (0 or > ISOFRAME_MAXDATA)
+ */
+unsigned isoframe_build(uint8_t *dest, const uint8_t *data, unsigned len,
+			bool addressed, bool lenbyte, uint8_t tgt, uint8_t src);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * K-line capture files, see kcap.h
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "kcap.h"
+
+
+bool kcap_is_tx(enum kcap_type type) {
+	return (type == KCAP_TXRAW) || (type == KCAP_TXMSG);
+}
+
+uint64_t kcap_now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t) tv.tv_sec * 1000000ULL) + (uint64_t) tv.tv_usec;
+}
+
+
+static void put_varint(FILE *f, uint64_t val) {
+	do {
+		uint8_t b = val & 0x7F;
+		val >>= 7;
+		if (val) {
+			b |= 0x80;
+		}
+		fputc(b, f);
+	} while (val);
+}
+
+/** ret 0 if ok */
+static int get_varint(FILE *f, uint64_t *val) {
+	unsigned shift = 0;
+	int c;
+
+	*val = 0;
+	do {
+		c = fgetc(f);
+		if ((c == EOF) || (shift > 63)) {
+			return -1;
+		}
+		*val |= (uint64_t) (c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+
+int kcap_create(struct kcap *kc, const char *fname) {
+	uint8_t hdr[KCAP_HDRLEN] = {0};
+	unsigned idx;
+
+	memset(kc, 0, sizeof(*kc));
+	kc->f = fopen(fname, "wb");
+	if (!kc->f) {
+		return -1;
+	}
+	kc->t_start = kcap_now();
+	memcpy(hdr, KCAP_MAGIC, 4);
+	hdr[4] = KCAP_VERSION;
+	for (idx = 0; idx < 8; idx++) {
+		hdr[8 + idx] = (uint8_t) (kc->t_start >> (8 * idx));
+	}
+	if (fwrite(hdr, 1, KCAP_HDRLEN, kc->f) != KCAP_HDRLEN) {
+		fclose(kc->f);
+		kc->f = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int kcap_write(struct kcap *kc, enum kcap_type type, uint64_t t_us, const uint8_t *data, unsigned len) {
+	if (!kc->f) {
+		return -1;
+	}
+	if (t_us < kc->t_last) {
+		t_us = kc->t_last;
+	}
+	do {
+		unsigned chunk = (len > KCAP_MAXREC) ? KCAP_MAXREC : len;
+
+		fputc((int) type, kc->f);
+		put_varint(kc->f, t_us - kc->t_last);
+		put_varint(kc->f, chunk);
+		if (chunk && (fwrite(data, 1, chunk, kc->f) != chunk)) {
+			return -1;
+		}
+		kc->t_last = t_us;
+		kc->nrecs += 1;
+		data += chunk;
+		len -= chunk;
+	} while (len);
+	return ferror(kc->f) ? -1 : 0;
+}
+
+
+int kcap_open(struct kcap *kc, const char *fname) {
+	uint8_t hdr[KCAP_HDRLEN];
+	unsigned idx;
+
+	memset(kc, 0, sizeof(*kc));
+	kc->f = fopen(fname, "rb");
+	if (!kc->f) {
+		return -1;
+	}
+	if ((fread(hdr, 1, KCAP_HDRLEN, kc->f) != KCAP_HDRLEN) ||
+	    memcmp(hdr, KCAP_MAGIC, 4) || (hdr[4] != KCAP_VERSION)) {
+		fclose(kc->f);
+		kc->f = NULL;
+		return -1;
+	}
+	for (idx = 0; idx < 8; idx++) {
+		kc->t_start |= (uint64_t) hdr[8 + idx] << (8 * idx);
+	}
+	return 0;
+}
+
+int kcap_read(struct kcap *kc, struct kcap_rec *rec) {
+	uint64_t dt, len;
+	int type;
+
+	type = fgetc(kc->f);
+	if (type == EOF) {
+		return 0;
+	}
+	if ((type < KCAP_TXRAW) || (type > KCAP_NOTE) ||
+	    get_varint(kc->f, &dt) || get_varint(kc->f, &len) || (len > KCAP_MAXREC)) {
+		return -1;
+	}
+	if (len && (fread(rec->data, 1, (size_t) len, kc->f) != len)) {
+		return -1;
+	}
+	kc->t_last += dt;
+	kc->nrecs += 1;
+	rec->type = (enum kcap_type) type;
+	rec->t_us = kc->t_last;
+	rec->len = (unsigned) len;
+	return 1;
+}
+
+void kcap_close(struct kcap *kc) {
+	if (kc->f) {
+		fclose(kc->f);
+	}
+	kc->f = NULL;
+}
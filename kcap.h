@@ -0,0 +1,70 @@
+#ifndef KCAP_H
+#define KCAP_H
+
+/* K-line session capture format. No freediag dependencies; written by nisprog ("kcap" command)
+ * and klshim (-c), read by klreplay.
+ *
+ * File : "KCAP" <version> <3 reserved bytes> <start time, us since epoch : u64 LE>
+ * then records : <type : u8> <dt : varint> <len : varint> <len bytes>
+ *	dt is in microseconds since the previous record (or since the start time);
+ *	varints are unsigned LEB128 (7 bits per byte, LSB first).
+ *
+ * Bytes are timestamped per record, i.e. per read / write call : a record holds whatever
+ * one diag_l1_recv() returned, or one relayed chunk for klshim.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define KCAP_MAGIC "KCAP"
+#define KCAP_VERSION 1
+#define KCAP_HDRLEN 16
+#define KCAP_MAXREC 4096	//max bytes per record
+
+enum kcap_type {
+	KCAP_TXRAW = 1,	//host -> ECU, bytes as on the wire
+	KCAP_RXRAW = 2,	//ECU -> host, bytes as on the wire (echo removed if the L0 does that)
+	KCAP_TXMSG = 3,	//host -> ECU, message data; L2 adds header + checksum
+	KCAP_RXMSG = 4,	//ECU -> host, message data; L2 removed header + checksum
+	KCAP_NOTE = 5,	//text, e.g. the CLI command being run
+};
+
+struct kcap_rec {
+	enum kcap_type type;
+	uint64_t t_us;		//since start of capture
+	unsigned len;
+	uint8_t data[KCAP_MAXREC];
+};
+
+struct kcap {
+	FILE *f;
+	uint64_t t_start;	//us since epoch
+	uint64_t t_last;	//us since t_start, of the last record
+	unsigned long nrecs;
+};
+
+/** ret 1 if the record goes from host to ECU */
+bool kcap_is_tx(enum kcap_type type);
+
+/** create capture file; t_start is the current time. ret 0 if ok */
+int kcap_create(struct kcap *kc, const char *fname);
+
+/** append a record; <t_us> is relative to the capture start and should not go backwards.
+ * Records longer than KCAP_MAXREC are split.
+ * ret 0 if ok
+ */
+int kcap_write(struct kcap *kc, enum kcap_type type, uint64_t t_us, const uint8_t *data, unsigned len);
+
+/** open capture for reading. ret 0 if ok */
+int kcap_open(struct kcap *kc, const char *fname);
+
+/** read next record. ret 1 if ok, 0 at end of file, -1 if the file is corrupt */
+int kcap_read(struct kcap *kc, struct kcap_rec *rec);
+
+void kcap_close(struct kcap *kc);
+
+/** wall clock, us since epoch */
+uint64_t kcap_now(void);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * (c) 2022 rimwall (Subaru algos)
+ * Licensed under GPLv3
+ *
+ * SID 27 seed/key algorithms, and batch versions.
+ *
+ * The batch versions process KEYALG_LANES seeds side by side with no data-dependent branches,
+ * so the compiler can map the lanes to SIMD registers. More importantly they use lookup
+ * tables that replace most of the work :
+ *
+ * - genkey2's loop is a Galois LFSR step ( s = (s << 1) ^ (msb(s) ? K : 0) ), i.e. linear over GF(2).
+ * Like a table-driven CRC, 8 steps can be done at once with s = (s << 8) ^ tab[s >> 24].
+ *
+ * - sub_genkey's round function only depends on a 16-bit value, so it is tabulated once (128kB).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stypes.h"
+
+#include "keyalg.h"
+#include "nissutils/cli_utils/nislib.h"
+
+
+#define KEYALG_LANES 8
+
+
+/************ genkey2 (NPT "KLINE_AT" algo) */
+static const uint32_t gk2_keytable[]={0x14FA3579, 0x27CD3964, 0x1777FE32, 0x9931AF12,
+	                                  0x75DB3A49, 0x19294CAA, 0x0FF18CD76, 0x788236D,
+	                                  0x5A6F7CBB, 0x7A992254, 0x0ADFD5414, 0x343CFBCB,
+	                                  0x0C2F51639, 0x6A6D5813, 0x3729FF68, 0x22A2C751};
+
+/** number of xorloops, and key index, both taken from seed bits */
+static inline uint32_t gk2_loops(uint32_t seed) {
+	uint32_t ecx;
+	ecx = (seed & 1)<<6 | (seed>>9 & 1)<<4 | (seed>>1 & 1)<<3;
+	ecx |= (seed>>11 & 1)<<2 | (seed>>2 & 1)<<1 | (seed>>5 & 1);
+	return ecx + 0x1F;
+}
+
+static inline unsigned gk2_ki(uint32_t seed) {
+	return (seed & 1)<<3 | (seed>>1 & 1)<<2 | (seed>>2 & 1)<<1 | (seed>>9 & 1);
+}
+
+void genkey2(const uint8_t *seed8, uint8_t *key) {
+	uint32_t seed, ecx, xorloops;
+	int ki;
+
+	seed = reconst_32(seed8);
+
+	ecx = gk2_loops(seed);
+
+	if (((int32_t) ecx) <= 0) {
+		printf("problem !!\n");
+		return;
+	}
+
+	ki = gk2_ki(seed);
+
+	//printf("starting xorloop with ecx=0x%0X, ki=0x%0X\n", ecx, ki);
+
+	for (xorloops=0; xorloops < ecx; xorloops++) {
+		if (seed & 0x80000000) {
+			seed += seed;
+			seed ^= gk2_keytable[ki];
+		} else {
+			seed += seed;
+		}
+	}
+	//here, the generated key is in "seed".
+
+	write_32b(seed, key);
+
+	return;
+}
+
+/* gk2_bytetab[ki][t] : result of 8 xorloops on (t << 24) */
+static bool gk2_tab_init = 0;
+static uint32_t gk2_bytetab[16][256];
+
+static void init_gk2_tab(void) {
+	unsigned ki, t, i;
+
+	for (ki = 0; ki < 16; ki++) {
+		for (t = 0; t < 256; t++) {
+			uint32_t s = t << 24;
+			for (i = 0; i < 8; i++) {
+				s = (s << 1) ^ ((s & 0x80000000) ? gk2_keytable[ki] : 0);
+			}
+			gk2_bytetab[ki][t] = s;
+		}
+	}
+	gk2_tab_init = 1;
+}
+
+void genkey2_batch(const uint32_t *seeds, uint32_t *keys, unsigned n) {
+	unsigned base;
+
+	if (!gk2_tab_init) {
+		init_gk2_tab();
+	}
+
+	for (base = 0; base < n; base += KEYALG_LANES) {
+		uint32_t s[KEYALG_LANES];
+		uint32_t loops[KEYALG_LANES];
+		const uint32_t *tab[KEYALG_LANES];
+		uint32_t kt[KEYALG_LANES];
+		unsigned lanes = n - base;
+		unsigned l, step, maxbytes = 0, maxbits = 0;
+
+		if (lanes > KEYALG_LANES) {
+			lanes = KEYALG_LANES;
+		}
+
+		for (l = 0; l < KEYALG_LANES; l++) {
+			uint32_t seed = (l < lanes) ? seeds[base + l] : 0;
+			unsigned ki = gk2_ki(seed);
+			s[l] = seed;
+			loops[l] = gk2_loops(seed);
+			tab[l] = gk2_bytetab[ki];
+			kt[l] = gk2_keytable[ki];
+			if ((loops[l] / 8) > maxbytes) {
+				maxbytes = loops[l] / 8;
+			}
+			if ((loops[l] % 8) > maxbits) {
+				maxbits = loops[l] % 8;
+			}
+		}
+
+		/* 8 steps at a time; lanes that are done keep their value */
+		for (step = 0; step < maxbytes; step++) {
+			for (l = 0; l < KEYALG_LANES; l++) {
+				uint32_t next = (s[l] << 8) ^ tab[l][s[l] >> 24];
+				uint32_t active = -(uint32_t) (step < (loops[l] / 8));
+				s[l] = (next & active) | (s[l] & ~active);
+			}
+		}
+		/* remaining 0-7 single steps */
+		for (step = 0; step < maxbits; step++) {
+			for (l = 0; l < KEYALG_LANES; l++) {
+				uint32_t next = (s[l] << 1) ^ (kt[l] & -(s[l] >> 31));
+				uint32_t active = -(uint32_t) (step < (loops[l] % 8));
+				s[l] = (next & active) | (s[l] & ~active);
+			}
+		}
+
+		for (l = 0; l < lanes; l++) {
+			keys[base + l] = s[l];
+		}
+	}
+}
+
+
+/************ Subaru algo */
+static const uint16_t sub_keytogenerateindex[]={
+	0x53DA, 0x33BC, 0x72EB, 0x437D,
+	0x7CA3, 0x3382, 0x834F, 0x3608,
+	0xAFB8, 0x503D, 0xDBA3, 0x9D34,
+	0x3563, 0x6B70, 0x6E74, 0x88F0
+};
+
+static const uint8_t sub_indextransformation[]={
+	0x5, 0x6, 0x7, 0x1, 0x9, 0xC, 0xD, 0x8,
+	0xA, 0xD, 0x2, 0xB, 0xF, 0x4, 0x0, 0x3,
+	0xB, 0x4, 0x6, 0x0, 0xF, 0x2, 0xD, 0x9,
+	0x5, 0xC, 0x1, 0xA, 0x3, 0xD, 0xE, 0x8
+};
+
+/** round function : nibble substitution + rotate */
+static uint16_t sub_round(uint16_t wordtogenerateindex, uint16_t roundkey) {
+	uint32_t index;
+	uint16_t encryptionkey;
+	int n;
+
+	index = wordtogenerateindex ^ roundkey;
+	index += index << 16;
+	encryptionkey = 0;
+
+	for (n = 0; n < 4; n++) {
+		encryptionkey += sub_indextransformation[(index >> (n * 4)) & 0x1F] << (n * 4);
+	}
+
+	encryptionkey = (encryptionkey >> 3) + (encryptionkey << 13);
+	return encryptionkey;
+}
+
+void sub_genkey(const uint8_t *seed8, uint8_t *key) {
+	uint32_t seed;
+	uint16_t wordtogenerateindex, wordtobeencrypted, encryptionkey;
+	int ki;
+
+	seed = reconst_32(seed8);
+
+	for (ki = 15; ki >= 0; ki--) {
+
+		wordtogenerateindex = seed;
+		wordtobeencrypted = seed >> 16;
+		encryptionkey = sub_round(wordtogenerateindex, sub_keytogenerateindex[ki]);
+		seed = (encryptionkey ^ wordtobeencrypted) + (wordtogenerateindex << 16);
+	}
+
+	seed = (seed >> 16) + (seed << 16);
+	write_32b(seed, key);
+
+	return;
+}
+
+/* sub_roundtab[x] = sub_round(x, 0) */
+static bool sub_tab_init = 0;
+static uint16_t sub_roundtab[0x10000];
+
+static void init_sub_tab(void) {
+	uint32_t x;
+	for (x = 0; x < 0x10000; x++) {
+		sub_roundtab[x] = sub_round(x, 0);
+	}
+	sub_tab_init = 1;
+}
+
+void sub_genkey_batch(const uint32_t *seeds, uint32_t *keys, unsigned n) {
+	unsigned base;
+
+	if (!sub_tab_init) {
+		init_sub_tab();
+	}
+
+	for (base = 0; base < n; base += KEYALG_LANES) {
+		uint32_t s[KEYALG_LANES];
+		unsigned lanes = n - base;
+		unsigned l;
+		int ki;
+
+		if (lanes > KEYALG_LANES) {
+			lanes = KEYALG_LANES;
+		}
+		for (l = 0; l < KEYALG_LANES; l++) {
+			s[l] = (l < lanes) ? seeds[base + l] : 0;
+		}
+
+		for (ki = 15; ki >= 0; ki--) {
+			uint16_t rk = sub_keytogenerateindex[ki];
+			for (l = 0; l < KEYALG_LANES; l++) {
+				uint32_t lo = s[l] & 0xFFFF;
+				uint32_t hi = s[l] >> 16;
+				s[l] = (sub_roundtab[lo ^ rk] ^ hi) | (lo << 16);
+			}
+		}
+
+		for (l = 0; l < lanes; l++) {
+			keys[base + l] = (s[l] >> 16) | (s[l] << 16);
+		}
+	}
+}
+
+
+/************ Subaru payload encryption : 4 rounds of the sub_genkey round function, with other keys.
+ * It's a Feistel network, so decryption is the same rounds in reverse order.
+ */
+static const uint16_t sub_enckeys[]={
+	0x7856, 0xCE22, 0xF513, 0x6E86
+};
+
+void sub_encrypt(const uint8_t *datatoencrypt, uint8_t *encrypteddata) {
+	uint32_t data;
+	uint16_t wordtogenerateindex, wordtobeencrypted, encryptionkey;
+	int ki;
+
+	data = reconst_32(datatoencrypt);
+
+	for (ki = 0; ki < 4; ki++) {
+		wordtogenerateindex = data;
+		wordtobeencrypted = data >> 16;
+		encryptionkey = sub_round(wordtogenerateindex, sub_enckeys[ki]);
+		data = (uint16_t) (encryptionkey ^ wordtobeencrypted) | ((uint32_t) wordtogenerateindex << 16);
+	}
+
+	data = (data >> 16) | (data << 16);
+	write_32b(data, encrypteddata);
+	return;
+}
+
+void sub_decrypt(const uint8_t *encrypteddata, uint8_t *decrypteddata) {
+	uint32_t data;
+	uint16_t wordtogenerateindex, encryptedword;
+	int ki;
+
+	data = reconst_32(encrypteddata);
+	data = (data >> 16) | (data << 16);
+
+	for (ki = 3; ki >= 0; ki--) {
+		wordtogenerateindex = data >> 16;
+		encryptedword = data;
+		data = wordtogenerateindex |
+		       ((uint32_t) (uint16_t) (encryptedword ^ sub_round(wordtogenerateindex, sub_enckeys[ki])) << 16);
+	}
+
+	write_32b(data, decrypteddata);
+	return;
+}
+
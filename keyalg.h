@@ -0,0 +1,41 @@
+#ifndef KEYALG_H
+#define KEYALG_H
+
+/* SID 27 seed/key algorithms that don't depend on anything else (no diag stuff),
+ * and batch versions for testing / exploring lots of seeds.
+ */
+
+#include <stdint.h>
+
+
+/** Encrypt with the kline_at algo... niskey2.c
+ * writes 4 bytes in buffer *key , bigE
+ */
+void genkey2(const uint8_t *seed8, uint8_t *key);
+
+/** For Subaru, generates key from seed
+ * writes 4 bytes in buffer *key
+ */
+void sub_genkey(const uint8_t *seed8, uint8_t *key);
+
+/** For Subaru, encrypts data for upload
+ * writes 4 bytes in buffer *encrypteddata
+ */
+void sub_encrypt(const uint8_t *datatoencrypt, uint8_t *encrypteddata);
+
+/** Inverse of sub_encrypt()
+ * writes 4 bytes in buffer *decrypteddata
+ */
+void sub_decrypt(const uint8_t *encrypteddata, uint8_t *decrypteddata);
+
+
+/** Batch versions : keys[i] = algo(seeds[i]) for <n> seeds.
+ *
+ * Seeds and keys are plain u32 (seed 0x11223344 is what the ECU sends as 11 22 33 44),
+ * results are bit-identical to the scalar versions above.
+ * keys[] and seeds[] may be the same array.
+ */
+void genkey2_batch(const uint32_t *seeds, uint32_t *keys, unsigned n);
+void sub_genkey_batch(const uint32_t *seeds, uint32_t *keys, unsigned n);
+
+#endif
@@ -19,8 +19,11 @@
 #include "diag_l2.h"
 #include "diag_iso14230.h"  //for NRC decoding
 
-#include "nisprog.h"
+#include "keyalg.h"
 #include "nis_backend.h"
+#include "np_kcap.h"
+#include "np_progress.h"
+#include "np_stats.h"
 #include "nissutils/cli_utils/nislib.h"
 
 #define CURFILE "nis_backend.c" //HAAAX
@@ -29,9 +32,9 @@
 /** Decode negative response code into a short error string.
  *
  * rxdata[] must contain at least 3 bytes, "7F <SID> <NRC>"
- * returns a static char * that must not be free'd !
+ * returns a string in ns->nrcstr, that must not be free'd !
  */
-static const char *decode_nrc(uint8_t *rxdata);
+static const char *decode_nrc(struct np_session *ns, uint8_t *rxdata);
 
 
 
@@ -46,57 +49,14 @@ void genkey1(const uint8_t *seed8, uint32_t m, uint8_t *key) {
 
 
 
-/** Encrypt with the kline_at algo... niskey2.c
- * writes 4 bytes in buffer *key
- */
-static void genkey2(const uint8_t *seed8, uint8_t *key) {
-	uint32_t seed, ecx, xorloops;
-	int ki;
-
-	const uint32_t keytable[]={0x14FA3579, 0x27CD3964, 0x1777FE32, 0x9931AF12,
-		                       0x75DB3A49, 0x19294CAA, 0x0FF18CD76, 0x788236D,
-		                       0x5A6F7CBB, 0x7A992254, 0x0ADFD5414, 0x343CFBCB,
-		                       0x0C2F51639, 0x6A6D5813, 0x3729FF68, 0x22A2C751};
-
-	seed = reconst_32(seed8);
-
-	ecx = (seed & 1)<<6 | (seed>>9 & 1)<<4 | (seed>>1 & 1)<<3;
-	ecx |= (seed>>11 & 1)<<2 | (seed>>2 & 1)<<1 | (seed>>5 & 1);
-	ecx += 0x1F;
-
-	if (((int32_t) ecx) <= 0) {
-		printf("problem !!\n");
-		return;
-	}
-
-	ki = (seed & 1)<<3 | (seed>>1 & 1)<<2 | (seed>>2 & 1)<<1 | (seed>>9 & 1);
-
-	//printf("starting xorloop with ecx=0x%0X, ki=0x%0X\n", ecx, ki);
-
-	for (xorloops=0; xorloops < ecx; xorloops++) {
-		if (seed & 0x80000000) {
-			seed += seed;
-			seed ^= keytable[ki];
-		} else {
-			seed += seed;
-		}
-	}
-	//here, the generated key is in "seed".
-
-	write_32b(seed, key);
-
-	return;
-}
-
-
-int get_ecuid(u8 *dest) {
+int get_ecuid(struct np_session *ns, u8 *dest) {
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	uint8_t txdata[64]; //data for nisreq
 
 	int errval;
 
-	if (npstate == NP_DISC) {
+	if (ns->state == NP_DISC) {
 		printf("Not connected to ECU\nTry \"nc\" first\n");
 		return -1;
 	}
@@ -107,7 +67,7 @@ int get_ecuid(u8 *dest) {
 	txdata[0]=0x1A;
 	txdata[1]=0x81;
 	nisreq.len=2;
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -132,7 +92,7 @@ int get_ecuid(u8 *dest) {
  *
  * @return 0 if successful
  */
-int sid27_unlock(int keyalg, uint32_t scode) {
+int sid27_unlock(struct np_session *ns, int keyalg, uint32_t scode) {
 	uint8_t txdata[64]; //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
@@ -142,14 +102,14 @@ int sid27_unlock(int keyalg, uint32_t scode) {
 	txdata[1]=0x01; //RequestSeed
 	nisreq.len=2;
 	nisreq.data=txdata;
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
 	if ((rxmsg->len < 6) || (rxmsg->data[0] != 0x67)) {
 		printf("got bad 27 01 response : ");
 		if (rxmsg->data[0] == 0x7F) {
-			printf("%s\n", decode_nrc(rxmsg->data));
+			printf("%s\n", decode_nrc(ns, rxmsg->data));
 		} else {
 			diag_data_dump(stdout, rxmsg->data, rxmsg->len);
 			printf("\n");
@@ -176,14 +136,14 @@ int sid27_unlock(int keyalg, uint32_t scode) {
 	printf("\n");
 
 	nisreq.len=6; //27 02 K K K K
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
 	if (rxmsg->data[0] != 0x67) {
 		printf("got bad 27 02 response : ");
 		if (rxmsg->data[0] == 0x7F) {
-			printf("%s\n", decode_nrc(rxmsg->data));
+			printf("%s\n", decode_nrc(ns, rxmsg->data));
 		} else {
 			diag_data_dump(stdout, rxmsg->data, rxmsg->len);
 			printf("\n");
@@ -204,7 +164,7 @@ int sid27_unlock(int keyalg, uint32_t scode) {
  *
  * Assumes everything is ok (conn state, etc)
  */
-int sid3480(void) {
+int sid3480(struct np_session *ns) {
 	uint8_t txdata[64]; //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
@@ -215,7 +175,7 @@ int sid3480(void) {
 	nisreq.len=2;
 	nisreq.data=txdata;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -236,12 +196,12 @@ int sid3480(void) {
  * Caller must have encrypted the payload
  * ret 0 if ok
  */
-int sid36(uint8_t *buf, uint32_t len) {
+int sid36(struct np_session *ns, uint8_t *buf, uint32_t len) {
 	uint8_t txdata[64]; //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	int errval;
 	uint16_t blockno;
-	uint16_t maxblocks;
+	struct npprog pg;
 
 	len &= ~0x1F;
 	if (!buf || !len) {
@@ -249,7 +209,7 @@ int sid36(uint8_t *buf, uint32_t len) {
 	}
 
 	blockno = 0;
-	maxblocks = (len / 32) - 1;
+	npprog_start(&pg, &ns->prog, "kernel", 0, len);
 
 	txdata[0]=0x36;
 	//txdata[1] and [2] is the 16bit block #
@@ -266,46 +226,50 @@ int sid36(uint8_t *buf, uint32_t len) {
 		memcpy(&txdata[4], buf, 32);
 		buf += 32;
 
-		//rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
-		errval = diag_l2_send(global_l2_conn, &nisreq);
+		//rxmsg=diag_l2_request(ns->conn, &nisreq, &errval);
+		errval = np_l2_send(ns, &nisreq);
 		if (errval) {
 			printf("l2_send error!\n");
+			npprog_done(&pg, 0);
 			return -1;
 		}
 
-		errval = diag_l1_recv(global_l2_conn->diag_link->l2_dl0d, rxbuf, 3, 50);
+		errval = np_l1_recv(ns, rxbuf, 3, 50);
 		if (errval < 3) {
 			printf("no response @ blockno %X\n", (unsigned) blockno);
-			(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+			(void) diag_l2_ioctl(ns->conn, DIAG_IOCTL_IFLUSH, NULL);
+			npprog_done(&pg, 0);
 			return -1;
 		}
 
 		if (rxbuf[0] & 0x80) {
 			printf("Problem: ECU responding with long headers ?\n");
+			npprog_done(&pg, 0);
 			return -1;
 		}
 		if (rxbuf[1] != 0x76) {
 			printf("got bad 36 response : ");
 			if (rxbuf[1] == 0x7F) {
-				printf("%s\n", decode_nrc(&rxbuf[1]));
+				printf("%s\n", decode_nrc(ns, &rxbuf[1]));
 			} else {
 				diag_data_dump(stdout, rxbuf, errval);
 				printf("\n");
 			}
-			(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+			(void) diag_l2_ioctl(ns->conn, DIAG_IOCTL_IFLUSH, NULL);
+			npprog_done(&pg, 0);
 			return -1;
 		}
-		printf("\rSID36 block 0x%04X/0x%04X done",
-		       (unsigned) blockno, (unsigned) maxblocks);
-		fflush(stdout);
+		npwire_framing(ns, 2);	//FMT, cks of the response
+		npprog_update(&pg, (blockno + 1) * 32UL, (blockno + 1) * 32UL);
 	}
+	npprog_done(&pg, 1);
 	printf("\n");
 	fflush(stdout);
 	return 0;
 }
 
 //send SID 37 transferexit request, ret 0 if ok
-int sid37(uint16_t cks) {
+int sid37(struct np_session *ns, uint16_t cks) {
 	uint8_t txdata[64]; //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
@@ -321,7 +285,7 @@ int sid37(uint16_t cks) {
 	diag_data_dump(stdout, txdata, 3);
 	printf("\n");
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -329,7 +293,7 @@ int sid37(uint16_t cks) {
 	if (rxmsg->data[0] != 0x77) {
 		printf("got bad 37 response : ");
 		if (rxmsg->data[0] == 0x7F) {
-			printf("%s\n", decode_nrc(rxmsg->data));
+			printf("%s\n", decode_nrc(ns, rxmsg->data));
 		} else {
 			diag_data_dump(stdout, rxmsg->data, rxmsg->len);
 			printf("\n");
@@ -344,7 +308,7 @@ int sid37(uint16_t cks) {
 /* RAMjump, takes care of SIDs BF 00 + BF 01
  * ret 0 if ok
  */
-int sidBF(void) {
+int sidBF(struct np_session *ns) {
 	uint8_t txdata[64]; //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
@@ -356,7 +320,7 @@ int sidBF(void) {
 	nisreq.data=txdata;
 
 	/* BF 00 : RAMjumpCheck */
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -372,7 +336,7 @@ int sidBF(void) {
 
 	/* BF 01 : RAMjumpCheck */
 	txdata[1] = 1;
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -389,14 +353,12 @@ int sidBF(void) {
 }
 
 
-#define NRC_STRLEN 80   //too small and we get an assert() failure in smartcat() !!!
 /** Return string for neg response code
  *
  * rxdata must point to the data frame (no headers), i.e. 0x7F <SID> <NRC>
  */
-static const char *decode_nrc(uint8_t *rxdata) {
+static const char *decode_nrc(struct np_session *ns, uint8_t *rxdata) {
 	struct diag_msg tmsg;
-	static char descr[NRC_STRLEN]="";
 
 	u8 nrc = rxdata[2];
 
@@ -434,9 +396,9 @@ static const char *decode_nrc(uint8_t *rxdata) {
 		// 2) Try Standard ISO14230 NRC
 		tmsg.data = rxdata;
 		tmsg.len = 3;   //assume rxdata contains a "7F <SID> <NRC>" message
-		(void) diag_l3_iso14230_decode_response(&tmsg, descr, NRC_STRLEN);
-		return descr;
+		(void) diag_l3_iso14230_decode_response(&tmsg, ns->nrcstr, sizeof(ns->nrcstr));
+		return ns->nrcstr;
 		break;
 	}
-	return descr;
+	return ns->nrcstr;
 }
@@ -7,8 +7,10 @@
 
 #include <stdint.h>
 
+#include "np_session.h"
+
 /* *******
- * All this stuff assumes the current global state is correct and validated by the caller
+ * All this stuff assumes the session state is correct and validated by the caller
  */
 
 
@@ -27,7 +29,7 @@ void genkey1(const uint8_t *seed8, uint32_t m, uint8_t *key);
  *
  * Ret 0 if ok
  */
-int get_ecuid(uint8_t *dest);
+int get_ecuid(struct np_session *ns, uint8_t *dest);
 
 
 /** Attempt a SecurityAccess (SID 27), using selected algo.
@@ -38,7 +40,7 @@ int get_ecuid(uint8_t *dest);
  *
  * @return 0 if successful
  */
-int sid27_unlock(int keyalg, uint32_t scode);
+int sid27_unlock(struct np_session *ns, int keyalg, uint32_t scode);
 
 
 
@@ -47,7 +49,7 @@ int sid27_unlock(int keyalg, uint32_t scode);
  *
  * Assumes everything is ok (conn state, etc)
  */
-int sid3480(void);
+int sid3480(struct np_session *ns);
 
 
 /** transfer payload from *buf
@@ -55,21 +57,21 @@ int sid3480(void);
  * Caller must have encrypted the payload
  * ret 0 if ok
  */
-int sid36(uint8_t *buf, uint32_t len);
+int sid36(struct np_session *ns, uint8_t *buf, uint32_t len);
 
 
 
 /** send SID 37 transferexit request
  * ret 0 if ok
  */
-int sid37(uint16_t cks);
+int sid37(struct np_session *ns, uint16_t cks);
 
 
 
 /** RAMjump, takes care of SIDs BF 00 + BF 01
  * ret 0 if ok
  */
-int sidBF(void);
+int sidBF(struct np_session *ns);
 
 
 #endif
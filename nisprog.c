@@ -16,6 +16,7 @@
 
 
 //#include <stdlib.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #include "diag.h"
@@ -27,7 +28,7 @@
 extern const char *GIT_REV; //defined in auto-generated version.c
 
 FILE *dbg_stream=NULL;  //for nislib
-enum npstate_t npstate;
+struct np_session npsess;
 
 const struct cmd_tbl_entry np_cmdtable[];
 
@@ -37,26 +38,19 @@ const struct cmd_tbl_entry np_cmdtable[];
 static void do_usage (void) {
 	fprintf( stderr,    "nisprog utility for Nissan ECUs\n\n"
 	         "  Usage -\n"
-	         "	nisprog [-h] [-f <file]\n\n"
+	         "	nisprog [-h] [-b] [-f <file]\n\n"
 	         "  Where:\n"
 	         "\t-h   -- Display this help message\n"
+	         "\t-b   -- Batch mode : never prompt, see \"npconf batch\"\n"
 	         "\t-f <file> Runs the commands from <file> at startup\n"
 	         "\n" );
 }
 
-void nisecu_cleardata(struct nisecu_t *pne) {
-	sprintf((char *) pne->ecuid, "UNK");
-	pne->keyset = NULL;
-	pne->flashdev = NULL;
-	return;
-}
-
 /** ret 0 if ok */
 static int np_init(void) {
 	int rv;
 
-	npstate = NP_DISC;
-	nisecu_cleardata(&nisecu);
+	np_session_init(&npsess);
 
 	rv = diag_init();
 	if (rv != 0) {
@@ -70,6 +64,7 @@ static int np_init(void) {
 int main(int argc, char **argv) {
 	int i;
 	const char *startfile=NULL; /* optional commands to run at startup */
+	bool batch = 0;
 	dbg_stream = stdout;
 
 	for ( i = 1 ; i < argc ; i++ ) {
@@ -84,6 +79,9 @@ int main(int argc, char **argv) {
 					goto badexit;
 				}
 				break;
+			case 'b':
+				batch = 1;
+				break;
 			case 'h': do_usage(); goto goodexit;
 			default: do_usage(); goto badexit;
 			}
@@ -97,6 +95,7 @@ int main(int argc, char **argv) {
 		printf("Problem in np_init() !?\n");
 		goto badexit;
 	}
+	npsess.batch = batch;
 
 	printf("\n**************** %s v%s-%s ****************\n", NP_PROGNAME, NP_VERSION, GIT_REV);
 	printf("%s: Type HELP for a list of commands; \"debug ?\" to show debugging options.\n", NP_PROGNAME);
@@ -117,13 +116,14 @@ const struct cmd_tbl_entry np_cmdtable[] =
 {
 	{ "spconn", "spconn", "Connect to Subaru ECU with current parameters",
 	  cmd_spconn, 0, NULL},
-	{ "npconn", "npconn", "Connect to ECU with current parameters",
+	{ "npconn", "npconn [--noprobe]", "Connect to ECU with current parameters. Reattaches to a running kernel if one answers, unless --noprobe",
 	  cmd_npconn, 0, NULL},
-	{ "nc", "nc", "Connect to ECU with current parameters",
+	{ "nc", "nc [--noprobe]", "Connect to ECU with current parameters",
 	  cmd_npconn, CLI_CMD_HIDDEN, NULL},
-	{ "npdisc", "npdisc", "Disconnect from ECU (does not reset the ECU if running a kernel)",
+	{ "npdisc", "npdisc [--stop | --keep]", "Disconnect from ECU. If a kernel is running, asks whether to stop it first,\n"
+	  "\tunless --stop (reset the ECU) or --keep (leave the kernel running) is given. Batch mode default : --stop\n",
 	  cmd_npdisc, 0, NULL},
-	{ "nd", "nd", "Disconnect from ECU (does not reset the ECU if running a kernel)",
+	{ "nd", "nd [--stop | --keep]", "(see \"npdisc\")",
 	  cmd_npdisc, CLI_CMD_HIDDEN, NULL},
 	{ "npconf", "npconf <paramname> <value>", "Set some extra parameters",
 	  cmd_npconf, 0, NULL},
@@ -131,20 +131,54 @@ const struct cmd_tbl_entry np_cmdtable[] =
 	  cmd_setdev, 0, NULL},
 	{ "gk", "gk", "Attempt to guess keyset",
 	  cmd_guesskey, 0, NULL},
+	{ "romkeys", "romkeys <romfile>", "Search a ROM dump for known keysets (no connection required)",
+	  cmd_romkeys, 0, NULL},
 	{ "writevin", "writevin <vin>", "Writes the VIN to EEPROM.",
 	  cmd_writevin, 0, NULL},
 	{ "setkeys", "setkeys <sid27_key> [<sid36_key>]", "Set ECU keys. Specifying the SID 36 key is optional if the SID 27 key is a known keyset.\n"
 	  "Please consider submitting new keys to be added to the list !\n",
 	  cmd_setkeys, 0, NULL},
-	{ "kspeed", "kspeed <new_speed>", "Change kernel comms speed and reinitialize kernel; Recommended <new_speed> values: 62500, 31250, 25000.",
+	{ "keydb", "keydb [<file>]", "Load a local list of confirmed \"ECUID,sid27_key\" pairs, used for keyset selection.\n"
+	  "Keysets confirmed by \"runkernel\" are appended to that file.\n",
+	  cmd_keydb, 0, NULL},
+	{ "keybatch", "keybatch <in.csv> <out.csv>", "Find keysets for a list of ECUIDs (first column of <in.csv>), offline.\n",
+	  cmd_keybatch, 0, NULL},
+	{ "ecucache", "ecucache [<file> | off]", "Use <file> to remember, per ECUID, the device type, confirmed keyset, npconf settings\n"
+	  "and kernel ID that worked. They are restored as soon as the same ECU is connected again.\n",
+	  cmd_ecucache, 0, NULL},
+	{ "kcap", "kcap [<file> | off]", "Capture all K-line traffic to <file> (replay with klreplay), or stop capturing",
+	  cmd_kcap, 0, NULL},
+	{ "progress", "progress [<file> | fd:<n> | off]", "Write JSON-lines progress events (start, progress, retry, done) of dumps,\n"
+	  "flash writes and kernel uploads to <file> (appended) or to an already open file descriptor.",
+	  cmd_progress, 0, NULL},
+	{ "trace", "trace [<file> | off | dump]", "The last messages are always kept in memory, and appended to a file (default \"nptrace.txt\")\n"
+	  "when a dump / flash / kernel command fails. Set that file, disable writing it, or print the messages now.",
+	  cmd_trace, 0, NULL},
+	{ "stats", "stats [clear | export <file>]", "Show timing percentiles (TX, time to first byte, frame, flush/retry) of dumps,\n"
+	  "CRC compares and flash writes since startup or \"stats clear\"; export histograms as CSV.\n"
+	  "Also shows bytes on the wire vs payload, and idle line time, per command.",
+	  cmd_stats, 0, NULL},
+	{ "kspeed", "kspeed <new_speed> | auto [<min_speed>]", "Change kernel comms speed and reinitialize kernel; Recommended <new_speed> values: 62500, 31250, 25000. \"auto\" tries speeds from fastest to slowest and keeps the fastest reliable one.",
 	  cmd_kspeed, 0, NULL},
+	{ "tune", "tune [--noadapt]", "Measure response times and set the smallest safe p3 and rxe. Unless --noadapt,\n"
+	  "they are then adjusted on timeouts during long operations (npconf autotune).",
+	  cmd_tune, 0, NULL},
 	{ "sprunkernel", "sprunkernel <file>", "Send + run specified kernel [Subaru]",
 	  cmd_sprunkernel, 0, NULL},
 	{ "runkernel", "runkernel <file>", "Send + run specified kernel [Nissan]",
 	  cmd_runkernel, 0, NULL},
 	{ "stopkernel", "stopkernel", "Disconnects + resets the ECU to exit kernel",
 	  cmd_stopkernel, 0, NULL},
-	{ "watch", "watch <addr>", "Watch 4 bytes @ <addr>",
+	{ "watch", "watch <addr> | <varlist> [<outfile>] [--bin] [--gap=<n>] [--count=<n>]\n"
+	  "\t[--trig=<expr> [--pre=<n>] [--post=<n>]]",
+	  "Watch 4 bytes @ <addr> (decimal, or hex with 0x or $), or log a list of RAM variables to a CSV\n"
+	  "\t(or binary) file. An existing file is always taken as a variable list.\n"
+	  "\t<varlist> has one \"<name> <addr> <u8|s8|u16|s16|u32|s32> [<scale> [<offset>]]\" per line.\n"
+	  "\t--gap : max unused bytes between variables read in one npkern request\n"
+	  "\t(default : the cost of one more request, from kspeed and p3)\n"
+	  "\t--count : stop after <n> samples (<n> captures with --trig) instead of waiting for Enter\n"
+	  "\t--trig : only write the <pre> samples up to and <post> samples after the moment\n"
+	  "\t<expr> (\"<name><op><value>\", op one of > < >= <= == != &) becomes true. Default 100 each\n",
 	  cmd_watch, 0, NULL},
 	{ "initk", "initk", "Initialize an already-running kernel",
 	  cmd_initk, 0, NULL},
@@ -156,18 +190,29 @@ const struct cmd_tbl_entry np_cmdtable[] =
 	  cmd_dumpmem, 0, NULL},
 	{ "dm", "dm <file> <start> <#_of_bytes> [eep]", "(see \"dumpmem\")",
 	  cmd_dumpmem, CLI_CMD_HIDDEN, NULL},
+	{ "ramsnap", "ramsnap <file> [--every=<ms>] [--count=<n>] [--addr=<addr>] [--len=<len>]\n"
+	  "\tramsnap extract <file> <n> <binfile>",
+	  "Snapshot RAM (0xFFFF8000-0xFFFFFFFF by default) into a delta-compressed series file,\n"
+	  "\tonce, or every <ms> until Enter or <n> snapshots. Needs the kernel.\n"
+	  "\t\"extract\" writes snapshot #<n> (from 0) of a series file as a raw binary.\n",
+	  cmd_ramsnap, 0, NULL},
 	{ "flverif", "flverif <file>", "Compare <file> against ROM",
 	  cmd_flverif, 0, NULL},
-	{ "flblock", "flblock <romfile> <blockno> [Y]", "Reflash a single block from <romfile>. "
+	{ "flblock", "flblock <romfile> <blockno> [Y] [--yes]", "Reflash a single block from <romfile>. "
 	  "If 'Y' is absent, this runs in \"practice\" mode (without modifying flash ROM).\n"
+	  "--yes : same as 'Y', without the 3 second \"last chance\". In batch mode, only --yes writes flash.\n"
 	  "ex.: \"flblock wholerom.bin 15 Y\"\n",
 	  cmd_flblock, 0, NULL},
-	{ "flrom", "flrom <romfile> [<orig_rom>]", "Reflash a new ROM from <romfile>. "
+	{ "flrom", "flrom <romfile> [<orig_rom>] [--yes] [--mode=changed|full|practice]", "Reflash a new ROM from <romfile>. "
 	  "If <orig_rom> is specified, it is used to select which blocks to reflash instead of the normal CRC comparison.\n"
-	  "ex.: \"flrom newrom.bin\"\n",
+	  "--mode answers the prompt : modified blocks, all blocks, or dry run. --yes alone means --mode=changed.\n"
+	  "In batch mode, flrom without --yes / --mode does nothing.\n"
+	  "ex.: \"flrom newrom.bin\", \"flrom newrom.bin --mode=practice\"\n",
 	  cmd_flrom, 0, NULL},
 	{ "npt", "npt [testnum]", "temporary / testing commands. Refer to source code",
 	  cmd_npt, 0, NULL},
+	{ "keytest", "keytest [<count>]", "Compare the speed of the batch SID27 key algorithms and the reference versions",
+	  cmd_keytest, 0, NULL},
 	CLI_TBL_END
 };
 
@@ -4,37 +4,10 @@
 #include <stdint.h>
 
 #include "libcli.h"
+#include "np_session.h"
 
-/* state of connection to ECU */
-enum npstate_t {
-	NP_DISC,	/** disconnected */
-	NP_NORMALCONN, /** normal connection to stock firmware */
-	NP_NPKCONN /** kernel connection to npkern */
-};
-
-extern enum npstate_t npstate;
-
-enum ecutype_t {
-	NISECU_UNK,
-	NISECU_7055_35,	/** old 350nm part */
-	NISECU_7055_18,	/** 180nm */
-	NISECU_7058
-	};
-
-struct nisecu_t {
-	//enum ecutype_t ecutype;	/** decides which flashblock descriptor to use etc */
-	uint8_t ecuid[6];		/** ASCIIz */
-
-	const void *keyset;	/** keyset to use */
-	const void *flashdev;	/** device descriptor */
-
-};
-
-extern struct nisecu_t nisecu;
-
-
-/* public funcs */
-void nisecu_cleardata(struct nisecu_t *pne);
+/* the CLI's session : connection state, ECU and tunables. See np_session.h */
+extern struct np_session npsess;
 
 
 /***** CLI command handlers */
@@ -43,14 +16,25 @@ enum cli_retval cmd_npdisc(int argc, char **argv);
 enum cli_retval cmd_npconf(int argc, char **argv);
 enum cli_retval cmd_setdev(int argc, char **argv);
 enum cli_retval cmd_guesskey(int argc, char **argv);
+enum cli_retval cmd_romkeys(int argc, char **argv);
 enum cli_retval cmd_setkeys(int argc, char **argv);
+enum cli_retval cmd_keydb(int argc, char **argv);
+enum cli_retval cmd_keybatch(int argc, char **argv);
+enum cli_retval cmd_kcap(int argc, char **argv);
+enum cli_retval cmd_stats(int argc, char **argv);
+enum cli_retval cmd_progress(int argc, char **argv);
+enum cli_retval cmd_trace(int argc, char **argv);
+enum cli_retval cmd_ecucache(int argc, char **argv);
+enum cli_retval cmd_keytest(int argc, char **argv);
 enum cli_retval cmd_kspeed(int argc, char **argv);
+enum cli_retval cmd_tune(int argc, char **argv);
 enum cli_retval cmd_runkernel(int argc, char **argv);
 enum cli_retval cmd_stopkernel(int argc, char **argv);
 enum cli_retval cmd_writevin(int argc, char** argv);
 enum cli_retval cmd_initk(int argc, char **argv);
 enum cli_retval cmd_dumpmem(int argc, char **argv);
 enum cli_retval cmd_watch(int argc, char **argv);
+enum cli_retval cmd_ramsnap(int argc, char **argv);
 enum cli_retval cmd_flverif(int argc, char **argv);
 enum cli_retval cmd_flblock(int argc, char **argv);
 enum cli_retval cmd_flrom(int argc, char **argv);
@@ -28,7 +28,18 @@
 #include "scantool_cli.h"
 
 #include "nisprog.h"
+#include "keyalg.h"
 #include "nis_backend.h"
+#include "np_ecucache.h"
+#include "np_kcap.h"
+#include "np_keydb.h"
+#include "np_progress.h"
+#include "np_rdplan.h"
+#include "np_snap.h"
+#include "np_stats.h"
+#include "np_trace.h"
+#include "np_tune.h"
+#include "np_watch.h"
 #include "npk_backend.h"
 #include "ssm_backend.h"
 #include "nissutils/cli_utils/nislib.h"
@@ -37,14 +48,12 @@
 
 #define CURFILE "np_cli.c"  //XXXXX TODO: fix VS automagic macro setting
 
-#define NPK_SPEED 62500 //bps default speed for npkern kernel
-
 
 typedef long nparam_val;    //type of .val member
 
 /** simpler parameter unit than diag_cfgi */
 struct nparam_t {
-	long val;
+	nparam_val *val;	//in npsess
 	const char *shortname;
 	const char *descr;
 	long min;
@@ -52,26 +61,31 @@ struct nparam_t {
 };
 
 
-static struct nparam_t nparam_p3 = {.val = 5, .shortname = "p3", .descr = "P3 time before new request (ms)",
+static struct nparam_t nparam_p3 = {.val = &npsess.p3, .shortname = "p3", .descr = "P3 time before new request (ms)",
 	                                .min = 0, .max = 500};
-static struct nparam_t nparam_rxe = {.val = 20, .shortname = "rxe", .descr = "Read timeout offset. Adjust to eliminate timeout errors",
+static struct nparam_t nparam_rxe = {.val = &npsess.rxe, .shortname = "rxe", .descr = "Read timeout offset. Adjust to eliminate timeout errors",
 	                                 .min = -20, .max = 500};
-static struct nparam_t nparam_eepr = {.val = 0, .shortname = "eepr", .descr = "eeprom_read() function address",
+static struct nparam_t nparam_eepr = {.val = &npsess.eepr, .shortname = "eepr", .descr = "eeprom_read() function address",
 	                                  .min = 0, .max = 2048L * 1024};
-static struct nparam_t nparam_kspeed = {.val = NPK_SPEED, .shortname = "kspeed", .descr = "kernel comms speed used by \"initk\" command",
+static struct nparam_t nparam_kspeed = {.val = &npsess.kspeed, .shortname = "kspeed", .descr = "kernel comms speed used by \"initk\" command",
 	                                    .min = 100, .max = 65000};
+static struct nparam_t nparam_batch = {.val = &npsess.batch, .shortname = "batch", .descr = "1 : never prompt (flrom, flblock, npdisc); print RESULT lines",
+	                                   .min = 0, .max = 1};
+static struct nparam_t nparam_autotune = {.val = &npsess.autotune, .shortname = "autotune", .descr = "1 : raise p3 / rxe on read timeouts, lower rxe when stable (see \"tune\")",
+	                                      .min = 0, .max = 1};
 static struct nparam_t *nparams[] = {
 	&nparam_p3,
 	&nparam_rxe,
 	&nparam_eepr,
 	&nparam_kspeed,
+	&nparam_batch,
+	&nparam_autotune,
 	NULL
 };
 
-struct nisecu_t nisecu;
-
 /** some static data for in here only */
 static struct keyset_t customkey;
+static char cache_id[ECUCACHE_IDLEN + 1];	//ECUID of the connected ECU, as used by the ECU cache; "" if none
 
 /** fwd decls **/
 static int npkern_init(void);
@@ -80,6 +94,8 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len);
 static uint32_t read_ac(uint8_t *dest, uint32_t addr, uint32_t len);
 static int npk_RMBA(uint8_t *dest, uint32_t addr, uint32_t len);
 static bool set_keyset(u32 s27k);
+static void cache_note(u32 s27k, const char *npk_id);
+static void np_disconnect(void);
 
 
 
@@ -88,13 +104,100 @@ static bool set_keyset(u32 s27k);
  * and therefore doesn't need to be handled in here
  */
 static void update_params(void) {
-	if (global_l2_conn) {
-		global_l2_conn->diag_l2_p3min = (u16) nparam_p3.val;
-		global_l2_conn->diag_l2_p4min=0;
+	if (npsess.conn) {
+		npsess.conn->diag_l2_p3min = (u16) npsess.p3;
+		npsess.conn->diag_l2_p4min=0;
 	}
 	return;
 }
 
+/** raw read of <len> bytes with the rxe timeout; the timing is reported to the autotuner,
+ * and to the <op> statistics (NPSTAT_NONE for the rest of a partially read response).
+ * @return same as np_l1_recv()
+ */
+static int np_rawrecv(enum npstat_op op, void *dest, size_t len) {
+	unsigned long t0 = diag_os_getms();
+	int rv;
+
+	rv = npstat_recv(&npsess, op, dest, len, (unsigned) (NPTUNE_RXBASE + npsess.rxe));
+	if (nptune_rx(&npsess, diag_os_getms() - t0, len, rv)) {
+		update_params();
+	}
+	return rv;
+}
+
+/** "--name" or "--name=value" command option */
+struct npflag {
+	const char *name;	//without "--"
+	const char *val;	//NULL if absent; "" for "--name"
+};
+
+/** take --options out of argv[], leaving the positional args in order.
+ * flags[] ends with a NULL name.
+ *
+ * @return new argc, or -1 if an unknown option was found
+ */
+static int take_flags(int argc, char **argv, struct npflag *flags) {
+	int in, out;
+
+	for (in = 1, out = 1; in < argc; in++) {
+		const char *arg = argv[in];
+		struct npflag *fl;
+
+		if (strncmp(arg, "--", 2) != 0) {
+			argv[out++] = argv[in];
+			continue;
+		}
+		arg += 2;
+		for (fl = flags; fl->name; fl++) {
+			size_t nlen = strlen(fl->name);
+			if (strncmp(arg, fl->name, nlen) != 0) {
+				continue;
+			}
+			if (arg[nlen] == 0) {
+				fl->val = "";
+				break;
+			}
+			if (arg[nlen] == '=') {
+				fl->val = &arg[nlen + 1];
+				break;
+			}
+		}
+		if (!fl->name) {
+			printf("unknown option \"%s\"\n", argv[in]);
+			return -1;
+		}
+	}
+	return out;
+}
+
+/** in batch mode, print a line for scripts : "RESULT <cmd> <status> [<details>]"
+ * status is one of ok, fail, aborted; details are key=value pairs.
+ */
+static void np_result(const char *cmd, const char *status, const char *details) {
+	if (!npsess.batch) {
+		return;
+	}
+	printf("RESULT %s %s%s%s\n", cmd, status, (details && *details) ? " " : "", details ? details : "");
+}
+
+/** write "3,15" (or "none") for the set flags */
+static void fmt_blocklist(char *dest, size_t len, const bool *block_modified, unsigned numblocks) {
+	unsigned blockno;
+	size_t used = 0;
+
+	dest[0] = 0;
+	for (blockno = 0; blockno < numblocks; blockno++) {
+		if (block_modified[blockno] && (used < len)) {
+			used += (size_t) snprintf(&dest[used], len - used, "%s%u", used ? "," : "", blockno);
+		}
+	}
+	if (!used) {
+		snprintf(dest, len, "none");
+	}
+}
+
+
 /* npconf <paramname> <value>
  */
 enum cli_retval cmd_npconf(int argc, char **argv) {
@@ -117,7 +220,7 @@ enum cli_retval cmd_npconf(int argc, char **argv) {
 	for (i = 0; nparams[i]; i++) {
 		npt = nparams[i];
 		if (helping) {
-			printf("%s\t%ld\t%s\n", npt->shortname, npt->val, npt->descr);
+			printf("%s\t%ld\t%s\n", npt->shortname, *npt->val, npt->descr);
 			continue;
 		}
 		if (strcmp(npt->shortname, argv[1]) == 0) {
@@ -138,7 +241,7 @@ enum cli_retval cmd_npconf(int argc, char **argv) {
 	if (argc == 2) {
 		//no new value : just print current setting
 		printf("%s is currently %ld (0x%lX)\n", npt->shortname,
-		       npt->val, npt->val);
+		       *npt->val, *npt->val);
 		return CMD_OK;
 	}
 
@@ -149,20 +252,21 @@ enum cli_retval cmd_npconf(int argc, char **argv) {
 		       (long) tempval, (long) tempval);
 		return CMD_FAILED;
 	}
-	npt->val = tempval;
+	*npt->val = tempval;
 	update_params();
-	printf("\t%s set to %ld (0x%lX).\n", argv[1], npt->val, npt->val);
+	cache_note(0, NULL);
+	printf("\t%s set to %ld (0x%lX).\n", argv[1], *npt->val, *npt->val);
 	return CMD_OK;
 }
 
 
 /* "dumpmem <file> <start> <len> [eep]" */
-enum cli_retval cmd_dumpmem(int argc, char **argv) {
+static enum cli_retval dumpmem(int argc, char **argv) {
 	u32 start, len;
 	FILE *fpl;
 	bool eep = 0;
 
-	if (npstate == NP_DISC) {
+	if (npsess.state == NP_DISC) {
 		printf("Not connected !\n");
 		return CMD_FAILED;
 	}
@@ -174,15 +278,15 @@ enum cli_retval cmd_dumpmem(int argc, char **argv) {
 	if (argc == 5) {
 		if (strcmp("eep", argv[4]) == 0) {
 			eep = 1;
-			if (npstate != NP_NPKCONN) {
+			if (npsess.state != NP_NPKCONN) {
 				printf("Kernel must be running for reading EEPROM. Try \"runkernel\" or \"initk\"\n");
 				return CMD_FAILED;
 			}
-			if (!nparam_eepr.val) {
+			if (!npsess.eepr) {
 				printf("Must set eeprom read function address first ! See \"npconf ?\"\n");
 				return CMD_FAILED;
 			}
-			if (set_eepr_addr((u32) nparam_eepr.val)) {
+			if (set_eepr_addr(&npsess, (u32) npsess.eepr)) {
 				printf("could not set eep_read() address!\n");
 				return CMD_FAILED;
 			}
@@ -204,7 +308,7 @@ enum cli_retval cmd_dumpmem(int argc, char **argv) {
 
 	if ((start == len) && (start == 0)) {
 		//special mode : dump all ROM as specified by device type.
-		const struct flashdev_t *fdt = nisecu.flashdev;
+		const struct flashdev_t *fdt = npsess.ecu.flashdev;
 		if (!fdt) {
 			printf("device type not set. Try setdev, or specify bounds manually.\n");
 			fclose(fpl);
@@ -215,7 +319,7 @@ enum cli_retval cmd_dumpmem(int argc, char **argv) {
 
 	/* Dispatch according to current state */
 
-	if (npstate == NP_NPKCONN) {
+	if (npsess.state == NP_NPKCONN) {
 		if (npk_dump(fpl, start, len, eep)) {
 			fclose(fpl);
 			return CMD_FAILED;
@@ -223,7 +327,7 @@ enum cli_retval cmd_dumpmem(int argc, char **argv) {
 		fclose(fpl);
 		return CMD_OK;
 	}
-	// npstate == NP_NORMALCONN:
+	// npsess.state == NP_NORMALCONN:
 	if (dump_fast(fpl, start, len)) {
 		fclose(fpl);
 		return CMD_FAILED;
@@ -232,14 +336,40 @@ enum cli_retval cmd_dumpmem(int argc, char **argv) {
 	return CMD_OK;
 }
 
+enum cli_retval cmd_dumpmem(int argc, char **argv) {
+	enum cli_retval rv;
+
+	npwire_begin(&npsess, "dumpmem");
+	rv = dumpmem(argc, argv);
+	npwire_end(&npsess);
+	return rv;
+}
+
 #define KEY_CANDIDATES 3
 #define KEY_MAXDIST 10  //do not use keys that are way off
+#define KEYDB_MAXDIST 2	//edit distance, for local keydb matches
 void autoselect_keyset(void) {
 	unsigned i;
 	u32 s27k;
 	struct ecuid_keymatch_t kcs[KEY_CANDIDATES];
+	struct keydb_match kdm[KEY_CANDIDATES];
+	unsigned kdcnt;
+
+	kdcnt = keydb_query((const char *) npsess.ecu.ecuid, kdm, KEY_CANDIDATES, KEYDB_MAXDIST);
+	if (kdcnt) {
+		printf("keydb candidate\tdist\tECUID\n");
+		for (i = 0; i < kdcnt; i++) {
+			printf("%u: 0x%08lX\t%u\t%s\n", i, (unsigned long) kdm[i].s27k, kdm[i].dist, kdm[i].ecuid);
+		}
+		printf("\n");
+		if ((kdm[0].dist == 0) && set_keyset(kdm[0].s27k)) {
+			printf("Using exact keydb match, SID27 key=%08lX. Use \"setkeys\" to change if required.\n",
+			       (unsigned long) kdm[0].s27k);
+			return;
+		}
+	}
 
-	ecuid_getkeys((const char *) nisecu.ecuid, kcs, KEY_CANDIDATES);
+	ecuid_getkeys((const char *) npsess.ecu.ecuid, kcs, KEY_CANDIDATES);
 
 	printf("Key candidate\tdist (smaller is better)\n");
 	for (i = 0; i < KEY_CANDIDATES; i++) {
@@ -263,11 +393,99 @@ void autoselect_keyset(void) {
 	return;
 }
 
+/** restore what the ECU cache knows about the connected ECU.
+ * @return 1 if a confirmed keyset was restored, i.e. no need to guess one
+ */
+static bool cache_restore(void) {
+	const struct ecucache_ent *ent;
+	bool gotkey = 0;
+	unsigned idx;
+
+	if (!cache_id[0]) {
+		return 0;
+	}
+	ent = ecucache_get(cache_id);
+	if (!ent) {
+		return 0;
+	}
+
+	printf("ECU cache : known ECU, restoring");
+	for (idx = 0; ent->dev[0] && flashdevices[idx].name; idx++) {
+		if (strcmp(flashdevices[idx].name, ent->dev) == 0) {
+			npsess.ecu.flashdev = &flashdevices[idx];
+			printf(" dev=%s", ent->dev);
+			break;
+		}
+	}
+	if (ent->s27k && set_keyset(ent->s27k)) {
+		printf(" s27k=%08lX", (unsigned long) ent->s27k);
+		gotkey = 1;
+	}
+	if (ent->kspeed != ECUCACHE_UNKNOWN) {
+		npsess.kspeed = ent->kspeed;
+		printf(" kspeed=%ld", ent->kspeed);
+	}
+	if (ent->p3 != ECUCACHE_UNKNOWN) {
+		npsess.p3 = ent->p3;
+		printf(" p3=%ld", ent->p3);
+	}
+	if (ent->rxe != ECUCACHE_UNKNOWN) {
+		npsess.rxe = ent->rxe;
+		printf(" rxe=%ld", ent->rxe);
+	}
+	if (ent->eepr != ECUCACHE_UNKNOWN) {
+		npsess.eepr = ent->eepr;
+		printf(" eepr=0x%lX", ent->eepr);
+	}
+	printf("\n");
+	if (ent->npk_id[0]) {
+		printf("\tlast kernel : %s\n", ent->npk_id);
+	}
+	update_params();
+	return gotkey;
+}
+
+/** record what works with the connected ECU : device, tunables, and optionally
+ * @param s27k : SID27 key confirmed by a kernel upload; 0 to keep the cached one
+ * @param npk_id : kernel ID; NULL to keep the cached one
+ */
+static void cache_note(u32 s27k, const char *npk_id) {
+	const struct flashdev_t *fdt = npsess.ecu.flashdev;
+	const struct ecucache_ent *old;
+	struct ecucache_ent ent;
+
+	if (!cache_id[0] || !ecucache_file()) {
+		return;
+	}
+	old = ecucache_get(cache_id);
+	if (old) {
+		ent = *old;
+	} else {
+		ecucache_newent(&ent, cache_id);
+	}
+	if (fdt) {
+		snprintf(ent.dev, sizeof(ent.dev), "%s", fdt->name);
+	}
+	if (s27k) {
+		ent.s27k = s27k;
+	}
+	ent.kspeed = npsess.kspeed;
+	ent.p3 = npsess.p3;
+	ent.rxe = npsess.rxe;
+	if (npsess.eepr) {
+		ent.eepr = npsess.eepr;
+	}
+	if (npk_id) {
+		snprintf(ent.npk_id, sizeof(ent.npk_id), "%s", npk_id);
+	}
+	(void) ecucache_update(&ent);
+}
+
 /* setdev <device_#> */
 enum cli_retval cmd_setdev(int argc, char **argv) {
 	bool helping = 0;
 	unsigned idx;
-	const struct flashdev_t *fdt = nisecu.flashdev;
+	const struct flashdev_t *fdt = npsess.ecu.flashdev;
 
 	if (argc != 2) {
 		if (fdt) {
@@ -287,8 +505,9 @@ enum cli_retval cmd_setdev(int argc, char **argv) {
 			continue;
 		}
 		if (strcmp(flashdevices[idx].name, argv[1]) == 0) {
-			nisecu.flashdev = &flashdevices[idx];
+			npsess.ecu.flashdev = &flashdevices[idx];
 			printf("now using %s.\n", flashdevices[idx].name);
+			cache_note(0, NULL);
 			return CMD_OK;
 		}
 	}
@@ -318,7 +537,7 @@ enum cli_retval cmd_setkeys(int argc, char **argv) {
 	if (argc == 3) {
 		// use specified keys : don't lookup in known_keys[]
 		customkey.s36k1 = (u32) htoi(argv[2]);
-		nisecu.keyset = &customkey;
+		npsess.ecu.keyset = &customkey;
 		goto goodexit;
 	}
 
@@ -330,13 +549,302 @@ enum cli_retval cmd_setkeys(int argc, char **argv) {
 	return CMD_FAILED;
 
 goodexit:
-	pks = nisecu.keyset;
+	pks = npsess.ecu.keyset;
 	printf("Now using SID27 key=%08lX, SID36 key1=%08lX\n",
 	       (unsigned long) pks->s27k, (unsigned long) pks->s36k1);
 	return CMD_OK;
 }
 
 
+/* keydb [<file>] : load local ECUID,s27k list */
+enum cli_retval cmd_keydb(int argc, char **argv) {
+	int cnt;
+
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 1) {
+		printf("keydb has %u entries.\n", keydb_count());
+		return CMD_OK;
+	}
+	if (argv[1][0] == '?') {
+		return CMD_USAGE;
+	}
+
+	cnt = keydb_load(argv[1]);
+	if (cnt < 0) {
+		return CMD_FAILED;
+	}
+	printf("Loaded %d entries from %s; keysets used by successful \"runkernel\" will be added to it.\n",
+	       cnt, argv[1]);
+	return CMD_OK;
+}
+
+
+/* ecucache [<file> | off] */
+enum cli_retval cmd_ecucache(int argc, char **argv) {
+	int cnt;
+
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 1) {
+		if (ecucache_file()) {
+			printf("ECU cache %s has %u entries.\n", ecucache_file(), ecucache_count());
+		} else {
+			printf("no ECU cache.\n");
+		}
+		return CMD_OK;
+	}
+	if (argv[1][0] == '?') {
+		return CMD_USAGE;
+	}
+	if (strcmp(argv[1], "off") == 0) {
+		ecucache_clear();
+		return CMD_OK;
+	}
+
+	cnt = ecucache_load(argv[1]);
+	if (cnt < 0) {
+		return CMD_FAILED;
+	}
+	printf("Loaded %d ECUs from %s; settings that work will be saved to it.\n", cnt, argv[1]);
+	if (cache_id[0]) {
+		/* already connected : use it now */
+		(void) cache_restore();
+	}
+	return CMD_OK;
+}
+
+/* kcap [<file> | off] : capture all K-line traffic to <file> */
+enum cli_retval cmd_kcap(int argc, char **argv) {
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 1) {
+		printf("capture %s\n", np_kcap_active(&npsess) ? "running" : "stopped");
+		return CMD_OK;
+	}
+	if (argv[1][0] == '?') {
+		return CMD_USAGE;
+	}
+	if (strcmp(argv[1], "off") == 0) {
+		printf("capture stopped, %lu records\n", np_kcap_stop(&npsess));
+		return CMD_OK;
+	}
+	if (np_kcap_start(&npsess, argv[1])) {
+		return CMD_FAILED;
+	}
+	np_kcap_note(&npsess, "kcap start");
+	printf("capturing to %s; \"kcap off\" to stop.\n", argv[1]);
+	return CMD_OK;
+}
+
+
+/* progress [<file> | fd:<n> | off] */
+enum cli_retval cmd_progress(int argc, char **argv) {
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 1) {
+		printf("progress events : %s\n", npprog_dest(&npsess.prog) ? npprog_dest(&npsess.prog) : "off");
+		return CMD_OK;
+	}
+	if (argv[1][0] == '?') {
+		return CMD_USAGE;
+	}
+	if (strcmp(argv[1], "off") == 0) {
+		npprog_close(&npsess.prog);
+		return CMD_OK;
+	}
+	if (npprog_open(&npsess.prog, argv[1])) {
+		printf("can't open %s\n", argv[1]);
+		return CMD_FAILED;
+	}
+	printf("progress events to %s; \"progress off\" to stop.\n", argv[1]);
+	return CMD_OK;
+}
+
+/* trace [<file> | off | dump] */
+enum cli_retval cmd_trace(int argc, char **argv) {
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 1) {
+		printf("trace ring : %u messages, written on errors to %s\n", NPTRACE_ENTRIES,
+		       nptrace_file(&npsess.trace) ? nptrace_file(&npsess.trace) : "(off)");
+		return CMD_OK;
+	}
+	if (argv[1][0] == '?') {
+		return CMD_USAGE;
+	}
+	if (strcmp(argv[1], "off") == 0) {
+		(void) nptrace_setfile(&npsess.trace, NULL);
+		return CMD_OK;
+	}
+	if (strcmp(argv[1], "dump") == 0) {
+		(void) nptrace_write(&npsess.trace, stdout, "trace dump");
+		return CMD_OK;
+	}
+	if (nptrace_setfile(&npsess.trace, argv[1])) {
+		printf("file name too long\n");
+		return CMD_FAILED;
+	}
+	return CMD_OK;
+}
+
+/* stats [clear | export <file>] */
+enum cli_retval cmd_stats(int argc, char **argv) {
+	if (argc == 1) {
+		if (!npstat_print(&npsess, stdout)) {
+			printf("no samples yet; they are recorded during dumps, CRC compares and flash writes\n");
+		}
+		if (npwire_print(&npsess, stdout)) {
+			printf("(wire bytes per command; payload is the data dumped, flashed or uploaded)\n");
+		}
+		return CMD_OK;
+	}
+	if ((argc == 2) && (strcmp(argv[1], "clear") == 0)) {
+		npstat_clear(&npsess);
+		npwire_clear(&npsess);
+		return CMD_OK;
+	}
+	if ((argc == 3) && (strcmp(argv[1], "export") == 0)) {
+		if (npstat_export(&npsess, argv[2])) {
+			printf("can't write %s\n", argv[2]);
+			return CMD_FAILED;
+		}
+		printf("histograms written to %s\n", argv[2]);
+		return CMD_OK;
+	}
+	return CMD_USAGE;
+}
+
+/** copy first CSV field of <line> to <dest> (max <dlen>-1 chars), without quotes or spaces.
+ * @return 1 if it looks like an ECUID
+ */
+static bool csv_get_ecuid(const char *line, char *dest, unsigned dlen) {
+	unsigned i = 0;
+	bool valid = 1;
+
+	for (; *line && !strchr(",;\t\r\n", *line); line++) {
+		if ((*line == '"') || isspace((unsigned char) *line)) {
+			continue;
+		}
+		if (!isalnum((unsigned char) *line)) {
+			valid = 0;
+		}
+		if (i < (dlen - 1)) {
+			dest[i++] = *line;
+		}
+	}
+	dest[i] = 0;
+	return valid && (i == KEYDB_IDLEN);
+}
+
+/* keybatch <in.csv> <out.csv> : resolve keysets for a list of ECUIDs.
+ * The ECUID must be the first column; the input lines are copied to the output
+ * with the results appended.
+ */
+enum cli_retval cmd_keybatch(int argc, char **argv) {
+	FILE *inf, *outf;
+	char line[512];
+	unsigned rows = 0, resolved = 0;
+	unsigned long t0, tdelta;
+	bool first = 1;
+
+	if (argc != 3) {
+		return CMD_USAGE;
+	}
+
+	if ((inf = fopen(argv[1], "r")) == NULL) {
+		printf("Cannot open %s !\n", argv[1]);
+		return CMD_FAILED;
+	}
+	if ((outf = fopen(argv[2], "w")) == NULL) {
+		printf("Cannot open %s !\n", argv[2]);
+		fclose(inf);
+		return CMD_FAILED;
+	}
+
+	t0 = diag_os_getms();
+	while (fgets(line, sizeof(line), inf)) {
+		char ecuid[16];
+		struct keydb_match kdm[KEY_CANDIDATES];
+		struct ecuid_keymatch_t kcs[KEY_CANDIDATES];
+		unsigned kdcnt, i;
+		u32 best = 0;
+		const char *bestsrc = "";
+
+		line[strcspn(line, "\r\n")] = 0;
+		if (!csv_get_ecuid(line, ecuid, sizeof(ecuid))) {
+			if (first) {
+				//assume it's a header line
+				fprintf(outf, "%s,best_s27k,best_src", line);
+				for (i = 0; i < KEY_CANDIDATES; i++) {
+					fprintf(outf, ",db_s27k%u,db_dist%u", i, i);
+				}
+				for (i = 0; i < KEY_CANDIDATES; i++) {
+					fprintf(outf, ",list_s27k%u,list_dist%u", i, i);
+				}
+				fprintf(outf, "\n");
+			} else {
+				fprintf(outf, "%s\n", line);
+			}
+			first = 0;
+			continue;
+		}
+		first = 0;
+		rows += 1;
+
+		kdcnt = keydb_query(ecuid, kdm, KEY_CANDIDATES, KEYDB_MAXDIST);
+		ecuid_getkeys(ecuid, kcs, KEY_CANDIDATES);
+
+		/* an exact local match wins, then the built-in list, then a close local match */
+		if (kdcnt && (kdm[0].dist == 0)) {
+			best = kdm[0].s27k;
+			bestsrc = "db";
+		} else if (kcs[0].dist <= KEY_MAXDIST) {
+			best = kcs[0].key;
+			bestsrc = "list";
+		} else if (kdcnt && (kdm[0].dist <= 1)) {
+			best = kdm[0].s27k;
+			bestsrc = "db";
+		}
+
+		fprintf(outf, "%s,", line);
+		if (best) {
+			resolved += 1;
+			fprintf(outf, "%08lX,%s", (unsigned long) best, bestsrc);
+		} else {
+			fprintf(outf, ",");
+		}
+		for (i = 0; i < KEY_CANDIDATES; i++) {
+			if (i < kdcnt) {
+				fprintf(outf, ",%08lX,%u", (unsigned long) kdm[i].s27k, kdm[i].dist);
+			} else {
+				fprintf(outf, ",,");
+			}
+		}
+		for (i = 0; i < KEY_CANDIDATES; i++) {
+			fprintf(outf, ",%08lX,%d", (unsigned long) kcs[i].key, kcs[i].dist);
+		}
+		fprintf(outf, "\n");
+	}
+	tdelta = diag_os_getms() - t0;
+
+	fclose(inf);
+	fclose(outf);
+
+	printf("%u ECUIDs, %u resolved, in %lu ms", rows, resolved, tdelta);
+	if (rows) {
+		printf(" (%lu us / ECUID)", (1000UL * tdelta) / rows);
+	}
+	printf(".\n");
+	return CMD_OK;
+}
+
+
 enum cli_retval cmd_initk(int argc, char **argv) {
 	const char *npk_id;
 
@@ -345,7 +853,7 @@ enum cli_retval cmd_initk(int argc, char **argv) {
 		return CMD_USAGE;
 	}
 
-	if ((npstate == NP_DISC) ||
+	if ((npsess.state == NP_DISC) ||
 	    (global_state == STATE_IDLE)) {
 		printf("Error : not connected\n");
 		return CMD_FAILED;
@@ -356,37 +864,150 @@ enum cli_retval cmd_initk(int argc, char **argv) {
 		return CMD_FAILED;
 	}
 
-	npstate = NP_NPKCONN;
+	npsess.state = NP_NPKCONN;
 
-	npk_id = get_npk_id();
+	npk_id = get_npk_id(&npsess);
 	if (npk_id) {
 		printf("Connected to kernel: %s\n", npk_id);
 	}
+	cache_note(0, npk_id);
 
 	return CMD_OK;
 }
 
 
 
+/** open L2 and StartCommunications at <speed>, with the current "set" parameters.
+ * @return new connection, NULL if the ECU didn't answer
+ */
+static struct diag_l2_conn *np_l2_start(unsigned speed) {
+	struct diag_l2_conn *d_conn;
+	struct diag_l0_device *dl0d = global_dl0d;
+	int rv;
+	flag_type flags = 0;
+
+	/* Open interface using current L1 proto and hardware */
+	rv = diag_l2_open(dl0d, global_cfg.L1proto);
+	if (rv) {
+		fprintf(stderr, "Open failed for protocol %d on %s\n",
+		        global_cfg.L1proto, dl0d->dl0->shortname);
+		return NULL;
+	}
+
+	if (global_cfg.addrtype) {
+		flags = DIAG_L2_TYPE_FUNCADDR;
+	} else {
+		flags = 0;
+	}
+
+	flags |= (global_cfg.initmode & DIAG_L2_TYPE_INITMASK);
+
+	d_conn = diag_l2_StartCommunications(dl0d, global_cfg.L2proto,
+	                                     flags, speed, global_cfg.tgt, global_cfg.src);
+
+	if (d_conn == NULL) {
+		(void) diag_geterr();
+		diag_l2_close(dl0d);
+		return NULL;
+	}
+	npwire_bitrate(&npsess, speed);
+	return d_conn;
+}
+
+#define PROBE_MAXSPEEDS 8
+/** kspeed values to try when looking for a running kernel, after the current and cached ones */
+static const long probe_speeds[] = {62500, 31250, 25000};
+
+static void probe_addspeed(long *speeds, unsigned *nspeeds, long speed) {
+	unsigned i;
+
+	/* at the "set speed" bitrate, a stock ECU would answer too */
+	if ((speed <= 0) || (speed == (long) global_cfg.speed) || (*nspeeds == PROBE_MAXSPEEDS)) {
+		return;
+	}
+	for (i = 0; i < *nspeeds; i++) {
+		if (speeds[i] == speed) {
+			return;
+		}
+	}
+	speeds[(*nspeeds)++] = speed;
+}
+
+/** look for a kernel left running (nisprog crash, "npdisc --keep" ...) : StartComm then
+ * SID_RECUID at the likely kernel speeds. If one answers, stay connected to it.
+ *
+ * @return 1 if connected to a kernel
+ */
+static bool probe_kernel(void) {
+	long speeds[PROBE_MAXSPEEDS];
+	unsigned nspeeds = 0;
+	unsigned i;
+
+	probe_addspeed(speeds, &nspeeds, npsess.kspeed);
+	if (ecucache_file()) {
+		long cached[PROBE_MAXSPEEDS];
+		unsigned ncached = ecucache_kspeeds(cached, PROBE_MAXSPEEDS);
+		for (i = 0; i < ncached; i++) {
+			probe_addspeed(speeds, &nspeeds, cached[i]);
+		}
+	}
+	for (i = 0; i < (sizeof(probe_speeds) / sizeof(probe_speeds[0])); i++) {
+		probe_addspeed(speeds, &nspeeds, probe_speeds[i]);
+	}
+
+	for (i = 0; i < nspeeds; i++) {
+		struct diag_l2_conn *d_conn;
+		const char *npk_id;
+		long prev_kspeed = npsess.kspeed;
+
+		printf("Looking for a running kernel at %ldbps...\n", speeds[i]);
+		d_conn = np_l2_start((unsigned) speeds[i]);
+		if (!d_conn) {
+			continue;
+		}
+		npsess.conn = d_conn;
+		global_l2_conn = d_conn;
+		global_state = STATE_CONNECTED;
+		npsess.state = NP_NORMALCONN;
+		npsess.kspeed = speeds[i];
+		update_params();
+
+		if (npkern_init() == 0) {
+			npk_id = get_npk_id(&npsess);
+			if (npk_id) {
+				npsess.state = NP_NPKCONN;
+				printf("Found running kernel: %s\n"
+				       "Kernel speed is now %ldbps. You may now use kernel-specific commands.\n",
+				       npk_id, npsess.kspeed);
+				return 1;
+			}
+		}
+		npsess.kspeed = prev_kspeed;
+		np_disconnect();
+	}
+	return 0;
+}
+
+/* npconn [--noprobe] */
 enum cli_retval cmd_npconn(int argc, char **argv) {
-	(void) argv;
-	if (argc > 1) {
+	struct npflag nflags[] = {{.name = "noprobe"}, {.name = NULL}};
+
+	argc = take_flags(argc, argv, nflags);
+	if ((argc < 0) || (argc > 1)) {
 		return CMD_USAGE;
 	}
 
-	if ((npstate != NP_DISC) ||
+	if ((npsess.state != NP_DISC) ||
 	    (global_state != STATE_IDLE)) {
 		printf("Error : already connected\n");
 		return CMD_FAILED;
 	}
 
-	nisecu_cleardata(&nisecu);
+	nisecu_cleardata(&npsess.ecu);
 
 
 	struct diag_l2_conn *d_conn;
 	struct diag_l0_device *dl0d = global_dl0d;
-	int rv;
-	flag_type flags = 0;
 
 	if (!dl0d) {
 		printf("No global L0. Please select + configure L0 first\n");
@@ -398,44 +1019,29 @@ enum cli_retval cmd_npconn(int argc, char **argv) {
 		return CMD_FAILED;
 	}
 
-	/* Open interface using current L1 proto and hardware */
-	rv = diag_l2_open(dl0d, global_cfg.L1proto);
-	if (rv) {
-		fprintf(stderr, "Open failed for protocol %d on %s\n",
-		        global_cfg.L1proto, dl0d->dl0->shortname);
-		return CMD_FAILED;
-	}
-
-	if (global_cfg.addrtype) {
-		flags = DIAG_L2_TYPE_FUNCADDR;
-	} else {
-		flags = 0;
+	if (!nflags[0].val && probe_kernel()) {
+		return CMD_OK;
 	}
 
-	flags |= (global_cfg.initmode & DIAG_L2_TYPE_INITMASK);
-
-	d_conn = diag_l2_StartCommunications(dl0d, global_cfg.L2proto,
-	                                     flags, global_cfg.speed, global_cfg.tgt, global_cfg.src);
-
+	d_conn = np_l2_start(global_cfg.speed);
 	if (d_conn == NULL) {
-		(void) diag_geterr();
-		diag_l2_close(dl0d);
 		printf("L2 StartComms failed\n");
 		return CMD_FAILED;
 	}
 
 	/* Connected ! */
 
-	global_l2_conn = d_conn;
+	npsess.conn = d_conn;
+	global_l2_conn = d_conn;	//for scantool
 	global_state = STATE_CONNECTED;
-	npstate = NP_NORMALCONN;
+	npsess.state = NP_NORMALCONN;
 
 	update_params();
 
 	printf("Connected to ECU !\n");
 
 	struct diag_l2_14230 * dlproto; // for bypassing headers
-	dlproto = (struct diag_l2_14230 *)global_l2_conn->diag_l2_proto_data;
+	dlproto = (struct diag_l2_14230 *)npsess.conn->diag_l2_proto_data;
 	if (dlproto->modeflags & ISO14230_SHORTHDR) {
 		dlproto->modeflags &= ~ISO14230_LONGHDR;    //deactivate long headers
 	} else {
@@ -443,12 +1049,15 @@ enum cli_retval cmd_npconn(int argc, char **argv) {
 		       "Some stuff will not work.");
 	}
 
-	if (get_ecuid(nisecu.ecuid)) {
+	if (get_ecuid(&npsess, npsess.ecu.ecuid)) {
 		printf("Couldn't get ECUID ? Verify settings, connection mode etc.\n");
 		return CMD_FAILED;
 	}
-	printf("ECUID: %s\n", (char *) nisecu.ecuid);
-	autoselect_keyset();
+	printf("ECUID: %s\n", (char *) npsess.ecu.ecuid);
+	snprintf(cache_id, sizeof(cache_id), "%s", (char *) npsess.ecu.ecuid);
+	if (!cache_restore()) {
+		autoselect_keyset();
+	}
 
 	return CMD_OK;
 }
@@ -460,13 +1069,13 @@ enum cli_retval cmd_spconn(int argc, char **argv) {
 		return CMD_USAGE;
 	}
 
-	if ((npstate != NP_DISC) ||
+	if ((npsess.state != NP_DISC) ||
 	    (global_state != STATE_IDLE)) {
 		printf("Error : already connected\n");
 		return CMD_FAILED;
 	}
 
-	nisecu_cleardata(&nisecu);
+	nisecu_cleardata(&npsess.ecu);
 
 	struct diag_l2_conn *d_conn;
 	struct diag_l0_device *dl0d = global_dl0d;
@@ -510,6 +1119,7 @@ enum cli_retval cmd_spconn(int argc, char **argv) {
 		printf("L2 StartComms failed\n");
 		return CMD_FAILED;
 	}
+	npwire_bitrate(&npsess, global_cfg.speed);
 
 	//At this point we have a valid RAW connection and need to update d_conn manually to change to ISO14230 with Subaru headers, checksum
 	//The general initialisation would have set d_conn->diag_link, ->l2proto, ->diag_l2_type, ->diag_l2_srcaddr, ->diag_l2_destaddr,
@@ -546,17 +1156,19 @@ enum cli_retval cmd_spconn(int argc, char **argv) {
 	dp->modeflags = 6; //length byte required, address bytes required (ie) 4 byte headers
 	printf("Change to ISO14230 successful\n");
 
-	global_l2_conn = d_conn;
+	npsess.conn = d_conn;
+	global_l2_conn = d_conn;	//for scantool
 	global_state = STATE_CONNECTED;
-	npstate = NP_NORMALCONN;
+	npsess.state = NP_NORMALCONN;
 
 	update_params();
 
-	if(sub_sid81_startcomms()) {
+	if(sub_sid81_startcomms(&npsess)) {
 		printf("SID 0x81 startCommunications failed. Verify settings, connection mode etc.\n");
+		npsess.conn = NULL;
 		global_l2_conn = NULL;
 		global_state = STATE_IDLE;
-		npstate = NP_DISC;
+		npsess.state = NP_DISC;
 		return CMD_FAILED;
 	}
 
@@ -564,58 +1176,97 @@ enum cli_retval cmd_spconn(int argc, char **argv) {
 
 	printf("\nConnected to ECU and ready for SSM or SID Commands\n");
 
-	if (sub_get_ecuid(nisecu.ecuid)) {
+	if (sub_get_ecuid(&npsess, npsess.ecu.ecuid)) {
 		printf("Couldn't get ECUID ? Verify settings, connection mode etc.\n");
 		return CMD_FAILED;
 	}
 	printf("\nECUID: ");
 	for (i=0; i < 5; i++) {
-		printf("%02x ", nisecu.ecuid[i]);
+		printf("%02x ", npsess.ecu.ecuid[i]);
+		sprintf(&cache_id[2 * i], "%02X", npsess.ecu.ecuid[i]);
 	}
 	printf("\n");
+	(void) cache_restore();
 
 	return CMD_OK;
 }
 
 
-enum cli_retval cmd_npdisc(UNUSED(int argc), UNUSED(char **argv)) {
-	if ((npstate == NP_DISC) ||
+/** close the connection, whatever is running on the ECU */
+static void np_disconnect(void) {
+	if (npsess.autotune) {
+		printf("autotune: final p3=%ld, rxe=%ld (%lu read timeouts)\n",
+		       npsess.p3, npsess.rxe, npsess.tune.timeouts);
+		cache_note(0, NULL);
+	}
+	diag_l2_StopCommunications(npsess.conn);
+	diag_l2_close(global_dl0d);
+
+	npsess.conn = NULL;
+	global_l2_conn = NULL;
+	global_state = STATE_IDLE;
+	npsess.state = NP_DISC;
+	cache_id[0] = 0;
+}
+
+/* npdisc [--stop | --keep] */
+enum cli_retval cmd_npdisc(int argc, char **argv) {
+	struct npflag flags[] = {{.name = "stop"}, {.name = "keep"}, {.name = NULL}};
+	const char *kstate = "kernel=none";
+
+	argc = take_flags(argc, argv, flags);
+	if ((argc < 0) || (argc > 1) || (flags[0].val && flags[1].val)) {
+		return CMD_USAGE;
+	}
+
+	if ((npsess.state == NP_DISC) ||
 	    (global_state == STATE_IDLE)) {
 		return CMD_OK;
 	}
 
-	if (npstate == NP_NPKCONN) {
-		printf("\n****** Kernel still running on ECU. Do you want to stop it before disconnecting ?\n"
-				"n : \t\t No, just disconnect and let kernel run (usually not what you want)\n"
-				"any other key :\t Yes, stopkernel first (preferred)\n");
+	if (npsess.state == NP_NPKCONN) {
+		char answer;
 
-		char *inp = cli_basic_get_input("> ", stdin);
-		if (!inp) {
-			//if user feeds an EOF, don't do anything
-			return CMD_FAILED;
+		if (flags[0].val) {
+			answer = 'y';
+		} else if (flags[1].val) {
+			answer = 'n';
+		} else if (npsess.batch) {
+			answer = 'y';	//same as the prompt's default
+		} else {
+			printf("\n****** Kernel still running on ECU. Do you want to stop it before disconnecting ?\n"
+					"n : \t\t No, just disconnect and let kernel run (usually not what you want)\n"
+					"any other key :\t Yes, stopkernel first (preferred)\n");
+
+			char *inp = cli_basic_get_input("> ", stdin);
+			if (!inp) {
+				//if user feeds an EOF, don't do anything
+				return CMD_FAILED;
+			}
+			answer=inp[0];
+			free(inp);
 		}
-		char answer=inp[0];
-		free(inp);
 
 		switch (answer) {
 		case 'n':	//fallthrough
 		case 'N':
+			kstate = "kernel=running";
 			break;
 		default:
 			printf("\n\tStopping kernel and rebooting ECU. To avoid the previous prompt,\n"
-			"\trun 'stopkernel' first.\n");
-			cmd_stopkernel(1, NULL);
+			"\trun 'stopkernel' first, or use \"npdisc --stop\".\n");
+			if (cmd_stopkernel(1, NULL) == CMD_OK) {
+				np_result("npdisc", "ok", "kernel=stopped");
+				return CMD_OK;
+			}
+			printf("stopkernel failed, disconnecting anyway.\n");
+			kstate = "kernel=unknown";
 			break;
 		}
 	}
 
-	diag_l2_StopCommunications(global_l2_conn);
-	diag_l2_close(global_dl0d);
-
-	global_l2_conn = NULL;
-	global_state = STATE_IDLE;
-	npstate = NP_DISC;
-
+	np_disconnect();
+	np_result("npdisc", "ok", kstate);
 	return CMD_OK;
 }
 
@@ -625,7 +1276,7 @@ enum cli_retval cmd_stopkernel(int argc, UNUSED(char **argv)) {
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	int errval;
 
-	if (npstate != NP_NPKCONN) {
+	if (npsess.state != NP_NPKCONN) {
 		return CMD_OK;
 	}
 
@@ -639,13 +1290,14 @@ enum cli_retval cmd_stopkernel(int argc, UNUSED(char **argv)) {
 	nisreq.len=1;
 	nisreq.data=txdata;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(&npsess, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return CMD_FAILED;
 	}
+	diag_freemsg(rxmsg);
 
-	(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
-	(void) cmd_npdisc(0, NULL);
+	(void) diag_l2_ioctl(npsess.conn, DIAG_IOCTL_IFLUSH, NULL);
+	np_disconnect();	//the kernel is gone, no need to ask
 
 	return CMD_OK;
 }
@@ -666,7 +1318,7 @@ static int np_1(UNUSED(int argc), UNUSED(char **argv)) {
 	nisreq.len=3;
 	nisreq.data=txdata;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(&npsess, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return CMD_FAILED;
 	}
@@ -685,7 +1337,7 @@ static int np_1(UNUSED(int argc), UNUSED(char **argv)) {
 	txdata[0]=0x83;
 	txdata[1]=0x0;  //read limits
 	nisreq.len=2;
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(&npsess, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return CMD_FAILED;
 	}
@@ -697,7 +1349,7 @@ static int np_1(UNUSED(int argc), UNUSED(char **argv)) {
 	txdata[0]=0x83;
 	txdata[1]=0x02;
 	nisreq.len=2;
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(&npsess, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return CMD_FAILED;
 	}
@@ -738,7 +1390,7 @@ static int np_2(int argc, char **argv) {
 	nisreq.len=7;
 	nisreq.data=txdata;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(&npsess, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return CMD_FAILED;
 	}
@@ -750,6 +1402,7 @@ static int np_2(int argc, char **argv) {
 		return CMD_FAILED;
 	}
 	printf("Got: 0x%02X\n", rxmsg->data[5]);
+	npwire_payload(&npsess, 1);
 	diag_freemsg(rxmsg);
 	return CMD_OK;
 }
@@ -773,8 +1426,10 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 	int retryscore=100; //successes increase this up to 100; failures decrease it.
 	uint8_t hackbuf[70];
 	int extra;  //extra bytes to purge
+	int purge;  //AC response bytes at the start of the 21 response
 	uint32_t addr, nextaddr, maxaddr;
 	unsigned long total_chron;
+	struct npprog pg;
 
 	nextaddr = start;
 	maxaddr = start + len - 1;
@@ -785,6 +1440,7 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 
 	nisreq.data=txdata;
 	total_chron = diag_os_getms();
+	npprog_start(&pg, &npsess.prog, "acdump", start, len);
 	while (retryscore >0) {
 
 		unsigned int linecur=0; //count from 0 to 11 (12 addresses per request)
@@ -800,10 +1456,6 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 		txi=2;
 		linecur = 0;
 
-		unsigned long t0, chrono;
-		unsigned chron_cnt = 0; //how many bytes between refreshes
-		t0 = diag_os_getms();
-
 		for (addr=nextaddr; addr <= maxaddr; addr++) {
 			txdata[txi++]= 0x83;        //field type
 			txdata[txi++]= (uint8_t) (addr >> 24) & 0xFF;
@@ -818,35 +1470,16 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 				continue;
 			}
 
-			unsigned curspeed, tmin, tsec;
-			chron_cnt += linecur;
-			chrono = diag_os_getms() - t0;
-			if (chrono > 200) {
-				//limit update rate
-				curspeed = 1000 * (chron_cnt) / chrono; //avg B/s
-				if (!curspeed) {
-					curspeed += 1;
-				}
-				tsec = ((maxaddr - addr) / curspeed) % 9999;
-				tmin = tsec / 60;
-				tsec = tsec % 60;
-
-				printf("\rreading @ 0x%08X (%3u %%, %5u B/s, ~ %3u:%02u remaining ", nextaddr,
-				       (unsigned) 100 * (maxaddr - addr) / len, curspeed, tmin, tsec);
-				fflush(stdout);
-				chron_cnt = 0;
-				t0 = diag_os_getms();
-			}
+			npprog_update(&pg, nextaddr, nextaddr - start);
 
 			int i, rqok;
 			//send the request "properly"
 
-			rqok = diag_l2_send(global_l2_conn, &nisreq);
+			rqok = npstat_send(&npsess, NPSTAT_ACDUMP, &nisreq);
 			if (rqok) {
 				printf("\nhack mode : bad l2_send\n");
 				retryscore -= 25;
-				diag_os_millisleep(300);
-				(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+				npstat_flush(&npsess, NPSTAT_ACDUMP, 300);
 				break;  //out of for()
 			}
 
@@ -857,8 +1490,7 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 			// we'll request just 4 bytes so we return very fast;
 			// We should find 0xEC if it's in there no matter what kind of header.
 			// We'll "purge" the next bytes when we send SID 21
-			errval=diag_l1_recv(global_l2_conn->diag_link->l2_dl0d,
-			                    hackbuf, 4, (unsigned) (25 + nparam_rxe.val));
+			errval=np_rawrecv(NPSTAT_ACDUMP, hackbuf, 4);
 			if (errval == 4) {
 				//try to find 0xEC in the first bytes:
 				for (i=0; i<=3; i++) {
@@ -872,8 +1504,7 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 			if (!rqok) {
 				printf("\nhack mode : bad AC response %02X %02X\n", hackbuf[0], hackbuf[1]);
 				retryscore -= 25;
-				diag_os_millisleep(300);
-				(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+				npstat_flush(&npsess, NPSTAT_ACDUMP, 300);
 				break;  //out of for()
 			}
 			//Here, we're guaranteed to have found 0xEC in the first 4 bytes we got. But we may
@@ -882,6 +1513,8 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 			//
 			extra = (3 + i - errval);   //bytes to purge. I think the formula is ok
 			extra = (extra < 0) ? 0: extra; //make sure >=0
+			purge = extra;
+			npwire_framing(&npsess, i + 1);	//header before 0xEC, cks
 
 			//Here, we sent a AC 81 83 ... 83... request that was accepted.
 			//We need to send 21 81 04 01 to get the data now
@@ -893,11 +1526,10 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 
 			rqok=0; //default to fail
 			//send the request "properly"
-			if (diag_l2_send(global_l2_conn, &nisreq)) {
+			if (npstat_send(&npsess, NPSTAT_ACDUMP, &nisreq)) {
 				printf("l2_send() problem !\n");
 				retryscore -=25;
-				diag_os_millisleep(300);
-				(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+				npstat_flush(&npsess, NPSTAT_ACDUMP, 300);
 				break;  //out of for ()
 			}
 
@@ -907,12 +1539,10 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 			//bytes still in buffer; we already calculated how many.
 			//By requesting (extra) + 4 with a short timeout, we'll return
 			//here very quickly and we're certain to "catch" 0x61.
-			errval=diag_l1_recv(global_l2_conn->diag_link->l2_dl0d,
-			                    hackbuf, extra + 4, (unsigned) (25 + nparam_rxe.val));
+			errval=np_rawrecv(NPSTAT_ACDUMP, hackbuf, extra + 4);
 			if (errval != extra+4) {
 				retryscore -=25;
-				diag_os_millisleep(300);
-				(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+				npstat_flush(&npsess, NPSTAT_ACDUMP, 300);
 				break;  //out of for ()
 			}
 			//try to find 0x61 in the first bytes:
@@ -935,8 +1565,7 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 				printf("\nhack mode : problem ! extra=%d\n",extra);
 				extra=0;
 			} else {
-				errval=diag_l1_recv(global_l2_conn->diag_link->l2_dl0d,
-				                    &hackbuf[errval], extra, (unsigned) (25 + nparam_rxe.val));
+				errval=np_rawrecv(NPSTAT_NONE, &hackbuf[errval], extra);
 			}
 
 			if (errval != extra) {  //this should always fit...
@@ -947,8 +1576,7 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 				//either negative response or not enough data !
 				printf("\nhack mode : bad 61 response %02X %02X, i=%02X extra=%02X ev=%02X\n",
 				       hackbuf[i], hackbuf[i+1], i, extra, errval);
-				diag_os_millisleep(300);
-				(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+				npstat_flush(&npsess, NPSTAT_ACDUMP, 300);
 				retryscore -= 25;
 				break;  //out of for ()
 			}
@@ -957,8 +1585,7 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 				//this checksum will not work with long headers...
 				printf("\nhack mode : bad 61 CS ! got %02X\n", hackbuf[i+2+linecur]);
 				diag_data_dump(stdout, &hackbuf[i], linecur+3);
-				diag_os_millisleep(300);
-				(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+				npstat_flush(&npsess, NPSTAT_ACDUMP, 300);
 				retryscore -=20;
 				break;  //out of for ()
 			}
@@ -970,6 +1597,8 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 				break;  //out of for ()
 			}
 
+			npwire_payload(&npsess, linecur);
+			npwire_framing(&npsess, ((i > purge) ? (i - purge) : 0) + 1);	//header before 0x61, cks
 			nextaddr += linecur;    //if we crash, we can resume starting at nextaddr
 			linecur=0;
 			//success: allow us more errors
@@ -986,13 +1615,18 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 			//the for loop didn't complete;
 			//(if succesful, addr == maxaddr+1 !!)
 			printf("\nRetry score: %d\n", retryscore);
+			npprog_retry(&pg, "bad response");
 		} else {
+			npprog_update(&pg, nextaddr, len);
+			npprog_done(&pg, 1);
 			printf("\nFinished! ~%lu Bps\n", 1000*(maxaddr - start)/(diag_os_getms() - total_chron));
 			break;  //leave while()
 		}
 	}   //while retryscore>0
 
 	if (retryscore <= 0) {
+		nptrace_dump(&npsess.trace, __func__);
+		npprog_done(&pg, 0);
 		printf("Too many errors, no more retries @ addr=%08X.\n", start);
 		return CMD_FAILED;
 	}
@@ -1000,6 +1634,76 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
 }
 
 
+#define AC_MAXADDRS 12	//SID AC : 12 addresses per request
+
+/** one SID AC + SID 21 exchange : read 1 byte at each of <n> (<= AC_MAXADDRS) addresses,
+ * that don't need to be contiguous.
+ * Uses global conn, assumes global state is OK
+ * @return 0 if ok
+ */
+static int ac_request(uint8_t *dest, const uint32_t *addrs, unsigned n) {
+	uint8_t txdata[64]; //data for nisreq
+	struct diag_msg nisreq={0}; //request to send
+	struct diag_msg *rxmsg=NULL;    //pointer to the reply
+	int errval;
+	unsigned i;
+	int txi;    //index into txbuf for constructing request
+	uint32_t addr = addrs[n - 1];	//for error messages
+
+	txdata[0]=0xAC;
+	txdata[1]=0x81;
+	nisreq.data=txdata;
+	txi=2;
+	for (i = 0; i < n; i++) {
+		txdata[txi++]= 0x83;        //field type
+		txdata[txi++]= (uint8_t) (addrs[i] >> 24) & 0xFF;
+		txdata[txi++]= (uint8_t) (addrs[i] >> 16) & 0xFF;
+		txdata[txi++]= (uint8_t) (addrs[i] >> 8) & 0xFF;
+		txdata[txi++]= (uint8_t) (addrs[i] & 0xFF);
+	}
+	nisreq.len = txi;
+
+	rxmsg=np_l2_request(&npsess, &nisreq, &errval);
+	if (rxmsg==NULL) {
+		printf("\nError: no resp to rqst AC @ %08X, err=%d\n", addr, errval);
+		return -1;
+	}
+	if ((rxmsg->data[0] != 0xEC) || (rxmsg->len != 2) ||
+	    (rxmsg->fmt & DIAG_FMT_BADCS)) {
+		printf("\nFatal : bad AC resp at addr=0x%X:\n", addr);
+		diag_data_dump(stdout, rxmsg->data, rxmsg->len);
+		diag_freemsg(rxmsg);
+		return -1;
+	}
+	diag_freemsg(rxmsg);
+
+	//Here, we sent a AC 81 83 ... 83... request that was accepted.
+	//We need to send 21 81 04 01 to get the data now
+	txdata[0]=0x21;
+	txdata[1]=0x81;
+	txdata[2]=0x04;
+	txdata[3]=0x01;
+	nisreq.len=4;
+
+	rxmsg=np_l2_request(&npsess, &nisreq, &errval);
+	if (rxmsg==NULL) {
+		printf("\nFatal : did not get response at address %08X, err=%d\n", addr, errval);
+		return -1;
+	}
+	if ((rxmsg->data[0] != 0x61) || (rxmsg->len != (2+n)) ||
+	    (rxmsg->fmt & DIAG_FMT_BADCS)) {
+		printf("\nFatal : error at addr=0x%X: %02X, len=%u\n", addr,
+		       rxmsg->data[0], rxmsg->len);
+		diag_freemsg(rxmsg);
+		return -1;
+	}
+	//Now we got the reply to SID 21 : 61 81 x x x ...
+	memcpy(dest, &(rxmsg->data[2]), n);
+	npwire_payload(&npsess, n);
+	diag_freemsg(rxmsg);
+	return 0;
+}
+
 /** Read bytes from memory
  * copies <len> bytes from offset <addr> in ROM to *dest,
  * using SID AC and std L2_request mechanism.
@@ -1007,135 +1711,356 @@ static int dump_fast(FILE *outf, const uint32_t start, uint32_t len) {
  * @return num of bytes read
  */
 static uint32_t read_ac(uint8_t *dest, uint32_t addr, uint32_t len) {
-	uint8_t txdata[64]; //data for nisreq
-	struct diag_msg nisreq={0}; //request to send
-	struct diag_msg *rxmsg=NULL;    //pointer to the reply
-	int errval;
-	uint32_t sent;  //count
+	uint32_t addrs[AC_MAXADDRS];
 	uint32_t goodbytes;
 
 	if (!dest || (len==0)) {
 		return 0;
 	}
 
-	unsigned int linecur;   //count from 0 to 11 (12 addresses per request)
-
-	int txi;    //index into txbuf for constructing request
+	for (goodbytes = 0; goodbytes < len; ) {
+		unsigned linecur;	//request 12 addresses at a time, or whatever's left at the end
+		unsigned i;
 
-	txdata[0]=0xAC;
-	txdata[1]=0x81;
-	nisreq.len = 2; //AC 81 : 2 bytes so far
-	nisreq.data=txdata;
-	txi=2;
-	linecur = 0;
-	goodbytes = 0;
-	for (sent=0; sent < len; addr++) {
-		txdata[txi++]= 0x83;        //field type
-		txdata[txi++]= (uint8_t) (addr >> 24) & 0xFF;
-		txdata[txi++]= (uint8_t) (addr >> 16) & 0xFF;
-		txdata[txi++]= (uint8_t) (addr >> 8) & 0xFF;
-		txdata[txi++]= (uint8_t) (addr & 0xFF);
-		nisreq.len += 5;
-		linecur += 1;
-		sent++;
-		//request 12 addresses at a time, or whatever's left at the end
-		if ((linecur != 0x0c) && (sent != len)) {
-			continue;
+		linecur = len - goodbytes;
+		if (linecur > AC_MAXADDRS) {
+			linecur = AC_MAXADDRS;
 		}
-
-		rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
-		if (rxmsg==NULL) {
-			printf("\nError: no resp to rqst AC @ %08X, err=%d\n", addr, errval);
-			break;  //leave for loop
+		for (i = 0; i < linecur; i++) {
+			addrs[i] = addr + goodbytes + i;
 		}
-		if ((rxmsg->data[0] != 0xEC) || (rxmsg->len != 2) ||
-		    (rxmsg->fmt & DIAG_FMT_BADCS)) {
-			printf("\nFatal : bad AC resp at addr=0x%X:\n", addr);
-			diag_data_dump(stdout, rxmsg->data, rxmsg->len);
-			diag_freemsg(rxmsg);
+		if (ac_request(&dest[goodbytes], addrs, linecur)) {
 			break;
 		}
-		diag_freemsg(rxmsg);
+		goodbytes += linecur;
+	}
 
-		//Here, we sent a AC 81 83 ... 83... request that was accepted.
-		//We need to send 21 81 04 01 to get the data now
-		txdata[0]=0x21;
-		txdata[1]=0x81;
-		txdata[2]=0x04;
-		txdata[3]=0x01;
-		nisreq.len=4;
-
-		rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
-		if (rxmsg==NULL) {
-			printf("\nFatal : did not get response at address %08X, err=%d\n", addr, errval);
-			break;  //leave for loop
-		}
-		if ((rxmsg->data[0] != 0x61) || (rxmsg->len != (2+linecur)) ||
-		    (rxmsg->fmt & DIAG_FMT_BADCS)) {
-			printf("\nFatal : error at addr=0x%X: %02X, len=%u\n", addr,
-			       rxmsg->data[0], rxmsg->len);
-			diag_freemsg(rxmsg);
-			break;
+	return goodbytes;
+}
+
+#define WATCH_SHOWVARS 4	//values shown on the console line
+#define WATCH_SHOWMS 250	//console refresh interval
+
+/** read one sample of every span into sbuf, using SID AC or npk RMBA.
+ * @return 0 if ok
+ */
+static int watch_read(const struct npw_list *wl, uint8_t *sbuf) {
+	uint32_t addrs[AC_MAXADDRS];
+	unsigned si, i, n;
+
+	if (npsess.state == NP_NPKCONN) {
+		for (si = 0; si < wl->nspans; si++) {
+			if (npk_RMBA(sbuf, wl->spans[si].addr, wl->spans[si].len)) {
+				return -1;
+			}
+			sbuf += wl->spans[si].len;
 		}
-		//Now we got the reply to SID 21 : 61 81 x x x ...
-		memcpy(dest, &(rxmsg->data[2]), linecur);
-		dest = &dest[linecur];
-		goodbytes = sent;
+		return 0;
+	}
 
-		diag_freemsg(rxmsg);
+	/* SID AC takes any 12 addresses per request, so the spans are packed back-to-back */
+	n = 0;
+	for (si = 0; si < wl->nspans; si++) {
+		for (i = 0; i < wl->spans[si].len; i++) {
+			addrs[n++] = wl->spans[si].addr + i;
+			if (n < AC_MAXADDRS) {
+				continue;
+			}
+			if (ac_request(sbuf, addrs, n)) {
+				return -1;
+			}
+			sbuf += n;
+			n = 0;
+		}
+	}
+	if (n) {
+		return ac_request(sbuf, addrs, n);
+	}
+	return 0;
+}
 
-		linecur=0;
+static void watch_show(const struct npw_list *wl, const uint8_t *sbuf, bool single, unsigned long nsamples, double rate) {
+	unsigned i;
 
-		//and reset tx template + sub-counters
-		txdata[0]=0xAc;
-		txdata[1]=0x81;
-		nisreq.len=2;
-		txi=2;
+	if (single) {
+		printf("\r%s: %02X %02X %02X %02X (%.1f/s)  ", wl->vars[0].name, sbuf[0], sbuf[1], sbuf[2], sbuf[3], rate);
+		fflush(stdout);
+		return;
+	}
+	printf("\r%lu (%.1f/s)", nsamples, rate);
+	for (i = 0; (i < wl->nvars) && (i < WATCH_SHOWVARS); i++) {
+		printf(" %s=%.6g", wl->vars[i].name, npw_value(&wl->vars[i], sbuf));
+	}
+	printf("  ");
+	fflush(stdout);
+}
+
+#define WATCH_TRIGWIN 100	//default samples kept before / written after a trigger
+#define WATCH_MAXPATH 256
+
+/** triggered capture state, see np_watch.h */
+struct watch_trig {
+	struct npw_trig tr;
+	struct npw_ring ring;	//pre-trigger samples
+	const char *base;	//output file name
+	bool binary;
+	unsigned long post;	//samples written after the trigger sample
+	unsigned long maxcapt;	//0 : until interrupted
+	unsigned long ncapt;	//captures completed
+	unsigned long postleft;
+	FILE *f;	//capture being written, NULL while armed
+	char fname[WATCH_MAXPATH];
+};
+
+/** <base> with "_<n>" before the extension, if several captures : log.csv -> log_002.csv */
+static void capt_fname(char *dest, size_t len, const char *base, unsigned long n, bool numbered) {
+	const char *ext = strrchr(base, '.');
+
+	if (!numbered) {
+		snprintf(dest, len, "%s", base);
+		return;
+	}
+	if (!ext || strchr(ext, '/') || strchr(ext, '\\')) {
+		ext = &base[strlen(base)];
+	}
+	snprintf(dest, len, "%.*s_%03lu%s", (int) (ext - base), base, n, ext);
+}
+
+/** feed a sample to the triggered capture.
+ * @return 1 when the last capture was written, 0 to continue, < 0 if error
+ */
+static int watch_trig(struct watch_trig *wt, const struct npw_list *wl, uint64_t t_us, const uint8_t *sbuf) {
+	bool fired = npw_trig_eval(&wt->tr, wl, sbuf);
+
+	if (!wt->f) {
+		npw_ring_add(&wt->ring, t_us, sbuf);
+		if (!fired) {
+			return 0;
+		}
+		capt_fname(wt->fname, sizeof(wt->fname), wt->base, wt->ncapt + 1, (wt->maxcapt != 1));
+		wt->f = fopen(wt->fname, wt->binary ? "wb" : "w");
+		if (!wt->f) {
+			printf("\nCannot open %s !\n", wt->fname);
+			return -1;
+		}
+		printf("\ntrigger at %.3f s : %s=%.6g\n", t_us / 1E6, wl->vars[wt->tr.var].name,
+		       npw_value(&wl->vars[wt->tr.var], sbuf));
+		npw_header(wt->f, wl, wt->binary);
+		npw_ring_flush(&wt->ring, wt->f, wl, wt->binary);
+		wt->postleft = wt->post;
+	} else {
+		npw_sample(wt->f, wl, wt->binary, t_us, sbuf);
+		wt->postleft -= 1;
+	}
+	if (wt->postleft) {
+		return 0;
+	}
+
+	fclose(wt->f);
+	wt->f = NULL;
+	wt->ncapt += 1;
+	printf("\ncapture %lu written to %s\n", wt->ncapt, wt->fname);
+	return (wt->maxcapt && (wt->ncapt >= wt->maxcapt));
+}
+
+/* watch 4 bytes @ <addr>, or log a list of variables (see np_watch.h), using SID AC or npk RMBA;
+ * optionally only around trigger events. */
+static enum cli_retval watch(int argc, char **argv) {
+	struct npflag flags[] = {{.name = "bin"}, {.name = "gap"}, {.name = "count"},
+		{.name = "trig"}, {.name = "pre"}, {.name = "post"}, {.name = NULL}};
+	static struct npw_list wl;	//a few kB, keep off the stack
+	struct watch_trig wt = {0};
+	uint8_t *sbuf = NULL;
+	FILE *outf = NULL;
+	bool binary, single;
+	unsigned maxgap = 0;
+	unsigned long count = 0;
+	unsigned long nsamples = 0;
+	unsigned long long t0, tshow, elapsed;
+	unsigned reqs;
+	int rv;
+	double rate = 0;
+	char details[64];
+	uint32_t addr;
+
+	argc = take_flags(argc, argv, flags);
+	if ((argc < 2) || (argc > 3)) {
+		return CMD_USAGE;
+	}
+	binary = (flags[0].val != NULL);
+	if (flags[1].val) {
+		maxgap = (unsigned) strtoul(flags[1].val, NULL, 0);
+	}
+	if (flags[2].val) {
+		count = strtoul(flags[2].val, NULL, 0);
+	}
+	if (flags[3].val && (argc != 3)) {
+		printf("--trig needs an output file\n");
+		return CMD_USAGE;
+	}
+
+	if (npsess.state == NP_DISC) {
+		printf("Please connect first (\"nc\")\n");
+		return CMD_FAILED;
+	}
 
-	}   //for
+	/* an existing file is a variable list, anything else an address (same syntax as elsewhere) */
+	outf = fopen(argv[1], "r");
+	single = (outf == NULL);
+	if (outf) {
+		fclose(outf);
+		outf = NULL;
+	}
+	if (single) {
+		char name[16];
 
-	return goodbytes;
-}
+		if (!isdigit((unsigned char) argv[1][0]) && (argv[1][0] != '$')) {
+			printf("Cannot open %s !\n", argv[1]);
+			return CMD_FAILED;
+		}
+		addr = (uint32_t) htoi(argv[1]);
+		memset(&wl, 0, sizeof(wl));
+		snprintf(name, sizeof(name), "0x%0X", (unsigned) addr);
+		(void) npw_add(&wl, name, addr, NPW_U32, 1, 0);
+	} else if (npw_load(&wl, argv[1]) <= 0) {
+		printf("No variables loaded.\n");
+		return CMD_FAILED;
+	}
 
-//(WIP) watch 4 bytes @ specified addr, using SID AC.
-//
-enum cli_retval cmd_watch(int argc, char **argv) {
-	uint32_t addr;
-	uint32_t len;
-	uint8_t wbuf[4];
+	if (npsess.state == NP_NPKCONN) {
+		if (!flags[1].val) {
+			maxgap = rdplan_overhead((unsigned long) npsess.kspeed, (unsigned long) (npsess.p3 * 1000) + RDPLAN_LATUS);
+		}
+		rv = npw_plan(&wl, maxgap, 1);
+		reqs = (unsigned) rv;
+	} else {
+		rv = npw_plan(&wl, 0, 0);	//gap bytes would cost as much as wanted bytes
+		reqs = 2 * ((wl.buflen + AC_MAXADDRS - 1) / AC_MAXADDRS);	//AC + 21 for every 12 bytes
+	}
+	if (rv < 0) {
+		printf("Some variables are outside the npkern RMBA windows (ROM, or RAM >= 0x%X).\n", RDPLAN_RAMSTART);
+		return CMD_FAILED;
+	}
+	printf("%u variable(s), %u bytes in %u request(s) per sample.\n", wl.nvars, wl.buflen, reqs);
 
-	if (argc != 2) {
-		return CMD_USAGE;
+	if (flags[3].val && npw_trig_parse(&wt.tr, &wl, flags[3].val)) {
+		printf("bad trigger \"%s\" : expected <name><op><value>, <op> one of > < >= <= == != &\n", flags[3].val);
+		return CMD_FAILED;
 	}
 
-	if (npstate == NP_DISC) {
-		printf("Please connect first (\"nc\")\n");
+	sbuf = malloc(wl.buflen);
+	if (!sbuf) {
+		printf("malloc prob\n");
 		return CMD_FAILED;
 	}
+	if (flags[3].val) {
+		unsigned long pre = flags[4].val ? strtoul(flags[4].val, NULL, 0) : WATCH_TRIGWIN;
 
-	addr = (uint32_t) htoi(argv[1]);
-	printf("\nMonitoring 0x%0X; press Enter to interrupt.\n", addr);
-	(void) diag_os_ipending();  //must be done outside the loop first
-	while ( !diag_os_ipending()) {
+		wt.post = flags[5].val ? strtoul(flags[5].val, NULL, 0) : WATCH_TRIGWIN;
+		wt.base = argv[2];
+		wt.binary = binary;
+		wt.maxcapt = flags[2].val ? count : 1;	//--count is the number of captures
+		if (npw_ring_init(&wt.ring, (unsigned) pre, wl.buflen)) {
+			printf("malloc prob\n");
+			goto badexit;
+		}
+		printf("Trigger : %s, keeping %u samples before and %lu after.\n", flags[3].val, wt.ring.size, wt.post);
+	} else if (argc == 3) {
+		outf = fopen(argv[2], binary ? "wb" : "w");
+		if (!outf) {
+			printf("Cannot open %s !\n", argv[2]);
+			goto badexit;
+		}
+		npw_header(outf, &wl, binary);
+	}
 
-		if (npstate == NP_NORMALCONN) {
-			len = read_ac(wbuf, addr, 4);
-			if (len != 4) {
-				printf("? got %u bytes\n", len);
-				return CMD_FAILED;
+	printf("Press Enter to interrupt.\n");
+	(void) diag_os_ipending();  //must be done outside the loop first
+	t0 = diag_os_gethrt();
+	tshow = t0;
+	while (!diag_os_ipending()) {
+		unsigned long long ts = diag_os_gethrt();
+		uint64_t t_us;
+
+		if (watch_read(&wl, sbuf)) {
+			printf("\nread failed after %lu samples\n", nsamples);
+			goto badexit;
+		}
+		nsamples += 1;
+		t_us = diag_os_hrtus(ts - t0);	//timestamped at the start of the sample's first request
+		if (wt.base) {
+			rv = watch_trig(&wt, &wl, t_us, sbuf);
+			if (rv < 0) {
+				goto badexit;
 			}
-		} else if (npstate == NP_NPKCONN) {
-			if (npk_RMBA(wbuf, addr, 4)) {
-				printf("RMBA problem\n");
-				return CMD_FAILED;
+			if (rv > 0) {
+				break;
+			}
+		} else {
+			if (outf) {
+				npw_sample(outf, &wl, binary, t_us, sbuf);
+			}
+			if (count && (nsamples >= count)) {
+				break;
 			}
 		}
+		ts = diag_os_gethrt();
+		if (diag_os_hrtus(ts - tshow) >= (WATCH_SHOWMS * 1000ULL)) {
+			elapsed = diag_os_hrtus(ts - t0);
+			rate = elapsed ? (nsamples * 1E6 / elapsed) : 0;
+			watch_show(&wl, sbuf, single, nsamples, rate);
+			tshow = ts;
+		}
+	}
+	elapsed = diag_os_hrtus(diag_os_gethrt() - t0);
+	rate = elapsed ? (nsamples * 1E6 / elapsed) : 0;
+	if (nsamples) {
+		watch_show(&wl, sbuf, single, nsamples, rate);
+	}
+	printf("\n%lu samples in %.1f s : %.1f samples/s\n", nsamples, elapsed / 1E6, rate);
+	if (wt.f) {
+		printf("interrupted : %s has only %lu of %lu samples after the trigger\n",
+		       wt.fname, wt.post - wt.postleft, wt.post);
+	}
+	if (wt.base) {
+		snprintf(details, sizeof(details), "samples=%lu rate=%.1f captures=%lu", nsamples, rate, wt.ncapt);
+	} else {
+		snprintf(details, sizeof(details), "samples=%lu rate=%.1f", nsamples, rate);
+	}
+	np_result("watch", "ok", details);
 
-		printf("\r0x%0X: %02X %02X %02X %02X", addr, wbuf[0], wbuf[1], wbuf[2], wbuf[3]);
-		fflush(stdout);
+	if (outf) {
+		fclose(outf);
 	}
-	printf("\n");
+	if (wt.f) {
+		fclose(wt.f);
+	}
+	npw_ring_free(&wt.ring);
+	free(sbuf);
 	return CMD_OK;
+
+badexit:
+	nptrace_dump(&npsess.trace, __func__);
+	snprintf(details, sizeof(details), "samples=%lu", nsamples);
+	np_result("watch", "fail", details);
+	if (outf) {
+		fclose(outf);
+	}
+	if (wt.f) {
+		fclose(wt.f);
+	}
+	npw_ring_free(&wt.ring);
+	free(sbuf);
+	return CMD_FAILED;
+}
+
+enum cli_retval cmd_watch(int argc, char **argv) {
+	enum cli_retval rv;
+
+	npwire_begin(&npsess, "watch");
+	rv = watch(argc, argv);
+	npwire_end(&npsess);
+	return rv;
 }
 
 /** encrypt buffer in-place
@@ -1196,7 +2121,7 @@ static bool set_keyset(u32 s27k) {
 	unsigned i;
 	for (i=0; known_keys[i].s27k != 0; i++) {
 		if (s27k == known_keys[i].s27k) {
-			nisecu.keyset = &known_keys[i];
+			npsess.ecu.keyset = &known_keys[i];
 			return 1;
 		}
 	}
@@ -1205,7 +2130,7 @@ static bool set_keyset(u32 s27k) {
 
 #define S27K_DEFAULTADDR    0xffff8416UL
 #define S27K_SEARCHSTART    0xffff8000UL
-#define S27K_SEARCHEND  0xffffA000UL    //on 7055, 7058 targets this will be adequate. TODO : adjust according to nisecu.flashdev ?
+#define S27K_SEARCHEND  0xffffA000UL    //on 7055, 7058 targets this will be adequate. TODO : adjust according to npsess.ecu.flashdev ?
 #define S27K_SEARCHSIZE 0x80    //search this many bytes at a time
 
 /* attempt to extract sid27 key by dumping RAM progressively. */
@@ -1218,7 +2143,7 @@ enum cli_retval cmd_guesskey(int argc, char **argv) {
 	u32 foundaddr;
 	const struct keyset_t *gkeyset;
 
-	if (npstate != NP_NORMALCONN) {
+	if (npsess.state != NP_NORMALCONN) {
 		printf("Must be connected normally (nc command) !\n");
 		return CMD_FAILED;
 	}
@@ -1233,7 +2158,7 @@ enum cli_retval cmd_guesskey(int argc, char **argv) {
 	nisreq.len=2;
 	nisreq.data=txdata;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(&npsess, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		printf("couldn't 2701\n");
 		return -1;
@@ -1285,19 +2210,247 @@ enum cli_retval cmd_guesskey(int argc, char **argv) {
 	return CMD_FAILED;
 
 guesskey_found:
-	gkeyset = nisecu.keyset;
+	gkeyset = npsess.ecu.keyset;
 	printf("keyset %08X found @ 0x%08X and saved !\n", gkeyset->s27k, foundaddr);
 	return CMD_OK;
 }
 
 
+/*** offline keyset search in ROM dumps
+ *
+ * Every s27k / s36k1 of known_keys[] is a pattern; the ROM is scanned once at 2-byte
+ * alignment and each u32 is checked against all patterns at the same time :
+ * a bitmap of the upper 16 bits rejects almost everything, the rest is bsearch()ed
+ * in the sorted pattern table.
+ *
+ * SH code loads 32-bit constants with "mov.l @(disp,PC),Rn" (0xDndd) from a literal pool;
+ * a hit that is actually referenced by such an instruction is much more likely to be a
+ * real key than a random match in calibration data.
+ *
+ * The scan is single-threaded on purpose : a 1 MB ROM takes a few ms, less than reading the file.
+ */
+struct romkey_pat {
+	u32 val;
+	unsigned ksi;	/** index in known_keys[] */
+	bool is_s36;	/** else s27k */
+};
+
+struct romkey_cand {
+	unsigned ksi;
+	unsigned score;
+	long ofs27;	/** ROM offset of s27k, -1 if not found */
+	long ofs36;
+	bool ref27;	/** referenced by a mov.l @(disp,PC) */
+	bool ref36;
+};
+
+#define ROMKEYS_SHOWMAX 8
+#define MOVL_PC_MAXDISP (255 * 4)
+
+static int romkey_patcmp(const void *a, const void *b) {
+	const struct romkey_pat *pa = a;
+	const struct romkey_pat *pb = b;
+	if (pa->val < pb->val) {
+		return -1;
+	}
+	return (pa->val > pb->val);
+}
+
+static int romkey_candcmp(const void *a, const void *b) {
+	const struct romkey_cand *ca = a;
+	const struct romkey_cand *cb = b;
+	return (int) cb->score - (int) ca->score;
+}
+
+/** check if the literal at <ofs> is loaded by a "mov.l @(disp,PC),Rn" */
+static bool romkey_is_movl_target(const u8 *rom, u32 siz, u32 ofs) {
+	u32 pc, pcmin;
+
+	if (ofs & 3) {
+		return 0;	//mov.l literals are always aligned
+	}
+	pcmin = (ofs > (MOVL_PC_MAXDISP + 4)) ? (ofs - MOVL_PC_MAXDISP - 4) : 0;
+	for (pc = pcmin; (pc + 4) <= ofs; pc += 2) {
+		u16 opc;
+		if ((pc + 2) > siz) {
+			break;
+		}
+		opc = (rom[pc] << 8) | rom[pc + 1];
+		if ((opc & 0xF000) != 0xD000) {
+			continue;
+		}
+		if (((pc & ~3UL) + 4 + ((opc & 0xFF) * 4)) == ofs) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* romkeys <file> : find keysets in a ROM dump */
+enum cli_retval cmd_romkeys(int argc, char **argv) {
+	FILE *fpl;
+	u8 *rom = NULL;
+	u8 *bitmap = NULL;
+	struct romkey_pat *pats = NULL;
+	struct romkey_cand *cands = NULL;
+	unsigned numks, numpats, i;
+	u32 siz, ofs;
+	unsigned long t0;
+	enum cli_retval rv = CMD_FAILED;
+
+	if (argc != 2) {
+		return CMD_USAGE;
+	}
+
+	if ((fpl = fopen(argv[1], "rb"))==NULL) {
+		printf("Cannot open %s !\n", argv[1]);
+		return CMD_FAILED;
+	}
+	siz = flen(fpl);
+	if (siz < 4) {
+		printf("file too small\n");
+		fclose(fpl);
+		return CMD_FAILED;
+	}
+	if (diag_malloc(&rom, siz)) {
+		printf("malloc prob\n");
+		fclose(fpl);
+		return CMD_FAILED;
+	}
+	if (fread(rom, 1, siz, fpl) != siz) {
+		printf("fread prob !?\n");
+		fclose(fpl);
+		goto exit;
+	}
+	fclose(fpl);
+
+	for (numks = 0; known_keys[numks].s27k != 0; numks++) {}
+	numpats = 2 * numks;
+
+	if (diag_calloc(&pats, numpats) ||
+	    diag_calloc(&cands, numks) ||
+	    diag_calloc(&bitmap, 0x10000 / 8)) {
+		printf("malloc prob\n");
+		goto exit;
+	}
+
+	for (i = 0; i < numks; i++) {
+		pats[2*i].val = known_keys[i].s27k;
+		pats[2*i].ksi = i;
+		pats[2*i].is_s36 = 0;
+		pats[2*i + 1].val = known_keys[i].s36k1;
+		pats[2*i + 1].ksi = i;
+		pats[2*i + 1].is_s36 = 1;
+		cands[i].ksi = i;
+		cands[i].ofs27 = -1;
+		cands[i].ofs36 = -1;
+	}
+	for (i = 0; i < numpats; i++) {
+		u16 hi = pats[i].val >> 16;
+		bitmap[hi / 8] |= 1 << (hi % 8);
+	}
+	qsort(pats, numpats, sizeof(*pats), romkey_patcmp);
+
+	t0 = diag_os_getms();
+	for (ofs = 0; (ofs + 4) <= siz; ofs += 2) {
+		struct romkey_pat key, *match;
+		u16 hi = (rom[ofs] << 8) | rom[ofs + 1];
+
+		if (!(bitmap[hi / 8] & (1 << (hi % 8)))) {
+			continue;
+		}
+		key.val = reconst_32(&rom[ofs]);
+		match = bsearch(&key, pats, numpats, sizeof(*pats), romkey_patcmp);
+		if (!match) {
+			continue;
+		}
+		//there may be duplicate values in the table; rewind to the first one
+		while ((match > pats) && (match[-1].val == key.val)) {
+			match--;
+		}
+		for (; (match < &pats[numpats]) && (match->val == key.val); match++) {
+			struct romkey_cand *kc = &cands[match->ksi];
+			bool ref = romkey_is_movl_target(rom, siz, ofs);
+			if (match->is_s36) {
+				if ((kc->ofs36 < 0) || (ref && !kc->ref36)) {
+					kc->ofs36 = ofs;
+					kc->ref36 = ref;
+				}
+			} else {
+				if ((kc->ofs27 < 0) || (ref && !kc->ref27)) {
+					kc->ofs27 = ofs;
+					kc->ref27 = ref;
+				}
+			}
+		}
+	}
+
+	/* score : each key found counts, a key that's actually loaded by code counts more,
+	 * and having both halves of the keyset is the best sign. */
+	for (i = 0; i < numks; i++) {
+		struct romkey_cand *kc = &cands[i];
+		kc->score = 0;
+		if (kc->ofs27 >= 0) {
+			kc->score += 10 + (kc->ref27 ? 5 : 0);
+		}
+		if (kc->ofs36 >= 0) {
+			kc->score += 10 + (kc->ref36 ? 5 : 0);
+		}
+		if ((kc->ofs27 >= 0) && (kc->ofs36 >= 0)) {
+			kc->score += 10;
+		}
+	}
+	qsort(cands, numks, sizeof(*cands), romkey_candcmp);
+
+	printf("Scanned %lu bytes against %u keysets in %lu ms.\n",
+	       (unsigned long) siz, numks, diag_os_getms() - t0);
+
+	if (!cands[0].score) {
+		printf("No known keyset found in ROM. Try gk once connected.\n");
+		goto exit;
+	}
+
+	printf("rank\tscore\tSID27 key\t@ offset\tSID36 key1\t@ offset\n");
+	for (i = 0; (i < numks) && (i < ROMKEYS_SHOWMAX); i++) {
+		const struct romkey_cand *kc = &cands[i];
+		const struct keyset_t *ks = &known_keys[kc->ksi];
+		if (!kc->score) {
+			break;
+		}
+		printf("%u\t%u\t0x%08lX\t", i, kc->score, (unsigned long) ks->s27k);
+		if (kc->ofs27 >= 0) {
+			printf("0x%06lX%s\t", (unsigned long) kc->ofs27, kc->ref27 ? "*" : " ");
+		} else {
+			printf("--------\t");
+		}
+		printf("0x%08lX\t", (unsigned long) ks->s36k1);
+		if (kc->ofs36 >= 0) {
+			printf("0x%06lX%s\n", (unsigned long) kc->ofs36, kc->ref36 ? "*" : " ");
+		} else {
+			printf("--------\n");
+		}
+	}
+	printf("(* : loaded by mov.l @(disp,PC) )\n"
+	       "Best candidate : use \"setkeys 0x%08lX\" after connecting.\n",
+	       (unsigned long) known_keys[cands[0].ksi].s27k);
+	rv = CMD_OK;
+
+exit:
+	free(bitmap);
+	free(cands);
+	free(pats);
+	free(rom);
+	return rv;
+}
+
+
 
 #define KERNEL_MAXSIZE_SUB 8*1024U  //For SH7058, Subaru requires it to fit between 0xFFFF3000 and 0xFFFF5000
 
 /* Does a complete SID 27 + 34 + 36 + 31 sequence to run the given kernel payload file.
  * Pads the input payload up to multiple of 4 bytes to make SID36 happy
  */
-enum cli_retval cmd_sprunkernel(int argc, char **argv) {
+static enum cli_retval sprunkernel(int argc, char **argv) {
 	uint32_t file_len, pl_len, load_addr;
 	FILE *fpl;
 	uint8_t *pl_encr;   //encrypted payload buffer
@@ -1309,7 +2462,7 @@ enum cli_retval cmd_sprunkernel(int argc, char **argv) {
 		return CMD_USAGE;
 	}
 
-	const struct flashdev_t *fdt = nisecu.flashdev;
+	const struct flashdev_t *fdt = npsess.ecu.flashdev;
 	if (!fdt) {
 		printf("device type not set. Try \"setdev ?\"\n");
 		return CMD_FAILED;
@@ -1326,7 +2479,7 @@ enum cli_retval cmd_sprunkernel(int argc, char **argv) {
 		return CMD_FAILED;
 	}
 
-	if (npstate != NP_NORMALCONN) {
+	if (npsess.state != NP_NORMALCONN) {
 		printf("Must be connected normally (nc command) !\n");
 		return CMD_FAILED;
 	}
@@ -1367,14 +2520,14 @@ enum cli_retval cmd_sprunkernel(int argc, char **argv) {
 	}
 
 	/* sid27 securityAccess */
-	if (sub_sid27_unlock()) {
+	if (sub_sid27_unlock(&npsess)) {
 		printf("\nsid27 problem\n");
 		goto badexit;
 	}
 	printf("\nsid27 done.\n");
 
 	/* sid10 diagnosticSession */
-	if (sub_sid10_diagsession()) {
+	if (sub_sid10_diagsession(&npsess)) {
 		printf("\nsid10 problem\n");
 		goto badexit;
 	}
@@ -1388,14 +2541,15 @@ enum cli_retval cmd_sprunkernel(int argc, char **argv) {
 
 	update_params();
 
-	errval=diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_SETSPEED, (void *) &set);
+	errval=diag_l2_ioctl(npsess.conn, DIAG_IOCTL_SETSPEED, (void *) &set);
 	if (errval) {
 		printf("\nsprunkernel: could not setspeed\n");
 		return -1;
 	}
+	npwire_bitrate(&npsess, set.speed);
 
 	/* sid34 requestDownload */
-	if (sub_sid34_reqdownload(load_addr, pl_len)) {
+	if (sub_sid34_reqdownload(&npsess, load_addr, pl_len)) {
 		printf("\nsid34 problem for payload\n");
 		goto badexit;
 	}
@@ -1405,14 +2559,15 @@ enum cli_retval cmd_sprunkernel(int argc, char **argv) {
 	sub_encrypt_buf(pl_encr, (uint32_t) pl_len);
 
 	/* sid36 transferData for payload */
-	if (sub_sid36_transferdata(load_addr, pl_encr, (uint32_t) pl_len)) {
+	if (sub_sid36_transferdata(&npsess, load_addr, pl_encr, (uint32_t) pl_len)) {
 		printf("\nsid 36 problem for payload\n");
 		goto badexit;
 	}
 	printf("sid36 done for payload.\n");
+	npwire_payload(&npsess, pl_len);
 
 	/* sid34 requestDownload - checksum bypass put just after payload */
-	if (sub_sid34_reqdownload((uint32_t) (load_addr + pl_len), 4)) {
+	if (sub_sid34_reqdownload(&npsess, (uint32_t) (load_addr + pl_len), 4)) {
 		printf("\nsid34 problem for checksum bypass\n");
 		goto badexit;
 	}
@@ -1421,7 +2576,7 @@ enum cli_retval cmd_sprunkernel(int argc, char **argv) {
 	sub_encrypt_buf(cks_bypass, (uint32_t) 4);
 
 	/* sid36 transferData for checksum bypass */
-	if (sub_sid36_transferdata((uint32_t) (load_addr + pl_len), cks_bypass, (uint32_t) 4)) {
+	if (sub_sid36_transferdata(&npsess, (uint32_t) (load_addr + pl_len), cks_bypass, (uint32_t) 4)) {
 		printf("\nsid 36 problem for checksum bypass\n");
 		goto badexit;
 	}
@@ -1430,7 +2585,7 @@ enum cli_retval cmd_sprunkernel(int argc, char **argv) {
 	/* SID 37 TransferExit does not exist on all Subaru ROMs */
 
 	/* RAMjump ! */
-	if (sub_sid31_startRoutine()) {
+	if (sub_sid31_startRoutine(&npsess)) {
 		printf("sid 31 problem\n");
 		goto badexit;
 	}
@@ -1446,30 +2601,41 @@ enum cli_retval cmd_sprunkernel(int argc, char **argv) {
 	}
 
 	const char *npk_id;
-	npk_id = get_npk_id();
+	npk_id = get_npk_id(&npsess);
 	if (npk_id) {
 		printf("Connected to kernel: %s\n", npk_id);
 	}
+	cache_note(0, npk_id);
 
 	printf("You may now use kernel-specific commands.\n");
-	npstate = NP_NPKCONN;
+	npsess.state = NP_NPKCONN;
 
 	return CMD_OK;
 
 badexit:
+	nptrace_dump(&npsess.trace, __func__);
 	free(pl_encr);
 	fclose(fpl);
 	return CMD_FAILED;
 
 }
 
+enum cli_retval cmd_sprunkernel(int argc, char **argv) {
+	enum cli_retval rv;
+
+	npwire_begin(&npsess, "sprunkernel");
+	rv = sprunkernel(argc, argv);
+	npwire_end(&npsess);
+	return rv;
+}
+
 
 #define KERNEL_MAXSIZE 10*1024U //warn for kernels larger than this
 
 /* Does a complete SID 27 + 34 + 36 + BF sequence to run the given kernel payload file.
  * Pads the input payload up to multiple of 32 bytes to make SID36 happy
  */
-enum cli_retval cmd_runkernel(int argc, char **argv) {
+static enum cli_retval runkernel(int argc, char **argv) {
 	const struct keyset_t *keyset;
 	uint32_t sid27key;
 	uint32_t sid36key;
@@ -1483,12 +2649,12 @@ enum cli_retval cmd_runkernel(int argc, char **argv) {
 		return CMD_USAGE;
 	}
 
-	if (npstate != NP_NORMALCONN) {
+	if (npsess.state != NP_NORMALCONN) {
 		printf("Must be connected normally (nc command) !\n");
 		return CMD_FAILED;
 	}
 
-	keyset = nisecu.keyset;
+	keyset = npsess.ecu.keyset;
 	if (!keyset) {
 		printf("No keyset selected - try \"setkeys\"\n");
 		return CMD_FAILED;
@@ -1532,13 +2698,13 @@ enum cli_retval cmd_runkernel(int argc, char **argv) {
 	}
 
 	/* re-use NP 7 to get the SID27 done */
-	if (sid27_unlock(1, sid27key)) {
+	if (sid27_unlock(&npsess, 1, sid27key)) {
 		printf("sid27 problem\n");
 		goto badexit;
 	}
 
 	/* SID 34 80 : */
-	if (sid3480()) {
+	if (sid3480(&npsess)) {
 		printf("sid 34 80 problem\n");
 		goto badexit;
 	}
@@ -1548,21 +2714,22 @@ enum cli_retval cmd_runkernel(int argc, char **argv) {
 	uint16_t cks = 0;
 	cks = encrypt_buf(pl_encr, (uint32_t) pl_len, sid36key);
 
-	if (sid36(pl_encr, (uint32_t) pl_len)) {
+	if (sid36(&npsess, pl_encr, (uint32_t) pl_len)) {
 		printf("sid 36 problem\n");
 		goto badexit;
 	}
 	printf("SID 36 done.\n");
+	npwire_payload(&npsess, pl_len);
 
 	/* SID 37 TransferExit */
-	if (sid37(cks)) {
+	if (sid37(&npsess, cks)) {
 		printf("sid 37 problem\n");
 		goto badexit;
 	}
 	printf("SID 37 done.\n");
 
 	/* shit gets real here : RAMjump ! */
-	if (sidBF()) {
+	if (sidBF(&npsess)) {
 		printf("RAMjump problem\n");
 		goto badexit;
 	}
@@ -1572,28 +2739,42 @@ enum cli_retval cmd_runkernel(int argc, char **argv) {
 
 	printf("SID BF done.\nECU now running from RAM ! Disabling periodic keepalive;\n");
 
+	/* the keyset is now confirmed for this ECUID */
+	(void) keydb_learn((const char *) npsess.ecu.ecuid, sid27key);
+
 	if (npkern_init()) {
 		printf("Problem starting kernel; try to disconnect + set speed + connect again.\n");
 		return CMD_FAILED;
 	}
 
 	const char *npk_id;
-	npk_id = get_npk_id();
+	npk_id = get_npk_id(&npsess);
 	if (npk_id) {
 		printf("Connected to kernel: %s\n", npk_id);
 	}
+	cache_note(sid27key, npk_id);
 
 	printf("You may now use kernel-specific commands.\n");
-	npstate = NP_NPKCONN;
+	npsess.state = NP_NPKCONN;
 
 	return CMD_OK;
 
 badexit:
+	nptrace_dump(&npsess.trace, __func__);
 	free(pl_encr);
 	fclose(fpl);
 	return CMD_FAILED;
 }
 
+enum cli_retval cmd_runkernel(int argc, char **argv) {
+	enum cli_retval rv;
+
+	npwire_begin(&npsess, "runkernel");
+	rv = runkernel(argc, argv);
+	npwire_end(&npsess);
+	return rv;
+}
+
 
 /** set speed + do startcomms, sabotage L2 modeflags for short headers etc.
  * Also disables keepalive
@@ -1610,27 +2791,28 @@ static int npkern_init(void) {
 	nisreq.data=txdata;
 
 	/* Assume kernel is freshly booted : disable keepalive and setspeed */
-	global_l2_conn->tinterval = -1;
+	npsess.conn->tinterval = -1;
 
-	set.speed = (unsigned) nparam_kspeed.val;
+	set.speed = (unsigned) npsess.kspeed;
 	set.databits = diag_databits_8;
 	set.stopbits = diag_stopbits_1;
 	set.parflag = diag_par_n;
 
-	errval=diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_SETSPEED, (void *) &set);
+	errval=diag_l2_ioctl(npsess.conn, DIAG_IOCTL_SETSPEED, (void *) &set);
 	if (errval) {
 		printf("npk_init: could not setspeed\n");
 		return -1;
 	}
-	(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+	npwire_bitrate(&npsess, set.speed);
+	(void) diag_l2_ioctl(npsess.conn, DIAG_IOCTL_IFLUSH, NULL);
 
-	dlproto = (struct diag_l2_14230 *)global_l2_conn->diag_l2_proto_data;
+	dlproto = (struct diag_l2_14230 *)npsess.conn->diag_l2_proto_data;
 	dlproto->modeflags = ISO14230_SHORTHDR | ISO14230_LENBYTE | ISO14230_FMTLEN;
 
 	/* StartComm */
 	txdata[0] = 0x81;
 	nisreq.len = 1;
-	rxmsg = diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg = np_l2_request(&npsess, &nisreq, &errval);
 	if (!rxmsg) {
 		printf("npk_init: startcomm failed : %d\n", errval);
 		return -1;
@@ -1688,7 +2870,7 @@ static int npk_RMBA(uint8_t *dest, uint32_t addr, uint32_t len) {
 		}
 		txdata[4] = (uint8_t) curlen;
 
-		rxmsg = diag_l2_request(global_l2_conn, &nisreq, &errval);
+		rxmsg = np_l2_request(&npsess, &nisreq, &errval);
 		if (!rxmsg) {
 			printf("npk sid23 failed : %d\n", errval);
 			return -1;
@@ -1702,6 +2884,7 @@ static int npk_RMBA(uint8_t *dest, uint32_t addr, uint32_t len) {
 		}
 		memcpy(dest, &rxmsg->data[1], curlen);
 		diag_freemsg(rxmsg);
+		npwire_payload(&npsess, curlen);
 		len -= curlen;
 		dest += curlen;
 		addr += curlen;
@@ -1711,6 +2894,34 @@ static int npk_RMBA(uint8_t *dest, uint32_t addr, uint32_t len) {
 }
 
 
+#define RAMREAD_CHUNK (RDPLAN_MAXLEN * 8)	//bytes per file write in npk_dump(); whole RMBA requests
+
+/** read <len> bytes with back-to-back full-size RMBA requests, so that only the last one can be
+ * short (256-byte reads would cost a 251-byte and a 5-byte request each).
+ * @param pg : progress, NULL if none; <done> is the number of bytes read before this call
+ *
+ * Assumes init was done before
+ * ret 0 if ok
+ */
+static int npk_ramread(uint8_t *dest, uint32_t addr, uint32_t len, struct npprog *pg, unsigned long done) {
+	while (len) {
+		uint32_t curlen = (len > RDPLAN_MAXLEN) ? RDPLAN_MAXLEN : len;
+
+		if (npk_RMBA(dest, addr, curlen)) {
+			return -1;
+		}
+		dest += curlen;
+		addr += curlen;
+		len -= curlen;
+		done += curlen;
+		if (pg) {
+			npprog_update(pg, addr, done);
+		}
+	}
+	return 0;
+}
+
+
 /** receive a bunch of dumpblocks (caller already send the dump request).
  * doesn't write the first "skip_start" bytes
  * ret 0 if ok
@@ -1724,8 +2935,7 @@ static int npk_rxrawdump(uint8_t *dest, uint32_t skip_start, uint32_t numblocks)
 		//loop for every 32-byte response
 
 		/* grab header. Assumes we only get "FMT PRC <data> cks" replies */
-		errval = diag_l1_recv(global_l2_conn->diag_link->l2_dl0d,
-		                      rxbuf, 3 + 32, (unsigned) (25 + nparam_rxe.val));
+		errval = np_rawrecv(NPSTAT_NPKDUMP, rxbuf, 3 + 32);
 		if (errval < 0) {
 			printf("dl1recv err\n");
 			goto badexit;
@@ -1749,10 +2959,13 @@ static int npk_rxrawdump(uint8_t *dest, uint32_t skip_start, uint32_t numblocks)
 		uint32_t cplen = 34 - datapos;
 		memcpy(dest, &rxbuf[datapos], cplen);
 		dest += cplen;
+		npwire_payload(&npsess, cplen);
+		npwire_framing(&npsess, 2);	//FMT, cks
 	}   //for
 	return 0;
 
 badexit:
+	nptrace_dump(&npsess.trace, __func__);
 	return -1;
 }
 
@@ -1768,10 +2981,11 @@ static int npk_dump(FILE *fpl, uint32_t start, uint32_t len, bool eep) {
 	int errval;
 
 	bool ram = 0;
+	struct npprog pg;
 
 	nisreq.data=txdata;
 
-	if (start > 0xFF800000) {
+	if (start >= RDPLAN_RAMSTART) {
 		ram = 1;
 	}
 
@@ -1780,11 +2994,38 @@ static int npk_dump(FILE *fpl, uint32_t start, uint32_t len, bool eep) {
 		return -1;
 	}
 
+	npprog_start(&pg, &npsess.prog, eep ? "eepdump" : "dump", start, len);
 	if (npkern_init()) {
 		printf("npk init failed\n");
 		goto badexit;
 	}
 
+	if (ram) {
+		/* RMBA isn't limited to 32-byte blocks : straight to the file in full-size requests */
+		uint8_t rbuf[RAMREAD_CHUNK];
+		uint32_t rdone;
+
+		for (rdone = 0; rdone < len; ) {
+			uint32_t curlen = len - rdone;
+
+			if (curlen > RAMREAD_CHUNK) {
+				curlen = RAMREAD_CHUNK;
+			}
+			if (npk_ramread(rbuf, start + rdone, curlen, &pg, rdone)) {
+				printf("RMBA error!\n");
+				goto badexit;
+			}
+			if (fwrite(rbuf, 1, curlen, fpl) != curlen) {
+				printf("fwrite error\n");
+				goto badexit;
+			}
+			rdone += curlen;
+		}
+		npprog_done(&pg, 1);
+		printf("\n");
+		return 0;
+	}
+
 	uint32_t skip_start = start & (32 - 1); //if unaligned, we'll be receiving this many extra bytes
 	uint32_t iter_addr = start - skip_start;
 	uint32_t willget = (skip_start + len + 31) & ~(32 - 1);
@@ -1795,94 +3036,258 @@ static int npk_dump(FILE *fpl, uint32_t start, uint32_t len, bool eep) {
 #define NP10_MAXBLKS    8   //# of blocks to request per loop. Too high might flood us
 	nisreq.len = 6;
 
-	unsigned t0 = diag_os_getms();
-
 	while (willget) {
 		uint8_t buf[NP10_MAXBLKS * 32];
 		uint32_t numblocks;
 
-		unsigned curspeed, tleft;
-		unsigned long chrono;
-
-		chrono = diag_os_getms() - t0;
-		if (!chrono) {
-			chrono += 1;
-		}
-		curspeed = 1000 * len_done / chrono;    //avg B/s
-		if (!curspeed) {
-			curspeed += 1;
-		}
-		tleft = (willget / curspeed) % 9999;    //s
-		printf("\rnpk dump @ 0x%08X, %5u B/s, %4u s remaining\t", iter_addr, curspeed, tleft);
-		fflush(stdout);
+		npprog_update(&pg, iter_addr, len_done);
 
 		numblocks = willget / 32;
 
 		if (numblocks > NP10_MAXBLKS) {
 			numblocks = NP10_MAXBLKS;                           //ceil
 
-		}
-		txdata[2] = numblocks >> 8;
-		txdata[3] = numblocks >> 0;
+		}
+		txdata[2] = numblocks >> 8;
+		txdata[3] = numblocks >> 0;
+
+		uint32_t curblock = (iter_addr / 32);
+		txdata[4] = curblock >> 8;
+		txdata[5] = curblock >> 0;
+
+		errval = npstat_send(&npsess, NPSTAT_NPKDUMP, &nisreq);
+		if (errval) {
+			printf("l2_send error!\n");
+			goto badexit;
+		}
+		if (npk_rxrawdump(buf, skip_start, numblocks)) {
+			printf("rxrawdump failed\n");
+			goto badexit;
+		}
+
+		/* don't count skipped first bytes */
+		uint32_t cplen = (numblocks * 32) - skip_start; //this is the actual # of valid bytes in buf[]
+		skip_start = 0;
+
+		/* and drop extra bytes at the end */
+		uint32_t extrabytes = (cplen + len_done);   //hypothetical new length
+		if (extrabytes > len) {
+			cplen -= (extrabytes - len);
+			//thus, (len_done + cplen) will not exceed len
+		}
+		uint32_t done = fwrite(buf, 1, cplen, fpl);
+		if (done != cplen) {
+			printf("fwrite error\n");
+			goto badexit;
+		}
+
+		/* increment addr, len, etc */
+		len_done += cplen;
+		iter_addr += (numblocks * 32);
+		willget -= (numblocks * 32);
+
+	}   //while
+	npprog_update(&pg, iter_addr, len_done);
+	npprog_done(&pg, 1);
+	printf("\n");
+	return 0;
+
+badexit:
+	nptrace_dump(&npsess.trace, __func__);
+	npprog_done(&pg, 0);
+	npstat_flush(&npsess, NPSTAT_NPKDUMP, 0);
+	fclose(fpl);
+	return -1;
+}
+
+
+#define RAMSNAP_START 0xFFFF8000	//default region : 0xFFFF8000 - 0xFFFFFFFF
+#define RAMSNAP_LEN 0x8000
+
+/* ramsnap extract <series> <n> <file> : write snapshot #n (from 0) of a series as a raw binary */
+static enum cli_retval ramsnap_extract(int argc, char **argv) {
+	struct npsnap ns;
+	unsigned long idx, want;
+	uint64_t t_us = 0;
+	FILE *outf;
+	int rv;
+
+	if (argc != 5) {
+		return CMD_USAGE;
+	}
+	want = strtoul(argv[3], NULL, 0);
+	if (npsnap_open(&ns, argv[2])) {
+		printf("Cannot open %s, or not a snapshot series !\n", argv[2]);
+		return CMD_FAILED;
+	}
+	for (idx = 0; (rv = npsnap_next(&ns, &t_us)) == 1; idx++) {
+		if (idx == want) {
+			break;
+		}
+	}
+	if (rv != 1) {
+		printf("%s\n", (rv < 0) ? "corrupt series file" : "no such snapshot");
+		npsnap_close(&ns);
+		return CMD_FAILED;
+	}
+
+	outf = fopen(argv[4], "wb");
+	if (!outf) {
+		printf("Cannot open %s !\n", argv[4]);
+		npsnap_close(&ns);
+		return CMD_FAILED;
+	}
+	if (fwrite(ns.cur, 1, ns.len, outf) != ns.len) {
+		printf("fwrite error\n");
+		fclose(outf);
+		npsnap_close(&ns);
+		return CMD_FAILED;
+	}
+	printf("snapshot %lu (t=%.3f s) : 0x%X bytes @ 0x%08X written to %s\n", want, t_us / 1E6,
+	       (unsigned) ns.len, (unsigned) ns.addr, argv[4]);
+	fclose(outf);
+	npsnap_close(&ns);
+	return CMD_OK;
+}
+
+/* ramsnap <file> [--every=<ms>] [--count=<n>] [--addr=<addr>] [--len=<len>]
+ * snapshot a memory region (whole RAM by default) into a delta-compressed series file,
+ * once, or every <ms> until Enter / <n> snapshots.
+ */
+static enum cli_retval ramsnap(int argc, char **argv) {
+	struct npflag flags[] = {{.name = "every"}, {.name = "count"}, {.name = "addr"}, {.name = "len"}, {.name = NULL}};
+	struct npsnap ns;
+	uint32_t addr = RAMSNAP_START;
+	uint32_t len = RAMSNAP_LEN;
+	unsigned long every = 0;
+	unsigned long count = 1;
+	unsigned long n;
+	unsigned long long hrt0 = 0;
+	unsigned long t0;
+	bool stop = 0;
+	uint8_t *buf;
+	char details[64];
+
+	if ((argc >= 2) && (strcmp(argv[1], "extract") == 0)) {
+		return ramsnap_extract(argc, argv);
+	}
+	argc = take_flags(argc, argv, flags);
+	if (argc != 2) {
+		return CMD_USAGE;
+	}
+	if (flags[0].val) {
+		every = strtoul(flags[0].val, NULL, 0);
+		count = 0;
+	}
+	if (flags[1].val) {
+		count = strtoul(flags[1].val, NULL, 0);
+	}
+	if (flags[2].val) {
+		addr = (uint32_t) strtoul(flags[2].val, NULL, 0);
+	}
+	if (flags[3].val) {
+		len = (uint32_t) strtoul(flags[3].val, NULL, 0);
+	}
+	if (!len || !rdplan_valid(addr, len)) {
+		printf("bad region : must be within ROM, or RAM >= 0x%X\n", RDPLAN_RAMSTART);
+		return CMD_USAGE;
+	}
+
+	if (npsess.state != NP_NPKCONN) {
+		printf("kernel not initialized - try \"runkernel\" or \"initk\"\n");
+		return CMD_FAILED;
+	}
 
-		uint32_t curblock = (iter_addr / 32);
-		txdata[4] = curblock >> 8;
-		txdata[5] = curblock >> 0;
+	buf = malloc(len);
+	if (!buf) {
+		printf("malloc prob\n");
+		return CMD_FAILED;
+	}
+	if (npsnap_create(&ns, argv[1], addr, len)) {
+		printf("Cannot create %s !\n", argv[1]);
+		free(buf);
+		return CMD_FAILED;
+	}
+	if (npkern_init()) {
+		printf("npk init failed\n");
+		goto badexit;
+	}
 
-		if (ram) {
-			errval = npk_RMBA(buf, iter_addr + skip_start, (numblocks * 32) - skip_start);
-			if (errval) {
-				printf("RMBA error!\n");
-				goto badexit;
-			}
-		} else {
-			errval = diag_l2_send(global_l2_conn, &nisreq);
-			if (errval) {
-				printf("l2_send error!\n");
-				goto badexit;
-			}
-			if (npk_rxrawdump(buf, skip_start, numblocks)) {
-				printf("rxrawdump failed\n");
-				goto badexit;
+	printf("Snapshots of 0x%X bytes @ 0x%08X", (unsigned) len, (unsigned) addr);
+	if (every) {
+		printf(" every %lu ms", every);
+	}
+	printf("; press Enter to stop.\n");
+	(void) diag_os_ipending();  //must be done outside the loop first
+	t0 = diag_os_getms();
+	for (n = 0; (!count || (n < count)) && !stop; n++) {
+		unsigned long long ts, took;
+		long written;
+
+		/* if a snapshot takes longer than the period, the next one starts right away */
+		while ((diag_os_getms() - t0) < (n * every)) {
+			if (diag_os_ipending()) {
+				stop = 1;
+				break;
 			}
+			diag_os_millisleep(10);
+		}
+		if (stop || diag_os_ipending()) {
+			break;
 		}
 
-		/* don't count skipped first bytes */
-		uint32_t cplen = (numblocks * 32) - skip_start; //this is the actual # of valid bytes in buf[]
-		skip_start = 0;
-
-		/* and drop extra bytes at the end */
-		uint32_t extrabytes = (cplen + len_done);   //hypothetical new length
-		if (extrabytes > len) {
-			cplen -= (extrabytes - len);
-			//thus, (len_done + cplen) will not exceed len
+		ts = diag_os_gethrt();
+		if (!n) {
+			hrt0 = ts;
 		}
-		uint32_t done = fwrite(buf, 1, cplen, fpl);
-		if (done != cplen) {
-			printf("fwrite error\n");
+		if (npk_ramread(buf, addr, len, NULL, 0)) {
+			printf("\nRMBA error after %lu snapshots\n", ns.count);
 			goto badexit;
 		}
+		took = diag_os_hrtus(diag_os_gethrt() - ts);
+		written = npsnap_add(&ns, diag_os_hrtus(ts - hrt0), buf);
+		if (written < 0) {
+			printf("\nwrite error\n");
+			goto badexit;
+		}
+		printf("\rsnapshot %lu : %.2f s (%.0f B/s), +%ld, %llu bytes in file  ", ns.count,
+		       took / 1E6, took ? (len * 1E6 / took) : 0, written, ns.filebytes);
+		fflush(stdout);
+	}
 
-		/* increment addr, len, etc */
-		len_done += cplen;
-		iter_addr += (numblocks * 32);
-		willget -= (numblocks * 32);
-
-	}   //while
-	printf("\n");
-	return 0;
+	printf("\n%lu snapshot(s), %llu bytes (raw : %llu)\n", ns.count, ns.filebytes,
+	       (unsigned long long) ns.count * len);
+	snprintf(details, sizeof(details), "snapshots=%lu bytes=%llu", ns.count, ns.filebytes);
+	np_result("ramsnap", "ok", details);
+	npsnap_close(&ns);
+	free(buf);
+	return CMD_OK;
 
 badexit:
-	(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
-	fclose(fpl);
-	return -1;
+	nptrace_dump(&npsess.trace, __func__);
+	snprintf(details, sizeof(details), "snapshots=%lu", ns.count);
+	np_result("ramsnap", "fail", details);
+	npsnap_close(&ns);
+	free(buf);
+	return CMD_FAILED;
 }
 
+enum cli_retval cmd_ramsnap(int argc, char **argv) {
+	enum cli_retval rv;
+
+	npwire_begin(&npsess, "ramsnap");
+	rv = ramsnap(argc, argv);
+	npwire_end(&npsess);
+	return rv;
+}
 
 /* reflash a given block !
+ * flblock <romfile> <blockno> [Y] [--yes]
  */
-enum cli_retval cmd_flblock(int argc, char **argv) {
-	const struct flashdev_t *fdt = nisecu.flashdev;
+static enum cli_retval flblock(int argc, char **argv) {
+	const struct flashdev_t *fdt = npsess.ecu.flashdev;
+	struct npflag flags[] = {{.name = "yes"}, {.name = NULL}};
+	char details[32];
 
 	uint8_t *newdata;   //block data will be copied in this
 
@@ -1890,6 +3295,7 @@ enum cli_retval cmd_flblock(int argc, char **argv) {
 
 	bool practice = 1;  //if set, disable modification to flash
 
+	argc = take_flags(argc, argv, flags);
 	if ((argc < 3) || (argc > 4)) {
 		return CMD_USAGE;
 	}
@@ -1899,7 +3305,7 @@ enum cli_retval cmd_flblock(int argc, char **argv) {
 		return CMD_FAILED;
 	}
 
-	if (npstate != NP_NPKCONN) {
+	if (npsess.state != NP_NPKCONN) {
 		printf("kernel not initialized - try \"runkernel\" or \"initk\"\n");
 		return CMD_FAILED;
 	}
@@ -1917,10 +3323,17 @@ enum cli_retval cmd_flblock(int argc, char **argv) {
 		return CMD_FAILED;
 	}
 
-	if (argc == 4) {
-		if (argv[3][0] == 'Y') {
-			printf("*** FLASH MAY BE MODIFIED ***\n");
-		}
+	snprintf(details, sizeof(details), "block=%u", blockno);
+
+	if (flags[0].val) {
+		/* already confirmed, and nobody would be there to press ENTER */
+		printf("*** FLASH WILL BE MODIFIED ***\n");
+		practice = 0;
+	} else if (npsess.batch) {
+		/* safe answer : only --yes writes in batch mode */
+		printf("*** Batch mode without --yes : practice mode, flash will not be modified ***\n");
+	} else if ((argc == 4) && (argv[3][0] == 'Y')) {
+		printf("*** FLASH MAY BE MODIFIED ***\n");
 		(void) diag_os_ipending();  //must be done outside the loop first
 		printf("*** Last chance : operation will be safely aborted in 3 seconds. ***\n"
 		       "*** Press ENTER to MODIFY FLASH ***\n");
@@ -1929,7 +3342,8 @@ enum cli_retval cmd_flblock(int argc, char **argv) {
 			printf("Proceeding with flash process.\n");
 		} else {
 			printf("Operation aborted; flash was not modified.\n");
-			goto badexit;
+			free(newdata);
+			return CMD_FAILED;
 		}
 		practice = 0;
 	} else {
@@ -1943,18 +3357,31 @@ enum cli_retval cmd_flblock(int argc, char **argv) {
 
 	u32 bstart = fdt->fblocks[blockno].start;
 
-	if (reflash_block(&newdata[bstart], fdt, blockno, practice) == CMD_OK) {
+	if (reflash_block(&npsess, &newdata[bstart], fdt, blockno, practice) == CMD_OK) {
 		printf("Reflash complete.\n");
 		free(newdata);
 		npkern_init();  //forces the kernel to disable write mode
+		snprintf(details, sizeof(details), "block=%u practice=%u", blockno, (unsigned) practice);
+		np_result("flblock", "ok", details);
 		return CMD_OK;
 	}
 
 badexit:
+	nptrace_dump(&npsess.trace, __func__);
+	np_result("flblock", "fail", details);
 	free(newdata);
 	return CMD_FAILED;
 }
 
+enum cli_retval cmd_flblock(int argc, char **argv) {
+	enum cli_retval rv;
+
+	npwire_begin(&npsess, "flblock");
+	rv = flblock(argc, argv);
+	npwire_end(&npsess);
+	return rv;
+}
+
 /** update VIN in onboard eeprom with SID 3B
  *
  * Nissan only; ECU needs to be running stock ROM (not npkern)
@@ -1983,7 +3410,7 @@ enum cli_retval cmd_writevin(int argc, char** argv) {
 		return CMD_USAGE;
 	}
 
-	if (npstate != NP_NORMALCONN) {
+	if (npsess.state != NP_NORMALCONN) {
 		printf("Must be connected normally (nc command) !\n");
 		return CMD_FAILED;
 	}
@@ -1996,7 +3423,7 @@ enum cli_retval cmd_writevin(int argc, char** argv) {
 
 		nisreq.len = 4;
 
-		rxmsg = diag_l2_request(global_l2_conn, &nisreq, &errval);
+		rxmsg = np_l2_request(&npsess, &nisreq, &errval);
 		if (rxmsg == NULL) {
 			return CMD_FAILED;
 		}
@@ -2018,7 +3445,7 @@ enum cli_retval cmd_writevin(int argc, char** argv) {
 
 		nisreq.len = 4;
 
-		rxmsg = diag_l2_request(global_l2_conn, &nisreq, &errval);
+		rxmsg = np_l2_request(&npsess, &nisreq, &errval);
 		if (rxmsg == NULL) {
 			return CMD_FAILED;
 		}
@@ -2040,7 +3467,7 @@ enum cli_retval cmd_writevin(int argc, char** argv) {
 /* collection of numbered test functions - these are the old "np 9" etc functions.
  * stuff in here is doomed to either die or become a normal command
  */
-enum cli_retval cmd_npt(int argc, char **argv) {
+static enum cli_retval npt(int argc, char **argv) {
 	unsigned testnum;
 
 	uint32_t scode; //for SID27
@@ -2072,9 +3499,9 @@ enum cli_retval cmd_npt(int argc, char **argv) {
 			printf("Did not understand %s\n", argv[2]);
 			return CMD_USAGE;
 		}
-		return sid27_unlock(1, scode);
+		return sid27_unlock(&npsess, 1, scode);
 	case 6:
-		return sid27_unlock(2, 0);
+		return sid27_unlock(&npsess, 2, 0);
 		break;  //case 6,7 (sid27)
 	default:
 		printf("test # invalid or deprecated\n");
@@ -2086,22 +3513,432 @@ enum cli_retval cmd_npt(int argc, char **argv) {
 	return CMD_OK;
 }
 
+enum cli_retval cmd_npt(int argc, char **argv) {
+	enum cli_retval rv;
+
+	npwire_begin(&npsess, "npt");
+	rv = npt(argc, argv);
+	npwire_end(&npsess);
+	return rv;
+}
+
+
+/** fill buf with xorshift32 pseudorandom seeds */
+static void keytest_fillseeds(u32 *buf, unsigned n, u32 *state) {
+	u32 x = *state;
+	for (; n; n--) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		*buf++ = x;
+	}
+	*state = x;
+}
+
+#define KEYTEST_CHUNK 0x10000U
+#define KEYTEST_DEFCOUNT (1024 * 1024UL)
+/* keytest [<count>] : time the batch key algos against the reference ones.
+ * Their results are checked by tests/keyalg_test.c. */
+enum cli_retval cmd_keytest(int argc, char **argv) {
+	static const struct {
+		const char *name;
+		void (*scalar)(const uint8_t *seed8, uint8_t *key);
+		void (*batch)(const u32 *seeds, u32 *keys, unsigned n);
+	} algos[] = {
+		{"genkey2", genkey2, genkey2_batch},
+		{"sub_genkey", sub_genkey, sub_genkey_batch},
+	};
+	unsigned long count = KEYTEST_DEFCOUNT;
+	u32 *seeds, *keys, *refkeys;
+	unsigned ai;
+
+	if (argc > 2) {
+		return CMD_USAGE;
+	}
+	if (argc == 2) {
+		if (argv[1][0] == '?') {
+			return CMD_USAGE;
+		}
+		count = (unsigned long) htoi(argv[1]);
+		if (!count) {
+			return CMD_USAGE;
+		}
+	}
+
+	seeds = keys = refkeys = NULL;
+	if (diag_malloc(&seeds, KEYTEST_CHUNK) ||
+	    diag_malloc(&keys, KEYTEST_CHUNK) ||
+	    diag_malloc(&refkeys, KEYTEST_CHUNK)) {
+		printf("malloc prob\n");
+		free(keys);
+		free(seeds);
+		return CMD_FAILED;
+	}
+
+	for (ai = 0; ai < (sizeof(algos) / sizeof(algos[0])); ai++) {
+		unsigned long done, t_batch, t_scalar;
+		unsigned long long us_batch = 0, us_scalar = 0;
+		u32 rngstate = 0x5EED5EED;
+
+		for (done = 0; done < count; done += KEYTEST_CHUNK) {
+			unsigned n = ((count - done) > KEYTEST_CHUNK) ? KEYTEST_CHUNK : (unsigned) (count - done);
+			unsigned i;
+			unsigned long long t0;
+
+			/* seeds are generated outside both timed regions */
+			keytest_fillseeds(seeds, n, &rngstate);
+
+			t0 = diag_os_gethrt();
+			algos[ai].batch(seeds, keys, n);
+			us_batch += diag_os_hrtus(diag_os_gethrt() - t0);
+
+			t0 = diag_os_gethrt();
+			for (i = 0; i < n; i++) {
+				u8 seed8[4], key8[4];
+				write_32b(seeds[i], seed8);
+				algos[ai].scalar(seed8, key8);
+				refkeys[i] = reconst_32(key8);
+			}
+			us_scalar += diag_os_hrtus(diag_os_gethrt() - t0);
+		}
+		t_batch = (unsigned long) (us_batch / 1000);
+		t_scalar = (unsigned long) (us_scalar / 1000);
+
+		printf("%s: %lu seeds. scalar: %lu ms (%lu kseeds/s); batch: %lu ms (%lu kseeds/s)\n",
+		       algos[ai].name, count,
+		       t_scalar, count / (t_scalar ? t_scalar : 1),
+		       t_batch, count / (t_batch ? t_batch : 1));
+	}
+
+	free(refkeys);
+	free(keys);
+	free(seeds);
+	return CMD_OK;
+}
+
+
+#define TUNE_PROBES 8	//requests per p3 value, and raw reads timed, by "tune"
+
+/** one request/response with the normal L2 timings, to check a p3 value
+ * @return 0 if ok
+ */
+static int tune_request(void) {
+	uint8_t ecuid[6];
+
+	if (npsess.state == NP_NPKCONN) {
+		return get_npk_id(&npsess) ? 0 : -1;
+	}
+	return get_ecuid(&npsess, ecuid);
+}
+
+/** send a request and time the raw read of the start of its response, like the dump code does.
+ * @return elapsed ms, or -1 if the response didn't arrive
+ */
+static long tune_rawtime(unsigned probe) {
+	uint8_t txdata[6];
+	uint8_t rxbuf[3 + 32];
+	struct diag_msg nisreq={0};
+	size_t wanted;
+	unsigned long t0;
+	int rv;
+
+	nisreq.data = txdata;
+	if (npsess.state == NP_NPKCONN) {
+		/* one dump block, as in npk_rxrawdump() */
+		txdata[0] = SID_DUMP;
+		txdata[1] = SID_DUMP_ROM;
+		txdata[2] = 0;
+		txdata[3] = 1;
+		txdata[4] = probe >> 8;
+		txdata[5] = probe >> 0;
+		nisreq.len = 6;
+		wanted = sizeof(rxbuf);
+	} else {
+		/* first bytes of the ECUID response, as in the "hack mode" reads of dump_fast() */
+		txdata[0] = 0x1A;
+		txdata[1] = 0x81;
+		nisreq.len = 2;
+		wanted = 4;
+	}
+
+	if (np_l2_send(&npsess, &nisreq)) {
+		return -1;
+	}
+	t0 = diag_os_getms();
+	rv = np_l1_recv(&npsess, rxbuf, wanted, 500);
+	t0 = diag_os_getms() - t0;
+
+	/* drop the rest of the response */
+	diag_os_millisleep(50);
+	(void) diag_l2_ioctl(npsess.conn, DIAG_IOCTL_IFLUSH, NULL);
+	if ((rv < 0) || ((size_t) rv != wanted)) {
+		return -1;
+	}
+	return (long) t0;
+}
+
+/* tune [--noadapt] */
+enum cli_retval cmd_tune(int argc, char **argv) {
+	struct npflag flags[] = {{.name = "noadapt"}, {.name = NULL}};
+	static const long p3_vals[] = {0, 1, 2, 5, 10, 20, 55};
+	long prev_p3 = npsess.p3;
+	unsigned long maxrx = 0;
+	unsigned pi, i;
+	char details[80];
+
+	argc = take_flags(argc, argv, flags);
+	if ((argc < 0) || (argc > 1)) {
+		return CMD_USAGE;
+	}
+	if (npsess.state == NP_DISC) {
+		printf("Not connected to ECU\nTry \"nc\" first\n");
+		return CMD_FAILED;
+	}
+
+	memset(&npsess.tune, 0, sizeof(npsess.tune));
+	npsess.tune.jitter = nptune_jitter();
+	printf("host jitter: %u ms\n", npsess.tune.jitter);
+
+	/* smallest p3 that gets every answer */
+	for (pi = 0; pi < (sizeof(p3_vals) / sizeof(p3_vals[0])); pi++) {
+		npsess.p3 = p3_vals[pi];
+		update_params();
+		for (i = 0; i < TUNE_PROBES; i++) {
+			if (tune_request()) {
+				break;
+			}
+		}
+		if (i == TUNE_PROBES) {
+			break;
+		}
+		printf("p3=%ld : %u/%u answers\n", npsess.p3, i, TUNE_PROBES);
+		diag_os_millisleep(300);
+		(void) diag_l2_ioctl(npsess.conn, DIAG_IOCTL_IFLUSH, NULL);
+	}
+	if (pi == (sizeof(p3_vals) / sizeof(p3_vals[0]))) {
+		printf("tune: no reliable p3 found, check the connection !\n");
+		npsess.p3 = prev_p3;
+		update_params();
+		np_result("tune", "fail", NULL);
+		return CMD_FAILED;
+	}
+
+	/* worst response time, including our own scheduling */
+	for (i = 0; i < TUNE_PROBES; i++) {
+		long t = tune_rawtime(i);
+		if (t < 0) {
+			printf("tune: no response to timing probe !\n");
+			np_result("tune", "fail", NULL);
+			return CMD_FAILED;
+		}
+		if ((unsigned long) t > maxrx) {
+			maxrx = (unsigned long) t;
+		}
+	}
+	npsess.rxe = nptune_rxe(maxrx, npsess.tune.jitter);
+
+	npsess.autotune = flags[0].val ? 0 : 1;
+	printf("slowest response: %lu ms\n"
+	       "now using p3=%ld, rxe=%ld; adjusting on timeouts : %s\n",
+	       maxrx, npsess.p3, npsess.rxe, npsess.autotune ? "yes" : "no");
+	snprintf(details, sizeof(details), "p3=%ld rxe=%ld jitter=%u maxrx=%lu",
+	         npsess.p3, npsess.rxe, npsess.tune.jitter, maxrx);
+	np_result("tune", "ok", details);
+	cache_note(0, NULL);
+	return CMD_OK;
+}
+
+
+#define KSPEED_SOAKREQS 32	//SID_DUMP requests per speed tried by "kspeed auto", 8 blocks each
+#define KSPEED_AUTOMIN 10400	//default slowest speed for "kspeed auto"
+
+/** change kernel speed. If the kernel can't be reached at the new speed, go back
+ * to the previous one if possible.
+ *
+ * @return 0 if now at <newspeed>; 1 if still at the previous speed; -1 if the kernel was lost
+ */
+static int kspeed_switch(u16 newspeed) {
+	nparam_val prevspeed = npsess.kspeed;
+	int retries;
+
+	if (set_kernel_speed(&npsess, newspeed)) {
+		/* no reply; the kernel may have switched anyway */
+		if (npkern_init() == 0) {
+			return 1;
+		}
+		npsess.kspeed = (nparam_val) newspeed;
+		if (npkern_init() == 0) {
+			return 0;
+		}
+		npsess.kspeed = prevspeed;
+		return -1;
+	}
+
+	npsess.kspeed = (nparam_val) newspeed;
+	for (retries = 0; retries < 3; retries++) {
+		if (npkern_init() == 0) {
+			return 0;
+		}
+	}
+
+	/* kernel unreachable at the new speed (e.g. unsupported by the interface) : maybe it didn't
+	 * actually switch */
+	npsess.kspeed = prevspeed;
+	if (npkern_init() == 0) {
+		return 1;
+	}
+	return -1;
+}
+
+/** SID_DUMP soak at the current kernel speed.
+ * @param goodput : set to good bytes / s, including the time lost on bad responses
+ * @return number of failed requests
+ */
+static unsigned kspeed_soak(unsigned *goodput) {
+	uint8_t txdata[6];
+	uint8_t buf[NP10_MAXBLKS * 32];
+	struct diag_msg nisreq={0};
+	unsigned long t0, elapsed;
+	unsigned good = 0, bad = 0;
+	unsigned ri;
+
+	nisreq.data = txdata;
+	nisreq.len = 6;
+	txdata[0] = SID_DUMP;
+	txdata[1] = SID_DUMP_ROM;
+	txdata[2] = 0;
+	txdata[3] = NP10_MAXBLKS;
+
+	t0 = diag_os_getms();
+	for (ri = 0; ri < KSPEED_SOAKREQS; ri++) {
+		uint32_t curblock = ri * NP10_MAXBLKS;
+		txdata[4] = curblock >> 8;
+		txdata[5] = curblock >> 0;
+
+		if (np_l2_send(&npsess, &nisreq) ||
+		    npk_rxrawdump(buf, 0, NP10_MAXBLKS)) {
+			bad += 1;
+			/* let the rest of the response arrive, and drop it */
+			diag_os_millisleep(50);
+			(void) diag_l2_ioctl(npsess.conn, DIAG_IOCTL_IFLUSH, NULL);
+			continue;
+		}
+		good += NP10_MAXBLKS * 32;
+	}
+	elapsed = diag_os_getms() - t0;
+	if (!elapsed) {
+		elapsed = 1;
+	}
+	*goodput = (unsigned) (1000UL * good / elapsed);
+	return bad;
+}
+
+/** kspeed auto [<min_speed>] : walk BRR divisors from fastest to slowest, soak-testing each
+ * speed with SID_DUMP. Stops at the first error-free speed, since slower ones can't do better.
+ */
+static enum cli_retval kspeed_auto(unsigned minspeed) {
+	unsigned div, firstdiv, lastdiv;
+	unsigned best_speed = 0, best_goodput = 0;
+	unsigned fallback_speed = 0, fallback_goodput = 0;
+	unsigned newspeed;
+	int rv;
+	char details[64];
+
+	if ((minspeed < KSPEED_FROM_BRR(0xFF)) || (minspeed > 0xFFFF)) {
+		printf("min speed out of bounds !\n");
+		return CMD_FAILED;
+	}
+
+	/* fastest divisor whose speed fits in a u16, for set_kernel_speed() */
+	for (firstdiv = 1; KSPEED_FROM_BRR(firstdiv) > 0xFFFF; firstdiv++) {}
+	lastdiv = BRR_FROM_KSPEED(minspeed);
+
+	for (div = firstdiv; div <= lastdiv; div++) {
+		unsigned speed = KSPEED_FROM_BRR(div);
+		unsigned goodput, errs;
+
+		printf("kspeed auto: trying %ubps...\n", speed);
+		rv = kspeed_switch((u16) speed);
+		if (rv < 0) {
+			goto lost;
+		}
+		if (rv > 0) {
+			printf("\t%ubps unusable\n", speed);
+			continue;
+		}
+		errs = kspeed_soak(&goodput);
+		printf("\t%ubps: %u B/s, %u/%u bad responses\n", speed, goodput, errs, KSPEED_SOAKREQS);
+		if (errs == 0) {
+			best_speed = speed;
+			best_goodput = goodput;
+			break;
+		}
+		if (goodput > fallback_goodput) {
+			fallback_speed = speed;
+			fallback_goodput = goodput;
+		}
+	}
+
+	/* error-free wins. Otherwise, settle for the best throughput seen */
+	if (!best_speed) {
+		if (!fallback_speed) {
+			printf("kspeed auto: no usable speed found !\n");
+			np_result("kspeed", "fail", NULL);
+			return CMD_FAILED;
+		}
+		printf("kspeed auto: no error-free speed, using the fastest effective one\n");
+		best_speed = fallback_speed;
+		best_goodput = fallback_goodput;
+	}
+
+	newspeed = best_speed;
+	if ((unsigned) npsess.kspeed != newspeed) {
+		rv = kspeed_switch((u16) newspeed);
+		if (rv < 0) {
+			goto lost;
+		}
+		if (rv > 0) {
+			printf("kspeed auto: could not go back to %ubps, staying at %ubps\n",
+			       newspeed, (unsigned) npsess.kspeed);
+		}
+	}
+	printf("Kernel now using %ubps (%u B/s measured).\n", (unsigned) npsess.kspeed, best_goodput);
+	snprintf(details, sizeof(details), "kspeed=%u goodput=%u", (unsigned) npsess.kspeed, best_goodput);
+	np_result("kspeed", "ok", details);
+	cache_note(0, NULL);
+	return CMD_OK;
+
+lost:
+	nptrace_dump(&npsess.trace, __func__);
+	printf("kspeed auto: lost contact with the kernel ! Try \"initk\" at the last speeds tried.\n");
+	diag_l2_ioctl(npsess.conn, DIAG_IOCTL_IFLUSH, NULL);
+	np_result("kspeed", "fail", "kernel=lost");
+	return CMD_FAILED;
+}
+
 
-/* kspeed <new_speed> */
+/* kspeed <new_speed> | auto [<min_speed>] */
 enum cli_retval cmd_kspeed(int argc, char **argv) {
 
-	if (argc != 2) {
+	if ((argc < 2) || (argc > 3)) {
 		return CMD_USAGE;
 	}
 
-	if (npstate != NP_NPKCONN) {
+	if (npsess.state != NP_NPKCONN) {
 		printf("kernel not initialized - try \"runkernel\" or \"initk\"\n");
 		return CMD_FAILED;
 	}
 
+	if (strcmp(argv[1], "auto") == 0) {
+		return kspeed_auto((argc == 3) ? (unsigned) htoi(argv[2]) : KSPEED_AUTOMIN);
+	}
+	if (argc != 2) {
+		return CMD_USAGE;
+	}
+
 	u16 newspeed = htoi(argv[1]);
 
-	if (set_kernel_speed(newspeed)) {
+	if (set_kernel_speed(&npsess, newspeed)) {
 		npkern_init();
 		printf("Kernel did not accept new speed %ubps, try another speed or \"initk\"\n",
 		       (unsigned) newspeed);
@@ -2109,15 +3946,16 @@ enum cli_retval cmd_kspeed(int argc, char **argv) {
 	}
 
 	//the kernel has changed speed; now use npkern_init to update the serial port
-	nparam_kspeed.val = (nparam_val) newspeed;
+	npsess.kspeed = (nparam_val) newspeed;
 
 	if (npkern_init()) {
 		printf("Failed to re-initialize kernel at new speed %ubps, try another speed or \"initk\"\n",
 		       (unsigned) newspeed);
-		diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+		diag_l2_ioctl(npsess.conn, DIAG_IOCTL_IFLUSH, NULL);
 		return CMD_FAILED;
 	}
 	printf("Kernel now using %ubps.\n", (unsigned) newspeed);
+	cache_note(0, NULL);
 
 	return CMD_OK;
 }
@@ -2125,9 +3963,9 @@ enum cli_retval cmd_kspeed(int argc, char **argv) {
 
 
 /* flverif <file> */
-enum cli_retval cmd_flverif(int argc, char **argv) {
+static enum cli_retval flverif(int argc, char **argv) {
 	uint8_t *newdata;   //file will be copied to this
-	const struct flashdev_t *fdt = nisecu.flashdev;
+	const struct flashdev_t *fdt = npsess.ecu.flashdev;
 	bool *block_modified;
 
 	if (argc != 2) {
@@ -2139,7 +3977,7 @@ enum cli_retval cmd_flverif(int argc, char **argv) {
 		return CMD_FAILED;
 	}
 
-	if (npstate != NP_NPKCONN) {
+	if (npsess.state != NP_NPKCONN) {
 		printf("kernel not initialized - try \"runkernel\" or \"initk\"\n");
 		return CMD_FAILED;
 	}
@@ -2155,7 +3993,7 @@ enum cli_retval cmd_flverif(int argc, char **argv) {
 		goto badexit_nofree;
 	}
 
-	if (get_changed_blocks(newdata, NULL, fdt, block_modified)) {
+	if (get_changed_blocks(&npsess, newdata, NULL, fdt, block_modified)) {
 		goto badexit;
 	}
 
@@ -2172,6 +4010,7 @@ enum cli_retval cmd_flverif(int argc, char **argv) {
 	return CMD_OK;
 
 badexit:
+	nptrace_dump(&npsess.trace, __func__);
 	free(block_modified);
 badexit_nofree:
 	free(newdata);
@@ -2179,40 +4018,68 @@ badexit_nofree:
 
 }
 
-/* flrom <newrom> [<oldrom>] : flash whole ROM */
-enum cli_retval cmd_flrom(int argc, char **argv) {
-	uint8_t *newdata;   //file will be copied to this
-	u8 *oldrom;
+enum cli_retval cmd_flverif(int argc, char **argv) {
+	enum cli_retval rv;
 
-	const struct flashdev_t *fdt = nisecu.flashdev;
-	bool *block_modified;
+	npwire_begin(&npsess, "flverif");
+	rv = flverif(argc, argv);
+	npwire_end(&npsess);
+	return rv;
+}
+
+/* flrom <newrom> [<oldrom>] [--yes] [--mode=changed|full|practice] : flash whole ROM */
+static enum cli_retval flrom(int argc, char **argv) {
+	uint8_t *newdata = NULL;   //file will be copied to this
+	u8 *oldrom = NULL;
 
+	const struct flashdev_t *fdt = npsess.ecu.flashdev;
+	bool *block_modified = NULL;
+	struct npflag flags[] = {{.name = "yes"}, {.name = "mode"}, {.name = NULL}};
+	char answer = 0;
+	char blocklist[64];
+	char details[96] = "stage=setup";
+
+	argc = take_flags(argc, argv, flags);
 	if ((argc < 2) || (argc > 3)) {
 		return CMD_USAGE;
 	}
 
+	/* --mode and --yes answer the prompt below */
+	if (flags[1].val) {
+		if (strcmp(flags[1].val, "changed") == 0) {
+			answer = 'y';
+		} else if (strcmp(flags[1].val, "full") == 0) {
+			answer = 'f';
+		} else if (strcmp(flags[1].val, "practice") == 0) {
+			answer = 'p';
+		} else {
+			printf("unknown mode \"%s\"; try changed, full or practice.\n", flags[1].val);
+			return CMD_USAGE;
+		}
+	} else if (flags[0].val) {
+		answer = 'y';
+	}
+
 	if (!fdt) {
 		printf("device type not set. Try \"setdev ?\"\n");
-		return CMD_FAILED;
+		goto badexit_nofree;
 	}
 
-	if (npstate != NP_NPKCONN) {
+	if (npsess.state != NP_NPKCONN) {
 		printf("kernel not initialized - try \"runkernel\" or \"initk\"\n");
-		return CMD_FAILED;
+		goto badexit_nofree;
 	}
 
-	oldrom = NULL;
 	if (argc == 3) {
 		oldrom = load_rom(argv[2], fdt->romsize);
 		if (!oldrom) {
-			return CMD_FAILED;
+			goto badexit_nofree;
 		}
 	}
 
 	newdata = load_rom(argv[1], fdt->romsize);
 	if (!newdata) {
-		free(oldrom);
-		return CMD_FAILED;
+		goto badexit_nofree;
 	}
 
 	if (diag_calloc(&block_modified, fdt->numblocks)) {
@@ -2220,7 +4087,8 @@ enum cli_retval cmd_flrom(int argc, char **argv) {
 		goto badexit_nofree;
 	}
 
-	if (get_changed_blocks(newdata, oldrom, fdt, block_modified)) {
+	snprintf(details, sizeof(details), "stage=verify");
+	if (get_changed_blocks(&npsess, newdata, oldrom, fdt, block_modified)) {
 		goto badexit;
 	}
 
@@ -2244,18 +4112,26 @@ enum cli_retval cmd_flrom(int argc, char **argv) {
 				"flashing incorrect or incomplete data here could brick the ECU !\n");
 	}
 
-	printf("\n\ty : To reflash the blocks listed above, enter 'y'\n"
-	       "\tf : to reflash the whole ROM\n"
-	       "\tp : to do a dry run (practice mode) without modifying ROM contents\n"
-	       "\tn : To abort/cancel, enter 'n'\n");
+	if (!answer && npsess.batch) {
+		/* never reflash without being told to */
+		printf("batch mode : no --yes or --mode given, flash not modified.\n");
+		answer = 'n';
+	}
+
+	if (!answer) {
+		printf("\n\ty : To reflash the blocks listed above, enter 'y'\n"
+		       "\tf : to reflash the whole ROM\n"
+		       "\tp : to do a dry run (practice mode) without modifying ROM contents\n"
+		       "\tn : To abort/cancel, enter 'n'\n");
 
-	char *inp = cli_basic_get_input("> ", stdin);
-	if (!inp) {
-		//if user feeds an EOF, don't do anything
-		goto badexit;
+		char *inp = cli_basic_get_input("> ", stdin);
+		if (!inp) {
+			//if user feeds an EOF, don't do anything
+			goto badexit;
+		}
+		answer=inp[0];
+		free(inp);
 	}
-	char answer=inp[0];
-	free(inp);
 
 	bool practice = 1;
 	switch (answer) {
@@ -2278,10 +4154,14 @@ enum cli_retval cmd_flrom(int argc, char **argv) {
 		break;
 	default:
 		printf("Aborting.\n");
+		fmt_blocklist(blocklist, sizeof(blocklist), block_modified, fdt->numblocks);
+		snprintf(details, sizeof(details), "modified=%s", blocklist);
+		np_result("flrom", "aborted", details);
 		goto goodexit;
 		break;
 	}
 
+	fmt_blocklist(blocklist, sizeof(blocklist), block_modified, fdt->numblocks);
 	for (blockno = 0; blockno < fdt->numblocks; blockno++) {
 		u32 bstart;
 		if (!block_modified[blockno]) {
@@ -2290,12 +4170,15 @@ enum cli_retval cmd_flrom(int argc, char **argv) {
 
 		bstart = fdt->fblocks[blockno].start;
 		printf("\tBlock %02u\n", blockno);
-		if (reflash_block(&newdata[bstart], fdt, blockno, practice)) {
+		if (reflash_block(&npsess, &newdata[bstart], fdt, blockno, practice)) {
+			snprintf(details, sizeof(details), "stage=reflash block=%u practice=%u", blockno, (unsigned) practice);
 			goto badexit;
 		}
 	}
 
 	printf("Reflash complete.\n");
+	snprintf(details, sizeof(details), "blocks=%s practice=%u", blocklist, (unsigned) practice);
+	np_result("flrom", "ok", details);
 
 goodexit:
 	free(block_modified);
@@ -2304,10 +4187,21 @@ goodexit:
 	return CMD_OK;
 
 badexit:
+	nptrace_dump(&npsess.trace, __func__);
 	free(block_modified);
 badexit_nofree:
+	np_result("flrom", "fail", details);
 	free(newdata);
 	free(oldrom);
 	return CMD_FAILED;
 
 }
+
+enum cli_retval cmd_flrom(int argc, char **argv) {
+	enum cli_retval rv;
+
+	npwire_begin(&npsess, "flrom");
+	rv = flrom(argc, argv);
+	npwire_end(&npsess);
+	return rv;
+}
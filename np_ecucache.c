@@ -0,0 +1,268 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * Per-ECU cache of device type, keyset, tunables and kernel ID.
+ *
+ * A few hundred ECUs at most, so a plain array with linear lookups will do; the whole
+ * file is rewritten on every update, which only happens a few times per session.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "np_ecucache.h"
+
+#define ECUCACHE_MAXPATH 256
+#define ECUCACHE_LINELEN 256
+#define ECUCACHE_MAXSPEEDS 16	//distinct kspeeds tracked by ecucache_kspeeds()
+
+static struct ecucache_ent *ents = NULL;
+static unsigned numents = 0;
+static unsigned maxents = 0;
+static char cachefile[ECUCACHE_MAXPATH] = "";
+
+
+void ecucache_clear(void) {
+	free(ents);
+	ents = NULL;
+	numents = 0;
+	maxents = 0;
+	cachefile[0] = 0;
+}
+
+unsigned ecucache_count(void) {
+	return numents;
+}
+
+const char *ecucache_file(void) {
+	return cachefile[0] ? cachefile : NULL;
+}
+
+void ecucache_newent(struct ecucache_ent *ent, const char *ecuid) {
+	memset(ent, 0, sizeof(*ent));
+	strncpy(ent->ecuid, ecuid, ECUCACHE_IDLEN);
+	ent->kspeed = ECUCACHE_UNKNOWN;
+	ent->p3 = ECUCACHE_UNKNOWN;
+	ent->rxe = ECUCACHE_UNKNOWN;
+	ent->eepr = ECUCACHE_UNKNOWN;
+}
+
+static struct ecucache_ent *ecucache_find(const char *ecuid) {
+	unsigned i;
+
+	for (i = 0; i < numents; i++) {
+		if (strcmp(ents[i].ecuid, ecuid) == 0) {
+			return &ents[i];
+		}
+	}
+	return NULL;
+}
+
+const struct ecucache_ent *ecucache_get(const char *ecuid) {
+	return ecucache_find(ecuid);
+}
+
+/** @return 0 if ok */
+static int ecucache_add(const struct ecucache_ent *ent) {
+	struct ecucache_ent *dest = ecucache_find(ent->ecuid);
+
+	if (!dest) {
+		if (numents == maxents) {
+			unsigned newmax = maxents ? (2 * maxents) : 64;
+			struct ecucache_ent *tmp = realloc(ents, newmax * sizeof(*ents));
+			if (!tmp) {
+				return -1;
+			}
+			ents = tmp;
+			maxents = newmax;
+		}
+		dest = &ents[numents++];
+	}
+	*dest = *ent;
+	return 0;
+}
+
+/** copy <src> up to <len> - 1 chars, without tabs / newlines that would break the file format */
+static void copy_field(char *dest, const char *src, size_t len) {
+	size_t i;
+
+	for (i = 0; (i < (len - 1)) && src[i]; i++) {
+		dest[i] = ((src[i] == '\t') || (src[i] == '\r') || (src[i] == '\n')) ? ' ' : src[i];
+	}
+	dest[i] = 0;
+}
+
+/** parse "<ECUID>\t<key>=<val>\t..." ; ret 0 if ok */
+static int ecucache_parseline(char *line, struct ecucache_ent *ent) {
+	char *tok, *next;
+
+	if ((line[0] == '#') || isspace((unsigned char) line[0])) {
+		return -1;
+	}
+	line[strcspn(line, "\r\n")] = 0;
+
+	next = strchr(line, '\t');
+	if (next) {
+		*next++ = 0;
+	}
+	if (strlen(line) > ECUCACHE_IDLEN) {
+		return -1;
+	}
+	ecucache_newent(ent, line);
+
+	for (tok = next; tok; tok = next) {
+		char *val;
+
+		next = strchr(tok, '\t');
+		if (next) {
+			*next++ = 0;
+		}
+		val = strchr(tok, '=');
+		if (!val) {
+			continue;
+		}
+		*val++ = 0;
+		if (strcmp(tok, "dev") == 0) {
+			copy_field(ent->dev, val, sizeof(ent->dev));
+		} else if (strcmp(tok, "s27k") == 0) {
+			ent->s27k = (uint32_t) strtoul(val, NULL, 0);
+		} else if (strcmp(tok, "kspeed") == 0) {
+			ent->kspeed = strtol(val, NULL, 0);
+		} else if (strcmp(tok, "p3") == 0) {
+			ent->p3 = strtol(val, NULL, 0);
+		} else if (strcmp(tok, "rxe") == 0) {
+			ent->rxe = strtol(val, NULL, 0);
+		} else if (strcmp(tok, "eepr") == 0) {
+			ent->eepr = strtol(val, NULL, 0);
+		} else if (strcmp(tok, "npk") == 0) {
+			copy_field(ent->npk_id, val, sizeof(ent->npk_id));
+		}
+	}
+	return 0;
+}
+
+int ecucache_load(const char *fname) {
+	FILE *fp;
+	char line[ECUCACHE_LINELEN];
+	int cnt = 0;
+
+	ecucache_clear();
+	strncpy(cachefile, fname, sizeof(cachefile) - 1);
+	cachefile[sizeof(cachefile) - 1] = 0;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		return 0;	//new cache
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		struct ecucache_ent ent;
+		if (ecucache_parseline(line, &ent)) {
+			continue;
+		}
+		if (ecucache_add(&ent)) {
+			printf("ecucache: out of memory\n");
+			break;
+		}
+		cnt += 1;
+	}
+	fclose(fp);
+	return cnt;
+}
+
+static int ecucache_save(void) {
+	FILE *fp;
+	unsigned i;
+
+	if (!cachefile[0]) {
+		return 0;
+	}
+	if ((fp = fopen(cachefile, "w")) == NULL) {
+		printf("ecucache: cannot write %s !\n", cachefile);
+		return -1;
+	}
+	fprintf(fp, "# nisprog ECU cache : <ECUID> followed by tab-separated key=value fields\n");
+	for (i = 0; i < numents; i++) {
+		const struct ecucache_ent *ent = &ents[i];
+
+		fprintf(fp, "%s", ent->ecuid);
+		if (ent->dev[0]) {
+			fprintf(fp, "\tdev=%s", ent->dev);
+		}
+		if (ent->s27k) {
+			fprintf(fp, "\ts27k=0x%08lX", (unsigned long) ent->s27k);
+		}
+		if (ent->kspeed != ECUCACHE_UNKNOWN) {
+			fprintf(fp, "\tkspeed=%ld", ent->kspeed);
+		}
+		if (ent->p3 != ECUCACHE_UNKNOWN) {
+			fprintf(fp, "\tp3=%ld", ent->p3);
+		}
+		if (ent->rxe != ECUCACHE_UNKNOWN) {
+			fprintf(fp, "\trxe=%ld", ent->rxe);
+		}
+		if (ent->eepr != ECUCACHE_UNKNOWN) {
+			fprintf(fp, "\teepr=0x%lX", ent->eepr);
+		}
+		if (ent->npk_id[0]) {
+			fprintf(fp, "\tnpk=%s", ent->npk_id);
+		}
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+	return 0;
+}
+
+unsigned ecucache_kspeeds(long *dest, unsigned max) {
+	unsigned cnt[ECUCACHE_MAXSPEEDS];
+	long speeds[ECUCACHE_MAXSPEEDS];
+	unsigned nspeeds = 0;
+	unsigned i, j;
+
+	for (i = 0; i < numents; i++) {
+		if (ents[i].kspeed == ECUCACHE_UNKNOWN) {
+			continue;
+		}
+		for (j = 0; j < nspeeds; j++) {
+			if (speeds[j] == ents[i].kspeed) {
+				cnt[j] += 1;
+				break;
+			}
+		}
+		if ((j == nspeeds) && (nspeeds < ECUCACHE_MAXSPEEDS)) {
+			speeds[nspeeds] = ents[i].kspeed;
+			cnt[nspeeds] = 1;
+			nspeeds += 1;
+		}
+	}
+
+	/* few values, selection sort is fine */
+	for (i = 0; (i < max) && (i < nspeeds); i++) {
+		unsigned best = i;
+		for (j = i + 1; j < nspeeds; j++) {
+			if (cnt[j] > cnt[best]) {
+				best = j;
+			}
+		}
+		dest[i] = speeds[best];
+		speeds[best] = speeds[i];
+		cnt[best] = cnt[i];
+	}
+	return i;
+}
+
+int ecucache_update(const struct ecucache_ent *ent) {
+	struct ecucache_ent clean = *ent;
+
+	copy_field(clean.dev, ent->dev, sizeof(clean.dev));
+	copy_field(clean.npk_id, ent->npk_id, sizeof(clean.npk_id));
+	if (ecucache_add(&clean)) {
+		return -1;
+	}
+	return ecucache_save();
+}
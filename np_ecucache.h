@@ -0,0 +1,65 @@
+#ifndef NP_ECUCACHE_H
+#define NP_ECUCACHE_H
+
+/* Per-ECU cache : what was learned about an ECU (device type, confirmed keyset, working
+ * comms parameters, kernel ID), keyed by ECUID, so it can be restored on the next connection
+ * instead of being found again with setdev, gk, npconf etc.
+ *
+ * Text file, one ECU per line; tab-separated key=value fields follow the ECUID :
+ *	<ECUID>	dev=7058	s27k=0x55552727	kspeed=62500	p3=0	rxe=20	eepr=0x0	npk=<kernel ID>
+ * Missing fields are unknown. Unknown fields are ignored, and dropped when the file is rewritten.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+
+#define ECUCACHE_IDLEN 15	//Nissan ECUIDs are 5 chars; Subaru ECUIDs are stored as 10 hex digits
+#define ECUCACHE_DEVLEN 8
+#define ECUCACHE_NPKLEN 64
+#define ECUCACHE_UNKNOWN LONG_MIN	//for tunables; rxe can be negative
+
+struct ecucache_ent {
+	char ecuid[ECUCACHE_IDLEN + 1];
+	char dev[ECUCACHE_DEVLEN];	/** flash device name, "" if unknown */
+	uint32_t s27k;	/** SID27 key confirmed by a successful runkernel, 0 if unknown */
+	long kspeed;	/** tunables (see npconf), ECUCACHE_UNKNOWN if unknown */
+	long p3;
+	long rxe;
+	long eepr;
+	char npk_id[ECUCACHE_NPKLEN];	/** last kernel ID, "" if unknown */
+};
+
+
+/** load the cache from a text file, replacing the current contents.
+ * The file doesn't need to exist; it will be created by the first ecucache_update().
+ *
+ * @return number of entries loaded, < 0 if error
+ */
+int ecucache_load(const char *fname);
+
+/** @return cached entry for <ecuid>, NULL if none. Valid until the next ecucache_* call */
+const struct ecucache_ent *ecucache_get(const char *ecuid);
+
+/** fill <ent> with "unknown" for every field, for <ecuid> */
+void ecucache_newent(struct ecucache_ent *ent, const char *ecuid);
+
+/** add or replace the entry for ent->ecuid, and rewrite the file.
+ * @return 0 if ok
+ */
+int ecucache_update(const struct ecucache_ent *ent);
+
+/** list the distinct kspeed values in the cache, most common first.
+ * @return number of values written to dest[]
+ */
+unsigned ecucache_kspeeds(long *dest, unsigned max);
+
+/** @return cache file name, NULL if no cache loaded */
+const char *ecucache_file(void);
+
+/** @return number of entries */
+unsigned ecucache_count(void);
+
+/** forget everything, and stop updating the file */
+void ecucache_clear(void);
+
+#endif
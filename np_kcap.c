@@ -0,0 +1,142 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * session capture wrappers, see np_kcap.h
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_l1.h"
+#include "diag_l2.h"
+#include "diag_l2_iso14230.h"
+
+#include "kcap.h"
+#include "np_kcap.h"
+#include "np_session.h"
+#include "np_stats.h"
+#include "np_trace.h"
+
+
+/** capture-relative timestamp */
+static uint64_t cap_time(const struct np_session *ns) {
+	return kcap_now() - ns->cap.t_start;
+}
+
+static void cap_write(struct np_session *ns, enum kcap_type type, const uint8_t *data, unsigned len) {
+	if (kcap_write(&ns->cap, type, cap_time(ns), data, len)) {
+		printf("capture write error, capture stopped\n");
+		(void) np_kcap_stop(ns);
+	}
+}
+
+
+int np_kcap_start(struct np_session *ns, const char *fname) {
+	(void) np_kcap_stop(ns);
+	if (kcap_create(&ns->cap, fname)) {
+		printf("can't create %s\n", fname);
+		return -1;
+	}
+	ns->cap_active = 1;
+	return 0;
+}
+
+unsigned long np_kcap_stop(struct np_session *ns) {
+	unsigned long nrecs;
+
+	if (!ns->cap_active) {
+		return 0;
+	}
+	nrecs = ns->cap.nrecs;
+	kcap_close(&ns->cap);
+	ns->cap_active = 0;
+	return nrecs;
+}
+
+bool np_kcap_active(const struct np_session *ns) {
+	return ns->cap_active;
+}
+
+void np_kcap_note(struct np_session *ns, const char *text) {
+	if (ns->cap_active) {
+		cap_write(ns, KCAP_NOTE, (const uint8_t *) text, (unsigned) strlen(text));
+	}
+}
+
+
+/** header + checksum bytes that iso14230 L2 adds to a <len>-byte message */
+static unsigned l2_framing(struct diag_l2_conn *d_l2_conn, unsigned len) {
+	const struct diag_l2_14230 *dlproto = d_l2_conn->diag_l2_proto_data;
+	unsigned framing = 2;	//format byte, checksum
+
+	if (dlproto->modeflags & ISO14230_LONGHDR) {
+		framing += 2;	//target, source
+	}
+	if ((len > 63) || !(dlproto->modeflags & ISO14230_FMTLEN)) {
+		framing += 1;	//length byte
+	}
+	return framing;
+}
+
+int np_l2_send(struct np_session *ns, struct diag_msg *msg) {
+	unsigned framing = l2_framing(ns->conn, msg->len);
+
+	if (ns->cap_active) {
+		cap_write(ns, KCAP_TXMSG, msg->data, msg->len);
+	}
+	npwire_tx(ns, msg->len + framing, framing);
+	nptrace_add(&ns->trace, NPTRACE_TX, msg->data, msg->len);
+	return diag_l2_send(ns->conn, msg);
+}
+
+struct diag_msg *np_l2_request(struct np_session *ns, struct diag_msg *msg, int *errval) {
+	struct diag_msg *rxmsg;
+	struct diag_msg *cur;
+
+	unsigned framing = l2_framing(ns->conn, msg->len);
+
+	if (ns->cap_active) {
+		cap_write(ns, KCAP_TXMSG, msg->data, msg->len);
+	}
+	npwire_tx(ns, msg->len + framing, framing);
+	nptrace_add(&ns->trace, NPTRACE_TX, msg->data, msg->len);
+	rxmsg = diag_l2_request(ns->conn, msg, errval);
+	if (!rxmsg) {
+		nptrace_add(&ns->trace, NPTRACE_RXERR, NULL, 0);
+	}
+
+	/* possibly a chain of responses */
+	for (cur = rxmsg; cur; cur = cur->next) {
+		framing = l2_framing(ns->conn, cur->len);
+		npwire_rx(ns, cur->len + framing, framing);
+		nptrace_add(&ns->trace, NPTRACE_RX, cur->data, cur->len);
+		if (ns->cap_active) {
+			cap_write(ns, KCAP_RXMSG, cur->data, cur->len);
+		}
+	}
+	return rxmsg;
+}
+
+int np_l1_recv(struct np_session *ns, void *data, size_t len, unsigned int timeout) {
+	int rv = diag_l1_recv(ns->conn->diag_link->l2_dl0d, data, len, timeout);
+
+	if (rv > 0) {
+		/* raw frames : the caller reports header / checksum with npwire_framing() */
+		npwire_rx(ns, (unsigned) rv, 0);
+		nptrace_add(&ns->trace, NPTRACE_RXRAW, (const uint8_t *) data, (unsigned) rv);
+		if (ns->cap_active) {
+			cap_write(ns, KCAP_RXRAW, (const uint8_t *) data, (unsigned) rv);
+		}
+	}
+	if ((rv < 0) || ((size_t) rv < len)) {
+		nptrace_add(&ns->trace, NPTRACE_RXERR, NULL, (unsigned) len);
+	}
+	return rv;
+}
@@ -0,0 +1,45 @@
+#ifndef NP_KCAP_H
+#define NP_KCAP_H
+
+/* session capture : nisprog moves all its data through these wrappers instead of calling
+ * diag_l2_send() / diag_l2_request() / diag_l1_recv() directly. While a capture is active,
+ * everything is recorded to a kcap file (see kcap.h) with microsecond timestamps;
+ * "klreplay" can then play the ECU side back. Each session has its own capture, so sessions
+ * running in separate threads write separate files.
+ * Every byte is also counted for the session's wire accounting, see np_stats.h, and the recent
+ * messages are kept for post-mortems, see np_trace.h.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "diag.h"
+#include "diag_l0.h"
+#include "diag_l2.h"
+
+#include "np_session.h"
+
+
+/** start capturing to <fname>, stopping any capture in progress.
+ * @return 0 if ok
+ */
+int np_kcap_start(struct np_session *ns, const char *fname);
+
+/** stop capture, if any.
+ * @return number of records written
+ */
+unsigned long np_kcap_stop(struct np_session *ns);
+
+bool np_kcap_active(const struct np_session *ns);
+
+/** record a text note (e.g. which operation is starting) */
+void np_kcap_note(struct np_session *ns, const char *text);
+
+/* same as diag_l2_send(), diag_l2_request(), diag_l1_recv() on the session's connection */
+int np_l2_send(struct np_session *ns, struct diag_msg *msg);
+
+struct diag_msg *np_l2_request(struct np_session *ns, struct diag_msg *msg, int *errval);
+
+int np_l1_recv(struct np_session *ns, void *data, size_t len, unsigned int timeout);
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * ECUID -> keyset database with a BK-tree index.
+ *
+ * A BK-tree works with any metric; here, the Levenshtein distance between ECUIDs.
+ * Every child edge is labeled with its distance to the parent, so when looking for
+ * matches within distance <r> of <q>, the triangle inequality lets us skip all subtrees
+ * whose edge label is not within [d(q,node) - r, d(q,node) + r].
+ * With a shrinking <r> (distance of the current k-th best) a query only visits a small
+ * fraction of the nodes.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "np_keydb.h"
+
+#define KEYDB_MAXPATH 256
+
+struct bknode {
+	char ecuid[KEYDB_IDLEN + 1];
+	uint32_t s27k;
+	int child;	/** first child, -1 if none */
+	int sibling;	/** next child of same parent */
+	unsigned edge;	/** distance to parent */
+};
+
+static struct bknode *nodes = NULL;
+static unsigned numnodes = 0;
+static unsigned maxnodes = 0;
+static int *bkstack = NULL;	/** keydb_query() work stack, maxnodes entries : every node is pushed at most once */
+static char dbfile[KEYDB_MAXPATH] = "";
+
+
+/** query string, pre-processed for ecuid_dist() */
+struct ecuid_pat {
+	uint32_t peq[256];	/** bit i set if pattern[i] == char */
+	unsigned len;
+};
+
+static void ecuid_mkpat(const char *ecuid, struct ecuid_pat *pat) {
+	unsigned i;
+
+	memset(pat->peq, 0, sizeof(pat->peq));
+	for (i = 0; (i < KEYDB_IDLEN) && ecuid[i]; i++) {
+		pat->peq[(unsigned char) ecuid[i]] |= 1U << i;
+	}
+	pat->len = i;
+}
+
+/** Levenshtein distance between pattern and <txt>.
+ *
+ * Bit-parallel version (G. Myers, 1999) : one column of the DP matrix fits in a word,
+ * so this costs a handful of ops per char of <txt>. This is the hot spot of a BK-tree query.
+ */
+static unsigned ecuid_dist(const struct ecuid_pat *pat, const char *txt) {
+	uint32_t pv, mv, hibit;
+	unsigned score = pat->len;
+	unsigned i;
+
+	if (!pat->len) {
+		return strlen(txt);
+	}
+
+	pv = (pat->len == 32) ? ~0U : ((1U << pat->len) - 1);
+	mv = 0;
+	hibit = 1U << (pat->len - 1);
+
+	for (i = 0; (i < KEYDB_IDLEN) && txt[i]; i++) {
+		uint32_t eq = pat->peq[(unsigned char) txt[i]];
+		uint32_t xv = eq | mv;
+		uint32_t xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint32_t ph = mv | ~(xh | pv);
+		uint32_t mh = pv & xh;
+
+		if (ph & hibit) {
+			score += 1;
+		} else if (mh & hibit) {
+			score -= 1;
+		}
+		ph = (ph << 1) | 1;	//top row of the matrix is 0,1,2...
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+	}
+	return score;
+}
+
+/** copy ECUID, uppercase, max KEYDB_IDLEN chars */
+static void ecuid_copy(char *dest, const char *src) {
+	unsigned i;
+	for (i = 0; (i < KEYDB_IDLEN) && src[i]; i++) {
+		dest[i] = toupper((unsigned char) src[i]);
+	}
+	dest[i] = 0;
+}
+
+
+void keydb_clear(void) {
+	free(nodes);
+	free(bkstack);
+	nodes = NULL;
+	bkstack = NULL;
+	numnodes = 0;
+	maxnodes = 0;
+	dbfile[0] = 0;
+}
+
+unsigned keydb_count(void) {
+	return numnodes;
+}
+
+/** @return index of exact (ecuid, key) match, -1 if none */
+static int keydb_find(const char *ecuid, uint32_t s27k) {
+	struct ecuid_pat pat;
+	char ucid[KEYDB_IDLEN + 1];
+	int cur = numnodes ? 0 : -1;
+
+	ecuid_copy(ucid, ecuid);
+	ecuid_mkpat(ucid, &pat);
+	while (cur >= 0) {
+		unsigned d = ecuid_dist(&pat, nodes[cur].ecuid);
+		int next = -1;
+		int ci;
+
+		if ((d == 0) && (nodes[cur].s27k == s27k)) {
+			return cur;
+		}
+		for (ci = nodes[cur].child; ci >= 0; ci = nodes[ci].sibling) {
+			if (nodes[ci].edge == d) {
+				next = ci;
+				break;
+			}
+		}
+		cur = next;
+	}
+	return -1;
+}
+
+int keydb_add(const char *ecuid, uint32_t s27k) {
+	struct ecuid_pat pat;
+	struct bknode *newn;
+	int cur;
+
+	if (!ecuid || !ecuid[0]) {
+		return -1;
+	}
+
+	if (numnodes == maxnodes) {
+		unsigned newmax = maxnodes ? (2 * maxnodes) : 256;
+		struct bknode *tmp = realloc(nodes, newmax * sizeof(*nodes));
+		int *tmpstack;
+		if (!tmp) {
+			return -1;
+		}
+		nodes = tmp;
+		tmpstack = realloc(bkstack, newmax * sizeof(*bkstack));
+		if (!tmpstack) {
+			return -1;
+		}
+		bkstack = tmpstack;
+		maxnodes = newmax;
+	}
+
+	newn = &nodes[numnodes];
+	memset(newn, 0, sizeof(*newn));
+	ecuid_copy(newn->ecuid, ecuid);
+	newn->s27k = s27k;
+	newn->child = -1;
+	newn->sibling = -1;
+
+	if (numnodes == 0) {
+		numnodes = 1;
+		return 0;
+	}
+
+	/* walk down the tree until there's no child at our distance */
+	ecuid_mkpat(newn->ecuid, &pat);
+	cur = 0;
+	while (1) {
+		unsigned d = ecuid_dist(&pat, nodes[cur].ecuid);
+		int ci;
+
+		if ((d == 0) && (nodes[cur].s27k == s27k)) {
+			return 0;	//duplicate
+		}
+		for (ci = nodes[cur].child; ci >= 0; ci = nodes[ci].sibling) {
+			if (nodes[ci].edge == d) {
+				break;
+			}
+		}
+		if (ci < 0) {
+			newn->edge = d;
+			newn->sibling = nodes[cur].child;
+			nodes[cur].child = numnodes;
+			numnodes += 1;
+			return 0;
+		}
+		cur = ci;
+	}
+}
+
+
+/** insert into res[] (sorted by dist, unique keys).
+ * @return new count
+ */
+static unsigned res_insert(struct keydb_match *res, unsigned cnt, unsigned k,
+                           const struct bknode *n, unsigned d) {
+	unsigned i;
+
+	for (i = 0; i < cnt; i++) {
+		if (res[i].s27k != n->s27k) {
+			continue;
+		}
+		if (res[i].dist <= d) {
+			return cnt;
+		}
+		//same key but closer ECUID : remove old entry, re-insert below
+		memmove(&res[i], &res[i + 1], (cnt - i - 1) * sizeof(*res));
+		cnt -= 1;
+		break;
+	}
+
+	for (i = cnt; i > 0; i--) {
+		if (res[i - 1].dist <= d) {
+			break;
+		}
+	}
+	if (i >= k) {
+		return cnt;
+	}
+	if (cnt == k) {
+		cnt -= 1;	//drop last
+	}
+	memmove(&res[i + 1], &res[i], (cnt - i) * sizeof(*res));
+	res[i].s27k = n->s27k;
+	res[i].dist = d;
+	memcpy(res[i].ecuid, n->ecuid, sizeof(res[i].ecuid));
+	return cnt + 1;
+}
+
+unsigned keydb_query(const char *ecuid, struct keydb_match *res, unsigned k, unsigned maxdist) {
+	struct ecuid_pat pat;
+	char ucid[KEYDB_IDLEN + 1];
+	int *stack = bkstack;
+	unsigned sp = 0;
+	unsigned cnt = 0;
+
+	if (!numnodes || !k || !ecuid) {
+		return 0;
+	}
+
+	ecuid_copy(ucid, ecuid);
+	ecuid_mkpat(ucid, &pat);
+	stack[sp++] = 0;
+	while (sp) {
+		const struct bknode *n = &nodes[stack[--sp]];
+		unsigned d = ecuid_dist(&pat, n->ecuid);
+		unsigned radius = (cnt == k) ? res[k - 1].dist : maxdist;
+		int ci;
+
+		if (d <= radius) {
+			cnt = res_insert(res, cnt, k, n, d);
+			radius = (cnt == k) ? res[k - 1].dist : maxdist;
+		}
+
+		for (ci = n->child; ci >= 0; ci = nodes[ci].sibling) {
+			unsigned e = nodes[ci].edge;
+			unsigned delta = (e > d) ? (e - d) : (d - e);
+			if (delta > radius) {
+				continue;
+			}
+			stack[sp++] = ci;
+		}
+	}
+	return cnt;
+}
+
+
+/** parse "<ECUID>,<s27k>" ; also accepts ';', tab or space separators
+ * @return 0 if ok
+ */
+static int keydb_parseline(char *line, char *ecuid, uint32_t *s27k) {
+	char *p = line;
+	char *endp;
+	unsigned i;
+
+	while (isspace((unsigned char) *p)) {
+		p++;
+	}
+	if ((*p == 0) || (*p == '#')) {
+		return -1;
+	}
+	for (i = 0; *p && !strchr(",; \t\r\n", *p); p++) {
+		if ((*p == '"') || (i >= KEYDB_IDLEN)) {
+			continue;
+		}
+		ecuid[i++] = *p;
+	}
+	ecuid[i] = 0;
+	while (*p && strchr(",; \t\"", *p)) {
+		p++;
+	}
+	*s27k = strtoul(p, &endp, 16);
+	if ((endp == p) || !i) {
+		return -1;
+	}
+	return 0;
+}
+
+int keydb_load(const char *fname) {
+	FILE *fp;
+	char line[128];
+	int cnt = 0;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		printf("Cannot open %s !\n", fname);
+		return -1;
+	}
+	keydb_clear();
+	while (fgets(line, sizeof(line), fp)) {
+		char ecuid[KEYDB_IDLEN + 1];
+		uint32_t s27k;
+		if (keydb_parseline(line, ecuid, &s27k)) {
+			continue;
+		}
+		if (keydb_add(ecuid, s27k)) {
+			printf("keydb: out of memory\n");
+			break;
+		}
+		cnt += 1;
+	}
+	fclose(fp);
+
+	strncpy(dbfile, fname, sizeof(dbfile) - 1);
+	dbfile[sizeof(dbfile) - 1] = 0;
+	return cnt;
+}
+
+int keydb_learn(const char *ecuid, uint32_t s27k) {
+	char ucid[KEYDB_IDLEN + 1];
+	FILE *fp;
+
+	if (!ecuid) {
+		return -1;
+	}
+	ecuid_copy(ucid, ecuid);	//stored uppercase, in RAM and in the file
+	if (keydb_find(ucid, s27k) >= 0) {
+		return 0;
+	}
+	if (keydb_add(ucid, s27k)) {
+		return -1;
+	}
+	if (!dbfile[0]) {
+		return 0;
+	}
+	if ((fp = fopen(dbfile, "a")) == NULL) {
+		printf("keydb: cannot append to %s !\n", dbfile);
+		return -1;
+	}
+	fprintf(fp, "%s,%08lX\n", ucid, (unsigned long) s27k);
+	fclose(fp);
+	return 0;
+}
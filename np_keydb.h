@@ -0,0 +1,55 @@
+#ifndef NP_KEYDB_H
+#define NP_KEYDB_H
+
+/* ECUID -> keyset database, indexed for fuzzy lookups.
+ *
+ * The built-in ECUID list (nissutils ecuid_list.c) is only reachable through ecuid_getkeys();
+ * this holds the ECUID / SID27 key pairs confirmed locally (fleet lists, successful runkernels...)
+ * in a BK-tree so that the k closest ECUIDs are found without scanning the whole list.
+ */
+
+#include <stdint.h>
+
+#define KEYDB_IDLEN 5	//ECUIDs are 5 chars
+
+struct keydb_match {
+	uint32_t s27k;
+	unsigned dist;	/** edit distance between ECUIDs, 0 = exact match */
+	char ecuid[KEYDB_IDLEN + 1];	/** closest ECUID that uses this key */
+};
+
+
+/** load ECUID,s27k pairs from a text file, replacing the current db.
+ * Blank lines and lines starting with '#' are ignored.
+ * Following calls to keydb_learn() will append to this file.
+ *
+ * @return number of entries loaded, < 0 if error
+ */
+int keydb_load(const char *fname);
+
+/** add a pair to the index (RAM only).
+ * @return 0 if ok
+ */
+int keydb_add(const char *ecuid, uint32_t s27k);
+
+/** add a pair and append it to the loaded db file, unless it's already known.
+ * The ECUID is stored uppercase.
+ * @return 0 if ok
+ */
+int keydb_learn(const char *ecuid, uint32_t s27k);
+
+/** find the <k> closest keysets for <ecuid>, each key appears only once.
+ *
+ * @param res : caller-provided array of <k> entries, sorted by distance on return
+ * @param maxdist : ignore entries farther than this
+ * @return number of entries written to res[]
+ */
+unsigned keydb_query(const char *ecuid, struct keydb_match *res, unsigned k, unsigned maxdist);
+
+/** @return number of entries in db */
+unsigned keydb_count(void);
+
+/** forget everything */
+void keydb_clear(void);
+
+#endif
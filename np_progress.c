@@ -0,0 +1,165 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * progress reporting, see np_progress.h
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_os.h"
+
+#include "kcap.h"	//for kcap_now()
+#include "np_progress.h"
+
+
+int npprog_open(struct npprog_sink *sink, const char *dest) {
+	FILE *f;
+
+	npprog_close(sink);
+	if (strncmp(dest, "fd:", 3) == 0) {
+		char *end;
+		long fd = strtol(&dest[3], &end, 0);
+		if ((end == &dest[3]) || *end || (fd < 0)) {
+			return -1;
+		}
+		f = fdopen((int) fd, "a");
+	} else {
+		f = fopen(dest, "a");
+	}
+	if (!f) {
+		return -1;
+	}
+	sink->f = f;
+	snprintf(sink->dest, sizeof(sink->dest), "%s", dest);
+	return 0;
+}
+
+void npprog_close(struct npprog_sink *sink) {
+	if (sink->f) {
+		fclose(sink->f);
+	}
+	sink->f = NULL;
+	sink->dest[0] = 0;
+}
+
+const char *npprog_dest(const struct npprog_sink *sink) {
+	return sink->f ? sink->dest : NULL;
+}
+
+/** avg B/s since start */
+static unsigned long pg_rate(const struct npprog *pg, unsigned long now) {
+	unsigned long elapsed = now - pg->t0;
+
+	if (!elapsed) {
+		elapsed = 1;
+	}
+	return (1000UL * pg->done) / elapsed;
+}
+
+/** @return estimated seconds remaining, 0 if unknown */
+static unsigned long pg_eta(const struct npprog *pg, unsigned long rate) {
+	if (!pg->total || !rate || (pg->done >= pg->total)) {
+		return 0;
+	}
+	return (pg->total - pg->done) / rate;
+}
+
+/** "{"ts":...,"event":"<event>","op":"<op>"" : caller adds the rest and the closing brace */
+static void ev_begin(const struct npprog *pg, const char *event) {
+	fprintf(pg->sink->f, "{\"ts\":%llu,\"event\":\"%s\",\"op\":\"%s\"",
+	        (unsigned long long) (kcap_now() / 1000), event, pg->op);
+}
+
+static void ev_end(const struct npprog *pg) {
+	fprintf(pg->sink->f, "}\n");
+	if (fflush(pg->sink->f)) {
+		printf("\nprogress events : write error, stopped\n");
+		npprog_close(pg->sink);
+	}
+}
+
+static void console_line(const struct npprog *pg, unsigned long rate) {
+	unsigned pct = pg->total ? (unsigned) ((100ULL * pg->done) / pg->total) : 0;
+	unsigned long eta = pg_eta(pg, rate);
+
+	printf("\r%s @ 0x%06lX (%3u %%, %5lu B/s, ~ %4lu s remaining)", pg->op,
+	       (unsigned long) pg->addr, pct, rate, (eta > 9999) ? 9999 : eta);
+	fflush(stdout);
+}
+
+
+void npprog_start(struct npprog *pg, struct npprog_sink *sink, const char *op, uint32_t addr, unsigned long total) {
+	memset(pg, 0, sizeof(*pg));
+	pg->sink = sink;
+	pg->op = op;
+	pg->addr = addr;
+	pg->total = total;
+	pg->t0 = diag_os_getms();
+	pg->t_console = pg->t0;
+	pg->t_event = pg->t0;
+
+	console_line(pg, 0);
+	if (pg->sink->f) {
+		ev_begin(pg, "start");
+		fprintf(pg->sink->f, ",\"addr\":%lu,\"total\":%lu", (unsigned long) addr, total);
+		ev_end(pg);
+	}
+}
+
+void npprog_update(struct npprog *pg, uint32_t addr, unsigned long done) {
+	unsigned long now = diag_os_getms();
+	unsigned long rate;
+
+	pg->addr = addr;
+	pg->done = done;
+
+	if (((now - pg->t_console) < NPPROG_CONSOLE_MS) &&
+	    (!pg->sink->f || ((now - pg->t_event) < NPPROG_EVENT_MS))) {
+		return;
+	}
+	rate = pg_rate(pg, now);
+	if ((now - pg->t_console) >= NPPROG_CONSOLE_MS) {
+		pg->t_console = now;
+		console_line(pg, rate);
+	}
+	if (pg->sink->f && ((now - pg->t_event) >= NPPROG_EVENT_MS)) {
+		pg->t_event = now;
+		ev_begin(pg, "progress");
+		fprintf(pg->sink->f, ",\"addr\":%lu,\"bytes\":%lu,\"total\":%lu,\"rate\":%lu,\"eta\":%lu",
+		        (unsigned long) addr, done, pg->total, rate, pg_eta(pg, rate));
+		ev_end(pg);
+	}
+}
+
+void npprog_retry(struct npprog *pg, const char *reason) {
+	pg->retries += 1;
+	if (pg->sink->f) {
+		ev_begin(pg, "retry");
+		fprintf(pg->sink->f, ",\"addr\":%lu,\"bytes\":%lu,\"reason\":\"%s\"",
+		        (unsigned long) pg->addr, pg->done, reason);
+		ev_end(pg);
+	}
+}
+
+void npprog_done(struct npprog *pg, bool ok) {
+	unsigned long now = diag_os_getms();
+	unsigned long rate = pg_rate(pg, now);
+
+	if (ok) {
+		console_line(pg, rate);
+	}
+	if (pg->sink->f) {
+		ev_begin(pg, "done");
+		fprintf(pg->sink->f, ",\"ok\":%s,\"bytes\":%lu,\"elapsed_ms\":%lu,\"rate\":%lu,\"retries\":%u",
+		        ok ? "true" : "false", pg->done, now - pg->t0, rate, pg->retries);
+		ev_end(pg);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef NP_PROGRESS_H
+#define NP_PROGRESS_H
+
+/* progress reporting for the long operations (dump, flash, kernel upload).
+ *
+ * The console line is redrawn at most every NPPROG_CONSOLE_MS, so a slow terminal can't delay
+ * the next frame. Optionally, JSON-lines events are written to a file or fd, one object per line :
+ *	{"ts":<unix ms>,"event":"start","op":"flash","addr":0,"total":1048576}
+ *	{"ts":...,"event":"progress","op":"flash","addr":4096,"bytes":4096,"total":1048576,"rate":5120,"eta":203}
+ *	{"ts":...,"event":"retry","op":"acdump","addr":8192,"bytes":8192,"reason":"bad response"}
+ *	{"ts":...,"event":"done","op":"flash","ok":true,"bytes":1048576,"elapsed_ms":204800,"rate":5120,"retries":0}
+ * "progress" events are limited to one every NPPROG_EVENT_MS. rate is in B/s, eta in s.
+ *
+ * The event output belongs to a session (np_session.h) : each session can send its events to
+ * a different destination.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define NPPROG_CONSOLE_MS 250
+#define NPPROG_EVENT_MS 1000
+#define NPPROG_MAXDEST 256
+
+/** event destination */
+struct npprog_sink {
+	FILE *f;	/** NULL if none */
+	char dest[NPPROG_MAXDEST];
+};
+
+struct npprog {
+	struct npprog_sink *sink;
+	const char *op;	/** string constant, e.g. "flash" */
+	uint32_t addr;	/** current address */
+	unsigned long total;	/** bytes, 0 if unknown */
+	unsigned long done;
+	unsigned retries;
+	unsigned long t0;	/** diag_os_getms() */
+	unsigned long t_console;	/** last console / event output */
+	unsigned long t_event;
+};
+
+
+/** send events to <dest> : a file name (appended to), or "fd:<n>" for an open descriptor
+ * @return 0 if ok
+ */
+int npprog_open(struct npprog_sink *sink, const char *dest);
+
+/** stop sending events */
+void npprog_close(struct npprog_sink *sink);
+
+/** @return current event destination, NULL if none */
+const char *npprog_dest(const struct npprog_sink *sink);
+
+/** events, if any, go to <sink> */
+void npprog_start(struct npprog *pg, struct npprog_sink *sink, const char *op, uint32_t addr, unsigned long total);
+
+/** <done> bytes so far, now at <addr>. Cheap unless it's time to redraw / send an event */
+void npprog_update(struct npprog *pg, uint32_t addr, unsigned long done);
+
+/** something failed and will be retried; <reason> is a string constant */
+void npprog_retry(struct npprog *pg, const char *reason);
+
+/** operation finished. If ok, the console line is redrawn one last time (without newline) */
+void npprog_done(struct npprog *pg, bool ok);
+
+#endif
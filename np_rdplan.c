@@ -0,0 +1,168 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * read planner, see np_rdplan.h
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "np_rdplan.h"
+
+/* 64-bit ends, so that a range ending at 0xFFFFFFFF doesn't wrap */
+struct rdp_ent {
+	uint64_t addr;
+	uint64_t end;
+	unsigned idx;	//in want[]
+	unsigned grp;
+};
+
+struct rdp_grp {
+	uint64_t addr;
+	uint64_t end;
+	uint32_t base;	//offset in the plan buffer
+};
+
+
+unsigned rdplan_overhead(unsigned long bitrate, unsigned long turnaround_us) {
+	//10 bits per byte on the K-line
+	return RDPLAN_REQBYTES + RDPLAN_RESPBYTES +
+	       (unsigned) (((unsigned long long) turnaround_us * bitrate) / 10000000ULL);
+}
+
+bool rdplan_valid(uint32_t addr, uint32_t len) {
+	uint64_t end = (uint64_t) addr + len;
+
+	if (addr < RDPLAN_ROMEND) {
+		return end <= RDPLAN_ROMEND;
+	}
+	return (addr >= RDPLAN_RAMSTART) && (end <= RDPLAN_RAMEND);
+}
+
+uint32_t rdplan_len(const struct rdp_range *reqs, unsigned nreqs) {
+	uint32_t len = 0;
+	unsigned i;
+
+	for (i = 0; i < nreqs; i++) {
+		len += reqs[i].len;
+	}
+	return len;
+}
+
+static int ent_cmp(const void *a, const void *b) {
+	const struct rdp_ent *ea = a;
+	const struct rdp_ent *eb = b;
+
+	if (ea->addr != eb->addr) {
+		return (ea->addr < eb->addr) ? -1 : 1;
+	}
+	return (ea->end < eb->end) ? -1 : (ea->end > eb->end);
+}
+
+/** @return cost of reading <len> contiguous bytes, in bytes */
+static uint64_t read_cost(uint64_t len, unsigned ovh, bool rmba) {
+	uint64_t nreqs = rmba ? ((len + RDPLAN_MAXLEN - 1) / RDPLAN_MAXLEN) : 1;
+
+	return (nreqs * ovh) + len;
+}
+
+int rdplan(const struct rdp_range *want, unsigned nwant, unsigned ovh, bool rmba,
+	struct rdp_range *reqs, unsigned maxreqs, uint32_t *ofs) {
+	struct rdp_ent *ents;
+	struct rdp_grp *grps;
+	unsigned nents = 0;
+	unsigned ngrps = 0;
+	unsigned nreqs = 0;
+	uint32_t base = 0;
+	unsigned i;
+
+	if (!nwant) {
+		return 0;
+	}
+	ents = malloc(nwant * sizeof(*ents));
+	grps = malloc(nwant * sizeof(*grps));
+	if (!ents || !grps) {
+		goto badexit;
+	}
+
+	for (i = 0; i < nwant; i++) {
+		if (ofs) {
+			ofs[i] = 0;
+		}
+		if (!want[i].len) {
+			continue;
+		}
+		if (rmba && !rdplan_valid(want[i].addr, want[i].len)) {
+			goto badexit;
+		}
+		ents[nents].addr = want[i].addr;
+		ents[nents].end = (uint64_t) want[i].addr + want[i].len;
+		ents[nents].idx = i;
+		nents += 1;
+	}
+	qsort(ents, nents, sizeof(*ents), ent_cmp);
+
+	/* merge neighbours when one read costs less than two. Both valid ranges are then in the
+	 * same RMBA window, since there's a gap of 0xFF000000 bytes between the windows.
+	 */
+	for (i = 0; i < nents; i++) {
+		struct rdp_ent *ent = &ents[i];
+
+		if (ngrps) {
+			struct rdp_grp *grp = &grps[ngrps - 1];
+			uint64_t newend = (ent->end > grp->end) ? ent->end : grp->end;
+
+			if ((ent->addr <= grp->end) ||
+			    (read_cost(newend - grp->addr, ovh, rmba) <=
+			     (read_cost(grp->end - grp->addr, ovh, rmba) + read_cost(ent->end - ent->addr, ovh, rmba)))) {
+				grp->end = newend;
+				ent->grp = ngrps - 1;
+				continue;
+			}
+		}
+		grps[ngrps].addr = ent->addr;
+		grps[ngrps].end = ent->end;
+		ent->grp = ngrps;
+		ngrps += 1;
+	}
+
+	for (i = 0; i < ngrps; i++) {
+		uint64_t addr = grps[i].addr;
+
+		grps[i].base = base;
+		while (addr < grps[i].end) {
+			uint64_t len = grps[i].end - addr;
+
+			if (rmba && (len > RDPLAN_MAXLEN)) {
+				len = RDPLAN_MAXLEN;
+			}
+			if (nreqs == maxreqs) {
+				goto badexit;
+			}
+			reqs[nreqs].addr = (uint32_t) addr;
+			reqs[nreqs].len = (uint32_t) len;
+			nreqs += 1;
+			base += (uint32_t) len;
+			addr += len;
+		}
+	}
+
+	if (ofs) {
+		for (i = 0; i < nents; i++) {
+			const struct rdp_grp *grp = &grps[ents[i].grp];
+			ofs[ents[i].idx] = grp->base + (uint32_t) (ents[i].addr - grp->addr);
+		}
+	}
+	free(ents);
+	free(grps);
+	return (int) nreqs;
+
+badexit:
+	free(ents);
+	free(grps);
+	return -1;
+}
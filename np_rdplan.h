@@ -0,0 +1,55 @@
+#ifndef NP_RDPLAN_H
+#define NP_RDPLAN_H
+
+/* read planner : turns a set of scattered (address, length) ranges into the fewest npkern
+ * SID 23 (RMBA) requests.
+ *
+ * Every request costs its own bytes, the response header, L2 framing and a turnaround (p3 +
+ * ECU + adapter latency) on top of the data; that overhead is expressed in bytes worth of line
+ * time. Ranges are taken in address order and two neighbours are read with one request when
+ * that costs less, i.e. when the gap between them is smaller than the overhead, as long as the
+ * 251-byte and ROM / RAM window limits of npk_RMBA() hold; merged ranges longer than 251 bytes
+ * are read as several contiguous requests.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RDPLAN_MAXLEN 251	//SID 23 limitation
+#define RDPLAN_ROMEND 0x800000	//RMBA windows : [0, 0x7F FFFF] and [0xFF80 0000, 0xFFFF FFFF]
+#define RDPLAN_RAMSTART 0xFF800000
+#define RDPLAN_RAMEND 0x100000000ULL	//end of the address space
+#define RDPLAN_REQBYTES (5 + 2)	//23 <addr24> <len>, + fmt, cks
+#define RDPLAN_RESPBYTES (4 + 3)	//response header, + fmt, len, cks
+#define RDPLAN_LATUS 2000	//typical npkern response + adapter latency, excluding p3
+
+struct rdp_range {
+	uint32_t addr;
+	uint32_t len;
+};
+
+/** @return cost of one request in bytes : request + response overhead, plus the turnaround
+ * (<turnaround_us>, usually p3 + RDPLAN_LATUS) at <bitrate> bps
+ */
+unsigned rdplan_overhead(unsigned long bitrate, unsigned long turnaround_us);
+
+/** @return true if npk_RMBA() can read [addr, addr + len) */
+bool rdplan_valid(uint32_t addr, uint32_t len);
+
+/** plan the requests covering every range in want[].
+ *
+ * @param ovh : cost of one request, see rdplan_overhead(). 0 : only merge adjacent / overlapping ranges
+ * @param rmba : apply the npk_RMBA() limits. If false, ranges are only merged (stock firmware reads
+ *	any address, one byte at a time), and the requests can be of any length.
+ * @param reqs : output, in address order; reading them back-to-back gives the "plan buffer"
+ * @param ofs : if not NULL, ofs[i] is set to the offset of want[i] in the plan buffer
+ * @return number of requests, < 0 if a range can't be read with RMBA or more than <maxreqs>
+ *	requests are needed
+ */
+int rdplan(const struct rdp_range *want, unsigned nwant, unsigned ovh, bool rmba,
+	struct rdp_range *reqs, unsigned maxreqs, uint32_t *ofs);
+
+/** @return total length of <nreqs> requests, i.e. the plan buffer size */
+uint32_t rdplan_len(const struct rdp_range *reqs, unsigned nreqs);
+
+#endif
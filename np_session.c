@@ -0,0 +1,41 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * ECU session state
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "np_session.h"
+
+#define NPK_SPEED 62500 //bps default speed for npkern kernel
+
+
+void nisecu_cleardata(struct nisecu_t *pne) {
+	sprintf((char *) pne->ecuid, "UNK");
+	pne->keyset = NULL;
+	pne->flashdev = NULL;
+	return;
+}
+
+void np_session_init(struct np_session *ns) {
+	memset(ns, 0, sizeof(*ns));
+	ns->conn = NULL;
+	ns->state = NP_DISC;
+	nisecu_cleardata(&ns->ecu);
+
+	ns->p3 = 5;
+	ns->rxe = 20;
+	ns->eepr = 0;
+	ns->kspeed = NPK_SPEED;
+	ns->batch = 0;
+	ns->autotune = 0;
+	ns->stats.wire_bps = NPWIRE_DEFBPS;
+	nptrace_init(&ns->trace);
+	return;
+}
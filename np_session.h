@@ -0,0 +1,83 @@
+#ifndef NP_SESSION_H
+#define NP_SESSION_H
+
+/* ECU session : everything needed to talk to one ECU.
+ *
+ * The backends (nis_backend, npk_backend, ssm_backend) only use what they are given here,
+ * and return strings in the session's scratch buffers. Separate sessions can therefore
+ * drive separate ECUs, e.g. one thread per interface. The CLI uses a single session, npsess.
+ * Timing statistics and wire accounting (np_stats.h), the trace ring (np_trace.h), the
+ * progress event output (np_progress.h) and the kcap capture (np_kcap.h) are kept in the
+ * session too.
+ */
+
+#include <stdint.h>
+
+#include "diag.h"
+#include "diag_l2.h"
+
+#include "kcap.h"
+#include "np_progress.h"
+#include "np_stats.h"
+#include "np_trace.h"
+#include "np_tune.h"
+
+
+/* state of connection to ECU */
+enum npstate_t {
+	NP_DISC,	/** disconnected */
+	NP_NORMALCONN, /** normal connection to stock firmware */
+	NP_NPKCONN /** kernel connection to npkern */
+};
+
+enum ecutype_t {
+	NISECU_UNK,
+	NISECU_7055_35,	/** old 350nm part */
+	NISECU_7055_18,	/** 180nm */
+	NISECU_7058
+	};
+
+struct nisecu_t {
+	//enum ecutype_t ecutype;	/** decides which flashblock descriptor to use etc */
+	uint8_t ecuid[6];		/** ASCIIz */
+
+	const void *keyset;	/** keyset to use */
+	const void *flashdev;	/** device descriptor */
+
+};
+
+#define NP_NPKID_LEN 256
+#define NP_NRCSTR_LEN 80	//too small and we get an assert() failure in smartcat() !!!
+
+struct np_session {
+	struct diag_l2_conn *conn;	/** L2 connection; NULL when disconnected */
+	enum npstate_t state;
+	struct nisecu_t ecu;
+
+	/* tunables, see "npconf" */
+	long p3;	/** P3 time before new request (ms) */
+	long rxe;	/** read timeout offset (ms) */
+	long eepr;	/** eeprom_read() function address */
+	long kspeed;	/** kernel comms speed */
+	long batch;	/** non-interactive : prompts are answered by policy, results printed as "RESULT" lines */
+	long autotune;	/** adjust p3 / rxe on timeouts, see np_tune.h */
+
+	struct nptune_state tune;
+	struct npstats stats;	/** see np_stats.h */
+	struct nptrace trace;	/** see np_trace.h */
+	struct npprog_sink prog;	/** progress events, see np_progress.h */
+	struct kcap cap;	/** K-line capture, see np_kcap.h */
+	bool cap_active;
+
+	/* scratch buffers for strings returned by the backends; valid until the next call */
+	char npk_id[NP_NPKID_LEN];
+	char nrcstr[NP_NRCSTR_LEN];
+};
+
+
+/** set defaults : disconnected, unknown ECU, default tunables */
+void np_session_init(struct np_session *ns);
+
+void nisecu_cleardata(struct nisecu_t *pne);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * RAM snapshot series, see np_snap.h
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "np_snap.h"
+
+
+/** @return number of bytes written */
+static unsigned put_varint(FILE *f, uint64_t val) {
+	unsigned cnt = 0;
+
+	do {
+		uint8_t b = val & 0x7F;
+		val >>= 7;
+		if (val) {
+			b |= 0x80;
+		}
+		fputc(b, f);
+		cnt += 1;
+	} while (val);
+	return cnt;
+}
+
+/** ret 0 if ok */
+static int get_varint(FILE *f, uint64_t *val) {
+	unsigned shift = 0;
+	int c;
+
+	*val = 0;
+	do {
+		c = fgetc(f);
+		if ((c == EOF) || (shift > 63)) {
+			return -1;
+		}
+		*val |= (uint64_t) (c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+static void put_u32le(uint8_t *dest, uint32_t val) {
+	unsigned idx;
+
+	for (idx = 0; idx < 4; idx++) {
+		dest[idx] = (uint8_t) (val >> (8 * idx));
+	}
+}
+
+static uint32_t get_u32le(const uint8_t *src) {
+	return (uint32_t) src[0] | ((uint32_t) src[1] << 8) | ((uint32_t) src[2] << 16) | ((uint32_t) src[3] << 24);
+}
+
+
+int npsnap_create(struct npsnap *ns, const char *fname, uint32_t addr, uint32_t len) {
+	uint8_t hdr[NPSNAP_HDRLEN] = {0};
+
+	memset(ns, 0, sizeof(*ns));
+	ns->cur = calloc(1, len);
+	if (!ns->cur) {
+		return -1;
+	}
+	ns->f = fopen(fname, "wb");
+	if (!ns->f) {
+		npsnap_close(ns);
+		return -1;
+	}
+	ns->addr = addr;
+	ns->len = len;
+
+	memcpy(hdr, NPSNAP_MAGIC, 4);
+	hdr[4] = NPSNAP_VERSION;
+	put_u32le(&hdr[8], addr);
+	put_u32le(&hdr[12], len);
+	if (fwrite(hdr, 1, NPSNAP_HDRLEN, ns->f) != NPSNAP_HDRLEN) {
+		npsnap_close(ns);
+		return -1;
+	}
+	ns->filebytes = NPSNAP_HDRLEN;
+	return 0;
+}
+
+long npsnap_add(struct npsnap *ns, uint64_t t_us, const uint8_t *data) {
+	uint32_t idx = 0;
+	uint32_t last = 0;	//end of the previous run
+	long written;
+
+	written = put_varint(ns->f, t_us);
+	while (idx < ns->len) {
+		uint32_t start, end, scan;
+
+		if (data[idx] == ns->cur[idx]) {
+			idx += 1;
+			continue;
+		}
+		/* extend the run over short unchanged stretches */
+		start = idx;
+		end = idx + 1;
+		for (scan = end; (scan < ns->len) && ((scan - end) < NPSNAP_MINGAP); scan++) {
+			if (data[scan] != ns->cur[scan]) {
+				end = scan + 1;
+			}
+		}
+		written += put_varint(ns->f, start - last);
+		written += put_varint(ns->f, end - start);
+		written += (long) fwrite(&data[start], 1, end - start, ns->f);
+		last = end;
+		idx = end;
+	}
+	written += put_varint(ns->f, 0);
+	written += put_varint(ns->f, 0);
+	if (ferror(ns->f)) {
+		return -1;
+	}
+
+	memcpy(ns->cur, data, ns->len);
+	ns->count += 1;
+	ns->filebytes += (unsigned long) written;
+	return written;
+}
+
+int npsnap_open(struct npsnap *ns, const char *fname) {
+	uint8_t hdr[NPSNAP_HDRLEN];
+
+	memset(ns, 0, sizeof(*ns));
+	ns->f = fopen(fname, "rb");
+	if (!ns->f) {
+		return -1;
+	}
+	if ((fread(hdr, 1, NPSNAP_HDRLEN, ns->f) != NPSNAP_HDRLEN) ||
+	    memcmp(hdr, NPSNAP_MAGIC, 4) || (hdr[4] != NPSNAP_VERSION)) {
+		npsnap_close(ns);
+		return -1;
+	}
+	ns->addr = get_u32le(&hdr[8]);
+	ns->len = get_u32le(&hdr[12]);
+	ns->cur = calloc(1, ns->len ? ns->len : 1);
+	if (!ns->cur) {
+		npsnap_close(ns);
+		return -1;
+	}
+	return 0;
+}
+
+int npsnap_next(struct npsnap *ns, uint64_t *t_us) {
+	uint64_t pos = 0;
+	int c;
+
+	c = fgetc(ns->f);
+	if (c == EOF) {
+		return 0;
+	}
+	ungetc(c, ns->f);
+	if (get_varint(ns->f, t_us)) {
+		return -1;
+	}
+	while (1) {
+		uint64_t skip, runlen;
+
+		if (get_varint(ns->f, &skip) || get_varint(ns->f, &runlen)) {
+			return -1;
+		}
+		if (!runlen) {
+			break;
+		}
+		pos += skip;
+		if ((pos + runlen) > ns->len) {
+			return -1;
+		}
+		if (fread(&ns->cur[pos], 1, (size_t) runlen, ns->f) != runlen) {
+			return -1;
+		}
+		pos += runlen;
+	}
+	ns->count += 1;
+	return 1;
+}
+
+void npsnap_close(struct npsnap *ns) {
+	if (ns->f) {
+		fclose(ns->f);
+	}
+	free(ns->cur);
+	memset(ns, 0, sizeof(*ns));
+}
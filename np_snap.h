@@ -0,0 +1,58 @@
+#ifndef NP_SNAP_H
+#define NP_SNAP_H
+
+/* RAM snapshot series : periodic snapshots of one memory region, delta-compressed against the
+ * previous snapshot, for reverse engineering (which bytes move, when).
+ *
+ * File format : 16-byte header
+ *	"NPSN" <version:u8> <3 reserved bytes> <addr:u32le> <len:u32le>
+ * then one record per snapshot, all numbers as LEB128 varints (as in kcap files) :
+ *	<t_us> { <skip> <runlen> <runlen bytes> } ... <0> <0>
+ * t_us is relative to the first snapshot. Each run starts <skip> bytes after the end of the
+ * previous one (from the start of the region for the first run) and replaces <runlen> bytes;
+ * bytes outside the runs are unchanged. The first snapshot is a delta against all zeros.
+ * Unchanged stretches shorter than NPSNAP_MINGAP are included in the surrounding run, since a
+ * new run costs at least 2 bytes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define NPSNAP_MAGIC "NPSN"
+#define NPSNAP_VERSION 1
+#define NPSNAP_HDRLEN 16
+#define NPSNAP_MINGAP 3
+
+struct npsnap {
+	FILE *f;
+	uint32_t addr;
+	uint32_t len;
+	uint8_t *cur;	/** last snapshot written / read */
+	unsigned long count;	/** snapshots written / read */
+	unsigned long long filebytes;	/** bytes written, header included */
+};
+
+
+/** create a series file for <len> bytes @ <addr>.
+ * @return 0 if ok
+ */
+int npsnap_create(struct npsnap *ns, const char *fname, uint32_t addr, uint32_t len);
+
+/** append a snapshot of ns->len bytes, taken <t_us> after the first one.
+ * @return bytes written, < 0 if error
+ */
+long npsnap_add(struct npsnap *ns, uint64_t t_us, const uint8_t *data);
+
+/** open a series file for reading.
+ * @return 0 if ok
+ */
+int npsnap_open(struct npsnap *ns, const char *fname);
+
+/** decode the next snapshot into ns->cur.
+ * @return 1 if ok, 0 at end of file, < 0 if the file is corrupt
+ */
+int npsnap_next(struct npsnap *ns, uint64_t *t_us);
+
+void npsnap_close(struct npsnap *ns);
+
+#endif
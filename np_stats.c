@@ -0,0 +1,310 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * timing statistics and wire accounting, see np_stats.h
+ *
+ * Histograms are log-linear : each power of 2 (in us) is split into NPSTAT_SUB buckets,
+ * so the error on any percentile is < 1 / NPSTAT_SUB of the value.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_l1.h"
+#include "diag_l2.h"
+#include "diag_os.h"
+
+#include "np_kcap.h"
+#include "np_session.h"
+#include "np_stats.h"
+
+static const char *opnames[NPSTAT_NUMOPS] = {"npkdump", "flash", "crc", "acdump"};
+static const char *phasenames[NPSTAT_NUMPHASES] = {"tx", "ttfb", "frame", "flush"};
+
+
+/** bucket index for <us>. Values below NPSTAT_SUB get one bucket each */
+static unsigned us_to_bucket(uint32_t us) {
+	unsigned octave = 0;
+
+	if (us < NPSTAT_SUB) {
+		return us;
+	}
+	while ((us >> octave) >= (2 * NPSTAT_SUB)) {
+		octave += 1;
+	}
+	if (octave >= NPSTAT_OCTAVES) {
+		return NPSTAT_BUCKETS - 1;
+	}
+	/* (us >> octave) is in [SUB, 2*SUB) */
+	return ((octave + 1) * NPSTAT_SUB) + ((us >> octave) - NPSTAT_SUB);
+}
+
+/** lowest value in bucket <b> */
+static uint32_t bucket_lo(unsigned b) {
+	unsigned octave;
+
+	if (b < NPSTAT_SUB) {
+		return b;
+	}
+	octave = (b / NPSTAT_SUB) - 1;
+	return (uint32_t) ((NPSTAT_SUB + (b % NPSTAT_SUB)) << octave);
+}
+
+static void npstat_add(struct np_session *ns, enum npstat_op op, enum npstat_phase phase, unsigned long long us) {
+	struct npstat_hist *h = &ns->stats.hists[op][phase];
+	uint32_t v = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t) us;
+
+	h->bucket[us_to_bucket(v)] += 1;
+	h->count += 1;
+	h->total += v;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+/** @return approximate percentile (<permille> / 10), in us (upper bound of the bucket) */
+static uint32_t hist_pct(const struct npstat_hist *h, unsigned permille) {
+	uint64_t want = (((uint64_t) h->count * permille) + 999) / 1000;
+	uint64_t seen = 0;
+	unsigned b;
+
+	if (!want) {
+		want = 1;
+	}
+	for (b = 0; b < NPSTAT_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= want) {
+			uint32_t hi = (b == (NPSTAT_BUCKETS - 1)) ? h->max : (bucket_lo(b + 1) - 1);
+			return (hi < h->max) ? hi : h->max;
+		}
+	}
+	return h->max;
+}
+
+
+int npstat_send(struct np_session *ns, enum npstat_op op, struct diag_msg *msg) {
+	unsigned long long t0 = diag_os_gethrt();
+	int rv;
+
+	rv = np_l2_send(ns, msg);
+	npstat_add(ns, op, NPSTAT_TX, diag_os_hrtus(diag_os_gethrt() - t0));
+	return rv;
+}
+
+int npstat_recv(struct np_session *ns, enum npstat_op op, void *data, size_t len, unsigned int timeout) {
+	unsigned long long t0, t1;
+	unsigned long long waited;
+	int rv;
+
+	/* no timeout left to split between the first byte and the rest */
+	if ((op >= NPSTAT_NUMOPS) || (len < 2) || !timeout) {
+		return np_l1_recv(ns, data, len, timeout);
+	}
+
+	/* first byte separately, to split ECU latency from wire time */
+	t0 = diag_os_gethrt();
+	rv = np_l1_recv(ns, data, 1, timeout);
+	t1 = diag_os_gethrt();
+	if (rv != 1) {
+		return rv;
+	}
+	waited = diag_os_hrtus(t1 - t0);
+	npstat_add(ns, op, NPSTAT_TTFB, waited);
+
+	waited /= 1000;
+	if (waited >= timeout) {
+		waited = timeout - 1;
+	}
+	rv = np_l1_recv(ns, (uint8_t *) data + 1, len - 1, timeout - (unsigned) waited);
+	if (rv < 0) {
+		/* timeout or error after the first byte : report what we got */
+		return 1;
+	}
+	if ((size_t) rv == (len - 1)) {
+		npstat_add(ns, op, NPSTAT_FRAME, diag_os_hrtus(diag_os_gethrt() - t1));
+	}
+	return rv + 1;
+}
+
+void npstat_flush(struct np_session *ns, enum npstat_op op, unsigned delay_ms) {
+	unsigned long long t0 = diag_os_gethrt();
+
+	if (delay_ms) {
+		diag_os_millisleep(delay_ms);
+	}
+	(void) diag_l2_ioctl(ns->conn, DIAG_IOCTL_IFLUSH, NULL);
+	npstat_add(ns, op, NPSTAT_FLUSH, diag_os_hrtus(diag_os_gethrt() - t0));
+}
+
+void npstat_clear(struct np_session *ns) {
+	memset(ns->stats.hists, 0, sizeof(ns->stats.hists));
+}
+
+unsigned npstat_print(struct np_session *ns, FILE *f) {
+	unsigned op, phase;
+	unsigned printed = 0;
+
+	for (op = 0; op < NPSTAT_NUMOPS; op++) {
+		for (phase = 0; phase < NPSTAT_NUMPHASES; phase++) {
+			const struct npstat_hist *h = &ns->stats.hists[op][phase];
+			if (!h->count) {
+				continue;
+			}
+			if (!printed) {
+				fprintf(f, "%-8s %-6s %8s %9s %9s %9s %9s %9s %9s\n", "op", "phase", "count",
+				        "mean(us)", "p50", "p90", "p99", "p99.9", "max");
+			}
+			fprintf(f, "%-8s %-6s %8lu %9lu %9lu %9lu %9lu %9lu %9lu\n",
+			        opnames[op], phasenames[phase], (unsigned long) h->count,
+			        (unsigned long) (h->total / h->count),
+			        (unsigned long) hist_pct(h, 500), (unsigned long) hist_pct(h, 900),
+			        (unsigned long) hist_pct(h, 990), (unsigned long) hist_pct(h, 999),
+			        (unsigned long) h->max);
+			printed += 1;
+		}
+	}
+	return printed;
+}
+
+int npstat_export(struct np_session *ns, const char *fname) {
+	FILE *f;
+	unsigned op, phase, b;
+
+	if ((f = fopen(fname, "w")) == NULL) {
+		return -1;
+	}
+	fprintf(f, "op,phase,bucket_lo_us,bucket_hi_us,count\n");
+	for (op = 0; op < NPSTAT_NUMOPS; op++) {
+		for (phase = 0; phase < NPSTAT_NUMPHASES; phase++) {
+			const struct npstat_hist *h = &ns->stats.hists[op][phase];
+			for (b = 0; b < NPSTAT_BUCKETS; b++) {
+				if (!h->bucket[b]) {
+					continue;
+				}
+				fprintf(f, "%s,%s,%lu,%lu,%lu\n", opnames[op], phasenames[phase],
+				        (unsigned long) bucket_lo(b),
+				        (b == (NPSTAT_BUCKETS - 1)) ? (unsigned long) h->max : (unsigned long) (bucket_lo(b + 1) - 1),
+				        (unsigned long) h->bucket[b]);
+			}
+		}
+	}
+	if (fclose(f)) {
+		return -1;
+	}
+	return 0;
+}
+
+
+void npwire_bitrate(struct np_session *ns, unsigned bps) {
+	if (bps) {
+		ns->stats.wire_bps = bps;
+	}
+}
+
+/** add line time for <len> bytes : 10 bits each */
+static void wire_busy(struct npstats *st, unsigned len) {
+	st->wire_cur.busy_us += (10ULL * 1000 * 1000 * len) / st->wire_bps;
+}
+
+void npwire_tx(struct np_session *ns, unsigned len, unsigned framing) {
+	ns->stats.wire_cur.tx += len;
+	ns->stats.wire_cur.framing += framing;
+	wire_busy(&ns->stats, len);
+}
+
+void npwire_rx(struct np_session *ns, unsigned len, unsigned framing) {
+	ns->stats.wire_cur.rx += len;
+	ns->stats.wire_cur.framing += framing;
+	wire_busy(&ns->stats, len);
+}
+
+void npwire_payload(struct np_session *ns, unsigned long len) {
+	ns->stats.wire_cur.payload += len;
+}
+
+void npwire_framing(struct np_session *ns, unsigned len) {
+	ns->stats.wire_cur.framing += len;
+}
+
+void npwire_begin(struct np_session *ns, const char *name) {
+	struct npstats *st = &ns->stats;
+
+	memset(&st->wire_cur, 0, sizeof(st->wire_cur));
+	st->wire_cur.name = name;
+	st->wire_t0 = diag_os_gethrt();
+	st->wire_active = 1;
+}
+
+/** print "<tx> TX + <rx> RX bytes ..." for <c> */
+static void wire_summary(FILE *f, const struct npwire_cnt *c) {
+	uint64_t total = c->tx + c->rx;
+	uint64_t idle = (c->elapsed_us > c->busy_us) ? (c->elapsed_us - c->busy_us) : 0;
+
+	fprintf(f, "%llu TX + %llu RX bytes (%llu framing), %llu payload",
+	        (unsigned long long) c->tx, (unsigned long long) c->rx,
+	        (unsigned long long) c->framing, (unsigned long long) c->payload);
+	if (c->payload && total) {
+		fprintf(f, " (%.1f%% efficiency)", 100.0 * c->payload / total);
+	}
+	if (c->elapsed_us) {
+		fprintf(f, ", line idle %.1f%% of %.2fs", 100.0 * idle / c->elapsed_us, c->elapsed_us / 1e6);
+	}
+	fprintf(f, "\n");
+}
+
+void npwire_end(struct np_session *ns) {
+	struct npstats *st = &ns->stats;
+	struct npwire_cnt *cur = &st->wire_cur;
+	struct npwire_cnt *tot;
+	unsigned i;
+
+	if (!st->wire_active) {
+		return;
+	}
+	st->wire_active = 0;
+	cur->elapsed_us = diag_os_hrtus(diag_os_gethrt() - st->wire_t0);
+	if (!(cur->tx + cur->rx)) {
+		return;
+	}
+	printf("wire: ");
+	wire_summary(stdout, cur);
+
+	for (i = 0; i < NPWIRE_MAXCMDS; i++) {
+		tot = &st->wire_tot[i];
+		if (!tot->name || (strcmp(tot->name, cur->name) == 0)) {
+			break;
+		}
+	}
+	if (i == NPWIRE_MAXCMDS) {
+		return;
+	}
+	tot->name = cur->name;
+	tot->runs += 1;
+	tot->tx += cur->tx;
+	tot->rx += cur->rx;
+	tot->framing += cur->framing;
+	tot->payload += cur->payload;
+	tot->busy_us += cur->busy_us;
+	tot->elapsed_us += cur->elapsed_us;
+}
+
+unsigned npwire_print(struct np_session *ns, FILE *f) {
+	const struct npwire_cnt *tot = ns->stats.wire_tot;
+	unsigned i;
+
+	for (i = 0; (i < NPWIRE_MAXCMDS) && tot[i].name; i++) {
+		fprintf(f, "%-12s x%-3lu ", tot[i].name, tot[i].runs);
+		wire_summary(f, &tot[i]);
+	}
+	return i;
+}
+
+void npwire_clear(struct np_session *ns) {
+	memset(ns->stats.wire_tot, 0, sizeof(ns->stats.wire_tot));
+}
@@ -0,0 +1,146 @@
+#ifndef NP_STATS_H
+#define NP_STATS_H
+
+/* timing statistics for the bulk operations, and wire accounting (below).
+ *
+ * Each operation (kernel dump, flash write, CRC compare, stock-firmware dump) records, per
+ * request / response :
+ *	- TX : time spent in np_l2_send(), i.e. wire time + adapter + echo removal
+ *	- TTFB : from the end of TX to the first response byte (ECU processing + adapter latency)
+ *	- frame : from the first to the last response byte (wire time + gaps)
+ *	- flush : time lost recovering from a bad / missing response (delays + input flush)
+ * into fixed log-scale histograms; recording costs a few additions.
+ *
+ * For chained responses (npkern dump blocks), the TTFB of the later frames is really the gap
+ * between frames, which shows up in the low percentiles.
+ *
+ * The statistics are per session (struct np_session), so sessions running in separate threads
+ * don't mix their numbers.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "diag.h"
+#include "diag_l0.h"
+#include "diag_l2.h"
+
+enum npstat_op {
+	NPSTAT_NPKDUMP,	/** npkern SID_DUMP / RMBA */
+	NPSTAT_FLASH,	/** npkern flash write */
+	NPSTAT_CRC,	/** npkern CRC compare */
+	NPSTAT_ACDUMP,	/** stock firmware dump (SID AC + 21) */
+	NPSTAT_NUMOPS
+};
+#define NPSTAT_NONE NPSTAT_NUMOPS	//for npstat_recv() of the rest of a response : not recorded
+
+enum npstat_phase {
+	NPSTAT_TX,
+	NPSTAT_TTFB,
+	NPSTAT_FRAME,
+	NPSTAT_FLUSH,
+	NPSTAT_NUMPHASES
+};
+
+#define NPSTAT_SUBBITS 2
+#define NPSTAT_SUB (1U << NPSTAT_SUBBITS)
+#define NPSTAT_OCTAVES 27	//up to 2^27 us, ~ 134 s
+#define NPSTAT_BUCKETS (NPSTAT_SUB * (NPSTAT_OCTAVES + 1))
+
+struct npstat_hist {
+	uint32_t bucket[NPSTAT_BUCKETS];
+	uint32_t count;
+	uint64_t total;	//us
+	uint32_t max;	//us
+};
+
+#define NPWIRE_MAXCMDS 16
+#define NPWIRE_DEFBPS 10400	//until npwire_bitrate() is called
+
+struct npwire_cnt {
+	const char *name;
+	unsigned long runs;
+	uint64_t tx;	//bytes
+	uint64_t rx;
+	uint64_t framing;
+	uint64_t payload;
+	uint64_t busy_us;	//time needed by tx + rx at the bitrate in use
+	uint64_t elapsed_us;
+};
+
+/** per-session statistics, see np_session_init() */
+struct npstats {
+	struct npstat_hist hists[NPSTAT_NUMOPS][NPSTAT_NUMPHASES];
+	struct npwire_cnt wire_tot[NPWIRE_MAXCMDS];
+	struct npwire_cnt wire_cur;
+	unsigned long long wire_t0;
+	bool wire_active;
+	unsigned wire_bps;	/** K-line bitrate, for idle time */
+};
+
+struct np_session;
+
+
+/** np_l2_send(), recording TX time */
+int npstat_send(struct np_session *ns, enum npstat_op op, struct diag_msg *msg);
+
+/** np_l1_recv() of a response of known length, recording TTFB and frame time.
+ * The total timeout is the same as np_l1_recv()'s.
+ */
+int npstat_recv(struct np_session *ns, enum npstat_op op, void *data, size_t len, unsigned int timeout);
+
+/** recover from a bad response : wait <delay_ms>, flush input; recording the time taken */
+void npstat_flush(struct np_session *ns, enum npstat_op op, unsigned delay_ms);
+
+/** forget all samples */
+void npstat_clear(struct np_session *ns);
+
+/** print count and percentiles for every (op, phase) with samples.
+ * @return number of histograms printed
+ */
+unsigned npstat_print(struct np_session *ns, FILE *f);
+
+/** write every non-empty histogram bucket as CSV : op,phase,bucket_lo_us,bucket_hi_us,count
+ * @return 0 if ok
+ */
+int npstat_export(struct np_session *ns, const char *fname);
+
+
+/* wire accounting : every byte going through the np_kcap wrappers is counted, along with the
+ * L2 framing (header + checksum) of the messages, and the payload that the code doing the
+ * work declares as useful (bytes dumped, flashed, uploaded). Between npwire_begin() and
+ * npwire_end() the counts go to the named command; idle line time is the command's duration
+ * minus the time needed to send all its bytes at the current bitrate.
+ */
+
+/** bitrate of the K-line from now on, for idle time */
+void npwire_bitrate(struct np_session *ns, unsigned bps);
+
+/** <len> bytes sent or received, of which <framing> are L2 header / checksum */
+void npwire_tx(struct np_session *ns, unsigned len, unsigned framing);
+void npwire_rx(struct np_session *ns, unsigned len, unsigned framing);
+
+/** <len> bytes of useful data were transferred */
+void npwire_payload(struct np_session *ns, unsigned long len);
+
+/** <len> bytes already counted by npwire_rx() were header / checksum of a raw frame.
+ * np_l1_recv() can't tell, so the parsers of raw frames report it next to npwire_payload() */
+void npwire_framing(struct np_session *ns, unsigned len);
+
+/** start counting for command <name> (kept by pointer; must be a string constant) */
+void npwire_begin(struct np_session *ns, const char *name);
+
+/** stop counting, add to the totals for the command and print a summary line */
+void npwire_end(struct np_session *ns);
+
+/** print the totals per command.
+ * @return number of commands printed
+ */
+unsigned npwire_print(struct np_session *ns, FILE *f);
+
+/** forget all totals */
+void npwire_clear(struct np_session *ns);
+
+#endif
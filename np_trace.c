@@ -0,0 +1,113 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * post-mortem trace ring, see np_trace.h
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "diag.h"
+#include "diag_os.h"
+
+#include "np_trace.h"
+
+static const char *typenames[] = {
+	[NPTRACE_TX] = "TX",
+	[NPTRACE_RX] = "RX",
+	[NPTRACE_RXRAW] = "RXRAW",
+	[NPTRACE_RXERR] = "RXERR",
+};
+
+
+void nptrace_init(struct nptrace *tr) {
+	memset(tr, 0, sizeof(*tr));
+	strcpy(tr->tracefile, NPTRACE_DEFFILE);
+}
+
+void nptrace_add(struct nptrace *tr, enum nptrace_type type, const uint8_t *data, unsigned len) {
+	struct nptrace_rec *rec = &tr->ring[tr->seq % NPTRACE_ENTRIES];
+
+	rec->t = diag_os_gethrt();
+	rec->type = (uint8_t) type;
+	rec->len = (len > UINT16_MAX) ? UINT16_MAX : (uint16_t) len;
+	if (data && len) {
+		memcpy(rec->data, data, (len > NPTRACE_DATALEN) ? NPTRACE_DATALEN : len);
+	}
+	tr->seq += 1;	//publish
+}
+
+int nptrace_setfile(struct nptrace *tr, const char *fname) {
+	if (!fname) {
+		tr->tracefile[0] = 0;
+		return 0;
+	}
+	if (strlen(fname) >= sizeof(tr->tracefile)) {
+		return -1;
+	}
+	strcpy(tr->tracefile, fname);
+	return 0;
+}
+
+const char *nptrace_file(const struct nptrace *tr) {
+	return tr->tracefile[0] ? tr->tracefile : NULL;
+}
+
+unsigned nptrace_write(const struct nptrace *tr, FILE *f, const char *where) {
+	unsigned long seq = tr->seq;	//only what was published so far
+	unsigned long first = (seq > NPTRACE_ENTRIES) ? (seq - NPTRACE_ENTRIES) : 0;
+	unsigned long long t_last;
+	unsigned long idx;
+	time_t now = time(NULL);
+
+	if (!seq) {
+		return 0;
+	}
+	t_last = tr->ring[(seq - 1) % NPTRACE_ENTRIES].t;
+	fprintf(f, "# nptrace : %s, %s# %lu records (of %lu total); times in us, relative to the last record\n",
+	        where, ctime(&now), seq - first, seq);
+
+	for (idx = first; idx < seq; idx++) {
+		const struct nptrace_rec *rec = &tr->ring[idx % NPTRACE_ENTRIES];
+		unsigned stored = (rec->len > NPTRACE_DATALEN) ? NPTRACE_DATALEN : rec->len;
+		unsigned di;
+
+		fprintf(f, "%10lld %-5s %3u :", -(long long) diag_os_hrtus(t_last - rec->t),
+		        typenames[rec->type], (unsigned) rec->len);
+		if (rec->type != NPTRACE_RXERR) {
+			for (di = 0; di < stored; di++) {
+				fprintf(f, " %02X", rec->data[di]);
+			}
+			if (stored < rec->len) {
+				fprintf(f, " ...");
+			}
+		}
+		fprintf(f, "\n");
+	}
+	fprintf(f, "\n");
+	return (unsigned) (seq - first);
+}
+
+void nptrace_dump(struct nptrace *tr, const char *where) {
+	FILE *f;
+	unsigned nrec;
+
+	if (!tr->tracefile[0] || (tr->seq == tr->dumped_seq)) {
+		return;
+	}
+	tr->dumped_seq = tr->seq;
+	f = fopen(tr->tracefile, "a");
+	if (!f) {
+		printf("can't write trace to %s\n", tr->tracefile);
+		return;
+	}
+	nrec = nptrace_write(tr, f, where);
+	fclose(f);
+	printf("(last %u messages written to %s)\n", nrec, tr->tracefile);
+}
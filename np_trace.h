@@ -0,0 +1,67 @@
+#ifndef NP_TRACE_H
+#define NP_TRACE_H
+
+/* post-mortem trace : the last NPTRACE_ENTRIES messages / raw reads going through the np_kcap
+ * wrappers are always kept in a fixed ring, with high-resolution timestamps. Recording is a
+ * timestamp read and a short memcpy, no I/O and no locks, so unlike "debug l1" it doesn't
+ * change the timing being debugged.
+ *
+ * Each session (np_session.h) has its own ring, written and dumped only by the thread driving
+ * that session. A record is published by incrementing seq after it is filled in; dumps only
+ * cover the records published when the dump started.
+ *
+ * nptrace_dump() is called from the error exits of the comms code; it appends the ring to the
+ * trace file (default "nptrace.txt"), unless nothing was recorded since the last dump.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define NPTRACE_ENTRIES 512
+#define NPTRACE_DATALEN 48	//bytes kept per record; longer messages are truncated
+#define NPTRACE_DEFFILE "nptrace.txt"
+#define NPTRACE_MAXFILE 256
+
+enum nptrace_type {
+	NPTRACE_TX,	/** L2 message sent (without header / checksum) */
+	NPTRACE_RX,	/** L2 message received (without header / checksum) */
+	NPTRACE_RXRAW,	/** raw L1 read, headers included */
+	NPTRACE_RXERR,	/** raw L1 read failed or timed out; len is the requested length */
+};
+
+struct nptrace_rec {
+	unsigned long long t;	/** diag_os_gethrt() */
+	uint16_t len;	/** original length */
+	uint8_t type;
+	uint8_t data[NPTRACE_DATALEN];
+};
+
+struct nptrace {
+	struct nptrace_rec ring[NPTRACE_ENTRIES];
+	unsigned long seq;	/** records published so far; ring index is (seq % NPTRACE_ENTRIES) */
+	unsigned long dumped_seq;	/** seq at the last nptrace_dump() */
+	char tracefile[NPTRACE_MAXFILE];	/** empty if off */
+};
+
+/** empty the ring, and set the default trace file */
+void nptrace_init(struct nptrace *tr);
+
+void nptrace_add(struct nptrace *tr, enum nptrace_type type, const uint8_t *data, unsigned len);
+
+/** set the trace file; NULL to never write it
+ * @return 0 if ok
+ */
+int nptrace_setfile(struct nptrace *tr, const char *fname);
+
+/** @return trace file name, NULL if off */
+const char *nptrace_file(const struct nptrace *tr);
+
+/** write the ring to <f>, oldest first.
+ * @return number of records written
+ */
+unsigned nptrace_write(const struct nptrace *tr, FILE *f, const char *where);
+
+/** append the ring to the trace file, if anything new was recorded. <where> : function name etc */
+void nptrace_dump(struct nptrace *tr, const char *where);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * p3 / rxe tuning, see np_tune.h
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "diag.h"
+#include "diag_os.h"
+
+#include "np_session.h"
+#include "np_tune.h"
+
+#define NPTUNE_MARGIN 3	//ms, on top of the measured jitter
+#define NPTUNE_JITTERLOOPS 20
+#define NPTUNE_WINDOW 256	//complete reads before considering a lower rxe
+
+
+unsigned nptune_jitter(void) {
+	unsigned worst = 0;
+	int i;
+
+	for (i = 0; i < NPTUNE_JITTERLOOPS; i++) {
+		unsigned long t0 = diag_os_getms();
+		unsigned long late;
+
+		diag_os_millisleep(1);
+		late = diag_os_getms() - t0;
+		late = (late > 1) ? (late - 1) : 0;
+		if (late > worst) {
+			worst = (unsigned) late;
+		}
+	}
+	return worst;
+}
+
+long nptune_rxe(unsigned long maxrx, unsigned jitter) {
+	long rxe = (long) (maxrx + jitter + NPTUNE_MARGIN) - NPTUNE_RXBASE;
+
+	if (rxe < NPTUNE_RXEMIN) {
+		return NPTUNE_RXEMIN;
+	}
+	if (rxe > NPTUNE_RXEMAX) {
+		return NPTUNE_RXEMAX;
+	}
+	return rxe;
+}
+
+/** @return increment for a tunable after a timeout : 25%, at least 5ms */
+static long tune_step(long val) {
+	return (val > 20) ? (val / 4) : 5;
+}
+
+bool nptune_rx(struct np_session *ns, unsigned long elapsed, size_t wanted, int got) {
+	struct nptune_state *ts = &ns->tune;
+	bool p3_changed = 0;
+
+	if ((got >= 0) && ((size_t) got == wanted)) {
+		if (!ns->autotune) {
+			return 0;
+		}
+		ts->clean += 1;
+		if (elapsed > ts->maxrx) {
+			ts->maxrx = elapsed;
+		}
+		if (ts->clean >= NPTUNE_WINDOW) {
+			/* go halfway towards what the last window needed, to avoid oscillating */
+			long target = nptune_rxe(ts->maxrx, ts->jitter);
+			if (target < ns->rxe) {
+				ns->rxe = (ns->rxe + target) / 2;
+				printf("\nautotune: rxe lowered to %ld\n", ns->rxe);
+			}
+			ts->clean = 0;
+			ts->maxrx = 0;
+		}
+		return 0;
+	}
+
+	ts->timeouts += 1;
+	if (!ns->autotune) {
+		return 0;
+	}
+	ts->clean = 0;
+	ts->maxrx = 0;
+
+	if ((got <= 0) && (ns->p3 < NPTUNE_P3MAX)) {
+		/* nothing came back : the request may have been ignored for arriving too soon */
+		ns->p3 += tune_step(ns->p3);
+		if (ns->p3 > NPTUNE_P3MAX) {
+			ns->p3 = NPTUNE_P3MAX;
+		}
+		p3_changed = 1;
+	}
+	if (ns->rxe < NPTUNE_RXEMAX) {
+		ns->rxe += tune_step(ns->rxe);
+		if (ns->rxe > NPTUNE_RXEMAX) {
+			ns->rxe = NPTUNE_RXEMAX;
+		}
+	}
+	printf("\nautotune: read timeout, now p3=%ld rxe=%ld\n", ns->p3, ns->rxe);
+	return p3_changed;
+}
@@ -0,0 +1,46 @@
+#ifndef NP_TUNE_H
+#define NP_TUNE_H
+
+/* p3 / rxe tuning.
+ *
+ * "tune" measures the host's sleep jitter and the ECU's response time, then picks the
+ * smallest safe p3 and rxe. While ns->autotune is set, every raw read bounded by rxe is
+ * reported to nptune_rx() : a timeout raises rxe (and p3 if nothing at all came back),
+ * and long runs without timeouts bring rxe back down towards the slowest read seen.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct np_session;
+
+#define NPTUNE_RXBASE 25	//ms; raw reads time out after (NPTUNE_RXBASE + rxe)
+#define NPTUNE_RXEMIN (-20)	//same limits as "npconf"
+#define NPTUNE_RXEMAX 500
+#define NPTUNE_P3MAX 500
+
+struct nptune_state {
+	unsigned jitter;	/** host sleep overshoot (ms), measured by "tune" */
+	unsigned long maxrx;	/** slowest complete read since the last adjustment (ms) */
+	unsigned long clean;	/** complete reads since the last adjustment */
+	unsigned long timeouts;	/** incomplete reads, total */
+};
+
+
+/** measure how late diag_os_millisleep() returns, which also bounds how late we
+ * start reading after a request.
+ * @return worst overshoot in ms
+ */
+unsigned nptune_jitter(void);
+
+/** @return smallest safe rxe for reads taking up to <maxrx> ms, with <jitter> ms of host jitter */
+long nptune_rxe(unsigned long maxrx, unsigned jitter);
+
+/** report a raw read of <wanted> bytes that returned <got> (< 0 if error) after <elapsed> ms.
+ * Adjusts ns->rxe and ns->p3 if ns->autotune is set.
+ *
+ * @return 1 if ns->p3 was changed; caller must apply it to the L2 connection
+ */
+bool nptune_rx(struct np_session *ns, unsigned long elapsed, size_t wanted, int got);
+
+#endif
@@ -0,0 +1,369 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * RAM logger variable lists, see np_watch.h
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "np_watch.h"
+
+#define NPW_LINELEN 256
+#define NPW_SEPS " \t,\r\n"
+
+static const struct {
+	const char *name;
+	enum npw_type type;
+} npw_types[] = {
+	{"u8", NPW_U8}, {"s8", NPW_S8},
+	{"u16", NPW_U16}, {"s16", NPW_S16},
+	{"u32", NPW_U32}, {"s32", NPW_S32},
+};
+
+static const char *type_name(enum npw_type type) {
+	unsigned i;
+
+	for (i = 0; i < sizeof(npw_types) / sizeof(npw_types[0]); i++) {
+		if (npw_types[i].type == type) {
+			return npw_types[i].name;
+		}
+	}
+	return "?";
+}
+
+unsigned npw_size(enum npw_type type) {
+	switch (type) {
+	case NPW_U8:
+	case NPW_S8:
+		return 1;
+	case NPW_U16:
+	case NPW_S16:
+		return 2;
+	default:
+		break;
+	}
+	return 4;
+}
+
+int npw_add(struct npw_list *wl, const char *name, uint32_t addr, enum npw_type type, double scale, double offset) {
+	struct npw_var *var;
+
+	if (wl->nvars == NPW_MAXVARS) {
+		return -1;
+	}
+	var = &wl->vars[wl->nvars++];
+	snprintf(var->name, sizeof(var->name), "%s", name);
+	var->addr = addr;
+	var->type = type;
+	var->scale = scale;
+	var->offset = offset;
+	var->bufofs = 0;
+	return 0;
+}
+
+/** parse "<name> <addr> <type> [<scale> [<offset>]]" ; ret 0 if ok, 1 if nothing to parse */
+static int npw_parseline(struct npw_list *wl, char *line) {
+	char *name, *tok, *endp;
+	uint32_t addr;
+	enum npw_type type;
+	double scale = 1.0;
+	double offset = 0;
+	unsigned i;
+
+	name = strtok(line, NPW_SEPS);
+	if (!name || (name[0] == '#')) {
+		return 1;
+	}
+
+	tok = strtok(NULL, NPW_SEPS);
+	if (!tok) {
+		return -1;
+	}
+	addr = (uint32_t) strtoul(tok, &endp, 0);
+	if (*endp) {
+		return -1;
+	}
+
+	tok = strtok(NULL, NPW_SEPS);
+	if (!tok) {
+		return -1;
+	}
+	for (i = 0; i < sizeof(npw_types) / sizeof(npw_types[0]); i++) {
+		if (strcmp(tok, npw_types[i].name) == 0) {
+			break;
+		}
+	}
+	if (i == sizeof(npw_types) / sizeof(npw_types[0])) {
+		return -1;
+	}
+	type = npw_types[i].type;
+
+	if ((tok = strtok(NULL, NPW_SEPS)) != NULL) {
+		scale = strtod(tok, &endp);
+		if (*endp) {
+			return -1;
+		}
+		if ((tok = strtok(NULL, NPW_SEPS)) != NULL) {
+			offset = strtod(tok, &endp);
+			if (*endp) {
+				return -1;
+			}
+		}
+	}
+	return npw_add(wl, name, addr, type, scale, offset);
+}
+
+int npw_load(struct npw_list *wl, const char *fname) {
+	FILE *fp;
+	char line[NPW_LINELEN];
+	unsigned lineno = 0;
+
+	memset(wl, 0, sizeof(*wl));
+	if ((fp = fopen(fname, "r")) == NULL) {
+		printf("Cannot open %s !\n", fname);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		int rv;
+
+		lineno += 1;
+		rv = npw_parseline(wl, line);
+		if (rv < 0) {
+			printf("%s:%u : bad variable, or more than %u variables\n", fname, lineno, NPW_MAXVARS);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return (int) wl->nvars;
+}
+
+int npw_plan(struct npw_list *wl, unsigned ovh, bool rmba) {
+	struct rdp_range want[NPW_MAXVARS];
+	uint32_t ofs[NPW_MAXVARS];
+	unsigned i;
+	int rv;
+
+	for (i = 0; i < wl->nvars; i++) {
+		want[i].addr = wl->vars[i].addr;
+		want[i].len = npw_size(wl->vars[i].type);
+	}
+	rv = rdplan(want, wl->nvars, ovh, rmba, wl->spans, NPW_MAXSPANS, ofs);
+	if (rv < 0) {
+		return rv;
+	}
+	wl->nspans = (unsigned) rv;
+	wl->buflen = rdplan_len(wl->spans, wl->nspans);
+	for (i = 0; i < wl->nvars; i++) {
+		wl->vars[i].bufofs = ofs[i];
+	}
+	return rv;
+}
+
+uint32_t npw_raw(const struct npw_var *var, const uint8_t *sbuf) {
+	const uint8_t *p = &sbuf[var->bufofs];
+	uint32_t raw = 0;
+	unsigned i;
+
+	for (i = 0; i < npw_size(var->type); i++) {
+		raw = (raw << 8) | p[i];
+	}
+	switch (var->type) {
+	case NPW_S8:
+		return (uint32_t) (int32_t) (int8_t) raw;
+	case NPW_S16:
+		return (uint32_t) (int32_t) (int16_t) raw;
+	default:
+		break;
+	}
+	return raw;
+}
+
+double npw_value(const struct npw_var *var, const uint8_t *sbuf) {
+	uint32_t raw = npw_raw(var, sbuf);
+	double val;
+
+	switch (var->type) {
+	case NPW_S8:
+	case NPW_S16:
+	case NPW_S32:
+		val = (int32_t) raw;
+		break;
+	default:
+		val = raw;
+		break;
+	}
+	return (val * var->scale) + var->offset;
+}
+
+void npw_header(FILE *f, const struct npw_list *wl, bool binary) {
+	unsigned i;
+
+	if (binary) {
+		fprintf(f, "# nisprog watch v1 t_us:u64le");
+		for (i = 0; i < wl->nvars; i++) {
+			fprintf(f, " %s:%s", wl->vars[i].name, type_name(wl->vars[i].type));
+		}
+		fprintf(f, "\n");
+		return;
+	}
+	fprintf(f, "t_ms");
+	for (i = 0; i < wl->nvars; i++) {
+		fprintf(f, ",%s", wl->vars[i].name);
+	}
+	fprintf(f, "\n");
+}
+
+void npw_sample(FILE *f, const struct npw_list *wl, bool binary, uint64_t t_us, const uint8_t *sbuf) {
+	unsigned i;
+
+	if (binary) {
+		uint8_t ts[8];
+
+		for (i = 0; i < 8; i++) {
+			ts[i] = (uint8_t) (t_us >> (8 * i));
+		}
+		fwrite(ts, 1, sizeof(ts), f);
+		for (i = 0; i < wl->nvars; i++) {
+			const struct npw_var *var = &wl->vars[i];
+			fwrite(&sbuf[var->bufofs], 1, npw_size(var->type), f);
+		}
+		return;
+	}
+	fprintf(f, "%.3f", (double) t_us / 1000);
+	for (i = 0; i < wl->nvars; i++) {
+		fprintf(f, ",%.6g", npw_value(&wl->vars[i], sbuf));
+	}
+	fprintf(f, "\n");
+}
+
+static const struct {
+	const char *str;
+	enum npw_op op;
+} npw_ops[] = {
+	//two-char operators first
+	{">=", NPW_GE}, {"<=", NPW_LE}, {"==", NPW_EQ}, {"!=", NPW_NE},
+	{">", NPW_GT}, {"<", NPW_LT}, {"&", NPW_AND},
+};
+
+int npw_trig_parse(struct npw_trig *tr, const struct npw_list *wl, const char *expr) {
+	size_t namelen = strcspn(expr, "<>=!&");
+	const char *opstr = &expr[namelen];
+	const char *valstr = NULL;
+	char *endp;
+	unsigned i;
+
+	for (i = 0; i < sizeof(npw_ops) / sizeof(npw_ops[0]); i++) {
+		size_t oplen = strlen(npw_ops[i].str);
+		if (strncmp(opstr, npw_ops[i].str, oplen) == 0) {
+			tr->op = npw_ops[i].op;
+			valstr = &opstr[oplen];
+			break;
+		}
+	}
+	if (!valstr || !namelen) {
+		return -1;
+	}
+
+	for (i = 0; i < wl->nvars; i++) {
+		if ((strlen(wl->vars[i].name) == namelen) && (strncmp(wl->vars[i].name, expr, namelen) == 0)) {
+			break;
+		}
+	}
+	if (i == wl->nvars) {
+		return -1;
+	}
+	tr->var = i;
+
+	if (tr->op == NPW_AND) {
+		tr->val = (double) strtoul(valstr, &endp, 0);
+	} else {
+		tr->val = strtod(valstr, &endp);
+	}
+	if ((endp == valstr) || *endp) {
+		return -1;
+	}
+	tr->prev = 0;
+	return 0;
+}
+
+bool npw_trig_eval(struct npw_trig *tr, const struct npw_list *wl, const uint8_t *sbuf) {
+	const struct npw_var *var = &wl->vars[tr->var];
+	double val = npw_value(var, sbuf);
+	bool cond = 0;
+	bool fired;
+
+	switch (tr->op) {
+	case NPW_GT:
+		cond = (val > tr->val);
+		break;
+	case NPW_LT:
+		cond = (val < tr->val);
+		break;
+	case NPW_GE:
+		cond = (val >= tr->val);
+		break;
+	case NPW_LE:
+		cond = (val <= tr->val);
+		break;
+	case NPW_EQ:
+		cond = (val == tr->val);
+		break;
+	case NPW_NE:
+		cond = (val != tr->val);
+		break;
+	case NPW_AND:
+		cond = ((npw_raw(var, sbuf) & (uint32_t) tr->val) != 0);
+		break;
+	}
+	fired = cond && !tr->prev;
+	tr->prev = cond;
+	return fired;
+}
+
+int npw_ring_init(struct npw_ring *ring, unsigned size, unsigned buflen) {
+	memset(ring, 0, sizeof(*ring));
+	if (!size) {
+		size = 1;	//at least the trigger sample
+	}
+	ring->bufs = malloc((size_t) size * buflen);
+	ring->ts = malloc(size * sizeof(*ring->ts));
+	if (!ring->bufs || !ring->ts) {
+		npw_ring_free(ring);
+		return -1;
+	}
+	ring->size = size;
+	ring->buflen = buflen;
+	return 0;
+}
+
+void npw_ring_free(struct npw_ring *ring) {
+	free(ring->bufs);
+	free(ring->ts);
+	memset(ring, 0, sizeof(*ring));
+}
+
+void npw_ring_add(struct npw_ring *ring, uint64_t t_us, const uint8_t *sbuf) {
+	memcpy(&ring->bufs[(size_t) ring->head * ring->buflen], sbuf, ring->buflen);
+	ring->ts[ring->head] = t_us;
+	ring->head = (ring->head + 1) % ring->size;
+	if (ring->count < ring->size) {
+		ring->count += 1;
+	}
+}
+
+void npw_ring_flush(struct npw_ring *ring, FILE *f, const struct npw_list *wl, bool binary) {
+	unsigned idx = (ring->head + ring->size - ring->count) % ring->size;
+
+	for (; ring->count; ring->count--) {
+		npw_sample(f, wl, binary, ring->ts[idx], &ring->bufs[(size_t) idx * ring->buflen]);
+		idx = (idx + 1) % ring->size;
+	}
+}
@@ -0,0 +1,138 @@
+#ifndef NP_WATCH_H
+#define NP_WATCH_H
+
+/* RAM logger for "watch" : variable list, read planning and sample output.
+ *
+ * Variable list, text file, one variable per line (blank lines and '#' comments ignored) :
+ *	<name> <addr> <type> [<scale> [<offset>]]
+ * fields separated by spaces, tabs or commas; <type> is u8, s8, u16, s16, u32 or s32 (big-endian,
+ * as in ECU RAM). Logged value = raw * scale + offset.
+ *
+ * The variables are coalesced into as few reads as possible by the read planner (np_rdplan.h);
+ * the planned requests ("spans") are read back-to-back into one sample buffer.
+ *
+ * Triggered capture : the last <n> samples are kept in a ring (npw_ring); a trigger expression
+ *	<name><op><value>
+ * with <op> one of > < >= <= == != on the scaled value of variable <name>, or & (any bit of the
+ * mask <value> set in the raw value), is evaluated on every sample. It fires when the condition
+ * becomes true (or is true on the first sample); the ring is then written out, followed by the
+ * samples after the trigger.
+ *
+ * Output files :
+ * - CSV : "t_ms,<name>,..." header, then one line of scaled values per sample;
+ * - binary : one text header line
+ *	"# nisprog watch v1 t_us:u64le <name>:<type> ...\n"
+ *   followed by fixed-size records : u64le timestamp (us), then the raw bytes of every
+ *   variable in header order, unscaled and big-endian as read from the ECU.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "np_rdplan.h"
+
+#define NPW_MAXVARS 128
+#define NPW_NAMELEN 24
+#define NPW_MAXSPANS NPW_MAXVARS	//merging never takes more requests than reading each variable
+
+enum npw_type {
+	NPW_U8, NPW_S8, NPW_U16, NPW_S16, NPW_U32, NPW_S32,
+};
+
+struct npw_var {
+	char name[NPW_NAMELEN];
+	uint32_t addr;
+	enum npw_type type;
+	double scale;
+	double offset;
+	unsigned bufofs;	/** offset of this variable in the sample buffer, set by npw_plan() */
+};
+
+struct npw_list {
+	struct npw_var vars[NPW_MAXVARS];	/** in file order */
+	unsigned nvars;
+	struct rdp_range spans[NPW_MAXSPANS];	/** sorted by address, filled by npw_plan() */
+	unsigned nspans;
+	unsigned buflen;	/** sample buffer size = sum of span lengths */
+};
+
+
+/** load a variable list, replacing the contents of <wl>.
+ * Errors are reported with the line number.
+ * @return number of variables, < 0 if error
+ */
+int npw_load(struct npw_list *wl, const char *fname);
+
+/** add one variable (used for "watch <addr>" : a single u32).
+ * @return 0 if ok
+ */
+int npw_add(struct npw_list *wl, const char *name, uint32_t addr, enum npw_type type, double scale, double offset);
+
+/** plan the sample reads, see rdplan(). <ovh> : cost of one request;
+ * <rmba> : reads will use npk_RMBA(), as opposed to SID AC.
+ *
+ * @return number of spans, < 0 if a variable can't be read
+ */
+int npw_plan(struct npw_list *wl, unsigned ovh, bool rmba);
+
+enum npw_op {
+	NPW_GT, NPW_LT, NPW_GE, NPW_LE, NPW_EQ, NPW_NE, NPW_AND,
+};
+
+struct npw_trig {
+	unsigned var;	/** index in vars[] */
+	enum npw_op op;
+	double val;	/** compared with the scaled value, or mask for NPW_AND */
+	bool prev;	/** condition at the previous sample */
+};
+
+/** ring of the last <size> samples, with their timestamps */
+struct npw_ring {
+	uint8_t *bufs;
+	uint64_t *ts;
+	unsigned size;
+	unsigned buflen;
+	unsigned head;	/** next slot to write */
+	unsigned count;
+};
+
+/** @return raw (unscaled) value of <var>, sign-extended for signed types */
+uint32_t npw_raw(const struct npw_var *var, const uint8_t *sbuf);
+
+/** @return scaled value of <var>, from a sample buffer */
+double npw_value(const struct npw_var *var, const uint8_t *sbuf);
+
+/** @return size in bytes */
+unsigned npw_size(enum npw_type type);
+
+/** write the file header */
+void npw_header(FILE *f, const struct npw_list *wl, bool binary);
+
+/** write one sample, timestamped <t_us> */
+void npw_sample(FILE *f, const struct npw_list *wl, bool binary, uint64_t t_us, const uint8_t *sbuf);
+
+/** parse a trigger expression for the variables of <wl>.
+ * @return 0 if ok
+ */
+int npw_trig_parse(struct npw_trig *tr, const struct npw_list *wl, const char *expr);
+
+/** evaluate the trigger on a new sample.
+ * @return true if the condition just became true
+ */
+bool npw_trig_eval(struct npw_trig *tr, const struct npw_list *wl, const uint8_t *sbuf);
+
+/** allocate a ring of <size> samples of <buflen> bytes.
+ * @return 0 if ok
+ */
+int npw_ring_init(struct npw_ring *ring, unsigned size, unsigned buflen);
+
+void npw_ring_free(struct npw_ring *ring);
+
+/** add a sample, dropping the oldest one if the ring is full */
+void npw_ring_add(struct npw_ring *ring, uint64_t t_us, const uint8_t *sbuf);
+
+/** write every sample in the ring (oldest first) with npw_sample(), then empty it */
+void npw_ring_flush(struct npw_ring *ring, FILE *f, const struct npw_list *wl, bool binary);
+
+#endif
@@ -22,6 +22,10 @@
 #include "diag_os.h"
 #include "diag_iso14230.h"  //for NRC decoding
 
+#include "np_kcap.h"
+#include "np_progress.h"
+#include "np_stats.h"
+#include "np_trace.h"
 #include "npk_backend.h"
 #include "nissutils/cli_utils/nislib.h"
 #include "npkern/iso_cmds.h"
@@ -30,130 +34,14 @@
 
 #define CURFILE "npk_backend.c" //HAAAX
 
-/* flash block definitions */
-const struct flashblock fblocks_7058[] = {
-	{0x00000000,    0x00001000},
-	{0x00001000,    0x00001000},
-	{0x00002000,    0x00001000},
-	{0x00003000,    0x00001000},
-	{0x00004000,    0x00001000},
-	{0x00005000,    0x00001000},
-	{0x00006000,    0x00001000},
-	{0x00007000,    0x00001000},
-	{0x00008000,    0x00018000},
-	{0x00020000,    0x00020000},
-	{0x00040000,    0x00020000},
-	{0x00060000,    0x00020000},
-	{0x00080000,    0x00020000},
-	{0x000A0000,    0x00020000},
-	{0x000C0000,    0x00020000},
-	{0x000E0000,    0x00020000},
-};
-
-const struct flashblock fblocks_7055[] = {
-	{0x00000000,    0x00001000},
-	{0x00001000,    0x00001000},
-	{0x00002000,    0x00001000},
-	{0x00003000,    0x00001000},
-	{0x00004000,    0x00001000},
-	{0x00005000,    0x00001000},
-	{0x00006000,    0x00001000},
-	{0x00007000,    0x00001000},
-	{0x00008000,    0x00008000},
-	{0x00010000,    0x00010000},
-	{0x00020000,    0x00010000},
-	{0x00030000,    0x00010000},
-	{0x00040000,    0x00010000},
-	{0x00050000,    0x00010000},
-	{0x00060000,    0x00010000},
-	{0x00070000,    0x00010000},
-};
-
-const struct flashblock fblocks_7051[] = {
-	{0x00000000,    0x00008000},
-	{0x00008000,    0x00008000},
-	{0x00010000,    0x00008000},
-	{0x00018000,    0x00008000},
-	{0x00020000,    0x00008000},
-	{0x00028000,    0x00008000},
-	{0x00030000,    0x00008000},
-	{0x00038000,    0x00007000},
-	{0x0003F000,    0x00000400},
-	{0x0003F400,    0x00000400},
-	{0x0003F800,    0x00000400},
-	{0x0003FC00,    0x00000400},
-};
-
-const struct flashdev_t flashdevices[] = {
-	{ "7051", SH7051, 256 * 1024, 12, fblocks_7051 },
-	{ "7055", SH7055, 512 * 1024, 16, fblocks_7055 },
-	{ "7058", SH7058, 1024 * 1024, 16, fblocks_7058 },
-	{ NULL, SH_INVALID, 0, 0, NULL },
-};
-
-
 /** Decode negative response code into a short error string.
  *
  * rxdata[] must contain at least 3 bytes, "7F <SID> <NRC>"
- * returns a static char * that must not be free'd !
- */
-static const char *decode_nrc(uint8_t *rxdata);
-
-
-
-/*** CRC16 implementation adapted from Lammert Bies
- * https://www.lammertbies.nl/comm/info/crc-calculation.html
- *
- *
+ * returns a string in ns->nrcstr, that must not be free'd !
  */
-#define NPK_CRC16   0xBAAD  //koopman, 2048bits (256B)
-static bool crc_tab16_init = 0;
-static u16 crc_tab16[256];
-
-static void init_crc16_tab( void ) {
-	u32 i, j;
-	u16 crc, c;
-
-	for (i=0; i<256; i++) {
-		crc = 0;
-		c   = (u16) i;
-
-		for (j=0; j<8; j++) {
-			if ( (crc ^ c) & 0x0001 ) {
-				crc = ( crc >> 1 ) ^ NPK_CRC16;
-			} else {
-				crc =   crc >> 1;
-			}
-			c = c >> 1;
-		}
-		crc_tab16[i] = crc;
-	}
+static const char *decode_nrc(struct np_session *ns, uint8_t *rxdata);
 
-	crc_tab16_init = 1;
 
-}  /* init_crc16_tab */
-
-
-static u16 crc16(const u8 *data, u32 siz) {
-	u16 crc;
-
-	if ( !crc_tab16_init ) {
-		init_crc16_tab();
-	}
-
-	crc = 0;
-
-	while (siz > 0) {
-		u16 tmp;
-		u8 nextval;
-
-		nextval = *data++;
-		tmp =  crc       ^ nextval;
-		crc = (crc >> 8) ^ crc_tab16[ tmp & 0xff ];
-		siz -= 1;
-	}
-	return crc;
-}
 
 /** compare CRC of source data at *src to ROM
  * the area starting at src[0] is compared to the area of ROM
@@ -168,7 +56,7 @@ static u16 crc16(const u8 *data, u32 siz) {
 #define ROMCRC_CHUNKSIZE 256
 #define ROMCRC_ITERSIZE (ROMCRC_NUMCHUNKS * ROMCRC_CHUNKSIZE)
 #define ROMCRC_LENMASK ((ROMCRC_NUMCHUNKS * ROMCRC_CHUNKSIZE) - 1)  //should look like 0x3FF
-static int check_romcrc(const uint8_t *src, uint32_t start, uint32_t len, bool *modified) {
+static int check_romcrc(struct np_session *ns, const uint8_t *src, uint32_t start, uint32_t len, bool *modified) {
 	uint8_t txdata[4 + (2*ROMCRC_NUMCHUNKS)];   //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	uint8_t rxbuf[10];
@@ -197,7 +85,7 @@ static int check_romcrc(const uint8_t *src, uint32_t start, uint32_t len, bool *
 		//fill the request with n*CRCs
 		unsigned chunk_cnt;
 		for (chunk_cnt = 0; chunk_cnt < ROMCRC_NUMCHUNKS; chunk_cnt++) {
-			u16 chunk_crc = crc16(src, ROMCRC_CHUNKSIZE);
+			u16 chunk_crc = npk_crc16(src, ROMCRC_CHUNKSIZE);
 			src += ROMCRC_CHUNKSIZE;
 			txdata[txi++] = chunk_crc >> 8;
 			txdata[txi++] = chunk_crc & 0xFF;
@@ -205,8 +93,8 @@ static int check_romcrc(const uint8_t *src, uint32_t start, uint32_t len, bool *
 		nisreq.len = txi;
 
 
-		//rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
-		errval = diag_l2_send(global_l2_conn, &nisreq);
+		//rxmsg=diag_l2_request(ns->conn, &nisreq, &errval);
+		errval = npstat_send(ns, NPSTAT_CRC, &nisreq);
 		if (errval) {
 			printf("\nl2_send error!\n");
 			return -1;
@@ -215,17 +103,18 @@ static int check_romcrc(const uint8_t *src, uint32_t start, uint32_t len, bool *
 		//responses :	01 <SID_CONF+0x40> <cks> for good CRC
 		//				03 7F <SID_CONF> <SID_CONF_CKS1_BADCKS> <cks> for bad CRC
 		// anything else is an error that causes abort
-		errval = diag_l1_recv(global_l2_conn->diag_link->l2_dl0d, rxbuf, 3, 50);
+		errval = npstat_recv(ns, NPSTAT_CRC, rxbuf, 3, 50);
 		if (errval != 3) {
 			printf("\nno response @ chunk %X\n", (unsigned) chunko);
 			goto badexit;
 		}
 
 		if (rxbuf[1] == SID_CONF + 0x40) {
+			npwire_framing(ns, 2);	//FMT, cks
 			continue;
 		}
 		//so, it's a 03 7F <SID_CONF> <NRC> <cks> response. Get remainder of packet
-		errval = diag_l1_recv(global_l2_conn->diag_link->l2_dl0d, rxbuf+3, 2, 50);
+		errval = np_l1_recv(ns, rxbuf+3, 2, 50);
 		if (errval != 2) {
 			printf("\nweirdness @ chunk %X\n", (unsigned) chunko);
 			goto badexit;
@@ -236,6 +125,7 @@ static int check_romcrc(const uint8_t *src, uint32_t start, uint32_t len, bool *
 			goto badexit;
 		}
 		//confirmed bad CRC, we can exit
+		npwire_framing(ns, 2);
 		*modified = 1;
 		return 0;
 	}   //for
@@ -244,14 +134,15 @@ static int check_romcrc(const uint8_t *src, uint32_t start, uint32_t len, bool *
 	return 0;
 
 badexit:
+	nptrace_dump(&ns->trace, __func__);
 	diag_data_dump(stdout, rxbuf, sizeof(rxbuf));
 	printf("\n");
-	(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+	npstat_flush(ns, NPSTAT_CRC, 0);
 	return -1;
 }
 
 
-int get_changed_blocks(const uint8_t *src, const uint8_t *orig_data, const struct flashdev_t *fdt, bool *modified) {
+int get_changed_blocks(struct np_session *ns, const uint8_t *src, const uint8_t *orig_data, const struct flashdev_t *fdt, bool *modified) {
 
 	unsigned blockno;
 
@@ -273,7 +164,7 @@ int get_changed_blocks(const uint8_t *src, const uint8_t *orig_data, const struc
 			}
 		} else {
 			/* otherwise do CRC comparison with ECU */
-			if (check_romcrc(&src[bs], bs, blen, &modified[blockno])) {
+			if (check_romcrc(ns, &src[bs], bs, blen, &modified[blockno])) {
 				return -1;
 			}
 		}
@@ -285,28 +176,12 @@ int get_changed_blocks(const uint8_t *src, const uint8_t *orig_data, const struc
 
 
 
-/* special checksum for reflash blocks:
- * "one's complement" checksum; if adding causes a carry, add 1 to sum. Slightly better than simple 8bit sum
- */
-static uint8_t cks_add8(uint8_t *data, unsigned len) {
-	uint16_t sum = 0;
-	for (; len; len--, data++) {
-		sum += *data;
-		if (sum & 0x100) {
-			sum += 1;
-		}
-		sum = (uint8_t) sum;
-	}
-	return sum;
-}
-
-
 /* ret 0 if ok. For use by reflash_block(),
  * assumes parameters have been validated,
  * and appropriate block has been erased
  */
 
-static int npk_raw_flashblock(const uint8_t *src, uint32_t start, uint32_t len) {
+static int npk_raw_flashblock(struct np_session *ns, const uint8_t *src, uint32_t start, uint32_t len) {
 
 	/* program 128-byte chunks */
 	uint32_t remain = len;
@@ -316,7 +191,7 @@ static int npk_raw_flashblock(const uint8_t *src, uint32_t start, uint32_t len)
 	int errval;
 	nisreq.data = txdata;
 
-	unsigned long t0, chrono;
+	struct npprog pg;
 
 	if ((len & (128 - 1)) ||
 	    (start & (128 - 1))) {
@@ -328,55 +203,41 @@ static int npk_raw_flashblock(const uint8_t *src, uint32_t start, uint32_t len)
 	txdata[1]=SIDFL_WB;
 	nisreq.len = 134;   //2 (header) + 3 (addr) + 128 (payload) + 1 (extra CRC)
 
-	t0 = diag_os_getms();
-
+	npprog_start(&pg, &ns->prog, "flash", start, len);
 
 	while (remain) {
 		uint8_t rxbuf[10];
-		unsigned curspeed, tleft;
 
-		chrono = diag_os_getms() - t0;
-		if (!chrono) {
-			chrono += 1;
-		}
-		curspeed = 1000 * (len - remain) / chrono;  //avg B/s
-		if (!curspeed) {
-			curspeed += 1;
-		}
-		tleft = remain / curspeed;  //s
-		if (tleft > 9999) {
-			tleft = 9999;
-		}
-
-		printf("\rwriting chunk @ 0x%06X (%3u %%, %5u B/s, ~ %4u s remaining)", start, (unsigned) 100 * (len - remain) / len,
-		       curspeed, tleft);
-		fflush(stdout);
+		npprog_update(&pg, start, len - remain);
 
 		txdata[2] = start >> 16;
 		txdata[3] = start >> 8;
 		txdata[4] = start >> 0;
 		memcpy(&txdata[5], src, 128);
-		txdata[133] = cks_add8(&txdata[2], 131);
+		txdata[133] = npk_cks_add8(&txdata[2], 131);
 
-		errval = diag_l2_send(global_l2_conn, &nisreq);
+		errval = npstat_send(ns, NPSTAT_FLASH, &nisreq);
 		if (errval) {
 			printf("l2_send error!\n");
+			npprog_done(&pg, 0);
 			return -1;
 		}
 
 		/* expect exactly 3 bytes, but with generous timeout */
-		//rxmsg = diag_l2_request(global_l2_conn, &nisreq, &errval);
-		errval = diag_l1_recv(global_l2_conn->diag_link->l2_dl0d, rxbuf, 3, 800);
+		//rxmsg = diag_l2_request(ns->conn, &nisreq, &errval);
+		errval = npstat_recv(ns, NPSTAT_FLASH, rxbuf, 3, 800);
 		if (errval <= 1) {
 			printf("\n\tProblem: no response @ %X\n", (unsigned) start);
-			(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+			npstat_flush(ns, NPSTAT_FLASH, 0);
+			npprog_done(&pg, 0);
 			return -1;
 		}
 		if (errval < 3) {
 			printf("\n\tProblem: incomplete response @ %X\n", (unsigned) start);
-			(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+			npstat_flush(ns, NPSTAT_FLASH, 0);
 			diag_data_dump(stdout, rxbuf, errval);
 			printf("\n");
+			npprog_done(&pg, 0);
 			return -1;
 		}
 
@@ -386,18 +247,23 @@ static int npk_raw_flashblock(const uint8_t *src, uint32_t start, uint32_t len)
 
 			int needed = 1 + rxbuf[0] - errval;
 			if (needed > 0) {
-				(void) diag_l1_recv(global_l2_conn->diag_link->l2_dl0d, &rxbuf[errval], needed, 300);
+				(void) np_l1_recv(ns, &rxbuf[errval], needed, 300);
 			}
-			printf("%s\n", decode_nrc(&rxbuf[1]));
-			(void) diag_l2_ioctl(global_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+			printf("%s\n", decode_nrc(ns, &rxbuf[1]));
+			npstat_flush(ns, NPSTAT_FLASH, 0);
+			npprog_done(&pg, 0);
 			return -1;
 		}
 
+		npwire_payload(ns, 128);
+		npwire_framing(ns, 2);	//FMT, cks of the response
 		remain -= 128;
 		start += 128;
 		src += 128;
 
 	}   //while len
+	npprog_update(&pg, start, len);
+	npprog_done(&pg, 1);
 	printf("\nWrite complete.\n");
 
 	return 0;
@@ -405,7 +271,7 @@ static int npk_raw_flashblock(const uint8_t *src, uint32_t start, uint32_t len)
 
 
 
-int reflash_block(const uint8_t *newdata, const struct flashdev_t *fdt, unsigned blockno, bool practice) {
+int reflash_block(struct np_session *ns, const uint8_t *newdata, const struct flashdev_t *fdt, unsigned blockno, bool practice) {
 	uint8_t txdata[64]; //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	int errval;
@@ -427,12 +293,12 @@ int reflash_block(const uint8_t *newdata, const struct flashdev_t *fdt, unsigned
 	/* 1- requestdownload */
 	txdata[0]=SID_FLREQ;
 	nisreq.len = 1;
-	rxmsg = diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg = np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		goto badexit;
 	}
 	if (rxmsg->data[0] != (SID_FLREQ + 0x40)) {
-		printf("got bad RequestDownload response : %s\n", decode_nrc(rxmsg->data));
+		printf("got bad RequestDownload response : %s\n", decode_nrc(ns, rxmsg->data));
 		diag_freemsg(rxmsg);
 		goto badexit;
 	}
@@ -443,12 +309,12 @@ int reflash_block(const uint8_t *newdata, const struct flashdev_t *fdt, unsigned
 		txdata[1]=SIDFL_UNPROTECT;
 		txdata[2]=~SIDFL_UNPROTECT;
 		nisreq.len = 3;
-		rxmsg = diag_l2_request(global_l2_conn, &nisreq, &errval);
+		rxmsg = np_l2_request(ns, &nisreq, &errval);
 		if (rxmsg==NULL) {
 			goto badexit;
 		}
 		if (rxmsg->data[0] != (SID_FLASH + 0x40)) {
-			printf("got bad Unprotect response : %s\n", decode_nrc(rxmsg->data));
+			printf("got bad Unprotect response : %s\n", decode_nrc(ns, rxmsg->data));
 			diag_freemsg(rxmsg);
 			goto badexit;
 		}
@@ -463,22 +329,22 @@ int reflash_block(const uint8_t *newdata, const struct flashdev_t *fdt, unsigned
 	txdata[2] = blockno;
 	nisreq.len = 3;
 	/* Problem : erasing can take a lot more than the default P2max for iso14230 */
-	uint16_t old_p2max = global_l2_conn->diag_l2_p2max;
-	global_l2_conn->diag_l2_p2max = 1800;
-	rxmsg = diag_l2_request(global_l2_conn, &nisreq, &errval);
-	global_l2_conn->diag_l2_p2max = old_p2max;  //restore p2max; the rest should be OK
+	uint16_t old_p2max = ns->conn->diag_l2_p2max;
+	ns->conn->diag_l2_p2max = 1800;
+	rxmsg = np_l2_request(ns, &nisreq, &errval);
+	ns->conn->diag_l2_p2max = old_p2max;  //restore p2max; the rest should be OK
 	if (rxmsg==NULL) {
 		printf("no ERASE_BLOCK response?\n");
 		goto badexit;
 	}
 	if (rxmsg->data[0] != (SID_FLASH + 0x40)) {
-		printf("got bad ERASE_BLOCK response : %s\n", decode_nrc(rxmsg->data));
+		printf("got bad ERASE_BLOCK response : %s\n", decode_nrc(ns, rxmsg->data));
 		diag_freemsg(rxmsg);
 		goto badexit;
 	}
 
 	/* 4- write */
-	errval = npk_raw_flashblock(newdata, start, len);
+	errval = npk_raw_flashblock(ns, newdata, start, len);
 	if (errval) {
 		printf("\nReflash error ! Do not panic, do not reset the ECU immediately. The kernel is "
 		       "most likely still running and receiving commands !\n");
@@ -488,6 +354,7 @@ int reflash_block(const uint8_t *newdata, const struct flashdev_t *fdt, unsigned
 	return 0;
 
 badexit:
+	nptrace_dump(&ns->trace, __func__);
 	return -1;
 
 }
@@ -536,7 +403,7 @@ badexit:
 }
 
 
-int set_eepr_addr(uint32_t addr) {
+int set_eepr_addr(struct np_session *ns, uint32_t addr) {
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	uint8_t txdata[8];  //data for nisreq
@@ -553,12 +420,12 @@ int set_eepr_addr(uint32_t addr) {
 	txdata[4] = (addr >> 0) & 0xff;
 	nisreq.len=5;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
 	if (rxmsg->data[0] != (SID_CONF + 0x40)) {
-		printf("got bad SID_CONF response : %s\n", decode_nrc(rxmsg->data));
+		printf("got bad SID_CONF response : %s\n", decode_nrc(ns, rxmsg->data));
 		diag_freemsg(rxmsg);
 		return -1;
 	}
@@ -568,11 +435,7 @@ int set_eepr_addr(uint32_t addr) {
 }
 
 
-//TODO : merge these into npkern defs ?
-#define KSPEED_FROM_BRR(x) ((20 * 1000 * 1000UL) / (32 * ((x) + 1)))
-#define BRR_FROM_KSPEED(x) (((20 * 1000 * 1000UL) / (32 * (x))) - 1)
-
-int set_kernel_speed(uint16_t kspeed) {
+int set_kernel_speed(struct np_session *ns, uint16_t kspeed) {
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	uint8_t txdata[8];  //data for nisreq
@@ -610,7 +473,7 @@ int set_kernel_speed(uint16_t kspeed) {
 	txdata[2] = newdiv & 0xff;
 	nisreq.len=3;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -629,11 +492,10 @@ int set_kernel_speed(uint16_t kspeed) {
 
 }
 
-const char *get_npk_id(void) {
+const char *get_npk_id(struct np_session *ns) {
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	uint8_t txdata[64]; //data for nisreq
-	static char npk_id[256];    //version string
 	unsigned idlen;
 
 	int errval;
@@ -642,28 +504,28 @@ const char *get_npk_id(void) {
 
 	txdata[0]=SID_RECUID;
 	nisreq.len=1;
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return NULL;
 	}
 	if (rxmsg->data[0] != (SID_RECUID + 0x40)) {
-		printf("got bad 1A response : %s", decode_nrc(rxmsg->data));
+		printf("got bad 1A response : %s", decode_nrc(ns, rxmsg->data));
 		diag_freemsg(rxmsg);
 		return NULL;
 	}
 
 	idlen = rxmsg->len;
 	if ((idlen <= 1) ||
-	    (idlen >= (sizeof(npk_id)))) {
+	    (idlen >= (sizeof(ns->npk_id)))) {
 		printf("bad length %u for npk version string ! Old kernel maybe?\n", idlen);
 		return NULL;
 	}
 
-	memcpy(npk_id, rxmsg->data + 1, idlen - 1); //skip 0x5A
-	npk_id[idlen]=0;    //null-terminate
+	memcpy(ns->npk_id, rxmsg->data + 1, idlen - 1); //skip 0x5A
+	ns->npk_id[idlen]=0;    //null-terminate
 
 	diag_freemsg(rxmsg);
-	return npk_id;
+	return ns->npk_id;
 
 }
 
@@ -722,14 +584,12 @@ static const char *decode_nrc_npk(const uint8_t nrc) {
 	return NULL;
 }
 
-#define NRC_STRLEN 80   //too small and we get an assert() failure in smartcat() !!!
 /** Return string for neg response code
  *
  * rxdata must point to the data frame (no headers), i.e. 0x7F <SID> <NRC>
  */
-static const char *decode_nrc(uint8_t *rxdata) {
+static const char *decode_nrc(struct np_session *ns, uint8_t *rxdata) {
 	struct diag_msg tmsg;
-	static char descr[NRC_STRLEN]="";
 	const char *output;
 
 	u8 nrc = rxdata[2];
@@ -743,7 +603,7 @@ static const char *decode_nrc(uint8_t *rxdata) {
 	// 2) standard NRCs
 	tmsg.data = rxdata;
 	tmsg.len = 3;   //assume rxdata contains a "7F <SID> <NRC>" message
-	(void) diag_l3_iso14230_decode_response(&tmsg, descr, NRC_STRLEN);
+	(void) diag_l3_iso14230_decode_response(&tmsg, ns->nrcstr, sizeof(ns->nrcstr));
 
-	return descr;
+	return ns->nrcstr;
 }
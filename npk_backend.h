@@ -7,41 +7,13 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-/* *******
- * All this stuff assumes the current global state is correct and validated by the caller
- */
-
+#include "np_session.h"
+#include "npk_util.h"
 
-/** defs for SH705x device types and flash block areas
+/* *******
+ * All this stuff assumes the session state is correct and validated by the caller
  */
 
-enum mcu_type {
-	SH7051,
-	SH7055,		//for the purpose of flash block areas, the 180 and 350nm versions of SH7055 are identical
-	//SH7055_35,
-	//SH7055_18,
-	SH7058,
-	SH_INVALID
-};
-
-struct flashblock {
-	uint32_t start;
-	uint32_t len;
-};
-
-struct flashdev_t {
-	const char *name;		// like "7058", for UI convenience only
-	enum mcu_type mctype;
-
-	const uint32_t romsize;		//in bytes
-	const unsigned numblocks;
-	const struct flashblock *fblocks;
-};
-
-
-/* list of all defined flash devices */
-extern const struct flashdev_t flashdevices[];
-
 
 /** load ROM with expected size.
  *
@@ -57,7 +29,7 @@ uint8_t *load_rom(const char *fname, uint32_t expect_size);
  *
  * return 0 if comparison completed ok
  */
-int get_changed_blocks(const uint8_t *src, const uint8_t *orig_data, const struct flashdev_t *fdt, bool *modified);
+int get_changed_blocks(struct np_session *ns, const uint8_t *src, const uint8_t *orig_data, const struct flashdev_t *fdt, bool *modified);
 
 
 /** reflash a single block.
@@ -65,24 +37,24 @@ int get_changed_blocks(const uint8_t *src, const uint8_t *orig_data, const struc
  * @param practice : if 1, ROM will not be modified
  * ret 0 if ok
  */
-int reflash_block(const uint8_t *newdata, const struct flashdev_t *fdt, unsigned blockno, bool practice);
+int reflash_block(struct np_session *ns, const uint8_t *newdata, const struct flashdev_t *fdt, unsigned blockno, bool practice);
 
 
 /** set eeprom eep_read() function address
  * return 0 if ok
  */
-int set_eepr_addr(uint32_t addr);
+int set_eepr_addr(struct np_session *ns, uint32_t addr);
 
 /** set kernel comms speed. Caller must then re-send StartComms
  * ret 0 if ok
  */
-int set_kernel_speed(uint16_t kspeed);
+int set_kernel_speed(struct np_session *ns, uint16_t kspeed);
 
 
 /** Get npkern ID string
  *
- * caller must not free() the string !
+ * returns ns->npk_id; caller must not free() the string !
  */
-const char *get_npk_id(void);
+const char *get_npk_id(struct np_session *ns);
 
 #endif
@@ -0,0 +1,148 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * Copyright (c) 2014-2016 fenugrec
+ *
+ * Licensed under GPLv3
+ *
+ * npkern helpers with no freediag dependencies
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stypes.h"
+
+#include "npk_util.h"
+
+
+/* flash block definitions */
+const struct flashblock fblocks_7058[] = {
+	{0x00000000,    0x00001000},
+	{0x00001000,    0x00001000},
+	{0x00002000,    0x00001000},
+	{0x00003000,    0x00001000},
+	{0x00004000,    0x00001000},
+	{0x00005000,    0x00001000},
+	{0x00006000,    0x00001000},
+	{0x00007000,    0x00001000},
+	{0x00008000,    0x00018000},
+	{0x00020000,    0x00020000},
+	{0x00040000,    0x00020000},
+	{0x00060000,    0x00020000},
+	{0x00080000,    0x00020000},
+	{0x000A0000,    0x00020000},
+	{0x000C0000,    0x00020000},
+	{0x000E0000,    0x00020000},
+};
+
+const struct flashblock fblocks_7055[] = {
+	{0x00000000,    0x00001000},
+	{0x00001000,    0x00001000},
+	{0x00002000,    0x00001000},
+	{0x00003000,    0x00001000},
+	{0x00004000,    0x00001000},
+	{0x00005000,    0x00001000},
+	{0x00006000,    0x00001000},
+	{0x00007000,    0x00001000},
+	{0x00008000,    0x00008000},
+	{0x00010000,    0x00010000},
+	{0x00020000,    0x00010000},
+	{0x00030000,    0x00010000},
+	{0x00040000,    0x00010000},
+	{0x00050000,    0x00010000},
+	{0x00060000,    0x00010000},
+	{0x00070000,    0x00010000},
+};
+
+const struct flashblock fblocks_7051[] = {
+	{0x00000000,    0x00008000},
+	{0x00008000,    0x00008000},
+	{0x00010000,    0x00008000},
+	{0x00018000,    0x00008000},
+	{0x00020000,    0x00008000},
+	{0x00028000,    0x00008000},
+	{0x00030000,    0x00008000},
+	{0x00038000,    0x00007000},
+	{0x0003F000,    0x00000400},
+	{0x0003F400,    0x00000400},
+	{0x0003F800,    0x00000400},
+	{0x0003FC00,    0x00000400},
+};
+
+const struct flashdev_t flashdevices[] = {
+	{ "7051", SH7051, 256 * 1024, 12, fblocks_7051 },
+	{ "7055", SH7055, 512 * 1024, 16, fblocks_7055 },
+	{ "7058", SH7058, 1024 * 1024, 16, fblocks_7058 },
+	{ NULL, SH_INVALID, 0, 0, NULL },
+};
+
+
+
+/*** CRC16 implementation adapted from Lammert Bies
+ * https://www.lammertbies.nl/comm/info/crc-calculation.html
+ *
+ *
+ */
+#define NPK_CRC16   0xBAAD  //koopman, 2048bits (256B)
+static bool crc_tab16_init = 0;
+static u16 crc_tab16[256];
+
+static void init_crc16_tab( void ) {
+	u32 i, j;
+	u16 crc, c;
+
+	for (i=0; i<256; i++) {
+		crc = 0;
+		c   = (u16) i;
+
+		for (j=0; j<8; j++) {
+			if ( (crc ^ c) & 0x0001 ) {
+				crc = ( crc >> 1 ) ^ NPK_CRC16;
+			} else {
+				crc =   crc >> 1;
+			}
+			c = c >> 1;
+		}
+		crc_tab16[i] = crc;
+	}
+
+	crc_tab16_init = 1;
+
+}  /* init_crc16_tab */
+
+
+u16 npk_crc16(const u8 *data, u32 siz) {
+	u16 crc;
+
+	if ( !crc_tab16_init ) {
+		init_crc16_tab();
+	}
+
+	crc = 0;
+
+	while (siz > 0) {
+		u16 tmp;
+		u8 nextval;
+
+		nextval = *data++;
+		tmp =  crc       ^ nextval;
+		crc = (crc >> 8) ^ crc_tab16[ tmp & 0xff ];
+		siz -= 1;
+	}
+	return crc;
+}
+
+
+uint8_t npk_cks_add8(const uint8_t *data, unsigned len) {
+	uint16_t sum = 0;
+	for (; len; len--, data++) {
+		sum += *data;
+		if (sum & 0x100) {
+			sum += 1;
+		}
+		sum = (uint8_t) sum;
+	}
+	return sum;
+}
@@ -0,0 +1,55 @@
+#ifndef NPK_UTIL_H
+#define NPK_UTIL_H
+
+/* npkern protocol helpers and SH705x definitions that don't depend on freediag,
+ * shared by nisprog and the standalone tools (ecusim etc.)
+ */
+
+#include <stdint.h>
+
+
+/** defs for SH705x device types and flash block areas
+ */
+
+enum mcu_type {
+	SH7051,
+	SH7055,		//for the purpose of flash block areas, the 180 and 350nm versions of SH7055 are identical
+	//SH7055_35,
+	//SH7055_18,
+	SH7058,
+	SH_INVALID
+};
+
+struct flashblock {
+	uint32_t start;
+	uint32_t len;
+};
+
+struct flashdev_t {
+	const char *name;		// like "7058", for UI convenience only
+	enum mcu_type mctype;
+
+	const uint32_t romsize;		//in bytes
+	const unsigned numblocks;
+	const struct flashblock *fblocks;
+};
+
+
+/* list of all defined flash devices */
+extern const struct flashdev_t flashdevices[];
+
+
+/** kernel comms speed <=> SCI BRR divisor (20MHz Pphi, n=0) */
+#define KSPEED_FROM_BRR(x) ((20 * 1000 * 1000UL) / (32 * ((x) + 1)))
+#define BRR_FROM_KSPEED(x) (((20 * 1000 * 1000UL) / (32 * (x))) - 1)
+
+
+/** CRC16 as used by SID_CONF_CKS1, over <siz> bytes */
+uint16_t npk_crc16(const uint8_t *data, uint32_t siz);
+
+/** special checksum for SIDFL_WB reflash blocks:
+ * "one's complement" checksum; if adding causes a carry, add 1 to sum. Slightly better than simple 8bit sum
+ */
+uint8_t npk_cks_add8(const uint8_t *data, unsigned len);
+
+#endif
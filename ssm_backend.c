@@ -18,7 +18,9 @@
 #include "diag_l2.h"
 #include "diag_iso14230.h"  //for NRC decoding
 
-#include "nisprog.h"
+#include "keyalg.h"
+#include "np_kcap.h"
+#include "np_progress.h"
 #include "ssm_backend.h"
 #include "nissutils/cli_utils/nislib.h"
 
@@ -29,11 +31,9 @@
 /** Decode negative response code into a short error string.
  *
  * rxdata[] must contain at least 3 bytes, "7F <SID> <NRC>"
- * returns a static char * that must not be free'd !
+ * returns a string in ns->nrcstr, that must not be free'd !
  */
-static const char *decode_nrc(uint8_t *rxdata);
-
-static void sub_genkey(const uint8_t *seed8, uint8_t *key);
+static const char *decode_nrc(struct np_session *ns, uint8_t *rxdata);
 
 
 /*
@@ -41,14 +41,14 @@ static void sub_genkey(const uint8_t *seed8, uint8_t *key);
  *
  * @return 0 if successful
  */
-int sub_get_ecuid(u8 *dest) {
+int sub_get_ecuid(struct np_session *ns, u8 *dest) {
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	uint8_t txdata[64]; //data for nisreq
 
 	int errval;
 
-	if (npstate == NP_DISC) {
+	if (ns->state == NP_DISC) {
 		printf("Not connected to ECU\nTry \"spconn\" first\n");
 		return -1;
 	}
@@ -74,7 +74,7 @@ int sub_get_ecuid(u8 *dest) {
 	txdata[15]=0x00;  //offset byte 0
 	txdata[16]=0x05;  //offset byte 5
 	nisreq.len=17;
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -98,14 +98,14 @@ int sub_get_ecuid(u8 *dest) {
  *
  * @return 0 if successful
  */
-int sub_sid81_startcomms() {
+int sub_sid81_startcomms(struct np_session *ns) {
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	uint8_t txdata[64]; //data for nisreq
 
 	int errval;
 
-	if (npstate == NP_DISC) {
+	if (ns->state == NP_DISC) {
 		printf("Not connected to ECU\nTry \"spconn\" first\n");
 	}
 
@@ -114,7 +114,7 @@ int sub_sid81_startcomms() {
 	txdata[0]=0x81;  //SID 0x81 startCommunications command
 	nisreq.len=1;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -136,7 +136,7 @@ int sub_sid81_startcomms() {
  *
  * @return 0 if successful
  */
-int sub_sid27_unlock(){
+int sub_sid27_unlock(struct np_session *ns){
 	uint8_t txdata[64]; //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
@@ -146,14 +146,14 @@ int sub_sid27_unlock(){
 	txdata[1]=0x01; //RequestSeed
 	nisreq.len=2;
 	nisreq.data=txdata;
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
 	if ((rxmsg->len != 6) || (rxmsg->data[0] != 0x67)) {
 		printf("got bad 27 01 response : ");
 		if (rxmsg->data[0] == 0x7F) {
-			printf("%s\n", decode_nrc(rxmsg->data));
+			printf("%s\n", decode_nrc(ns, rxmsg->data));
 		} else {
 			diag_data_dump(stdout, rxmsg->data, rxmsg->len);
 			printf("\n");
@@ -175,14 +175,14 @@ int sub_sid27_unlock(){
 	printf("\n");
 
 	nisreq.len=6; //27 02 K K K K
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
 	if (rxmsg->data[0] != 0x67) {
 		printf("got bad 27 02 response : ");
 		if (rxmsg->data[0] == 0x7F) {
-			printf("%s\n", decode_nrc(rxmsg->data));
+			printf("%s\n", decode_nrc(ns, rxmsg->data));
 		} else {
 			diag_data_dump(stdout, rxmsg->data, rxmsg->len);
 			printf("\n");
@@ -196,103 +196,12 @@ int sub_sid27_unlock(){
 }
 
 
-/** For Subaru, generates key from seed
- * writes 4 bytes in buffer *key
- */
-static void sub_genkey(const uint8_t *seed8, uint8_t *key) {
-	uint32_t seed, index;
-	uint16_t wordtogenerateindex, wordtobeencrypted, encryptionkey;
-	int ki, n;
-
-	const uint16_t keytogenerateindex[]={
-		0x53DA, 0x33BC, 0x72EB, 0x437D,
-		0x7CA3, 0x3382, 0x834F, 0x3608,
-		0xAFB8, 0x503D, 0xDBA3, 0x9D34,
-		0x3563, 0x6B70, 0x6E74, 0x88F0
-	};
-
-	const uint8_t indextransformation[]={
-		0x5, 0x6, 0x7, 0x1, 0x9, 0xC, 0xD, 0x8,
-		0xA, 0xD, 0x2, 0xB, 0xF, 0x4, 0x0, 0x3,
-		0xB, 0x4, 0x6, 0x0, 0xF, 0x2, 0xD, 0x9,
-		0x5, 0xC, 0x1, 0xA, 0x3, 0xD, 0xE, 0x8
-	};
-
-	seed = reconst_32(seed8);
-
-	for (ki = 15; ki >= 0; ki--) {
-
-		wordtogenerateindex = seed;
-		wordtobeencrypted = seed >> 16;
-		index = wordtogenerateindex ^ keytogenerateindex[ki];
-		index += index << 16;
-		encryptionkey = 0;
-
-		for (n = 0; n < 4; n++) {
-			encryptionkey += indextransformation[(index >> (n * 4)) & 0x1F] << (n * 4);
-		}
-
-		encryptionkey = (encryptionkey >> 3) + (encryptionkey << 13);
-		seed = (encryptionkey ^ wordtobeencrypted) + (wordtogenerateindex << 16);
-	}
-
-	seed = (seed >> 16) + (seed << 16);
-	write_32b(seed, key);
-
-	return;
-}
-
-
-/** For Subaru, encrypts data for upload
- * writes 4 bytes in buffer *encrypteddata
- */
-void sub_encrypt(const uint8_t *datatoencrypt, uint8_t *encrypteddata) {
-	uint32_t datatoencrypt32, index;
-	uint16_t wordtogenerateindex, wordtobeencrypted, encryptionkey;
-	int ki, n;
-
-	const uint16_t keytogenerateindex[]={
-		0x7856, 0xCE22, 0xF513, 0x6E86
-	};
-
-	const uint8_t indextransformation[]={
-		0x5, 0x6, 0x7, 0x1, 0x9, 0xC, 0xD, 0x8,
-		0xA, 0xD, 0x2, 0xB, 0xF, 0x4, 0x0, 0x3,
-		0xB, 0x4, 0x6, 0x0, 0xF, 0x2, 0xD, 0x9,
-		0x5, 0xC, 0x1, 0xA, 0x3, 0xD, 0xE, 0x8
-	};
-
-	datatoencrypt32 = reconst_32(datatoencrypt);
-
-	for (ki = 0; ki < 4; ki++) {
-
-		wordtogenerateindex = datatoencrypt32;
-		wordtobeencrypted = datatoencrypt32 >> 16;
-		index = wordtogenerateindex ^ keytogenerateindex[ki];
-		index += index << 16;
-		encryptionkey = 0;
-
-		for (n = 0; n < 4; n++) {
-			encryptionkey += indextransformation[(index >> (n * 4)) & 0x1F] << (n * 4);
-		}
-
-		encryptionkey = (encryptionkey >> 3) + (encryptionkey << 13);
-		datatoencrypt32 = (encryptionkey ^ wordtobeencrypted) + (wordtogenerateindex << 16);
-	}
-
-	datatoencrypt32 = (datatoencrypt32 >> 16) + (datatoencrypt32 << 16);
-	write_32b(datatoencrypt32, encrypteddata);
-
-	return;
-}
-
-
 /*
  * For Subaru, use SID 0x10 to start a diagnostic session to access programming commands.
  * Assumes everything is ok (conn state, etc)
  * @return 0 if successful
  */
-int sub_sid10_diagsession() {
+int sub_sid10_diagsession(struct np_session *ns) {
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	uint8_t txdata[64]; //data for nisreq
@@ -305,7 +214,7 @@ int sub_sid10_diagsession() {
 	txdata[2]=0x02;
 	nisreq.len=3;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -328,7 +237,7 @@ int sub_sid10_diagsession() {
  * arguments are address for data to be downloaded to, and length of data
  * @return 0 if successful
  */
-int sub_sid34_reqdownload(uint32_t dataaddr, uint32_t datalen) {
+int sub_sid34_reqdownload(struct np_session *ns, uint32_t dataaddr, uint32_t datalen) {
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
 	uint8_t txdata[64]; //data for nisreq
@@ -347,7 +256,7 @@ int sub_sid34_reqdownload(uint32_t dataaddr, uint32_t datalen) {
 
 	nisreq.len=8;
 
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -369,7 +278,7 @@ int sub_sid34_reqdownload(uint32_t dataaddr, uint32_t datalen) {
  * Caller must have encrypted the payload
  * ret 0 if ok
  */
-int sub_sid36_transferdata(uint32_t dataaddr, uint8_t *buf, uint32_t len) {
+int sub_sid36_transferdata(struct np_session *ns, uint32_t dataaddr, uint8_t *buf, uint32_t len) {
 	uint8_t txdata[132];    //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
@@ -377,6 +286,7 @@ int sub_sid36_transferdata(uint32_t dataaddr, uint8_t *buf, uint32_t len) {
 	uint16_t blockno;
 	uint16_t maxblocks;
 	uint32_t blockaddr;
+	struct npprog pg;
 
 	len &= ~0x03;
 	if (!buf || !len) {
@@ -385,6 +295,7 @@ int sub_sid36_transferdata(uint32_t dataaddr, uint8_t *buf, uint32_t len) {
 
 	maxblocks = (len - 1) >> 7;  // number of 128 byte blocks - 1
 
+	npprog_start(&pg, &ns->prog, "kernel", dataaddr, len);
 	txdata[0]=0x36;
 
 	nisreq.data=txdata;
@@ -406,21 +317,22 @@ int sub_sid36_transferdata(uint32_t dataaddr, uint8_t *buf, uint32_t len) {
 			len -= 128;
 		}
 
-		rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+		rxmsg=np_l2_request(ns, &nisreq, &errval);
 
 		if ((rxmsg->len != 1) || rxmsg->data[0] != 0x76) {
 			printf("got bad SID 0x36 dataTransfer response : ");
 			diag_data_dump(stdout, rxmsg->data, rxmsg->len);
 			printf("\n");
 			diag_freemsg(rxmsg);
+			npprog_done(&pg, 0);
 			return -1;
 		}
 
-		printf("\rSID36 block 0x%04X/0x%04X done",
-		       (unsigned) blockno, (unsigned) maxblocks);
+		npprog_update(&pg, blockaddr, (blockno == maxblocks) ? pg.total : ((blockno + 1) * 128UL));
 
 	}
 
+	npprog_done(&pg, 1);
 	printf("\n");
 	return 0;
 }
@@ -431,7 +343,7 @@ int sub_sid36_transferdata(uint32_t dataaddr, uint8_t *buf, uint32_t len) {
  *
  * ret 0 if ok
  */
-int sub_sid31_startRoutine() {
+int sub_sid31_startRoutine(struct np_session *ns) {
 	uint8_t txdata[64]; //data for nisreq
 	struct diag_msg nisreq={0}; //request to send
 	struct diag_msg *rxmsg=NULL;    //pointer to the reply
@@ -444,7 +356,7 @@ int sub_sid31_startRoutine() {
 	nisreq.data=txdata;
 
 	/* RAMjump */
-	rxmsg=diag_l2_request(global_l2_conn, &nisreq, &errval);
+	rxmsg=np_l2_request(ns, &nisreq, &errval);
 	if (rxmsg==NULL) {
 		return -1;
 	}
@@ -462,19 +374,17 @@ int sub_sid31_startRoutine() {
 }
 
 
-#define NRC_STRLEN 80   //too small and we get an assert() failure in smartcat() !!!
 /** Return string for neg response code
  *
  * rxdata must point to the data frame (no headers), i.e. 0x7F <SID> <NRC>
  */
-static const char *decode_nrc(uint8_t *rxdata) {
+static const char *decode_nrc(struct np_session *ns, uint8_t *rxdata) {
 	struct diag_msg tmsg;
-	static char descr[NRC_STRLEN]="";
 
 	// Try Standard ISO14230 NRC
 	tmsg.data = rxdata;
 	tmsg.len = 3;   //assume rxdata contains a "7F <SID> <NRC>" message
-	(void) diag_l3_iso14230_decode_response(&tmsg, descr, NRC_STRLEN);
+	(void) diag_l3_iso14230_decode_response(&tmsg, ns->nrcstr, sizeof(ns->nrcstr));
 
-	return descr;
+	return ns->nrcstr;
 }
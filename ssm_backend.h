@@ -5,8 +5,10 @@
 
 #include <stdint.h>
 
+#include "np_session.h"
+
 /* *******
- * All this stuff assumes the current global state is correct and validated by the caller
+ * All this stuff assumes the session state is correct and validated by the caller
  */
 
 
@@ -15,7 +17,7 @@
  *
  * Ret 0 if ok
  */
-int sub_get_ecuid(uint8_t *dest);
+int sub_get_ecuid(struct np_session *ns, uint8_t *dest);
 
 
 /** Subaru Start Communications with SID 0x81 command
@@ -23,7 +25,7 @@ int sub_get_ecuid(uint8_t *dest);
  *
  * Ret 0 if ok
  */
-int sub_sid81_startcomms(void);
+int sub_sid81_startcomms(struct np_session *ns);
 
 
 /** Subaru attempt securityAccess with SID 0x27 command, step 1 and 2
@@ -31,13 +33,7 @@ int sub_sid81_startcomms(void);
  *
  * Ret 0 if successful
  */
-int sub_sid27_unlock(void);
-
-
-/** For Subaru, encrypts data for upload
- * writes 4 bytes in buffer *encrypteddata
- */
-void sub_encrypt(const uint8_t *datatoencrypt, uint8_t *encrypteddata);
+int sub_sid27_unlock(struct np_session *ns);
 
 
 /*
@@ -45,7 +41,7 @@ void sub_encrypt(const uint8_t *datatoencrypt, uint8_t *encrypteddata);
  * Assumes everything is ok (conn state, etc)
  * @return 0 if successful
  */
-int sub_sid10_diagsession(void);
+int sub_sid10_diagsession(struct np_session *ns);
 
 
 /** Subaru attempt requestDownload with SID 0x34 command
@@ -53,7 +49,7 @@ int sub_sid10_diagsession(void);
  *
  * Ret 0 if successful
  */
-int sub_sid34_reqdownload(uint32_t dataaddr, uint32_t datalen);
+int sub_sid34_reqdownload(struct np_session *ns, uint32_t dataaddr, uint32_t datalen);
 
 
 /* transfer payload from *buf
@@ -61,7 +57,7 @@ int sub_sid34_reqdownload(uint32_t dataaddr, uint32_t datalen);
  * Caller must have encrypted the payload
  * ret 0 if ok
  */
-int sub_sid36_transferdata(uint32_t dataaddr, uint8_t *buf, uint32_t len);
+int sub_sid36_transferdata(struct np_session *ns, uint32_t dataaddr, uint8_t *buf, uint32_t len);
 
 
 /* execute RAM Jump to address set in ROM (0xFFFF3004)
@@ -69,7 +65,7 @@ int sub_sid36_transferdata(uint32_t dataaddr, uint8_t *buf, uint32_t len);
  * 
  * ret 0 if ok
  */
-int sub_sid31_startRoutine(void);
+int sub_sid31_startRoutine(struct np_session *ns);
 
 
 #endif
@@ -0,0 +1,119 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * key algorithm checks : batch versions against the scalar ones on a fixed set of seeds,
+ * and the Subaru payload encryption round trip. Exit status 0 if all pass.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stypes.h"
+
+#include "keyalg.h"
+#include "nissutils/cli_utils/nislib.h"
+
+#define NSEEDS 10007	//not a multiple of the batch width
+
+static unsigned failed = 0;
+
+static uint32_t seeds[NSEEDS];
+static uint32_t keys[NSEEDS];
+
+/** same seeds every run : a few edge values, then xorshift32 */
+static void fill_seeds(void) {
+	static const uint32_t edges[] = {0, 1, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, 0x11223344};
+	uint32_t x = 0x5EED5EED;
+	unsigned i;
+
+	for (i = 0; i < NSEEDS; i++) {
+		if (i < (sizeof(edges) / sizeof(edges[0]))) {
+			seeds[i] = edges[i];
+			continue;
+		}
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		seeds[i] = x;
+	}
+}
+
+static void test_batch(const char *name, void (*scalar)(const uint8_t *seed8, uint8_t *key),
+                       void (*batch)(const uint32_t *seeds, uint32_t *keys, unsigned n)) {
+	unsigned i, mismatches = 0;
+
+	batch(seeds, keys, NSEEDS);
+	for (i = 0; i < NSEEDS; i++) {
+		u8 seed8[4], key8[4];
+
+		write_32b(seeds[i], seed8);
+		scalar(seed8, key8);
+		if (reconst_32(key8) != keys[i]) {
+			if (!mismatches) {
+				printf("FAIL : %s, seed %08lX : batch %08lX, scalar %08lX\n", name,
+				       (unsigned long) seeds[i], (unsigned long) keys[i],
+				       (unsigned long) reconst_32(key8));
+			}
+			mismatches += 1;
+		}
+	}
+
+	/* in place, and a short tail */
+	for (i = 0; i < 5; i++) {
+		keys[i] = seeds[i];
+	}
+	batch(keys, keys, 5);
+	for (i = 0; i < 5; i++) {
+		u8 seed8[4], key8[4];
+
+		write_32b(seeds[i], seed8);
+		scalar(seed8, key8);
+		if (reconst_32(key8) != keys[i]) {
+			mismatches += 1;
+		}
+	}
+
+	if (mismatches) {
+		printf("FAIL : %s, %u mismatches\n", name, mismatches);
+		failed += 1;
+	}
+}
+
+static void test_subcrypt(void) {
+	unsigned i, mismatches = 0;
+
+	for (i = 0; i < NSEEDS; i++) {
+		u8 plain[4], enc[4], dec[4];
+
+		write_32b(seeds[i], plain);
+		sub_encrypt(plain, enc);
+		sub_decrypt(enc, dec);
+		if (reconst_32(dec) != seeds[i]) {
+			if (!mismatches) {
+				printf("FAIL : sub_decrypt(sub_encrypt(%08lX)) = %08lX\n",
+				       (unsigned long) seeds[i], (unsigned long) reconst_32(dec));
+			}
+			mismatches += 1;
+		}
+	}
+	if (mismatches) {
+		failed += 1;
+	}
+}
+
+int main(void) {
+	fill_seeds();
+	test_batch("genkey2", genkey2, genkey2_batch);
+	test_batch("sub_genkey", sub_genkey, sub_genkey_batch);
+	test_subcrypt();
+	if (failed) {
+		printf("%u check(s) failed\n", failed);
+		return 1;
+	}
+	printf("keyalg : all checks passed\n");
+	return 0;
+}
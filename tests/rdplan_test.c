@@ -0,0 +1,77 @@
+/*
+ *	nisprog - Nissan ECU communications utility
+ *
+ * (c) 2014-2016 fenugrec
+ * Licensed under GPLv3
+ *
+ * read planner checks, mostly at the edges of the RMBA windows. Exit status 0 if all pass.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "np_rdplan.h"
+
+static unsigned failed = 0;
+
+static void check(bool cond, const char *what) {
+	if (!cond) {
+		printf("FAIL : %s\n", what);
+		failed += 1;
+	}
+}
+
+static void test_valid(void) {
+	check(rdplan_valid(0, 1), "first ROM byte");
+	check(rdplan_valid(RDPLAN_ROMEND - 4, 4), "ROM, up to ROMEND");
+	check(!rdplan_valid(RDPLAN_ROMEND - 4, 5), "ROM, past ROMEND");
+	check(!rdplan_valid(RDPLAN_ROMEND, 1), "between the windows");
+	check(!rdplan_valid(RDPLAN_RAMSTART - 1, 2), "RAM, starts before RAMSTART");
+	check(rdplan_valid(RDPLAN_RAMSTART, 4), "first RAM bytes");
+
+	/* 4 GiB boundary */
+	check(rdplan_valid(0xFFFFFFFF, 1), "last byte");
+	check(rdplan_valid(0xFFFFFF00, 0x100), "RAM, up to 4 GiB");
+	check(!rdplan_valid(0xFFFFFF00, 0x101), "RAM, one byte past 4 GiB");
+	check(!rdplan_valid(0xFFFFFFFF, 2), "last byte + 1");
+	check(!rdplan_valid(0xFFFFFFF0, 0xFFFFFFFF), "len wraps to a low address");
+}
+
+static void test_plan(void) {
+	struct rdp_range want[2];
+	struct rdp_range reqs[4];
+	uint32_t ofs[2];
+	int rv;
+
+	/* last 4 bytes of the address space : one request, must not wrap */
+	want[0].addr = 0xFFFFFFFC;
+	want[0].len = 4;
+	rv = rdplan(want, 1, 0, 1, reqs, 4, ofs);
+	check((rv == 1) && (reqs[0].addr == 0xFFFFFFFC) && (reqs[0].len == 4), "plan up to 4 GiB");
+
+	/* one byte further is refused */
+	want[0].len = 5;
+	rv = rdplan(want, 1, 0, 1, reqs, 4, ofs);
+	check(rv < 0, "plan past 4 GiB");
+
+	/* close neighbours at the top are merged */
+	want[0].addr = 0xFFFFFFF0;
+	want[0].len = 2;
+	want[1].addr = 0xFFFFFFFE;
+	want[1].len = 2;
+	rv = rdplan(want, 2, 20, 1, reqs, 4, ofs);
+	check((rv == 1) && (reqs[0].addr == 0xFFFFFFF0) && (reqs[0].len == 16) && (ofs[1] == 14),
+	      "merged plan near 4 GiB");
+}
+
+int main(void) {
+	test_valid();
+	test_plan();
+	if (failed) {
+		printf("%u check(s) failed\n", failed);
+		return 1;
+	}
+	printf("rdplan : all checks passed\n");
+	return 0;
+}